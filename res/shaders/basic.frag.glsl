@@ -1,9 +1,19 @@
 #version 450
 
+// Specialization constants, see SPECIALIZATION_CONSTANTS in main.c
+layout(constant_id = 0) const uint COLOR_MODE = 0; // Color_Mode: 0 = vertex color, 1 = grayscale, 2 = inverted
+layout(constant_id = 1) const float BRIGHTNESS = 1.0;
+
 layout(location = 0) in vec3 fragColor;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec3 color = fragColor;
+    if (COLOR_MODE == 1) {
+        color = vec3(dot(color, vec3(0.299, 0.587, 0.114)));
+    } else if (COLOR_MODE == 2) {
+        color = 1.0 - color;
+    }
+    outColor = vec4(color * BRIGHTNESS, 1.0);
 }
\ No newline at end of file
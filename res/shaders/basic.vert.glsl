@@ -1,11 +1,48 @@
 #version 450
 
+// Specialization constants, see SPECIALIZATION_CONSTANTS in main.c
+layout(constant_id = 2) const uint TRANSFORM_SOURCE = 0; // Transform_Source: 0 = none, 1 = push constants, 2 = storage buffer
+
+// 2D affine transform as two rows (x, y, translation, padding), see Object_Transform in main.c
+struct Object_Transform {
+    vec4 rows[2];
+};
+
+// Every object's transform for this frame, indexed by draw ID (the draw's firstInstance)
+layout(std430, set = 0, binding = 0) readonly buffer Object_Transforms {
+    Object_Transform object_transforms[];
+};
+
+// See Draw_Constants in main.c: the whole block is pushed once per command buffer, the transform again per draw
+// when it comes from push constants
+layout(push_constant) uniform Draw_Constants {
+    Object_Transform transform;
+    vec2 camera_center;
+    float camera_zoom;
+    float depth_step; // 0 without a depth buffer
+} draw_constants;
+
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
 layout(location = 0) out vec3 fragColor;
 
+// The depth pre-pass and the color pass must compute the same depth to the bit
+invariant gl_Position;
+
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
+    vec3 position = vec3(inPosition, 1.0);
+    if (TRANSFORM_SOURCE != 0) {
+        Object_Transform transform;
+        if (TRANSFORM_SOURCE == 1) {
+            transform = draw_constants.transform;
+        } else {
+            transform = object_transforms[gl_InstanceIndex];
+        }
+        position.xy = vec2(dot(transform.rows[0].xyz, position), dot(transform.rows[1].xyz, position));
+    }
+    // Later draws are nearer, so a depth buffer keeps what draw order alone would show
+    float depth = 1.0 - float(gl_InstanceIndex + 1) * draw_constants.depth_step;
+    gl_Position = vec4((position.xy - draw_constants.camera_center) * draw_constants.camera_zoom, depth, 1.0);
     fragColor = inColor;
 }
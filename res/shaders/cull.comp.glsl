@@ -0,0 +1,138 @@
+#version 450
+
+// One invocation per indirect command, see CULL_GROUP_SIZE in main.c
+layout(local_size_x = 64) in;
+
+struct Object_Transform {
+    vec4 rows[2];
+};
+
+// See Cull_Object in main.c
+struct Cull_Object {
+    vec2 center;
+    float radius;
+    uint draw;
+    uint run;
+    uint first_run_command;
+};
+
+// See Cull_Statistics in main.c, one per frame in flight
+struct Cull_Statistics {
+    uint visible;
+    uint occluded; // Inside the view but behind what the previous frame drew, only with OCCLUSION
+};
+
+// VkDrawIndexedIndirectCommand
+struct Draw_Command {
+    uint index_count;
+    uint instance_count;
+    uint first_index;
+    int vertex_offset;
+    uint first_instance;
+};
+
+// Same set 0 as basic.vert.glsl
+layout(std430, set = 0, binding = 0) readonly buffer Object_Transforms {
+    Object_Transform object_transforms[];
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer Cull_Objects {
+    Cull_Object objects[];
+};
+layout(std430, set = 1, binding = 1) readonly buffer Commands {
+    Draw_Command commands[];
+};
+layout(std430, set = 1, binding = 2) writeonly buffer Visible_Commands {
+    Draw_Command visible_commands[];
+};
+layout(std430, set = 1, binding = 3) buffer Visible_Counts {
+    uint visible_counts[];
+};
+layout(std430, set = 1, binding = 4) buffer Statistics {
+    Cull_Statistics statistics[];
+};
+#ifdef OCCLUSION
+// Compiled to cull_hiz.comp.spv: the depth pyramid built from the previous frame, see Hiz_Pyramid in main.c
+layout(set = 1, binding = 5) uniform sampler2D hiz;
+#endif
+
+// See Cull_Constants in main.c
+layout(push_constant) uniform Cull_Constants {
+    vec2 camera_center;
+    float camera_zoom;
+    uint command_count;
+    uint read_transforms;
+    uint compact;
+    uint statistics_slot;
+    uint occlusion; // The pyramid has been built, 0 until the end of the first frame
+    vec2 hiz_camera_center;
+    float hiz_camera_zoom;
+    float depth_step;
+} constants;
+
+#ifdef OCCLUSION
+// The farthest depth the previous frame left under the bounding square of the circle, read from the pyramid
+// level where the square covers at most 2x2 texels. Later draws are nearer (see basic.vert.glsl), so if the
+// object's own depth is farther than all of it, every pixel it could touch was drawn over.
+bool is_occluded(vec2 center, float radius, uint draw) {
+    vec2 view_center = (center - constants.hiz_camera_center) * constants.hiz_camera_zoom;
+    float view_radius = radius * constants.hiz_camera_zoom;
+    vec2 view_min = view_center - view_radius;
+    vec2 view_max = view_center + view_radius;
+    // Nothing is known about what was outside the previous view
+    if (any(lessThan(view_min, vec2(-1.0))) || any(greaterThan(view_max, vec2(1.0)))) return false;
+
+    ivec2 size = textureSize(hiz, 0);
+    ivec2 texel_min = min(ivec2((view_min * 0.5 + 0.5) * vec2(size)), size - 1);
+    ivec2 texel_max = min(ivec2((view_max * 0.5 + 0.5) * vec2(size)), size - 1);
+    int level = 0;
+    while (any(greaterThan((texel_max >> level) - (texel_min >> level), ivec2(1)))) level++;
+    texel_min >>= level;
+    texel_max >>= level;
+
+    float farthest = 0.0;
+    for (int y = texel_min.y; y <= texel_max.y; y++) {
+        for (int x = texel_min.x; x <= texel_max.x; x++) {
+            farthest = max(farthest, texelFetch(hiz, ivec2(x, y), level).r);
+        }
+    }
+    float depth = 1.0 - float(draw + 1) * constants.depth_step;
+    return depth > farthest;
+}
+#endif
+
+void main() {
+    uint c = gl_GlobalInvocationID.x;
+    if (c >= constants.command_count) return;
+
+    Cull_Object object = objects[c];
+    vec2 center = object.center;
+    float radius = object.radius;
+    if (constants.read_transforms != 0) {
+        Object_Transform transform = object_transforms[object.draw];
+        center = vec2(dot(transform.rows[0].xyz, vec3(center, 1.0)), dot(transform.rows[1].xyz, vec3(center, 1.0)));
+        radius *= max(length(transform.rows[0].xy), length(transform.rows[1].xy));
+    }
+
+    // The view is [-1, 1] on both axes once the camera has moved and scaled the scene
+    vec2 view_center = (center - constants.camera_center) * constants.camera_zoom;
+    float view_radius = radius * constants.camera_zoom;
+    bool visible = all(lessThanEqual(abs(view_center), vec2(1.0 + view_radius)));
+#ifdef OCCLUSION
+    if (visible && constants.occlusion != 0 && is_occluded(center, radius, object.draw)) {
+        visible = false;
+        atomicAdd(statistics[constants.statistics_slot].occluded, 1);
+    }
+#endif
+
+    Draw_Command command = commands[c];
+    if (constants.compact != 0) {
+        if (!visible) return;
+        uint slot = atomicAdd(visible_counts[object.run], 1);
+        visible_commands[object.first_run_command + slot] = command;
+    } else {
+        if (!visible) command.instance_count = 0;
+        visible_commands[c] = command;
+    }
+    if (visible) atomicAdd(statistics[constants.statistics_slot].visible, 1);
+}
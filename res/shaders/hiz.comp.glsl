@@ -0,0 +1,31 @@
+#version 450
+
+// One invocation per texel of the level being written, see HIZ_GROUP_SIZE in main.c
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// The depth buffer for level 0, the level above for the others
+layout(set = 0, binding = 0) uniform sampler2D source;
+layout(set = 0, binding = 1, r32f) uniform writeonly image2D destination;
+
+// See Hiz_Constants in main.c
+layout(push_constant) uniform Hiz_Constants {
+    uvec2 source_size;
+    uvec2 destination_size;
+} constants;
+
+void main() {
+    uvec2 texel = gl_GlobalInvocationID.xy;
+    if (any(greaterThanEqual(texel, constants.destination_size))) return;
+
+    // The farthest depth over every source texel this one overlaps, rounded outward so nothing under it is
+    // missed. 2x2 between levels, whatever the window size works out to from the depth buffer.
+    uvec2 first = texel * constants.source_size / constants.destination_size;
+    uvec2 last = ((texel + 1u) * constants.source_size + constants.destination_size - 1u) / constants.destination_size;
+    float farthest = 0.0;
+    for (uint y = first.y; y < last.y; y++) {
+        for (uint x = first.x; x < last.x; x++) {
+            farthest = max(farthest, texelFetch(source, ivec2(x, y), 0).r);
+        }
+    }
+    imageStore(destination, ivec2(texel), vec4(farthest));
+}
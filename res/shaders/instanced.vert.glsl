@@ -0,0 +1,17 @@
+#version 450
+
+// Mesh vertices (binding 0)
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+
+// Per-instance data (binding 1), see GPU_INSTANCE_ATTRIBUTES in main.c
+layout(location = 2) in vec2 inOffset;
+layout(location = 3) in float inScale;
+layout(location = 4) in vec4 inInstanceColor;
+
+layout(location = 0) out vec3 fragColor;
+
+void main() {
+    gl_Position = vec4(inPosition * inScale + inOffset, 0.0, 1.0);
+    fragColor = inColor * inInstanceColor.rgb;
+}
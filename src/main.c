@@ -1,3 +1,7 @@
+// fsync and fileno for saving the pipeline cache
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -6,6 +10,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 
@@ -13,12 +25,85 @@
 
 enum { SCREEN_WIDTH = 800, SCREEN_HEIGHT = 600 };
 
+// NOTE: How many frames the CPU may record ahead of the GPU. Selectable with --frames-in-flight N.
+enum { DEFAULT_FRAMES_IN_FLIGHT = 2, MAX_FRAMES_IN_FLIGHT = 8 };
+
+// NOTE: Old swapchains waiting for their last frames to retire. More than a handful only happens when
+//       resizing faster than frames complete.
+enum { MAX_RETIRED_SWAPCHAINS = 8 };
+
+// NOTE: Cache size the vertex cache optimizer targets. Scores degrade gracefully on smaller hardware caches.
+enum { FORSYTH_CACHE_SIZE = 32 };
+
+// NOTE: Worker threads that record secondary command buffers. Selectable with --record-threads N.
+enum { MAX_RECORD_THREADS = 16 };
+
+// NOTE: Pipelines compile on their own threads so a new variant never stalls a frame.
+//       --sync-pipeline-compiles compiles on the main thread instead, for comparison.
+enum { PIPELINE_COMPILE_THREAD_COUNT = 2 };
+enum { PIPELINE_VARIANT_CAPACITY = 256 }; // Hash table slots, a power of two
+
+// NOTE: --materials N: one pipeline variant per material. Materials come into use one every
+//       MATERIAL_REVEAL_INTERVAL_FRAMES frames, the way new content shows up mid-game.
+enum { MAX_MATERIALS = 32, MATERIAL_REVEAL_INTERVAL_FRAMES = 30 };
+
+// NOTE: What the swapchain is tuned for. Selectable with --latency-mode.
+typedef enum {
+    LATENCY_MODE_LOW_LATENCY,  // MAILBOX, triple buffered: newest frame wins at vblank, no tearing
+    LATENCY_MODE_UNCAPPED,     // IMMEDIATE: no vsync, for measuring raw frame throughput
+    LATENCY_MODE_POWER_SAVING, // FIFO(_RELAXED): capped to the refresh rate, fewest images
+    LATENCY_MODE_COUNT
+} Latency_Mode;
+
+// NOTE: One step of a latency mode's fallback chain. image_count of 0 means the surface's minImageCount.
+typedef struct {
+    VkPresentModeKHR present_mode;
+    uint32_t image_count;
+} Present_Mode_Policy;
+
+enum { MAX_PRESENT_MODE_FALLBACKS = 4 };
+
+typedef struct {
+    const char *name;
+    uint32_t policy_count;
+    Present_Mode_Policy policies[MAX_PRESENT_MODE_FALLBACKS];
+} Latency_Mode_Info;
+
+// NOTE: FIFO is the only mode every surface has to support, so it ends every chain
+static Latency_Mode_Info latency_modes[LATENCY_MODE_COUNT] = {
+    [LATENCY_MODE_LOW_LATENCY] = {
+        // No IMMEDIATE: it tears, which only uncapped asks for
+        "low-latency", 2, {
+            {VK_PRESENT_MODE_MAILBOX_KHR, 3},
+            {VK_PRESENT_MODE_FIFO_KHR, 0} // Deeper FIFO queues only add latency
+        }
+    },
+    [LATENCY_MODE_UNCAPPED] = {
+        "uncapped", 4, {
+            {VK_PRESENT_MODE_IMMEDIATE_KHR, 3},
+            {VK_PRESENT_MODE_MAILBOX_KHR, 3},
+            {VK_PRESENT_MODE_FIFO_RELAXED_KHR, 3},
+            {VK_PRESENT_MODE_FIFO_KHR, 3}
+        }
+    },
+    [LATENCY_MODE_POWER_SAVING] = {
+        // FIFO_RELAXED only differs from FIFO when a frame misses vblank: it shows it right away instead of
+        // holding it for another full refresh
+        "power-saving", 2, {
+            {VK_PRESENT_MODE_FIFO_RELAXED_KHR, 0},
+            {VK_PRESENT_MODE_FIFO_KHR, 0}
+        }
+    },
+};
+
 typedef struct {
     VkSwapchainKHR swapchain;
     uint32_t swapchain_image_count;
     VkImage *swapchain_images;
     VkFormat swapchain_image_format;
     VkExtent2D swapchain_extent;
+    Latency_Mode latency_mode;
+    VkPresentModeKHR present_mode;
 } Swapchain_Etc;
 
 typedef struct {
@@ -27,17 +112,295 @@ typedef struct {
     uint32_t graphics_queue_family_index;
     VkQueue present_queue;
     uint32_t present_queue_family_index;
+    // The graphics queue when the device has no transfer-only family
+    VkQueue transfer_queue;
+    uint32_t transfer_queue_family_index;
+    bool graphics_queue_has_compute; // Compute dispatches can go in the frame's command buffer
+    uint32_t timestamp_valid_bits;   // Of the graphics family, 0 = no timestamps
+    // Optional, enabled when the device has them
+    bool multi_draw_indirect;
+    bool draw_indirect_first_instance;
+    PFN_vkCmdDrawIndexedIndirectCountKHR draw_indexed_indirect_count; // NULL without VK_KHR_draw_indirect_count
+    PFN_vkCmdBeginRenderingKHR begin_rendering;                       // NULL without VK_KHR_dynamic_rendering
+    PFN_vkCmdEndRenderingKHR end_rendering;
+    bool pipeline_statistics_query;
+    bool inherited_queries; // Queries can stay active across vkCmdExecuteCommands
 } Logical_Device_Etc;
 
+// NOTE: What a frame renders into, one per swapchain image. The render pass path begins render_pass on
+//       framebuffer. The dynamic rendering path has neither and begins rendering on the image view, with
+//       barriers doing the layout transitions the render pass would have done.
+typedef struct {
+    VkRenderPass render_pass; // VK_NULL_HANDLE: dynamic rendering
+    VkFramebuffer framebuffer;
+    VkImage image;
+    VkImageView image_view;
+    VkFormat format;
+    VkExtent2D extent;
+    VkImage depth_image;
+    VkImageView depth_view;
+    VkFormat depth_format; // VK_FORMAT_UNDEFINED without --depth
+    bool store_depth;      // --hiz: the depth pyramid is built from it after the render pass
+    VkImage msaa_image;    // VK_NULL_HANDLE without --msaa, otherwise rendered to and resolved into image
+    VkImageView msaa_view;
+    VkSampleCountFlagBits samples;
+    PFN_vkCmdBeginRenderingKHR begin_rendering;
+    PFN_vkCmdEndRenderingKHR end_rendering;
+} Render_Target;
+
+// NOTE: Source vertex, what meshes are built, deduplicated and optimized with on the CPU
 typedef struct {
     float position[2];
     float color[3];
 } Vertex;
 
+// NOTE: What actually goes into vertex buffers, picked at compile time with -DVERTEX_LAYOUT=...
+//       Each layout is a single X-macro list of attributes; the struct, the attribute descriptions and
+//       the packing from Vertex are all generated from it, so they can't drift apart.
+//       X(location, field, type, count, format, source_field, source_count, pack)
+#define VERTEX_LAYOUT_FULL 0    // 20 bytes: float2 position, float3 color
+#define VERTEX_LAYOUT_HALF 1    //  8 bytes: half2 position, unorm8x4 color
+#define VERTEX_LAYOUT_SNORM 2   //  8 bytes: snorm16x2 position (clip space is [-1, 1] anyway), unorm8x4 color
+
+#ifndef VERTEX_LAYOUT
+#define VERTEX_LAYOUT VERTEX_LAYOUT_FULL
+#endif
+
+#if VERTEX_LAYOUT == VERTEX_LAYOUT_FULL
+#define VERTEX_LAYOUT_NAME "full"
+#define GPU_VERTEX_ATTRIBUTES(X) \
+    X(0, position, float, 2, VK_FORMAT_R32G32_SFLOAT, position, 2, pack_float) \
+    X(1, color, float, 3, VK_FORMAT_R32G32B32_SFLOAT, color, 3, pack_float)
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_HALF
+#define VERTEX_LAYOUT_NAME "half"
+#define GPU_VERTEX_ATTRIBUTES(X) \
+    X(0, position, uint16_t, 2, VK_FORMAT_R16G16_SFLOAT, position, 2, pack_half) \
+    X(1, color, uint8_t, 4, VK_FORMAT_R8G8B8A8_UNORM, color, 3, pack_unorm8)
+#elif VERTEX_LAYOUT == VERTEX_LAYOUT_SNORM
+#define VERTEX_LAYOUT_NAME "snorm"
+#define GPU_VERTEX_ATTRIBUTES(X) \
+    X(0, position, int16_t, 2, VK_FORMAT_R16G16_SNORM, position, 2, pack_snorm16) \
+    X(1, color, uint8_t, 4, VK_FORMAT_R8G8B8A8_UNORM, color, 3, pack_unorm8)
+#else
+#error "Unknown VERTEX_LAYOUT"
+#endif
+
+#define DECLARE_GPU_VERTEX_FIELD(location, field, type, count, format, source_field, source_count, pack) \
+    type field[count];
+typedef struct {
+    GPU_VERTEX_ATTRIBUTES(DECLARE_GPU_VERTEX_FIELD)
+} Gpu_Vertex;
+#undef DECLARE_GPU_VERTEX_FIELD
+
+// NOTE: Per-instance data of instanced batches, in its own binding at VK_VERTEX_INPUT_RATE_INSTANCE. Same
+//       scheme as the vertex layout, without the packing: X(location, field, type, count, format)
+#define GPU_INSTANCE_ATTRIBUTES(X)                   \
+    X(2, offset, float, 2, VK_FORMAT_R32G32_SFLOAT)  \
+    X(3, scale, float, 1, VK_FORMAT_R32_SFLOAT)      \
+    X(4, color, uint8_t, 4, VK_FORMAT_R8G8B8A8_UNORM)
+
+#define DECLARE_GPU_INSTANCE_FIELD(location, field, type, count, format) type field[count];
+typedef struct {
+    GPU_INSTANCE_ATTRIBUTES(DECLARE_GPU_INSTANCE_FIELD)
+} Gpu_Instance;
+#undef DECLARE_GPU_INSTANCE_FIELD
+
+enum { VERTEX_BINDING = 0, INSTANCE_BINDING = 1 };
+
+// NOTE: Device memory is sub-allocated from large blocks instead of one vkAllocateMemory per resource.
+//       Drivers cap the number of live allocations (maxMemoryAllocationCount, often 4096) and each one is slow.
+enum { DEVICE_MEMORY_BLOCK_SIZE = 64 * 1024 * 1024 };
+enum { BUDDY_MIN_BLOCK_SIZE = 256 };
+enum { BUDDY_ORDER_COUNT = 19 }; // BUDDY_MIN_BLOCK_SIZE << 18 == DEVICE_MEMORY_BLOCK_SIZE
+
+typedef enum {
+    // General purpose: power-of-two blocks that merge with their buddy on free
+    ALLOCATION_STRATEGY_BUDDY,
+    // Bump allocation for resources that die together. The block rewinds once all of them are freed.
+    ALLOCATION_STRATEGY_LINEAR,
+    // Too big for a shared block
+    ALLOCATION_STRATEGY_DEDICATED,
+    ALLOCATION_STRATEGY_COUNT
+} Allocation_Strategy;
+
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t memory_type_index;
+    Allocation_Strategy strategy;
+    void *mapped; // Whole block, persistently mapped when host visible
+    uint32_t live_count;
+    VkDeviceSize bytes_used;
+
+    // ALLOCATION_STRATEGY_LINEAR
+    VkDeviceSize linear_offset;
+
+    // ALLOCATION_STRATEGY_BUDDY: free lists are intrusive, linked through per-unit arrays.
+    // free_orders[unit] is order + 1 when a free block of that order starts at unit, 0 otherwise.
+    uint32_t free_heads[BUDDY_ORDER_COUNT];
+    uint32_t *free_next;
+    uint32_t *free_prev;
+    uint8_t *free_orders;
+} Memory_Block;
+
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;           // What was reserved, including rounding
+    VkDeviceSize requested_size; // What the resource asked for
+    void *mapped;                // NULL unless the memory type is host visible
+    uint32_t block_index;
+} Device_Allocation;
+
+typedef struct {
+    uint64_t live_allocation_count;
+    uint64_t total_allocation_count;
+    uint64_t block_allocation_count; // vkAllocateMemory calls
+    uint32_t live_block_count;
+    VkDeviceSize bytes_requested;
+    VkDeviceSize bytes_used;
+    VkDeviceSize bytes_reserved;
+    float fragmentation; // 1 - largest free range / free bytes, over all shared blocks
+} Device_Allocator_Stats;
+
+typedef struct {
+    VkPhysicalDevice physical_device;
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkDeviceSize buffer_image_granularity;
+    Memory_Block *blocks;
+    uint32_t block_count; // Including empty slots (memory == VK_NULL_HANDLE), so block indices stay stable
+    uint32_t block_capacity;
+    uint64_t total_allocation_count;
+    uint64_t block_allocation_count;
+    VkDeviceSize bytes_requested;
+} Device_Allocator;
+
+typedef struct {
+    VkBuffer buffer;
+    Device_Allocation allocation;
+} Buffer_Etc;
+
+typedef struct {
+    VkImage image;
+    Device_Allocation allocation;
+    VkMemoryPropertyFlags memory_properties; // What the memory was picked with, see create_image
+} Image_Etc;
+
+// NOTE: An attachment that only lives inside the render pass, one image shared by every swapchain image.
+//       Frames run one after the other on the graphics queue and nothing reads it once the render pass is
+//       over, so it's cleared on load and never stored: a transient attachment, which tilers can keep in
+//       tile memory and never back. The exception is the depth with --hiz, which is sampled after the render
+//       pass, so it's stored and gets real memory.
+typedef struct {
+    Image_Etc image;
+    VkImageView view;
+    VkFormat format; // VK_FORMAT_UNDEFINED when not in use
+} Transient_Attachment;
+
+typedef struct {
+    VkSampleCountFlagBits samples;
+    Transient_Attachment color; // --msaa: multisampled color, resolved into the swapchain image by the subpass
+    Transient_Attachment depth; // --depth, at the same sample count
+    bool depth_sampled;         // --hiz
+} Transient_Attachments;
+
+// NOTE: Uploads are staged through a host-visible ring and copied into device-local buffers on the
+//       transfer queue. Copies are batched into one command buffer until flush_uploads submits them.
+enum { STAGING_RING_SIZE = 16 * 1024 * 1024 };
+enum { UPLOAD_BATCH_COUNT = 4 };
+
+typedef struct {
+    VkCommandBuffer command_buffer;
+    VkFence fence;
+    uint64_t ticket;
+    VkDeviceSize ring_end; // Ring head when the batch was submitted, the tail moves here once it completes
+} Upload_Batch;
+
+typedef struct {
+    VkDevice device;
+    VkQueue queue;
+    uint32_t queue_family_indices[2]; // Transfer and graphics, for buffers shared between them
+    uint32_t queue_family_count;
+    VkCommandPool command_pool;
+
+    Buffer_Etc staging;
+    // Monotonic byte counters, the ring position is the counter modulo STAGING_RING_SIZE
+    VkDeviceSize head;
+    VkDeviceSize tail;
+
+    Upload_Batch batches[UPLOAD_BATCH_COUNT];
+    uint32_t oldest_batch;
+    uint32_t pending_batch_count;
+    bool recording;
+    uint64_t submitted_ticket;
+    uint64_t completed_ticket;
+
+    uint64_t copy_count;
+    uint64_t submit_count;
+    VkDeviceSize bytes_uploaded;
+} Uploader;
+
+// NOTE: Per-frame data the CPU rewrites every frame (UI, debug lines, particles) goes straight into a
+//       persistently mapped buffer split into one partition per frame in flight. A partition is
+//       rewound once its frame's fence has signaled, so allocation is a bump and there's no copy.
+enum { STREAM_FRAME_SIZE = 8 * 1024 * 1024 };
+
+typedef struct {
+    Buffer_Etc buffer;
+    VkDeviceSize frame_size; // STREAM_FRAME_SIZE plus whatever the instanced batches need
+    uint32_t frame_count;
+    uint32_t current_frame;
+    VkDeviceSize used; // In the current frame's partition
+    VkDeviceSize peak_used;
+    VkDeviceSize storage_alignment;
+    uint64_t overflow_count;
+} Stream_Buffer;
+
 typedef struct {
+    void *data; // NULL when the partition is full
     VkBuffer buffer;
-    VkDeviceMemory buffer_memory;
-} Vertex_Buffer_Etc;
+    VkDeviceSize offset;
+} Stream_Allocation;
+
+// NOTE: --instances N: instanced batches of many copies of a few small meshes (glyphs, markers). Instances
+//       are added in any order during the frame, build_instance_batches groups them by mesh and streams them
+//       in, and every mesh is then one vkCmdDrawIndexed with a large instance count.
+enum { MAX_INSTANCE_MESHES = 8, MAX_INSTANCES = 1 << 20 };
+
+typedef struct {
+    uint32_t first_index;
+    uint32_t index_count;
+    int32_t vertex_offset;
+} Instance_Mesh;
+
+typedef struct {
+    uint32_t mesh;
+    uint32_t first_instance; // Into this frame's instance data
+    uint32_t instance_count;
+} Instance_Batch;
+
+typedef struct {
+    Buffer_Etc vertex_buffer; // All meshes, 16-bit indices
+    Buffer_Etc index_buffer;
+    uint32_t mesh_count;
+    Instance_Mesh meshes[MAX_INSTANCE_MESHES];
+    VkPipeline pipeline; // Refreshed every frame, it changes when the shaders are reloaded
+
+    // Added by add_instance since the last build
+    uint32_t instance_capacity;
+    uint32_t instance_count;
+    Gpu_Instance *instances;
+    uint32_t *instance_meshes;
+    Gpu_Instance *sorted_instances; // Scratch for build_instance_batches
+    uint64_t dropped_instance_count;
+
+    // Built by build_instance_batches
+    uint32_t batch_count;
+    Instance_Batch batches[MAX_INSTANCE_MESHES];
+    VkBuffer instance_buffer;
+    VkDeviceSize instance_offset;
+} Instance_Batcher;
 
 typedef struct {
     VkSemaphore image_available_semaphore;
@@ -45,6 +408,886 @@ typedef struct {
     VkFence in_flight_fence;
 } Synchronization_Objects;
 
+// NOTE: Everything one frame needs to be recorded and submitted while other frames are still on the GPU
+typedef struct {
+    VkCommandBuffer command_buffer;
+    Synchronization_Objects sync;
+} Frame_Context;
+
+typedef struct {
+    uint32_t frame_count;
+    uint32_t current_frame;
+    uint64_t frame_number; // Frames submitted so far
+    Frame_Context frames[MAX_FRAMES_IN_FLIGHT];
+    // NOTE: Per swapchain image: fence of the frame that last rendered into it (VK_NULL_HANDLE if none).
+    //       Acquire can hand us an image out of order, so the frame fence alone doesn't protect the image.
+    uint32_t image_count;
+    VkFence *images_in_flight;
+} Frame_Ring;
+
+// NOTE: A swapchain replaced by recreation together with the views, framebuffers and transient attachments built
+//       on it.
+//       Destroyed once every frame submitted before retire_frame_number has finished on the GPU.
+typedef struct {
+    Swapchain_Etc swapchain_etc;
+    VkImageView *image_views;
+    VkFramebuffer *framebuffers;
+    Transient_Attachments transient_attachments;
+    uint64_t retire_frame_number;
+} Retired_Swapchain;
+
+typedef struct {
+    uint32_t count;
+    Retired_Swapchain entries[MAX_RETIRED_SWAPCHAINS];
+} Retired_Swapchains;
+
+// NOTE: Where the vertex shader gets each object's transform from, the TRANSFORM_SOURCE specialization
+//       constant. Objects are draws: the draw index goes in as firstInstance and comes back as gl_InstanceIndex.
+typedef enum {
+    TRANSFORM_SOURCE_NONE,           // Positions are used as they are
+    TRANSFORM_SOURCE_PUSH_CONSTANTS, // Pushed before every draw
+    TRANSFORM_SOURCE_STORAGE_BUFFER, // One per-frame buffer with every object's transform, indexed by draw ID
+    TRANSFORM_SOURCE_COUNT
+} Transform_Source;
+
+// NOTE: A 2D affine transform as two rows (x, y, translation, padding), which is two vec4 in std430 and in
+//       push constants alike. Matches Object_Transform in basic.vert.glsl.
+typedef struct {
+    float rows[2][4];
+} Object_Transform;
+
+// NOTE: 2D camera, applied after the object transform: ndc = (position - center) * zoom
+typedef struct {
+    float center[2];
+    float zoom;
+} Camera;
+
+// Push constants of the basic program, see Draw_Constants in basic.vert.glsl. The whole block is pushed once per
+// command buffer, the shader reads the transform member whatever the source. With TRANSFORM_SOURCE_PUSH_CONSTANTS
+// the transform is pushed again before every draw.
+typedef struct {
+    Object_Transform transform;
+    Camera camera;
+    float depth_step;
+} Draw_Constants;
+
+// NOTE: --animate: how objects move every frame. Only ANIMATION_MODE_VERTICES touches vertex memory, it's
+//       the baseline the transform paths are measured against.
+typedef enum {
+    ANIMATION_MODE_NONE,
+    ANIMATION_MODE_VERTICES,       // Every vertex transformed on the CPU and streamed in as a new vertex buffer
+    ANIMATION_MODE_PUSH_CONSTANTS, // 32 bytes pushed per draw
+    ANIMATION_MODE_STORAGE_BUFFER, // 32 bytes per object streamed into one storage buffer
+    ANIMATION_MODE_COUNT
+} Animation_Mode;
+
+typedef struct {
+    const char *name;
+    Transform_Source transform_source;
+} Animation_Mode_Info;
+
+static Animation_Mode_Info animation_modes[ANIMATION_MODE_COUNT] = {
+    [ANIMATION_MODE_NONE] = {"none", TRANSFORM_SOURCE_NONE},
+    [ANIMATION_MODE_VERTICES] = {"vertices", TRANSFORM_SOURCE_NONE},
+    [ANIMATION_MODE_PUSH_CONSTANTS] = {"push-constants", TRANSFORM_SOURCE_PUSH_CONSTANTS},
+    [ANIMATION_MODE_STORAGE_BUFFER] = {"storage-buffer", TRANSFORM_SOURCE_STORAGE_BUFFER},
+};
+
+// NOTE: Descriptor set 0 holds per-frame data written into the stream buffer. Its buffers are bound with dynamic
+//       offsets (see reflect_shader_program), so a single descriptor set serves every frame in flight.
+enum { DESCRIPTOR_SET_FRAME = 0, OBJECT_TRANSFORM_BINDING = 0 };
+
+typedef struct {
+    VkDescriptorPool pool;
+    VkDescriptorSet set;
+    VkDeviceSize object_transform_range;
+} Frame_Descriptors;
+
+// NOTE: --draw-path: how the draw list reaches the GPU. Direct records a vkCmdDrawIndexed per draw, indirect
+//       reads the draws from Indirect_Draws with one call per material.
+typedef enum {
+    DRAW_PATH_DIRECT,
+    DRAW_PATH_INDIRECT,
+    DRAW_PATH_COUNT
+} Draw_Path;
+
+static const char *draw_path_names[DRAW_PATH_COUNT] = {
+    [DRAW_PATH_DIRECT] = "direct",
+    [DRAW_PATH_INDIRECT] = "indirect",
+};
+
+// NOTE: --render-path: a VkRenderPass with a framebuffer per swapchain image, or VK_KHR_dynamic_rendering
+//       straight on the image views, see Render_Target
+typedef enum {
+    RENDER_PATH_RENDER_PASS,
+    RENDER_PATH_DYNAMIC,
+    RENDER_PATH_COUNT
+} Render_Path;
+
+static const char *render_path_names[RENDER_PATH_COUNT] = {
+    [RENDER_PATH_RENDER_PASS] = "render-pass",
+    [RENDER_PATH_DYNAMIC] = "dynamic",
+};
+
+// NOTE: The draw list as VkDrawIndexedIndirectCommands in a device local buffer, grouped by material so every
+//       material is one run. counts holds each run's draw count for drawIndirectCount; both buffers can be
+//       written by a compute pass.
+typedef struct {
+    Buffer_Etc commands;
+    Buffer_Etc counts;
+    uint32_t material_count;
+    uint32_t *material_first_commands; // material_count + 1, run m is [m], [m + 1])
+    uint32_t *command_draws;           // Draw index of every command
+    bool multi_draw;
+    PFN_vkCmdDrawIndexedIndirectCountKHR draw_indexed_indirect_count;
+} Indirect_Draws;
+
+// NOTE: --cull: a compute pass tests every object's bounding circle against the camera before the render pass
+//       and writes the commands that survive to visible_commands, which the indirect path draws from instead.
+//       With drawIndirectCount the survivors are packed to the front of their material run and counted in
+//       visible_counts, without it they keep their slot and culled commands get an instanceCount of 0.
+//       With --hiz the same shader compiled with OCCLUSION also tests what's left against a Hiz_Pyramid.
+#define CULL_SHADER "cull.comp.spv"
+#define CULL_HIZ_SHADER "cull_hiz.comp.spv"
+enum { CULL_GROUP_SIZE = 64 }; // local_size_x in cull.comp.glsl
+enum { DESCRIPTOR_SET_CULL = 1 };
+enum {
+    CULL_OBJECTS_BINDING,
+    CULL_COMMANDS_BINDING,
+    CULL_VISIBLE_COMMANDS_BINDING,
+    CULL_VISIBLE_COUNTS_BINDING,
+    CULL_STATISTICS_BINDING,
+    CULL_HIZ_BINDING,  // CULL_HIZ_SHADER only
+    CULL_BINDING_COUNT
+};
+
+// One per indirect command, in the same order, see Cull_Object in cull.comp.glsl
+typedef struct {
+    float center[2]; // Bounding circle in object space, the object's transform moves it
+    float radius;
+    uint32_t draw;   // Draw ID, indexes the transforms
+    uint32_t run;    // Material run of the command
+    uint32_t first_run_command;
+} Cull_Object;
+
+typedef struct {
+    Camera camera;
+    uint32_t command_count;
+    uint32_t read_transforms; // TRANSFORM_SOURCE_STORAGE_BUFFER, otherwise the bounds don't move
+    uint32_t compact;
+    uint32_t statistics_slot; // Frame in flight
+    uint32_t occlusion;       // CULL_HIZ_SHADER: the pyramid has been built
+    Camera hiz_camera;        // What the pyramid was built with
+    float depth_step;         // Scene.depth_step, to tell how deep each draw is
+} Cull_Constants;
+
+// One per frame in flight, see Cull_Statistics in cull.comp.glsl
+typedef struct {
+    uint32_t visible;
+    uint32_t occluded; // Inside the view but behind the previous frame's depth, --hiz only
+} Cull_Statistics;
+
+// NOTE: --hiz: the previous frame's depth buffer reduced into a fixed size mip chain, every texel holding the
+//       farthest depth under it. The cull pass takes each object's bounding square to the level where it
+//       covers at most 2x2 texels, and if the object is farther than all of them, something was drawn in
+//       front of every pixel it could touch. It's built after the render pass and read by the next frame's
+//       cull pass, with the camera of the frame it was built in, so it's one frame late: something that comes
+//       out from behind an occluder (or whose occluder moved away) is drawn a frame after it should be.
+//       Sampling the depth rules out multisampled depth.
+#define HIZ_SHADER "hiz.comp.spv"
+enum { HIZ_SIZE = 512, HIZ_LEVEL_COUNT = 10 }; // 512x512 down to 1x1, whatever the window size
+enum { HIZ_GROUP_SIZE = 8 };                   // local_size_x and local_size_y in hiz.comp.glsl
+
+// See Hiz_Constants in hiz.comp.glsl
+typedef struct {
+    uint32_t source_size[2];
+    uint32_t destination_size[2];
+} Hiz_Constants;
+
+typedef struct {
+    VkDevice device;
+    VkPipeline pipeline;
+    VkPipelineLayout pipeline_layout; // Owned by the layout cache
+    VkDescriptorPool descriptor_pool;
+    Image_Etc image;                  // R32_SFLOAT, HIZ_LEVEL_COUNT levels, in VK_IMAGE_LAYOUT_GENERAL once built
+    VkImageView view;                 // Every level, what the cull pass reads
+    VkImageView level_views[HIZ_LEVEL_COUNT];
+    VkSampler sampler;                // Nearest, the shaders only fetch texels
+    VkDescriptorSet *depth_sets;      // Per frame in flight: depth buffer into level 0, pointed at the depth when recording
+    VkDescriptorSet level_sets[HIZ_LEVEL_COUNT - 1]; // [l - 1]: level l - 1 into level l
+    bool built;                       // Recorded at least once, the cull pass skips the test until then
+    Camera camera;                    // Of the frame it was last built in
+} Hiz_Pyramid;
+
+typedef struct {
+    VkPipeline pipeline;
+    VkPipelineLayout pipeline_layout; // Owned by the layout cache
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet frame_set; // Object transforms, with the same dynamic offset as the graphics set
+    VkDescriptorSet set;
+    Buffer_Etc objects;
+    Buffer_Etc visible_commands;
+    Buffer_Etc visible_counts;
+    Buffer_Etc statistics; // A Cull_Statistics per frame in flight, host visible
+    uint32_t command_count;
+    uint32_t frame_count;
+    bool read_transforms;
+    bool compact;
+    bool occlusion;  // --hiz
+    Hiz_Pyramid hiz; // Zeroed without --hiz
+
+    bool *statistics_pending; // Per frame in flight: submitted, not collected yet
+    uint64_t visible_total;
+    uint64_t occluded_total;
+    uint64_t sampled_frame_count;
+} Cull_Pass;
+
+// NOTE: --gpu-timing: timestamps around the culling and the render pass of every frame, read back once the
+//       frame's fence has signaled. Building the --hiz pyramid after the render pass counts as culling. Where pipeline statistics queries are supported, the render pass's
+//       fragment shader invocations are counted too, which is the overdraw figure.
+enum { GPU_TIMESTAMP_FRAME_BEGIN, GPU_TIMESTAMP_CULLED, GPU_TIMESTAMP_RENDERED, GPU_TIMESTAMP_HIZ_BUILT, GPU_TIMESTAMP_COUNT };
+
+typedef struct {
+    VkQueryPool query_pool;      // GPU_TIMESTAMP_COUNT per frame in flight
+    VkQueryPool statistics_pool; // One per frame in flight, VK_NULL_HANDLE when fragments aren't counted
+    uint32_t frame_count;
+    float timestamp_period; // Nanoseconds per tick
+    bool *pending;          // Per frame in flight: submitted, not collected yet
+    double cull_ms;
+    double render_ms;
+    uint64_t sampled_frame_count;
+    uint64_t fragment_invocations; // Over all sampled frames
+} Gpu_Timer;
+
+// NOTE: --render-queue: the direct path draws from a sorted queue instead of in draw list order. Submitters push
+//       a 64-bit sort key and a payload into their own buffer (one per recording thread, so nothing is locked),
+//       build_render_queue merges the buffers and radix sorts the keys, and recording walks the sorted items
+//       and only binds what changed since the item before.
+//       Key, most significant bits first: layer | pipeline | material | depth. Layers are drawn in order, so
+//       anything that has to stay on top goes in a later layer; inside a layer the sort decides. The blended
+//       layer is layer | depth | pipeline | material instead, blending is only right in depth order.
+enum { RENDER_KEY_LAYER_BITS = 4, RENDER_KEY_PIPELINE_BITS = 12, RENDER_KEY_MATERIAL_BITS = 16, RENDER_KEY_DEPTH_BITS = 32 };
+enum { RENDER_LAYER_SCENE = 0, RENDER_LAYER_BLENDED = 1 };
+
+typedef struct {
+    VkPipeline pipeline;
+    VkBuffer vertex_buffer;
+    VkDeviceSize vertex_offset;
+    uint32_t draw; // Draw ID, indexes the draw list and the transforms
+} Render_Item;
+
+typedef struct {
+    uint64_t key;
+    uint32_t item; // Into the merged items
+} Render_Sort_Entry;
+
+// Written by one thread only
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t *keys;
+    Render_Item *items;
+} Render_Queue_Buffer;
+
+typedef struct {
+    uint32_t buffer_count;
+    Render_Queue_Buffer buffers[MAX_RECORD_THREADS];
+    uint32_t pipeline_ids[MAX_MATERIALS]; // Key pipeline field per material, shared by materials with the same pipeline
+
+    // Built by build_render_queue, items in submission order and entries sorted by key
+    uint32_t item_count;
+    uint32_t item_capacity;
+    Render_Item *items;
+    Render_Sort_Entry *entries;
+    Render_Sort_Entry *scratch;
+
+    // Totals over all builds, binds as a single command buffer would make them. Each extra recording thread
+    // starts its slice with a fresh bind of both.
+    uint64_t build_count;
+    uint64_t command_count;
+    uint64_t pipeline_bind_count;
+    uint64_t vertex_buffer_bind_count;
+    uint64_t unsorted_pipeline_bind_count; // The same items drawn in submission order
+    double submit_ms;
+    double sort_ms;
+} Render_Queue;
+
+typedef struct {
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t material;
+} Draw_Command;
+
+// NOTE: What gets drawn. version is bumped on every change so recorded command buffers can tell they're stale.
+typedef struct {
+    VkClearValue clear_color;
+    uint64_t version;
+
+    Vertex *vertices;
+    uint32_t vertex_count;
+    uint32_t *indices;
+    uint32_t index_count;
+    Draw_Command *draws;
+    uint32_t draw_count;
+
+    // Resolved by resolve_material_pipelines every frame. VK_NULL_HANDLE skips the material's draws.
+    VkPipeline *material_pipelines;
+    bool *material_blended;        // Blended materials don't write depth, the render queue draws them last
+    VkPipeline *prepass_pipelines; // --depth-prepass: depth-only twin of each material pipeline, NULL otherwise
+    bool front_to_back;            // Walk the draw list backwards, only set on record_depth_prepass's copy
+    uint32_t material_count;
+
+    // Uploaded by main, 16-bit when the vertex count allows it
+    VkBuffer index_buffer;
+    VkIndexType index_type;
+
+    // Rewritten every frame from the stream buffer, drawn after the draw list
+    VkBuffer dynamic_vertex_buffer;
+    VkDeviceSize dynamic_vertex_offset;
+    uint32_t dynamic_vertex_count;
+
+    // One object per draw. object_transforms has an extra identity transform at draw_count for the
+    // dynamic geometry.
+    Transform_Source transform_source;
+    float *object_centers; // x, y per draw
+    float *object_radii;   // Bounding circle around the center, per draw
+    Object_Transform *object_transforms;
+    uint32_t *vertex_objects; // Draw each vertex belongs to, for ANIMATION_MODE_VERTICES
+
+    // Bound once per command buffer, every pipeline shares the basic program's layout
+    VkPipelineLayout pipeline_layout;
+    VkShaderStageFlags push_constant_stages;
+    VkDescriptorSet frame_descriptor_set;
+    uint32_t object_transform_offset; // Dynamic offset of this frame's transforms in the stream buffer
+
+    // ANIMATION_MODE_VERTICES: this frame's transformed copy of the vertices, VK_NULL_HANDLE otherwise
+    VkBuffer animated_vertex_buffer;
+    VkDeviceSize animated_vertex_offset;
+
+    // Drawn after the draw list, NULL without --instances
+    const Instance_Batcher *instance_batcher;
+
+    // DRAW_PATH_INDIRECT: replaces the per-draw calls, NULL on the direct path
+    const Indirect_Draws *indirect_draws;
+
+    Camera camera;
+    float depth_step;      // --depth: draw ID i is drawn at depth 1 - (i + 1) * depth_step, 0 without
+    uint32_t frame_index;  // Frame in flight, picks the slots of the cull statistics and timestamps
+    Cull_Pass *cull_pass;  // NULL without --cull
+    Gpu_Timer *gpu_timer;  // NULL without --gpu-timing
+
+    // --render-queue: replaces the draw list order on the direct path, NULL otherwise
+    const Render_Queue *render_queue;
+} Scene;
+
+// NOTE: --static-scene: one command buffer per swapchain image, recorded once and only re-recorded when
+//       the scene version changes or the swapchain is rebuilt
+typedef struct {
+    uint32_t count;
+    VkCommandBuffer *command_buffers;
+    uint64_t *recorded_versions;  // Scene version each buffer was recorded with, 0 = needs recording
+    VkFence *last_submit_fences;  // Fence of the last frame that submitted each buffer
+    uint64_t record_count;        // Every recording, including the first one per buffer
+    uint64_t rerecord_count;      // Recordings that replaced a stale buffer
+} Static_Command_Buffers;
+
+// NOTE: What the recording threads are asked to do for one frame. Each active thread records its slice of
+//       the draw list into its own secondary command buffer, or, for RECORD_JOB_SUBMIT, pushes its slice of
+//       the draw list into its own render queue buffer.
+typedef enum {
+    RECORD_JOB_RECORD,
+    RECORD_JOB_SUBMIT
+} Record_Job_Kind;
+
+typedef struct {
+    Record_Job_Kind kind;
+    uint32_t frame_index;
+    uint32_t active_thread_count;
+    Render_Target target; // Dynamic state is not inherited, so every secondary sets its own viewport
+    VkPipeline pipeline;
+    VkBuffer vertex_buffer;
+    const Scene *scene;
+    Render_Queue *render_queue; // RECORD_JOB_SUBMIT only
+} Record_Job;
+
+typedef struct Record_Workers Record_Workers;
+
+// NOTE: Command pools are externally synchronized, so every thread owns one pool per frame in flight.
+//       A pool is only reset once its frame's fence has signaled.
+typedef struct {
+    Record_Workers *workers;
+    uint32_t thread_index;
+    pthread_t thread;
+    VkCommandPool command_pools[MAX_FRAMES_IN_FLIGHT];
+    VkCommandBuffer command_buffers[MAX_FRAMES_IN_FLIGHT];
+} Record_Worker;
+
+struct Record_Workers {
+    VkDevice device;
+    uint32_t thread_count;
+    uint32_t frame_count;
+    Record_Worker workers[MAX_RECORD_THREADS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;
+    pthread_cond_t job_done;
+    uint64_t job_generation;
+    uint32_t jobs_remaining;
+    bool quit;
+    Record_Job job;
+};
+
+// NOTE: On-disk pipeline cache. The driver's blob is wrapped in our own header so a cache from another
+//       device, driver version or a truncated write is thrown away before the driver ever sees it.
+#define PIPELINE_CACHE_DEFAULT_PATH "../bin/pipeline_cache.bin"
+enum { PIPELINE_CACHE_FILE_MAGIC = 0x43504b56 }; // "VKPC"
+enum { PIPELINE_CACHE_FILE_VERSION = 1 };
+enum { PIPELINE_CACHE_SAVE_INTERVAL_SECONDS = 30 };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t file_version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+    uint32_t data_checksum;
+    uint64_t data_size;
+} Pipeline_Cache_File_Header;
+
+typedef struct {
+    VkPipelineCache cache;
+    const char *path;
+    VkPhysicalDeviceProperties device_properties;
+    bool warm;         // Started from a valid file
+    size_t saved_size; // Size of the data last written, to skip saves when nothing was added
+    double last_save_time;
+} Pipeline_Cache_Etc;
+
+typedef enum {
+    SHADER_PROGRAM_BASIC,
+    SHADER_PROGRAM_INSTANCED,
+    SHADER_PROGRAM_COUNT
+} Shader_Program;
+
+typedef struct {
+    const char *vertex_spirv; // Looked up with create_shader_module
+    const char *fragment_spirv;
+    const char *vertex_source; // GLSL the SPIR-V is compiled from, for --watch-shaders
+    const char *fragment_source;
+} Shader_Program_Info;
+
+#define SHADER_SOURCE_DIRECTORY "../res/shaders"
+#define SHADER_BINARY_DIRECTORY "../res/shaders/bin"
+// NOTE: SHADER_BINARY_DIRECTORY is relative to src/, which is where it's resolved at build time (EMBED_SHADERS).
+//       At runtime it's resolved from the executable's directory by init_shader_binary_directory, bin/ being
+//       next to src/, so mapped shaders don't depend on the working directory.
+static char shader_binary_directory[512] = SHADER_BINARY_DIRECTORY;
+// Where the shader watcher compiles to; renamed over the real file once reflection has accepted it
+#define PENDING_SPIRV_SUFFIX ".tmp"
+static Shader_Program_Info shader_programs[SHADER_PROGRAM_COUNT] = {
+    [SHADER_PROGRAM_BASIC] = {
+        "basic.vert.spv",
+        "basic.frag.spv",
+        SHADER_SOURCE_DIRECTORY "/basic.vert.glsl",
+        SHADER_SOURCE_DIRECTORY "/basic.frag.glsl",
+    },
+    [SHADER_PROGRAM_INSTANCED] = {
+        "instanced.vert.spv",
+        "basic.frag.spv",
+        SHADER_SOURCE_DIRECTORY "/instanced.vert.glsl",
+        SHADER_SOURCE_DIRECTORY "/basic.frag.glsl",
+    },
+};
+
+// NOTE: Every compiled shader by file name. Builds with -DEMBED_SHADERS link them into the executable, the
+//       rest (and --shaders-from-disk) map them from SHADER_BINARY_DIRECTORY. New shaders go here and into
+//       the Makefile's SHADERS list.
+#define SHADER_BINARIES(X)                  \
+    X(basic_vert, "basic.vert.spv")         \
+    X(basic_frag, "basic.frag.spv")         \
+    X(instanced_vert, "instanced.vert.spv") \
+    X(cull_comp, "cull.comp.spv")           \
+    X(cull_hiz_comp, "cull_hiz.comp.spv")   \
+    X(hiz_comp, "hiz.comp.spv")
+
+#ifdef EMBED_SHADERS
+#define SHADERS_EMBEDDED true
+// NOTE: .incbin resolves the path from the directory the compiler runs in, which is src/ like every other
+//       relative path here. SPIR-V is read as uint32_t words, hence the alignment.
+#define EMBED_SHADER_BINARY(symbol, file_name)                        \
+    __asm__(".section .rodata\n"                                      \
+            ".balign 4\n"                                             \
+            ".global embedded_" #symbol "_start\n"                    \
+            "embedded_" #symbol "_start:\n"                           \
+            ".incbin \"" SHADER_BINARY_DIRECTORY "/" file_name "\"\n" \
+            ".global embedded_" #symbol "_end\n"                      \
+            "embedded_" #symbol "_end:\n"                             \
+            ".previous\n");                                           \
+    extern const uint32_t embedded_##symbol##_start[];                \
+    extern const uint8_t embedded_##symbol##_end[];
+SHADER_BINARIES(EMBED_SHADER_BINARY)
+#undef EMBED_SHADER_BINARY
+
+typedef struct {
+    const char *name;
+    const uint32_t *start;
+    const uint8_t *end;
+} Embedded_Shader;
+
+#define REGISTER_EMBEDDED_SHADER(symbol, file_name) {file_name, embedded_##symbol##_start, embedded_##symbol##_end},
+static const Embedded_Shader embedded_shaders[] = {
+    SHADER_BINARIES(REGISTER_EMBEDDED_SHADER)
+};
+#undef REGISTER_EMBEDDED_SHADER
+#else
+#define SHADERS_EMBEDDED false
+#endif
+
+typedef struct {
+    const uint32_t *code;
+    size_t size;
+    void *mapping; // Set when the code was mapped from disk
+} Shader_Code;
+
+// NOTE: Just enough of SPIR-V to read a shader's interface: its stage, input and output locations, descriptor
+//       bindings and push constant block. See the SPIR-V specification, section 2.3 "Physical Layout" and 3.
+enum { SPIRV_MAGIC = 0x07230203, SPIRV_HEADER_WORD_COUNT = 5 };
+
+enum {
+    SPIRV_OP_ENTRY_POINT = 15,
+    SPIRV_OP_TYPE_BOOL = 20,
+    SPIRV_OP_TYPE_INT = 21,
+    SPIRV_OP_TYPE_FLOAT = 22,
+    SPIRV_OP_TYPE_VECTOR = 23,
+    SPIRV_OP_TYPE_MATRIX = 24,
+    SPIRV_OP_TYPE_IMAGE = 25,
+    SPIRV_OP_TYPE_SAMPLER = 26,
+    SPIRV_OP_TYPE_SAMPLED_IMAGE = 27,
+    SPIRV_OP_TYPE_ARRAY = 28,
+    SPIRV_OP_TYPE_RUNTIME_ARRAY = 29,
+    SPIRV_OP_TYPE_STRUCT = 30,
+    SPIRV_OP_TYPE_POINTER = 32,
+    SPIRV_OP_CONSTANT = 43,
+    SPIRV_OP_VARIABLE = 59,
+    SPIRV_OP_DECORATE = 71,
+    SPIRV_OP_MEMBER_DECORATE = 72,
+};
+
+enum {
+    SPIRV_DECORATION_BUFFER_BLOCK = 3,
+    SPIRV_DECORATION_ARRAY_STRIDE = 6,
+    SPIRV_DECORATION_MATRIX_STRIDE = 7,
+    SPIRV_DECORATION_BUILT_IN = 11,
+    SPIRV_DECORATION_LOCATION = 30,
+    SPIRV_DECORATION_BINDING = 33,
+    SPIRV_DECORATION_DESCRIPTOR_SET = 34,
+    SPIRV_DECORATION_OFFSET = 35,
+};
+
+enum {
+    SPIRV_STORAGE_CLASS_UNIFORM_CONSTANT = 0,
+    SPIRV_STORAGE_CLASS_INPUT = 1,
+    SPIRV_STORAGE_CLASS_UNIFORM = 2,
+    SPIRV_STORAGE_CLASS_OUTPUT = 3,
+    SPIRV_STORAGE_CLASS_PUSH_CONSTANT = 9,
+    SPIRV_STORAGE_CLASS_STORAGE_BUFFER = 12,
+};
+
+enum { SPIRV_EXECUTION_MODEL_VERTEX = 0, SPIRV_EXECUTION_MODEL_FRAGMENT = 4, SPIRV_EXECUTION_MODEL_GL_COMPUTE = 5 };
+enum { SPIRV_DIM_BUFFER = 5, SPIRV_DIM_SUBPASS_DATA = 6 };
+enum { SPIRV_IMAGE_SAMPLED_STORAGE = 2 };
+#define SPIRV_NOT_DECORATED UINT32_MAX
+
+// NOTE: Everything the reflection pass remembers about one SPIR-V id
+typedef struct {
+    uint32_t opcode;        // Instruction that defined the id, 0 when undefined
+    uint32_t type_id;       // Component, column, element or pointee type, the pointer type of a variable
+    uint32_t count;         // Vector size, matrix columns, int/float width, array length id
+    uint32_t storage_class; // Pointers and variables
+    uint32_t value;         // OpConstant: the low word. OpTypeInt: signedness
+    uint32_t image_dim;
+    uint32_t image_sampled;
+    uint32_t first_member; // Structs, into Spirv_Module.members
+    uint32_t member_count;
+
+    uint32_t location; // Decorations, SPIRV_NOT_DECORATED when missing
+    uint32_t binding;
+    uint32_t set;
+    uint32_t array_stride;
+    bool builtin;
+    bool buffer_block;
+} Spirv_Id;
+
+typedef struct {
+    uint32_t type_id;
+    uint32_t offset;
+    uint32_t matrix_stride;
+} Spirv_Member;
+
+typedef struct {
+    const char *name;
+    uint32_t id_bound;
+    Spirv_Id *ids;
+    Spirv_Member *members;
+    uint32_t member_count;
+    bool failed; // Set by spirv_error, the reflection is thrown away
+} Spirv_Module;
+
+typedef enum {
+    SHADER_NUMERIC_FLOAT, // Includes normalized and scaled formats, which the vertex fetch turns into floats
+    SHADER_NUMERIC_SINT,
+    SHADER_NUMERIC_UINT,
+} Shader_Numeric_Type;
+
+enum { MAX_SHADER_INTERFACE_VARIABLES = 32, MAX_SHADER_BINDINGS = 32, MAX_DESCRIPTOR_SETS = 4 };
+
+// One location of a stage's inputs or outputs
+typedef struct {
+    uint32_t location;
+    uint32_t component_count;
+    Shader_Numeric_Type numeric_type;
+} Shader_Interface_Variable;
+
+typedef struct {
+    uint32_t set;
+    uint32_t binding;
+    VkDescriptorType descriptor_type;
+    uint32_t descriptor_count;
+    VkShaderStageFlags stages;
+} Shader_Binding;
+
+typedef struct {
+    VkShaderStageFlagBits stage;
+    uint32_t input_count;
+    Shader_Interface_Variable inputs[MAX_SHADER_INTERFACE_VARIABLES];
+    uint32_t output_count;
+    Shader_Interface_Variable outputs[MAX_SHADER_INTERFACE_VARIABLES];
+    uint32_t binding_count;
+    Shader_Binding bindings[MAX_SHADER_BINDINGS];
+    VkPushConstantRange push_constant_range; // size 0 = no push constants
+} Shader_Reflection;
+
+// NOTE: What a program needs from the pipeline, generated from the reflection of all its stages. Always
+//       zero-initialized, so two interfaces can be compared with memcmp.
+typedef struct {
+    uint32_t vertex_binding_count;
+    VkVertexInputBindingDescription vertex_bindings[2]; // Per vertex and per instance, when read at all
+    uint32_t attribute_count;
+    VkVertexInputAttributeDescription attributes[MAX_SHADER_INTERFACE_VARIABLES];
+    uint32_t binding_count;
+    Shader_Binding bindings[MAX_SHADER_BINDINGS]; // Sorted by set, then binding
+    VkPushConstantRange push_constant_range;
+} Shader_Program_Interface;
+
+typedef struct {
+    Shader_Program_Interface interface;
+    // Owned by the Layout_Cache, shared with equal programs
+    VkPipelineLayout pipeline_layout;
+    uint32_t set_layout_count;
+    VkDescriptorSetLayout set_layouts[MAX_DESCRIPTOR_SETS];
+} Shader_Program_Layout;
+
+// NOTE: Equal set layouts and pipeline layouts are only created once and shared between programs. Programs
+//       with the same pipeline layout can keep their descriptor sets bound when switching pipelines.
+enum { MAX_CACHED_SET_LAYOUTS = 32, MAX_CACHED_PIPELINE_LAYOUTS = 16 };
+
+typedef struct {
+    uint32_t binding_count;
+    VkDescriptorSetLayoutBinding bindings[MAX_SHADER_BINDINGS];
+    VkDescriptorSetLayout layout;
+} Cached_Set_Layout;
+
+typedef struct {
+    uint32_t set_layout_count;
+    VkDescriptorSetLayout set_layouts[MAX_DESCRIPTOR_SETS];
+    VkPushConstantRange push_constant_range;
+    VkPipelineLayout layout;
+} Cached_Pipeline_Layout;
+
+typedef struct {
+    VkDevice device;
+    uint32_t set_layout_count;
+    Cached_Set_Layout set_layouts[MAX_CACHED_SET_LAYOUTS];
+    uint32_t pipeline_layout_count;
+    Cached_Pipeline_Layout pipeline_layouts[MAX_CACHED_PIPELINE_LAYOUTS];
+    uint32_t request_count; // Pipeline layouts asked for, shared or not
+} Layout_Cache;
+
+// NOTE: Specialization constants, X(constant_id, field, type). The ids match layout(constant_id = N) in the
+//       shaders, and a stage that doesn't declare one ignores it. The driver folds the constants in when it
+//       compiles the pipeline, so branches on them cost nothing at runtime and unused paths are stripped.
+//       Keep every type 32 bits wide, the values are part of Pipeline_Key.
+#define SPECIALIZATION_CONSTANTS(X) \
+    X(0, color_mode, uint32_t)      \
+    X(1, brightness, float)         \
+    X(2, transform_source, uint32_t)
+
+typedef enum {
+    COLOR_MODE_VERTEX,
+    COLOR_MODE_GRAYSCALE,
+    COLOR_MODE_INVERTED,
+    COLOR_MODE_COUNT
+} Color_Mode;
+
+#define DECLARE_SPECIALIZATION_CONSTANT(constant_id, field, type) type field;
+typedef struct {
+    SPECIALIZATION_CONSTANTS(DECLARE_SPECIALIZATION_CONSTANT)
+} Specialization_Constants;
+#undef DECLARE_SPECIALIZATION_CONSTANT
+
+// NOTE: The state a graphics pipeline is compiled from. Framebuffer size is deliberately not part of it:
+//       viewport and scissor are dynamic state, so resizes, split-screen viewports and render scale changes
+//       never need a new pipeline. Every field is 32 bits wide, so the key can be hashed as raw bytes.
+typedef struct {
+    Shader_Program shader_program;
+    VkFormat color_format; // Render pass compatibility
+    uint32_t vertex_layout;
+    VkPrimitiveTopology topology;
+    VkPolygonMode polygon_mode;
+    VkCullModeFlags cull_mode;
+    VkFrontFace front_face;
+    VkBool32 blend_enable;
+    VkColorComponentFlags color_write_mask; // 0: depth only, no fragment shader
+    VkBool32 depth_write_enable;            // Ignored without a depth attachment
+    Specialization_Constants constants;
+} Pipeline_Key;
+
+typedef enum {
+    PIPELINE_VARIANT_EMPTY,
+    PIPELINE_VARIANT_PENDING,
+    PIPELINE_VARIANT_READY,
+} Pipeline_Variant_State;
+
+typedef struct {
+    Pipeline_Variant_State state;
+    bool queued;    // Waiting for a compile thread. A READY variant is queued when its shaders were reloaded.
+    bool compiling; // Some thread is in compile_pipeline_variant for it, nobody else may start one
+    bool dirty;     // The shaders were reloaded during that compile, so it goes again when it's done
+    Pipeline_Key key;
+    uint32_t hash;
+    VkPipeline pipeline;
+    double request_time;
+} Pipeline_Variant;
+
+// NOTE: A pipeline replaced by a rebuild. The compile thread can't know which frames still use it, so
+//       retire_frame_number is filled in by the main thread the first time it sees the entry.
+#define PIPELINE_RETIRE_FRAME_UNKNOWN UINT64_MAX
+typedef struct {
+    VkPipeline pipeline;
+    uint64_t retire_frame_number;
+} Retired_Pipeline;
+
+typedef enum {
+    PIPELINE_FALLBACK_DEFAULT, // Draw with the default material's pipeline until the variant is ready
+    PIPELINE_FALLBACK_SKIP,    // Leave the draws out until the variant is ready
+} Pipeline_Fallback;
+
+// NOTE: Every graphics pipeline, looked up by a hash of its Pipeline_Key. Missing variants are queued for the
+//       compile threads and the lookup returns VK_NULL_HANDLE until they're done. With no compile threads
+//       the lookup compiles on the spot, which is the stall this is here to avoid.
+//       Everything below the mutex is guarded by it. VkPipelineCache is internally synchronized.
+typedef struct {
+    VkDevice device;
+    Pipeline_Cache_Etc *pipeline_cache;
+    VkRenderPass render_pass; // VK_NULL_HANDLE: dynamic rendering, pipelines name their color format instead
+    VkFormat depth_format;    // VK_FORMAT_UNDEFINED without --depth
+    VkSampleCountFlagBits samples;
+    Layout_Cache layout_cache;
+    Shader_Program_Layout program_layouts[SHADER_PROGRAM_COUNT]; // Fixed at startup, read by every thread
+    bool shaders_from_disk;
+    uint32_t thread_count;
+    pthread_t threads[PIPELINE_COMPILE_THREAD_COUNT];
+    uint64_t request_count;   // Variants that weren't in the table yet. Only touched by the main thread.
+    uint64_t not_ready_count; // Lookups that returned VK_NULL_HANDLE. Only touched by the main thread.
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t variant_ready;
+    bool quit;
+    Pipeline_Variant variants[PIPELINE_VARIANT_CAPACITY];
+    uint32_t variant_count;
+    uint32_t queue[PIPELINE_VARIANT_CAPACITY]; // Slots waiting for a compile thread, each one queued at most once
+    uint32_t queue_head;
+    uint32_t queue_tail;
+    uint64_t creation_count;
+    double total_compile_ms;
+    double max_compile_ms;
+    double max_wait_ms; // Longest time from request to ready
+    uint64_t rebuild_count;
+    Retired_Pipeline *retired;
+    uint32_t retired_count;
+    uint32_t retired_capacity;
+} Pipeline_Manager;
+
+// NOTE: --watch-shaders: a thread that waits on inotify for changes to the GLSL sources, recompiles them with
+//       glslangValidator and has the pipeline manager rebuild every variant that uses them. Frames keep
+//       rendering with the old pipelines until the new ones are swapped in.
+typedef struct {
+    Pipeline_Manager *manager;
+    int inotify_fd;
+    int quit_pipe[2]; // Written to by destroy_shader_watcher to wake the thread from poll
+    pthread_t thread;
+} Shader_Watcher;
+
+typedef struct {
+    bool framebuffer_resized;
+    bool clear_color_changed;
+    uint32_t clear_color_index;
+} Window_State;
+
+typedef struct {
+    uint32_t frames_in_flight;
+    Latency_Mode latency_mode;
+    bool static_scene;
+    uint32_t draw_count;
+    uint32_t record_threads; // 0 = record inline on the main thread
+    bool bench_recording;
+    bool stress_allocator;
+    bool dynamic_geometry;
+    uint32_t mesh_grid_size; // 0 = one triangle per draw
+    uint64_t exit_after_frames; // 0 = run until the window is closed
+    const char *pipeline_cache_path;
+    bool cold_pipeline_cache; // Ignore the file on disk, to measure a cold start
+    uint32_t material_count;
+    uint32_t instance_count; // 0 = no instanced batches
+    bool sync_pipeline_compiles;
+    Pipeline_Fallback pipeline_fallback;
+    bool watch_shaders;
+    bool shaders_from_disk; // Ignore embedded SPIR-V
+    Animation_Mode animation_mode;
+    Draw_Path draw_path;
+    bool cull;
+    bool hiz; // Implies cull and depth
+    bool gpu_timing;
+    float camera_zoom; // 1 = the whole scene
+    bool render_queue;
+    Render_Path render_path;
+    uint32_t rebuild_swapchain_interval; // Frames, 0 = only when the surface changes
+    float overlap;      // Triangle size in grid cells, 1 = no triangle covers another
+    bool depth;
+    bool depth_prepass; // Implies depth
+    uint32_t msaa_samples; // Requested, clamped to what the device supports
+} Config;
+
+typedef struct {
+    uint64_t frame_count;
+    double start_time;
+    double last_frame_time;
+    float *frame_times_ms; // Every frame, for the percentiles at exit
+    uint64_t frame_time_count;
+    uint64_t frame_time_capacity;
+    uint64_t resize_count;
+    uint64_t resize_pipeline_creations; // vkCreateGraphicsPipelines calls that completed while resizing, 0 unless something
+                                        // compiles in the background or the key depends on the extent, see Pipeline_Key
+    double resize_ms;        // CPU time spent recreating the swapchain and what's built on it, all resizes
+    double animation_ms;     // CPU time spent moving objects, all frames
+    double animation_bytes;  // Written for it, vertices or transforms, all frames
+    double instance_ms;      // CPU time spent adding and batching instances, all frames
+    uint64_t instance_draw_count;
+    double record_ms;        // CPU time spent recording the frame's command buffer, all frames
+} Frame_Stats;
+
 static Vertex vertices[] = {
     {{ 0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
     {{ 0.5f,  0.5f}, {0.0f, 1.0f, 0.0f}},
@@ -55,57 +1298,587 @@ void exit_with_error(const char *msg, ...);
 void trace_log(const char *msg, ...);
 void *xmalloc(size_t bytes);
 
+Config parse_command_line(int argc, char **argv);
+
+Config parse_command_line(int argc, char **argv) {
+    Config config = {0};
+    config.frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT;
+    config.latency_mode = LATENCY_MODE_POWER_SAVING;
+    config.draw_count = 1;
+    config.pipeline_cache_path = PIPELINE_CACHE_DEFAULT_PATH;
+    config.material_count = 1;
+    config.camera_zoom = 1.0f;
+    config.overlap = 1.0f;
+    config.msaa_samples = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+            int frames_in_flight = atoi(argv[++i]);
+            if (frames_in_flight < 1 || frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+                exit_with_error("--frames-in-flight must be between 1 and %d", MAX_FRAMES_IN_FLIGHT);
+            }
+            config.frames_in_flight = (uint32_t)frames_in_flight;
+        } else if (strcmp(argv[i], "--static-scene") == 0) {
+            config.static_scene = true;
+        } else if (strcmp(argv[i], "--draw-count") == 0 && i + 1 < argc) {
+            int draw_count = atoi(argv[++i]);
+            if (draw_count < 1) exit_with_error("--draw-count must be at least 1");
+            config.draw_count = (uint32_t)draw_count;
+        } else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc) {
+            int record_threads = atoi(argv[++i]);
+            if (record_threads < 0 || record_threads > MAX_RECORD_THREADS) {
+                exit_with_error("--record-threads must be between 0 and %d", MAX_RECORD_THREADS);
+            }
+            config.record_threads = (uint32_t)record_threads;
+        } else if (strcmp(argv[i], "--bench-recording") == 0) {
+            config.bench_recording = true;
+        } else if (strcmp(argv[i], "--stress-allocator") == 0) {
+            config.stress_allocator = true;
+        } else if (strcmp(argv[i], "--dynamic-geometry") == 0) {
+            config.dynamic_geometry = true;
+        } else if (strcmp(argv[i], "--pipeline-cache") == 0 && i + 1 < argc) {
+            config.pipeline_cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--cold-pipeline-cache") == 0) {
+            config.cold_pipeline_cache = true;
+        } else if (strcmp(argv[i], "--materials") == 0 && i + 1 < argc) {
+            int material_count = atoi(argv[++i]);
+            if (material_count < 1 || material_count > MAX_MATERIALS) {
+                exit_with_error("--materials must be between 1 and %d", MAX_MATERIALS);
+            }
+            config.material_count = (uint32_t)material_count;
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            long instance_count = atol(argv[++i]);
+            if (instance_count < 1 || instance_count > MAX_INSTANCES) {
+                exit_with_error("--instances must be between 1 and %d", MAX_INSTANCES);
+            }
+            config.instance_count = (uint32_t)instance_count;
+        } else if (strcmp(argv[i], "--watch-shaders") == 0) {
+            config.watch_shaders = true;
+        } else if (strcmp(argv[i], "--shaders-from-disk") == 0) {
+            config.shaders_from_disk = true;
+        } else if (strcmp(argv[i], "--sync-pipeline-compiles") == 0) {
+            config.sync_pipeline_compiles = true;
+        } else if (strcmp(argv[i], "--pipeline-fallback") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "default") == 0) {
+                config.pipeline_fallback = PIPELINE_FALLBACK_DEFAULT;
+            } else if (strcmp(name, "skip") == 0) {
+                config.pipeline_fallback = PIPELINE_FALLBACK_SKIP;
+            } else {
+                exit_with_error("Unknown pipeline fallback '%s' (expected default or skip)", name);
+            }
+        } else if (strcmp(argv[i], "--animate") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            bool found = false;
+            for (int mode = 0; mode < ANIMATION_MODE_COUNT; mode++) {
+                if (strcmp(name, animation_modes[mode].name) == 0) {
+                    config.animation_mode = (Animation_Mode)mode;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                exit_with_error("Unknown animation mode '%s' (expected none, vertices, push-constants or storage-buffer)", name);
+            }
+        } else if (strcmp(argv[i], "--cull") == 0) {
+            config.cull = true;
+        } else if (strcmp(argv[i], "--hiz") == 0) {
+            config.cull = true;
+            config.depth = true;
+            config.hiz = true;
+        } else if (strcmp(argv[i], "--gpu-timing") == 0) {
+            config.gpu_timing = true;
+        } else if (strcmp(argv[i], "--zoom") == 0 && i + 1 < argc) {
+            config.camera_zoom = (float)atof(argv[++i]);
+            if (!(config.camera_zoom >= 1.0f)) exit_with_error("--zoom must be at least 1");
+        } else if (strcmp(argv[i], "--render-path") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            bool found = false;
+            for (int path = 0; path < RENDER_PATH_COUNT; path++) {
+                if (strcmp(name, render_path_names[path]) == 0) {
+                    config.render_path = (Render_Path)path;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                exit_with_error("Unknown render path '%s' (expected render-pass or dynamic)", name);
+            }
+        } else if (strcmp(argv[i], "--rebuild-swapchain-every") == 0 && i + 1 < argc) {
+            int interval = atoi(argv[++i]);
+            if (interval < 1) exit_with_error("--rebuild-swapchain-every must be at least 1");
+            config.rebuild_swapchain_interval = (uint32_t)interval;
+        } else if (strcmp(argv[i], "--overlap") == 0 && i + 1 < argc) {
+            config.overlap = (float)atof(argv[++i]);
+            if (!(config.overlap >= 1.0f)) exit_with_error("--overlap must be at least 1");
+        } else if (strcmp(argv[i], "--depth") == 0) {
+            config.depth = true;
+        } else if (strcmp(argv[i], "--depth-prepass") == 0) {
+            config.depth = true;
+            config.depth_prepass = true;
+        } else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc) {
+            int samples = atoi(argv[++i]);
+            if (samples < 1 || samples > 64 || (samples & (samples - 1)) != 0) {
+                exit_with_error("--msaa must be a power of two from 1 to 64");
+            }
+            config.msaa_samples = (uint32_t)samples;
+        } else if (strcmp(argv[i], "--render-queue") == 0) {
+            config.render_queue = true;
+        } else if (strcmp(argv[i], "--draw-path") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            bool found = false;
+            for (int path = 0; path < DRAW_PATH_COUNT; path++) {
+                if (strcmp(name, draw_path_names[path]) == 0) {
+                    config.draw_path = (Draw_Path)path;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                exit_with_error("Unknown draw path '%s' (expected direct or indirect)", name);
+            }
+        } else if (strcmp(argv[i], "--exit-after-frames") == 0 && i + 1 < argc) {
+            long long frames = atoll(argv[++i]);
+            if (frames < 1) exit_with_error("--exit-after-frames must be at least 1");
+            config.exit_after_frames = (uint64_t)frames;
+        } else if (strcmp(argv[i], "--mesh-grid") == 0 && i + 1 < argc) {
+            int mesh_grid_size = atoi(argv[++i]);
+            if (mesh_grid_size < 1 || mesh_grid_size > 1024) exit_with_error("--mesh-grid must be between 1 and 1024");
+            config.mesh_grid_size = (uint32_t)mesh_grid_size;
+        } else if (strcmp(argv[i], "--latency-mode") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            bool found = false;
+            for (int mode = 0; mode < LATENCY_MODE_COUNT; mode++) {
+                if (strcmp(name, latency_modes[mode].name) == 0) {
+                    config.latency_mode = (Latency_Mode)mode;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                exit_with_error("Unknown latency mode '%s' (expected low-latency, uncapped or power-saving)", name);
+            }
+        } else {
+            exit_with_error("Unknown command line argument: %s", argv[i]);
+        }
+    }
+
+    // Reloaded shaders are written to disk, the embedded copies would shadow them
+    if (config.watch_shaders) config.shaders_from_disk = true;
+
+    // Pre-recorded command buffers would bake in last frame's stream offsets
+    if (config.static_scene && config.dynamic_geometry) {
+        exit_with_error("--static-scene and --dynamic-geometry can't be combined");
+    }
+    if (config.static_scene && config.animation_mode != ANIMATION_MODE_NONE) {
+        exit_with_error("--static-scene and --animate can't be combined");
+    }
+    if (config.static_scene && config.instance_count > 0) {
+        exit_with_error("--static-scene and --instances can't be combined");
+    }
+    // Push constants are per call, an indirect run of draws would all get the same transform
+    if (config.draw_path == DRAW_PATH_INDIRECT && config.animation_mode == ANIMATION_MODE_PUSH_CONSTANTS) {
+        exit_with_error("--draw-path indirect and --animate push-constants can't be combined");
+    }
+    // Culling writes the indirect commands, the direct path has none
+    if (config.cull && config.draw_path != DRAW_PATH_INDIRECT) {
+        exit_with_error("--cull needs --draw-path indirect");
+    }
+    // The pyramid is built by sampling the depth buffer, one sample per pixel
+    if (config.hiz && config.msaa_samples > 1) {
+        exit_with_error("--hiz needs --msaa 1");
+    }
+    // The indirect commands are already grouped by material, and built once
+    if (config.render_queue && config.draw_path != DRAW_PATH_DIRECT) {
+        exit_with_error("--render-queue needs --draw-path direct");
+    }
+    // Static command buffers are recorded for one frame slot and one camera
+    if (config.static_scene && (config.cull || config.gpu_timing || config.camera_zoom > 1.0f)) {
+        exit_with_error("--static-scene can't be combined with --cull, --gpu-timing or --zoom");
+    }
+
+    return config;
+}
+
 void keyboard_callback(GLFWwindow *window, int key, int scancode, int action, int mods);
+void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 
 VkInstance create_instance();
 bool check_layer_support(const char **requested_layers, int requested_layer_count);
+bool check_instance_extension_support(const char *extension_name);
+bool check_device_extension_support(VkPhysicalDevice physical_device, const char *extension_name);
 VkPhysicalDevice find_suitable_physical_device(VkInstance instance);
 
 VkSurfaceKHR create_surface(VkInstance instance, GLFWwindow *window);
 Logical_Device_Etc create_logical_device(VkPhysicalDevice physical_device, VkSurfaceKHR surface);
 
-Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_device, Logical_Device_Etc logical_device);
-VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format);
+VkExtent2D get_framebuffer_extent(GLFWwindow *window);
+const char *get_present_mode_name(VkPresentModeKHR present_mode);
+Present_Mode_Policy choose_present_mode(Latency_Mode latency_mode,
+                                       VkPresentModeKHR *present_modes,
+                                       uint32_t present_mode_count,
+                                       VkSurfaceCapabilitiesKHR surface_capabilities);
+Swapchain_Etc create_swapchain(VkSurfaceKHR surface,
+                               VkPhysicalDevice physical_device,
+                               Logical_Device_Etc logical_device,
+                               VkExtent2D framebuffer_extent,
+                               Latency_Mode latency_mode,
+                               VkSwapchainKHR old_swapchain);
+void destroy_swapchain_resources(VkDevice device,
+                                 Swapchain_Etc *swapchain_etc,
+                                 VkImageView *swapchain_image_views,
+                                 VkFramebuffer *swapchain_framebuffers);
+double recreate_swapchain(VkSurfaceKHR surface,
+                          VkPhysicalDevice physical_device,
+                          Logical_Device_Etc logical_device,
+                          Device_Allocator *allocator,
+                          VkExtent2D framebuffer_extent,
+                          VkRenderPass render_pass,
+                          Swapchain_Etc *swapchain_etc,
+                          VkImageView **swapchain_image_views,
+                          VkFramebuffer **swapchain_framebuffers,
+                          Transient_Attachments *transient_attachments,
+                          Frame_Ring *ring,
+                          Retired_Swapchains *retired);
+void destroy_retired_swapchains(Device_Allocator *allocator, Retired_Swapchains *retired, uint64_t completed_frame_number, bool force);
+VkRenderPass create_render_pass(VkDevice device,
+                                VkFormat swapchain_image_format,
+                                VkFormat depth_format,
+                                VkSampleCountFlagBits samples,
+                                bool store_depth);
 VkImageView *create_image_views(VkDevice device, VkFormat swapchain_image_format, VkImage *swapchain_images, uint32_t image_count);
 VkFramebuffer *create_framebuffers(VkDevice device,
                                    VkRenderPass render_pass,
                                    VkExtent2D swapchain_extent,
                                    VkImageView *swapchain_image_views,
+                                   const Transient_Attachments *transient_attachments,
                                    uint32_t image_count);
-
-VkShaderModule create_shader_module(VkDevice device, const char *file_name);
-VkPipelineLayout create_pipeline_layout(VkDevice device);
-VkVertexInputBindingDescription get_binding_description();
-VkVertexInputAttributeDescription *get_attribute_descriptions();
-VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent, VkRenderPass render_pass, VkPipelineLayout pipeline_layout);
+VkFormat choose_depth_format(VkPhysicalDevice physical_device, bool sampled);
+VkSampleCountFlagBits choose_sample_count(VkPhysicalDevice physical_device, uint32_t requested_samples, bool depth);
+Transient_Attachment create_transient_attachment(Device_Allocator *allocator,
+                                                 VkFormat format,
+                                                 VkExtent2D extent,
+                                                 VkSampleCountFlagBits samples,
+                                                 VkImageUsageFlags usage,
+                                                 VkImageAspectFlags aspect);
+void destroy_transient_attachment(Device_Allocator *allocator, Transient_Attachment *attachment);
+Transient_Attachments create_transient_attachments(Device_Allocator *allocator,
+                                                   VkFormat color_format,
+                                                   VkFormat depth_format,
+                                                   bool depth_sampled,
+                                                   VkSampleCountFlagBits samples,
+                                                   VkExtent2D extent);
+void destroy_transient_attachments(Device_Allocator *allocator, Transient_Attachments *transient_attachments);
+Render_Target *create_render_targets(const Swapchain_Etc *swapchain_etc,
+                                     VkImageView *swapchain_image_views,
+                                     VkFramebuffer *swapchain_framebuffers,
+                                     const Transient_Attachments *transient_attachments,
+                                     VkRenderPass render_pass,
+                                     const Logical_Device_Etc *logical_device);
+void transition_attachment_image(VkCommandBuffer command_buffer,
+                                 VkImage image,
+                                 VkImageAspectFlags aspect,
+                                 VkImageLayout old_layout,
+                                 VkImageLayout new_layout,
+                                 VkPipelineStageFlags src_stage,
+                                 VkAccessFlags src_access,
+                                 VkPipelineStageFlags dst_stage,
+                                 VkAccessFlags dst_access);
+
+void init_shader_binary_directory(void);
+void log_shader_loading(bool from_disk);
+const uint32_t *find_embedded_shader(const char *name, size_t *size);
+Shader_Code load_shader_code(const char *name, bool from_disk);
+void release_shader_code(Shader_Code *shader_code);
+VkShaderModule create_shader_module(VkDevice device, const Shader_Code *shader_code, const char *name);
+Spirv_Id *get_spirv_id(Spirv_Module *module, uint32_t id);
+uint32_t get_spirv_min_length(uint32_t opcode, const uint32_t *operands, uint32_t length);
+uint32_t get_spirv_type_size(Spirv_Module *module, uint32_t type_id, uint32_t matrix_stride);
+uint32_t add_shader_interface_variables(Spirv_Module *module,
+                                        uint32_t type_id,
+                                        uint32_t location,
+                                        Shader_Interface_Variable *variables,
+                                        uint32_t *variable_count);
+void spirv_error(Spirv_Module *module, const char *msg, ...);
+bool reflect_spirv(const uint32_t *code, size_t size, const char *name, Shader_Reflection *reflection);
+Shader_Numeric_Type get_format_numeric_type(VkFormat format);
+bool reflect_shader_program(Shader_Program program, bool from_disk, const bool *pending, Shader_Program_Interface *interface);
+bool reflect_compute_shader(const char *spirv_name, bool from_disk, Shader_Program_Interface *interface);
+void finish_shader_program_interface(Shader_Program_Interface *interface);
+VkDescriptorSetLayout get_descriptor_set_layout(Layout_Cache *cache,
+                                                const VkDescriptorSetLayoutBinding *bindings,
+                                                uint32_t binding_count);
+Cached_Pipeline_Layout get_pipeline_layout(Layout_Cache *cache, const Shader_Program_Interface *interface);
+void destroy_layout_cache(Layout_Cache *cache);
+VkVertexInputBindingDescription *get_binding_descriptions(uint32_t *binding_count);
+VkVertexInputAttributeDescription *get_attribute_descriptions(uint32_t *attribute_count);
+uint16_t float_to_half(float value);
+void pack_float(float *out, const float *in, uint32_t out_count, uint32_t in_count);
+void pack_half(uint16_t *out, const float *in, uint32_t out_count, uint32_t in_count);
+void pack_snorm16(int16_t *out, const float *in, uint32_t out_count, uint32_t in_count);
+void pack_unorm8(uint8_t *out, const float *in, uint32_t out_count, uint32_t in_count);
+void pack_vertices(Gpu_Vertex *out, const Vertex *in, uint32_t vertex_count);
+Pipeline_Key get_default_pipeline_key(VkFormat color_format, Transform_Source transform_source);
+Pipeline_Key get_material_pipeline_key(uint32_t material, VkFormat color_format, Transform_Source transform_source);
+Pipeline_Key get_instanced_pipeline_key(VkFormat color_format);
+Pipeline_Key get_depth_prepass_pipeline_key(const Pipeline_Key *color_key);
+uint32_t hash_pipeline_key(const Pipeline_Key *key);
+VkPipeline create_graphics_pipeline(VkDevice device,
+                                    Pipeline_Cache_Etc *pipeline_cache,
+                                    VkRenderPass render_pass,
+                                    VkFormat depth_format,
+                                    VkSampleCountFlagBits samples,
+                                    const Shader_Program_Layout *program_layout,
+                                    const Pipeline_Key *key,
+                                    bool shaders_from_disk);
+VkPipeline create_compute_pipeline(VkDevice device,
+                                   Pipeline_Cache_Etc *pipeline_cache,
+                                   VkPipelineLayout pipeline_layout,
+                                   const char *spirv_name,
+                                   bool shaders_from_disk);
+Pipeline_Cache_Etc create_pipeline_cache(VkPhysicalDevice physical_device, VkDevice device, const char *path, bool cold);
+void save_pipeline_cache(VkDevice device, Pipeline_Cache_Etc *pipeline_cache, bool force);
+void destroy_pipeline_cache(VkDevice device, Pipeline_Cache_Etc *pipeline_cache);
+Pipeline_Manager *create_pipeline_manager(VkDevice device,
+                                          Pipeline_Cache_Etc *pipeline_cache,
+                                          VkRenderPass render_pass,
+                                          VkFormat depth_format,
+                                          VkSampleCountFlagBits samples,
+                                          bool shaders_from_disk,
+                                          uint32_t thread_count);
+void destroy_pipeline_manager(Pipeline_Manager *manager);
+void *pipeline_compile_thread_main(void *arg);
+void compile_pipeline_variant(Pipeline_Manager *manager, uint32_t slot);
+VkPipeline get_pipeline(Pipeline_Manager *manager, const Pipeline_Key *key, bool wait);
+bool resolve_material_pipelines(Pipeline_Manager *manager,
+                                Scene *scene,
+                                VkFormat color_format,
+                                uint32_t active_material_count,
+                                Pipeline_Fallback fallback);
+void log_pipeline_manager_stats(Pipeline_Manager *manager);
+uint64_t get_pipeline_creation_count(Pipeline_Manager *manager);
+void rebuild_shader_program_pipelines(Pipeline_Manager *manager, Shader_Program program);
+void destroy_retired_pipelines(Pipeline_Manager *manager, uint64_t frame_number, uint64_t completed_frame_number, bool force);
+Shader_Watcher *create_shader_watcher(Pipeline_Manager *manager);
+void destroy_shader_watcher(Shader_Watcher *watcher);
+void *shader_watcher_main(void *arg);
+bool compile_shader_source(const char *source_path, const char *spirv_path);
+uint32_t compute_checksum(const void *data, size_t size);
 uint32_t find_memory_type(VkPhysicalDevice physical_device, uint32_t type_filter, VkMemoryPropertyFlags properties);
-Vertex_Buffer_Etc create_vertex_buffer(VkDevice device, VkPhysicalDevice physical_device);
-void destroy_vertex_buffer(VkDevice device, Vertex_Buffer_Etc vertex_buffer);
+Scene create_scene(uint32_t draw_count, uint32_t mesh_grid_size, uint32_t material_count, float overlap);
+void destroy_scene(Scene *scene);
+void generate_grid_mesh(Scene *scene, uint32_t grid_size);
+uint32_t deduplicate_vertices(Vertex *vertices, uint32_t vertex_count, uint32_t *indices, uint32_t index_count);
+float forsyth_vertex_score(int32_t cache_position, uint32_t remaining_triangles);
+void optimize_vertex_cache(uint32_t *indices, uint32_t index_count, uint32_t vertex_count);
+void optimize_vertex_fetch(Vertex *vertices, uint32_t vertex_count, uint32_t *indices, uint32_t index_count);
+float compute_acmr(const uint32_t *indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size);
+void optimize_scene_mesh(Scene *scene);
+Device_Allocator create_device_allocator(VkPhysicalDevice physical_device, VkDevice device);
+void destroy_device_allocator(Device_Allocator *allocator);
+VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment);
+uint32_t create_memory_block(Device_Allocator *allocator,
+                             uint32_t memory_type_index,
+                             VkDeviceSize size,
+                             Allocation_Strategy strategy);
+void destroy_memory_block(Device_Allocator *allocator, uint32_t block_index);
+void buddy_push(Memory_Block *block, uint32_t unit, uint32_t order);
+void buddy_remove(Memory_Block *block, uint32_t unit, uint32_t order);
+uint32_t buddy_order_for_size(VkDeviceSize size);
+bool allocate_from_block(Memory_Block *block,
+                         VkDeviceSize size,
+                         VkDeviceSize alignment,
+                         VkDeviceSize *offset,
+                         VkDeviceSize *reserved_size);
+Device_Allocation allocate_device_memory(Device_Allocator *allocator,
+                                         VkMemoryRequirements requirements,
+                                         VkMemoryPropertyFlags properties,
+                                         Allocation_Strategy strategy);
+void free_device_memory(Device_Allocator *allocator, Device_Allocation *allocation);
+Device_Allocator_Stats get_device_allocator_stats(Device_Allocator *allocator);
+void log_device_allocator_stats(Device_Allocator *allocator);
+void run_allocator_stress_test(Device_Allocator *allocator);
+
+Buffer_Etc create_buffer(Device_Allocator *allocator,
+                         VkDeviceSize size,
+                         VkBufferUsageFlags usage,
+                         VkMemoryPropertyFlags properties,
+                         Allocation_Strategy strategy);
+void destroy_buffer(Device_Allocator *allocator, Buffer_Etc *buffer);
+Image_Etc create_image(Device_Allocator *allocator,
+                       const VkImageCreateInfo *image_info,
+                       VkMemoryPropertyFlags properties,
+                       VkMemoryPropertyFlags preferred_properties);
+void destroy_image(Device_Allocator *allocator, Image_Etc *image);
+Buffer_Etc create_vertex_buffer(Device_Allocator *allocator, Uploader *uploader, Vertex *vertices, uint32_t vertex_count);
+Buffer_Etc create_index_buffer(Device_Allocator *allocator,
+                               Uploader *uploader,
+                               const uint32_t *indices,
+                               uint32_t index_count,
+                               VkIndexType index_type);
+
+Uploader create_uploader(Device_Allocator *allocator, Logical_Device_Etc logical_device);
+void destroy_uploader(Device_Allocator *allocator, Uploader *uploader);
+void upload_to_buffer(Uploader *uploader, VkBuffer buffer, VkDeviceSize offset, const void *data, VkDeviceSize size);
+uint64_t flush_uploads(Uploader *uploader);
+void wait_for_uploads(Uploader *uploader, uint64_t ticket);
+void retire_oldest_upload_batch(Uploader *uploader);
+Buffer_Etc create_device_local_buffer(Device_Allocator *allocator,
+                                      Uploader *uploader,
+                                      VkBufferUsageFlags usage,
+                                      const void *data,
+                                      VkDeviceSize size);
 
 VkCommandPool create_command_pool(VkDevice device, uint32_t queue_family_index);
 VkCommandBuffer allocate_command_buffer(VkDevice device, VkCommandPool command_pool);
+void begin_render_pass(VkCommandBuffer command_buffer,
+                       const Render_Target *target,
+                       const Scene *scene,
+                       VkSubpassContents contents);
+void begin_dynamic_rendering(VkCommandBuffer command_buffer,
+                             const Render_Target *target,
+                             const Scene *scene,
+                             VkSubpassContents contents);
+void end_render_pass(VkCommandBuffer command_buffer, const Render_Target *target);
+void record_draws(VkCommandBuffer command_buffer,
+                  VkBuffer vertex_buffer,
+                  const Scene *scene,
+                  uint32_t first_draw,
+                  uint32_t draw_count);
+void record_depth_prepass(VkCommandBuffer command_buffer, VkBuffer vertex_buffer, const Scene *scene);
+uint32_t get_draw_list_count(const Scene *scene);
+void set_viewport_and_scissor(VkCommandBuffer command_buffer, VkRect2D area);
+void record_dynamic_draws(VkCommandBuffer command_buffer, VkPipeline pipeline, const Scene *scene);
 void record_command_buffer(VkCommandBuffer command_buffer,
-                           VkRenderPass render_pass,
-                           VkFramebuffer framebuffer,
+                           const Render_Target *target,
                            VkPipeline pipeline,
                            VkBuffer vertex_buffer,
-                           VkExtent2D swapchain_extent);
+                           const Scene *scene);
+
+Record_Workers *create_record_workers(VkDevice device, uint32_t queue_family_index, uint32_t thread_count, uint32_t frame_count);
+void destroy_record_workers(Record_Workers *workers);
+void *record_worker_main(void *arg);
+void run_record_job(Record_Workers *workers, const Record_Job *job);
+void record_command_buffer_parallel(VkCommandBuffer command_buffer,
+                                    Record_Workers *workers,
+                                    uint32_t active_thread_count,
+                                    uint32_t frame_index,
+                                    const Render_Target *target,
+                                    VkPipeline pipeline,
+                                    VkBuffer vertex_buffer,
+                                    const Scene *scene);
+void run_recording_benchmark(VkDevice device,
+                             VkCommandPool command_pool,
+                             Record_Workers *workers,
+                             const Render_Target *target,
+                             VkPipeline pipeline,
+                             VkBuffer vertex_buffer,
+                             const Scene *scene);
+
+Static_Command_Buffers create_static_command_buffers(VkDevice device, VkCommandPool command_pool, uint32_t image_count);
+void invalidate_static_command_buffers(VkDevice device,
+                                       VkCommandPool command_pool,
+                                       Static_Command_Buffers *static_command_buffers,
+                                       uint32_t image_count);
+void destroy_static_command_buffers(Static_Command_Buffers *static_command_buffers);
+
+Stream_Buffer create_stream_buffer(Device_Allocator *allocator,
+                                   VkPhysicalDevice physical_device,
+                                   uint32_t frame_count,
+                                   VkDeviceSize frame_size);
+void destroy_stream_buffer(Device_Allocator *allocator, Stream_Buffer *stream);
+void begin_stream_frame(Stream_Buffer *stream, uint32_t frame_index);
+Stream_Allocation stream_allocate(Stream_Buffer *stream, VkDeviceSize size, VkDeviceSize alignment);
+void write_dynamic_geometry(Stream_Buffer *stream, Scene *scene, double time);
+VkDeviceSize get_object_transform_range(const Stream_Buffer *stream, Transform_Source transform_source, uint32_t object_count);
+Frame_Descriptors create_frame_descriptors(VkDevice device,
+                                           const Shader_Program_Layout *program_layout,
+                                           Stream_Buffer *stream,
+                                           Transform_Source transform_source,
+                                           uint32_t object_count);
+void destroy_frame_descriptors(VkDevice device, Frame_Descriptors *descriptors);
+void animate_objects(Scene *scene, double time);
+VkDeviceSize write_object_transforms(Stream_Buffer *stream, Scene *scene);
+VkDeviceSize write_animated_vertices(Stream_Buffer *stream, Scene *scene);
+Instance_Batcher create_instance_batcher(Device_Allocator *allocator, Uploader *uploader, uint32_t instance_capacity);
+void destroy_instance_batcher(Device_Allocator *allocator, Instance_Batcher *batcher);
+void add_instance(Instance_Batcher *batcher, uint32_t mesh, float x, float y, float scale, const float color[3]);
+void build_instance_batches(Instance_Batcher *batcher, Stream_Buffer *stream);
+void record_instance_batches(VkCommandBuffer command_buffer, const Instance_Batcher *batcher);
+void write_markers(Instance_Batcher *batcher, uint32_t marker_count, double time);
+Indirect_Draws create_indirect_draws(Device_Allocator *allocator,
+                                     Uploader *uploader,
+                                     Logical_Device_Etc logical_device,
+                                     const Scene *scene);
+void destroy_indirect_draws(Device_Allocator *allocator, Indirect_Draws *indirect);
+void record_indirect_draws(VkCommandBuffer command_buffer, const Scene *scene, const Indirect_Draws *indirect);
+void update_camera(Camera *camera, float zoom, double time);
+void push_draw_constants(VkCommandBuffer command_buffer, const Scene *scene);
+Cull_Pass create_cull_pass(Device_Allocator *allocator,
+                           Uploader *uploader,
+                           Pipeline_Manager *pipeline_manager,
+                           Stream_Buffer *stream,
+                           const Scene *scene,
+                           const Indirect_Draws *indirect,
+                           uint32_t frame_count,
+                           bool occlusion);
+void destroy_cull_pass(Device_Allocator *allocator, Cull_Pass *cull);
+void record_cull_pass(VkCommandBuffer command_buffer, const Scene *scene, const Cull_Pass *cull);
+void collect_cull_statistics(Cull_Pass *cull, uint32_t frame_index);
+Hiz_Pyramid create_hiz_pyramid(Device_Allocator *allocator, Pipeline_Manager *pipeline_manager, uint32_t frame_count);
+void destroy_hiz_pyramid(Device_Allocator *allocator, Hiz_Pyramid *hiz);
+void record_hiz_pyramid(VkCommandBuffer command_buffer, const Render_Target *target, const Scene *scene, Hiz_Pyramid *hiz);
+Gpu_Timer create_gpu_timer(VkDevice device, uint32_t frame_count, float timestamp_period, bool count_fragments);
+void destroy_gpu_timer(VkDevice device, Gpu_Timer *timer);
+void collect_gpu_timestamps(VkDevice device, Gpu_Timer *timer, uint32_t frame_index);
+void record_frame_prologue(VkCommandBuffer command_buffer, const Scene *scene);
+void record_frame_epilogue(VkCommandBuffer command_buffer, const Render_Target *target, const Scene *scene);
+Render_Queue create_render_queue(uint32_t buffer_count);
+void destroy_render_queue(Render_Queue *queue);
+uint64_t make_render_key(uint32_t layer, uint32_t pipeline, uint32_t material, uint32_t depth);
+void push_render_item(Render_Queue_Buffer *buffer, uint64_t key, const Render_Item *item);
+void submit_scene_draws(Render_Queue *queue,
+                        uint32_t buffer_index,
+                        const Scene *scene,
+                        VkBuffer vertex_buffer,
+                        uint32_t first_draw,
+                        uint32_t draw_count);
+Render_Sort_Entry *radix_sort_render_entries(Render_Sort_Entry *entries, Render_Sort_Entry *scratch, uint32_t count);
+void build_render_queue(Render_Queue *queue, const Scene *scene, VkBuffer vertex_buffer, Record_Workers *workers);
+void record_render_queue(VkCommandBuffer command_buffer,
+                         const Scene *scene,
+                         const Render_Queue *queue,
+                         uint32_t first_entry,
+                         uint32_t entry_count);
 
 Synchronization_Objects create_synchronization_objects(VkDevice device);
 void destroy_synchronization_objects(VkDevice device, Synchronization_Objects *sync);
-
-void draw_frame(VkDevice device,
+Frame_Ring create_frame_ring(VkDevice device, VkCommandPool command_pool, uint32_t frame_count, uint32_t image_count);
+void destroy_frame_ring(VkDevice device, Frame_Ring *ring);
+void reset_images_in_flight(Frame_Ring *ring, uint32_t image_count);
+uint64_t get_completed_frame_number(Frame_Ring *ring);
+void begin_frame(VkDevice device, Frame_Ring *ring, Stream_Buffer *stream);
+void record_frame_time(Frame_Stats *stats, double now);
+void log_frame_time_percentiles(Frame_Stats *stats);
+int compare_floats(const void *a, const void *b);
+
+bool draw_frame(VkDevice device,
                 Swapchain_Etc swapchain_etc,
-                VkFramebuffer *swapchain_framebuffers,
-                VkRenderPass render_pass,
+                const Render_Target *render_targets,
                 VkPipeline pipeline,
                 VkBuffer vertex_buffer,
                 VkQueue graphics_queue,
                 VkQueue present_queue,
-                VkCommandBuffer command_buffer,
-                Synchronization_Objects *sync);
+                const Scene *scene,
+                Frame_Ring *ring,
+                Static_Command_Buffers *static_command_buffers,
+                Record_Workers *record_workers,
+                Frame_Stats *frame_stats);
+
+int main(int argc, char **argv) {
+    Config config = parse_command_line(argc, argv);
+    init_shader_binary_directory();
 
-int main() {
     if (!glfwInit()) exit_with_error("Failed to intialize GLFW");
 
     trace_log("Initialized GLFW");
@@ -118,7 +1891,10 @@ int main() {
 
     glfwMakeContextCurrent(window);
 
+    Window_State window_state = {0};
+    glfwSetWindowUserPointer(window, &window_state);
     glfwSetKeyCallback(window, keyboard_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 
     VkInstance instance = create_instance();
 
@@ -128,71 +1904,498 @@ int main() {
 
     VkSurfaceKHR surface = create_surface(instance, window);
     Logical_Device_Etc logical_device = create_logical_device(physical_device, surface);
+    Device_Allocator device_allocator = create_device_allocator(physical_device, logical_device.device);
+
+    if (config.stress_allocator) {
+        run_allocator_stress_test(&device_allocator);
+        glfwSetWindowShouldClose(window, true);
+    }
 
     // Surface <- Swapchain image <- image view <- framebuffer?
-    Swapchain_Etc swapchain_etc = create_swapchain(surface, physical_device, logical_device);
-    VkRenderPass render_pass = create_render_pass(logical_device.device, swapchain_etc.swapchain_image_format);
+    Swapchain_Etc swapchain_etc = create_swapchain(surface,
+                                                   physical_device,
+                                                   logical_device,
+                                                   get_framebuffer_extent(window),
+                                                   config.latency_mode,
+                                                   VK_NULL_HANDLE);
+    // Sized with the swapchain, recreated with it
+    VkSampleCountFlagBits samples = choose_sample_count(physical_device, config.msaa_samples, config.depth);
+    Transient_Attachments transient_attachments = create_transient_attachments(&device_allocator,
+                                                                               swapchain_etc.swapchain_image_format,
+                                                                               config.depth ? choose_depth_format(physical_device, config.hiz) : VK_FORMAT_UNDEFINED,
+                                                                               config.hiz,
+                                                                               samples,
+                                                                               swapchain_etc.swapchain_extent);
+    VkRenderPass render_pass = VK_NULL_HANDLE;
+    if (config.render_path == RENDER_PATH_RENDER_PASS) {
+        render_pass = create_render_pass(logical_device.device,
+                                         swapchain_etc.swapchain_image_format,
+                                         transient_attachments.depth.format,
+                                         samples,
+                                         transient_attachments.depth_sampled);
+    } else if (!logical_device.begin_rendering) {
+        exit_with_error("--render-path dynamic needs VK_KHR_dynamic_rendering");
+    }
     VkImageView *swapchain_image_views = create_image_views(logical_device.device,
                                                             swapchain_etc.swapchain_image_format,
                                                             swapchain_etc.swapchain_images,
                                                             swapchain_etc.swapchain_image_count);
-    VkFramebuffer *swapchain_framebuffers = create_framebuffers(logical_device.device,
-                                                                render_pass,
-                                                                swapchain_etc.swapchain_extent,
-                                                                swapchain_image_views,
-                                                                swapchain_etc.swapchain_image_count);
-
-    VkPipelineLayout pipeline_layout = create_pipeline_layout(logical_device.device);
-    VkPipeline pipeline = create_graphics_pipeline(logical_device.device,
-                                                   swapchain_etc.swapchain_extent,
-                                                   render_pass,
-                                                   pipeline_layout);
-    Vertex_Buffer_Etc vertex_buffer_etc = create_vertex_buffer(logical_device.device, physical_device);
+    VkFramebuffer *swapchain_framebuffers = NULL;
+    if (render_pass != VK_NULL_HANDLE) {
+        swapchain_framebuffers = create_framebuffers(logical_device.device,
+                                                     render_pass,
+                                                     swapchain_etc.swapchain_extent,
+                                                     swapchain_image_views,
+                                                     &transient_attachments,
+                                                     swapchain_etc.swapchain_image_count);
+    }
+    Render_Target *render_targets = create_render_targets(&swapchain_etc,
+                                                          swapchain_image_views,
+                                                          swapchain_framebuffers,
+                                                          &transient_attachments,
+                                                          render_pass,
+                                                          &logical_device);
+
+    Pipeline_Cache_Etc pipeline_cache = create_pipeline_cache(physical_device,
+                                                              logical_device.device,
+                                                              config.pipeline_cache_path,
+                                                              config.cold_pipeline_cache);
+    log_shader_loading(!SHADERS_EMBEDDED || config.shaders_from_disk);
+    Pipeline_Manager *pipeline_manager = create_pipeline_manager(logical_device.device,
+                                                                 &pipeline_cache,
+                                                                 render_pass,
+                                                                 transient_attachments.depth.format,
+                                                                 samples,
+                                                                 !SHADERS_EMBEDDED || config.shaders_from_disk,
+                                                                 config.sync_pipeline_compiles ? 0 : PIPELINE_COMPILE_THREAD_COUNT);
+    // The default pipeline is the fallback for every other variant, so it's the one worth waiting for
+    Transform_Source transform_source = animation_modes[config.animation_mode].transform_source;
+    Pipeline_Key default_pipeline_key = get_default_pipeline_key(swapchain_etc.swapchain_image_format, transform_source);
+    VkPipeline pipeline = get_pipeline(pipeline_manager, &default_pipeline_key, true);
+    Scene scene = create_scene(config.draw_count, config.mesh_grid_size, config.material_count, config.overlap);
+    scene.transform_source = transform_source;
+    if (config.depth) {
+        // Every draw gets its own depth, strictly inside (0, 1), with room for the dynamic geometry after the last
+        scene.depth_step = 1.0f / (float)(scene.draw_count + 2);
+    }
+    if (config.depth_prepass) {
+        scene.prepass_pipelines = xmalloc(sizeof(VkPipeline) * scene.material_count);
+        memset(scene.prepass_pipelines, 0, sizeof(VkPipeline) * scene.material_count);
+    }
+    resolve_material_pipelines(pipeline_manager, &scene, swapchain_etc.swapchain_image_format, 1, config.pipeline_fallback);
+    Shader_Watcher *shader_watcher = config.watch_shaders ? create_shader_watcher(pipeline_manager) : NULL;
+    Uploader uploader = create_uploader(&device_allocator, logical_device);
+    Buffer_Etc vertex_buffer_etc = create_vertex_buffer(&device_allocator, &uploader, scene.vertices, scene.vertex_count);
+    Buffer_Etc index_buffer_etc = create_index_buffer(&device_allocator,
+                                                      &uploader,
+                                                      scene.indices,
+                                                      scene.index_count,
+                                                      scene.index_type);
+    scene.index_buffer = index_buffer_etc.buffer;
+
+    Instance_Batcher instance_batcher = {0};
+    Pipeline_Key instanced_pipeline_key = get_instanced_pipeline_key(swapchain_etc.swapchain_image_format);
+    if (config.instance_count > 0) {
+        instance_batcher = create_instance_batcher(&device_allocator, &uploader, config.instance_count);
+        instance_batcher.pipeline = get_pipeline(pipeline_manager, &instanced_pipeline_key, true);
+        scene.instance_batcher = &instance_batcher;
+    }
+
+    // NOTE: Indirect draws pass the draw ID as firstInstance, which has to be 0 without drawIndirectFirstInstance.
+    //       Whatever reads the draw ID (the transform from the storage buffer, the depth) would then get draw 0's
+    //       for every draw, so those draw on the direct path instead. Culling only has the indirect path.
+    bool reads_draw_id = transform_source == TRANSFORM_SOURCE_STORAGE_BUFFER || config.depth;
+    if (config.draw_path == DRAW_PATH_INDIRECT && reads_draw_id && !logical_device.draw_indirect_first_instance) {
+        if (config.cull) exit_with_error("--cull with --depth or --animate storage-buffer needs drawIndirectFirstInstance");
+        trace_log("WARNING: No drawIndirectFirstInstance, drawing with --draw-path direct");
+        config.draw_path = DRAW_PATH_DIRECT;
+    }
+    Indirect_Draws indirect_draws = {0};
+    if (config.draw_path == DRAW_PATH_INDIRECT) {
+        indirect_draws = create_indirect_draws(&device_allocator, &uploader, logical_device, &scene);
+        scene.indirect_draws = &indirect_draws;
+    }
+    // All startup uploads go out in one submit
+    wait_for_uploads(&uploader, flush_uploads(&uploader));
 
     VkCommandPool command_pool = create_command_pool(logical_device.device, logical_device.graphics_queue_family_index);
-    VkCommandBuffer command_buffer = allocate_command_buffer(logical_device.device, command_pool);
-    Synchronization_Objects synchronization_objects = create_synchronization_objects(logical_device.device);
+    Frame_Ring frame_ring = create_frame_ring(logical_device.device,
+                                              command_pool,
+                                              config.frames_in_flight,
+                                              swapchain_etc.swapchain_image_count);
+
+    // Instances go through the stream buffer too, so it grows with --instances
+    VkDeviceSize stream_frame_size = STREAM_FRAME_SIZE + align_up(sizeof(Gpu_Instance) * (VkDeviceSize)config.instance_count, 256);
+    Stream_Buffer stream_buffer = create_stream_buffer(&device_allocator,
+                                                       physical_device,
+                                                       frame_ring.frame_count,
+                                                       stream_frame_size);
+    const Shader_Program_Layout *basic_program_layout = &pipeline_manager->program_layouts[SHADER_PROGRAM_BASIC];
+    if (basic_program_layout->interface.push_constant_range.size != sizeof(Draw_Constants)) {
+        exit_with_error("The shaders declare %u bytes of push constants, expected a Draw_Constants (%zu bytes)",
+                        basic_program_layout->interface.push_constant_range.size,
+                        sizeof(Draw_Constants));
+    }
+    Frame_Descriptors frame_descriptors = create_frame_descriptors(logical_device.device,
+                                                                   basic_program_layout,
+                                                                   &stream_buffer,
+                                                                   transform_source,
+                                                                   scene.draw_count);
+    scene.pipeline_layout = basic_program_layout->pipeline_layout;
+    scene.push_constant_stages = basic_program_layout->interface.push_constant_range.stageFlags;
+    scene.frame_descriptor_set = frame_descriptors.set;
+
+    Cull_Pass cull_pass = {0};
+    if (config.cull) {
+        if (!logical_device.graphics_queue_has_compute) exit_with_error("--cull needs a graphics queue with compute");
+        cull_pass = create_cull_pass(&device_allocator,
+                                     &uploader,
+                                     pipeline_manager,
+                                     &stream_buffer,
+                                     &scene,
+                                     &indirect_draws,
+                                     frame_ring.frame_count,
+                                     config.hiz);
+        wait_for_uploads(&uploader, flush_uploads(&uploader));
+        scene.cull_pass = &cull_pass;
+    }
+    Gpu_Timer gpu_timer = {0};
+    if (config.gpu_timing) {
+        if (logical_device.timestamp_valid_bits == 0) exit_with_error("--gpu-timing: the graphics queue has no timestamps");
+        // Secondary command buffers can only run inside the query with inheritedQueries
+        bool secondaries = config.record_threads > 0 || config.bench_recording;
+        bool count_fragments = logical_device.pipeline_statistics_query && (!secondaries || logical_device.inherited_queries);
+        gpu_timer = create_gpu_timer(logical_device.device,
+                                     frame_ring.frame_count,
+                                     pipeline_cache.device_properties.limits.timestampPeriod,
+                                     count_fragments);
+        scene.gpu_timer = &gpu_timer;
+    }
 
-    trace_log("Entering main loop");
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
-        draw_frame(logical_device.device,
-                   swapchain_etc,
-                   swapchain_framebuffers,
-                   render_pass,
-                   pipeline,
-                   vertex_buffer_etc.buffer,
-                   logical_device.graphics_queue,
-                   logical_device.present_queue,
-                   command_buffer,
-                   &synchronization_objects);
+    Record_Workers *record_workers = NULL;
+    if (config.record_threads > 0 || config.bench_recording) {
+        uint32_t thread_count = config.record_threads > 0 ? config.record_threads : MAX_RECORD_THREADS / 2;
+        record_workers = create_record_workers(logical_device.device,
+                                               logical_device.graphics_queue_family_index,
+                                               thread_count,
+                                               frame_ring.frame_count);
     }
 
-    trace_log("Exiting gracefully");
+    // One buffer per recording thread, submitting runs on the same threads
+    Render_Queue render_queue = {0};
+    if (config.render_queue) {
+        render_queue = create_render_queue(config.record_threads > 0 ? config.record_threads : 1);
+        build_render_queue(&render_queue, &scene, vertex_buffer_etc.buffer, config.record_threads > 0 ? record_workers : NULL);
+        scene.render_queue = &render_queue;
+    }
 
-    vkDeviceWaitIdle(logical_device.device);
-    destroy_synchronization_objects(logical_device.device, &synchronization_objects);
-    vkDestroyCommandPool(logical_device.device, command_pool, NULL);
-    destroy_vertex_buffer(logical_device.device, vertex_buffer_etc);
-    vkDestroyPipeline(logical_device.device, pipeline, NULL);
-    vkDestroyPipelineLayout(logical_device.device, pipeline_layout, NULL);
-    for (uint32_t i = 0; i < swapchain_etc.swapchain_image_count; i++) {
-        vkDestroyFramebuffer(logical_device.device, swapchain_framebuffers[i], NULL);
-        vkDestroyImageView(logical_device.device, swapchain_image_views[i], NULL);
+    if (config.bench_recording) {
+        run_recording_benchmark(logical_device.device,
+                                command_pool,
+                                record_workers,
+                                &render_targets[0],
+                                pipeline,
+                                vertex_buffer_etc.buffer,
+                                &scene);
+        glfwSetWindowShouldClose(window, true);
     }
-    free(swapchain_framebuffers);
-    free(swapchain_image_views);
-    vkDestroyRenderPass(logical_device.device, render_pass, NULL);
-    vkDestroySwapchainKHR(logical_device.device, swapchain_etc.swapchain, NULL);
-    vkDestroySurfaceKHR(instance, surface, NULL);
-    vkDestroyDevice(logical_device.device, NULL);
-    vkDestroyInstance(instance, NULL);
-    glfwDestroyWindow(window);
-    glfwTerminate();
-    return 0;
-}
 
-void exit_with_error(const char *msg, ...) {
+    Static_Command_Buffers static_command_buffers = {0};
+    if (config.static_scene) {
+        static_command_buffers = create_static_command_buffers(logical_device.device,
+                                                               command_pool,
+                                                               swapchain_etc.swapchain_image_count);
+    }
+
+    // NOTE: Checkpoint: everything compiled at startup is in the cache now
+    save_pipeline_cache(logical_device.device, &pipeline_cache, false);
+
+    // glfwGetTime counts from glfwInit
+    trace_log("Startup took %.1f ms (%s pipeline cache, %s shaders)",
+              1000.0 * glfwGetTime(),
+              pipeline_cache.warm ? "warm" : "cold",
+              pipeline_manager->shaders_from_disk ? "mapped" : "embedded");
+    trace_log("Entering main loop with %u frames in flight%s, rendering through the %s path",
+              frame_ring.frame_count,
+              config.static_scene ? " (static scene)" : "",
+              render_path_names[config.render_path]);
+    Frame_Stats frame_stats = {0};
+    frame_stats.start_time = glfwGetTime();
+    Retired_Swapchains retired_swapchains = {0};
+    while (!glfwWindowShouldClose(window)) {
+        glfwPollEvents();
+
+        // NOTE: A minimized window has a 0x0 framebuffer and no swapchain can be created for it
+        VkExtent2D framebuffer_extent = get_framebuffer_extent(window);
+        if (framebuffer_extent.width == 0 || framebuffer_extent.height == 0) {
+            glfwWaitEvents();
+            continue;
+        }
+
+        if (window_state.clear_color_changed) {
+            window_state.clear_color_changed = false;
+            static const float clear_colors[][4] = {
+                {0.0f, 0.0f, 0.0f, 1.0f},
+                {0.1f, 0.1f, 0.2f, 1.0f},
+                {0.2f, 0.1f, 0.1f, 1.0f},
+            };
+            const float *color = clear_colors[window_state.clear_color_index % array_count(clear_colors)];
+            memcpy(scene.clear_color.color.float32, color, sizeof(float) * 4);
+            scene.version++;
+        }
+
+        begin_frame(logical_device.device, &frame_ring, &stream_buffer);
+        record_frame_time(&frame_stats, glfwGetTime());
+        scene.frame_index = frame_ring.current_frame;
+        if (scene.cull_pass) collect_cull_statistics(&cull_pass, frame_ring.current_frame);
+        if (scene.gpu_timer) collect_gpu_timestamps(logical_device.device, &gpu_timer, frame_ring.current_frame);
+        if (config.camera_zoom > 1.0f) update_camera(&scene.camera, config.camera_zoom, glfwGetTime());
+
+        uint32_t active_material_count = (uint32_t)(1 + frame_ring.frame_number / MATERIAL_REVEAL_INTERVAL_FRAMES);
+        if (resolve_material_pipelines(pipeline_manager,
+                                       &scene,
+                                       swapchain_etc.swapchain_image_format,
+                                       active_material_count,
+                                       config.pipeline_fallback)) {
+            scene.version++;
+        }
+        // The default pipeline changes too when its shaders are reloaded
+        pipeline = scene.material_pipelines[0];
+
+        if (config.dynamic_geometry) {
+            write_dynamic_geometry(&stream_buffer, &scene, glfwGetTime());
+        }
+
+        if (config.animation_mode != ANIMATION_MODE_NONE) {
+            double animation_start = glfwGetTime();
+            animate_objects(&scene, animation_start);
+            if (config.animation_mode == ANIMATION_MODE_VERTICES) {
+                frame_stats.animation_bytes += (double)write_animated_vertices(&stream_buffer, &scene);
+            } else if (config.animation_mode == ANIMATION_MODE_STORAGE_BUFFER) {
+                frame_stats.animation_bytes += (double)write_object_transforms(&stream_buffer, &scene);
+            } else {
+                // Pushed while recording, so the cost shows up in the frame times rather than here
+                frame_stats.animation_bytes += (double)(sizeof(Object_Transform) * scene.draw_count);
+            }
+            frame_stats.animation_ms += 1000.0 * (glfwGetTime() - animation_start);
+        }
+
+        if (scene.instance_batcher) {
+            double instance_start = glfwGetTime();
+            instance_batcher.pipeline = get_pipeline(pipeline_manager, &instanced_pipeline_key, false);
+            write_markers(&instance_batcher, config.instance_count, instance_start);
+            build_instance_batches(&instance_batcher, &stream_buffer);
+            frame_stats.instance_ms += 1000.0 * (glfwGetTime() - instance_start);
+            frame_stats.instance_draw_count += instance_batcher.batch_count;
+        }
+
+        if (scene.render_queue) {
+            build_render_queue(&render_queue, &scene, vertex_buffer_etc.buffer, config.record_threads > 0 ? record_workers : NULL);
+        }
+
+        bool swapchain_out_of_date = draw_frame(logical_device.device,
+                                                swapchain_etc,
+                                                render_targets,
+                                                pipeline,
+                                                vertex_buffer_etc.buffer,
+                                                logical_device.graphics_queue,
+                                                logical_device.present_queue,
+                                                &scene,
+                                                &frame_ring,
+                                                config.static_scene ? &static_command_buffers : NULL,
+                                                config.record_threads > 0 ? record_workers : NULL,
+                                                &frame_stats);
+
+        // --rebuild-swapchain-every: the same work as a resize, on demand, to measure it
+        bool forced_rebuild = config.rebuild_swapchain_interval > 0 &&
+                              frame_ring.frame_number % config.rebuild_swapchain_interval == 0;
+        if (swapchain_out_of_date || window_state.framebuffer_resized || forced_rebuild) {
+            window_state.framebuffer_resized = false;
+            uint64_t pipeline_creations_before = get_pipeline_creation_count(pipeline_manager);
+            frame_stats.resize_ms += recreate_swapchain(surface,
+                                                        physical_device,
+                                                        logical_device,
+                                                        &device_allocator,
+                                                        framebuffer_extent,
+                                                        render_pass,
+                                                        &swapchain_etc,
+                                                        &swapchain_image_views,
+                                                        &swapchain_framebuffers,
+                                                        &transient_attachments,
+                                                        &frame_ring,
+                                                        &retired_swapchains);
+            free(render_targets);
+            render_targets = create_render_targets(&swapchain_etc,
+                                                   swapchain_image_views,
+                                                   swapchain_framebuffers,
+                                                   &transient_attachments,
+                                                   render_pass,
+                                                   &logical_device);
+            uint64_t pipeline_creations = get_pipeline_creation_count(pipeline_manager) - pipeline_creations_before;
+            frame_stats.resize_count++;
+            frame_stats.resize_pipeline_creations += pipeline_creations;
+            if (pipeline_creations > 0) {
+                trace_log("WARNING: %llu pipelines were created during swapchain recreation",
+                          (unsigned long long)pipeline_creations);
+            }
+            if (config.static_scene) {
+                invalidate_static_command_buffers(logical_device.device,
+                                                  command_pool,
+                                                  &static_command_buffers,
+                                                  swapchain_etc.swapchain_image_count);
+            }
+        }
+
+        destroy_retired_swapchains(&device_allocator,
+                                   &retired_swapchains,
+                                   get_completed_frame_number(&frame_ring),
+                                   false);
+        destroy_retired_pipelines(pipeline_manager, frame_ring.frame_number, get_completed_frame_number(&frame_ring), false);
+
+        if (glfwGetTime() - pipeline_cache.last_save_time > PIPELINE_CACHE_SAVE_INTERVAL_SECONDS) {
+            save_pipeline_cache(logical_device.device, &pipeline_cache, false);
+        }
+
+        if (config.exit_after_frames > 0 && frame_ring.frame_number >= config.exit_after_frames) {
+            glfwSetWindowShouldClose(window, true);
+        }
+    }
+
+    double elapsed = glfwGetTime() - frame_stats.start_time;
+    frame_stats.frame_count = frame_ring.frame_number;
+    if (frame_stats.frame_count > 0 && elapsed > 0.0) {
+        trace_log("Rendered %llu frames in %.2f s through the %s path at %ux MSAA: %.3f ms/frame, %.1f FPS",
+                  (unsigned long long)frame_stats.frame_count,
+                  elapsed,
+                  render_path_names[config.render_path],
+                  (uint32_t)samples,
+                  1000.0 * elapsed / (double)frame_stats.frame_count,
+                  (double)frame_stats.frame_count / elapsed);
+    }
+    log_frame_time_percentiles(&frame_stats);
+    log_pipeline_manager_stats(pipeline_manager);
+
+    if (frame_stats.frame_count > 0) {
+        trace_log("Recording %u draws (%s): %.3f ms/frame on the CPU",
+                  scene.draw_count,
+                  draw_path_names[config.draw_path],
+                  frame_stats.record_ms / (double)frame_stats.frame_count);
+    }
+
+    if (render_queue.build_count > 0) {
+        double builds = (double)render_queue.build_count;
+        trace_log("Render queue: %.1f commands/frame, %.1f pipeline binds (%.1f in submission order), %.1f vertex buffer binds",
+                  (double)render_queue.command_count / builds,
+                  (double)render_queue.pipeline_bind_count / builds,
+                  (double)render_queue.unsorted_pipeline_bind_count / builds,
+                  (double)render_queue.vertex_buffer_bind_count / builds);
+        trace_log("Render queue: %.3f ms/frame submitting on %u thread%s, %.3f ms/frame merging and sorting",
+                  render_queue.submit_ms / builds,
+                  render_queue.buffer_count,
+                  render_queue.buffer_count == 1 ? "" : "s",
+                  render_queue.sort_ms / builds);
+    }
+
+    if (cull_pass.sampled_frame_count > 0) {
+        double visible = (double)cull_pass.visible_total / (double)cull_pass.sampled_frame_count;
+        trace_log("Culling at zoom %.1f: %.1f of %u draws visible per frame, %.1f%% culled",
+                  config.camera_zoom,
+                  visible,
+                  cull_pass.command_count,
+                  100.0 * (1.0 - visible / (double)cull_pass.command_count));
+        if (cull_pass.occlusion) {
+            double occluded = (double)cull_pass.occluded_total / (double)cull_pass.sampled_frame_count;
+            trace_log("Occlusion culling: %.1f draws per frame inside the view but behind the previous frame's depth, %.1f%%",
+                      occluded,
+                      100.0 * occluded / (double)cull_pass.command_count);
+        }
+    }
+    if (gpu_timer.sampled_frame_count > 0) {
+        trace_log("GPU time per frame: %.3f ms culling, %.3f ms render pass (%llu frames)",
+                  gpu_timer.cull_ms / (double)gpu_timer.sampled_frame_count,
+                  gpu_timer.render_ms / (double)gpu_timer.sampled_frame_count,
+                  (unsigned long long)gpu_timer.sampled_frame_count);
+        if (gpu_timer.statistics_pool != VK_NULL_HANDLE) {
+            double invocations = (double)gpu_timer.fragment_invocations / (double)gpu_timer.sampled_frame_count;
+            double pixels = (double)swapchain_etc.swapchain_extent.width * (double)swapchain_etc.swapchain_extent.height;
+            trace_log("Fragment shader invocations: %.0f per frame, %.2f per pixel (%s%s)",
+                      invocations,
+                      invocations / pixels,
+                      config.depth_prepass ? "depth pre-pass" : config.depth ? "depth test" : "no depth buffer",
+                      config.render_queue ? ", sorted" : "");
+        }
+    }
+
+    if (config.instance_count > 0 && frame_stats.frame_count > 0) {
+        trace_log("Instancing: %u instances in %.1f draws/frame, %.3f ms/frame on the CPU to add and batch them",
+                  config.instance_count,
+                  (double)frame_stats.instance_draw_count / (double)frame_stats.frame_count,
+                  frame_stats.instance_ms / (double)frame_stats.frame_count);
+        if (instance_batcher.dropped_instance_count > 0) {
+            trace_log("WARNING: %llu instances dropped, over capacity",
+                      (unsigned long long)instance_batcher.dropped_instance_count);
+        }
+    }
+
+    if (config.animation_mode != ANIMATION_MODE_NONE && frame_stats.frame_count > 0) {
+        trace_log("Animated %u objects by %s: %.3f ms/frame on the CPU, %.1f KiB/frame written",
+                  scene.draw_count,
+                  animation_modes[config.animation_mode].name,
+                  frame_stats.animation_ms / (double)frame_stats.frame_count,
+                  frame_stats.animation_bytes / (double)frame_stats.frame_count / 1024.0);
+    }
+
+    if (frame_stats.resize_count > 0) {
+        trace_log("Resizes: %llu, %.3f ms each, pipelines created during them: %llu",
+                  (unsigned long long)frame_stats.resize_count,
+                  frame_stats.resize_ms / (double)frame_stats.resize_count,
+                  (unsigned long long)frame_stats.resize_pipeline_creations);
+    }
+
+    if (config.static_scene) {
+        trace_log("Static scene: %llu command buffer recordings, %llu of them re-recordings after invalidation",
+                  (unsigned long long)static_command_buffers.record_count,
+                  (unsigned long long)static_command_buffers.rerecord_count);
+    }
+
+    trace_log("Exiting gracefully");
+
+    vkDeviceWaitIdle(logical_device.device);
+    destroy_retired_swapchains(&device_allocator, &retired_swapchains, frame_ring.frame_number, true);
+    destroy_frame_ring(logical_device.device, &frame_ring);
+    destroy_static_command_buffers(&static_command_buffers);
+    if (record_workers) destroy_record_workers(record_workers);
+    vkDestroyCommandPool(logical_device.device, command_pool, NULL);
+    destroy_buffer(&device_allocator, &vertex_buffer_etc);
+    destroy_buffer(&device_allocator, &index_buffer_etc);
+    if (scene.instance_batcher) destroy_instance_batcher(&device_allocator, &instance_batcher);
+    if (scene.render_queue) destroy_render_queue(&render_queue);
+    if (scene.cull_pass) destroy_cull_pass(&device_allocator, &cull_pass);
+    if (scene.gpu_timer) destroy_gpu_timer(logical_device.device, &gpu_timer);
+    if (scene.indirect_draws) destroy_indirect_draws(&device_allocator, &indirect_draws);
+    destroy_uploader(&device_allocator, &uploader);
+    destroy_frame_descriptors(logical_device.device, &frame_descriptors);
+    destroy_stream_buffer(&device_allocator, &stream_buffer);
+    destroy_transient_attachments(&device_allocator, &transient_attachments);
+    log_device_allocator_stats(&device_allocator);
+    destroy_device_allocator(&device_allocator);
+    destroy_scene(&scene);
+    if (shader_watcher) destroy_shader_watcher(shader_watcher);
+    destroy_pipeline_manager(pipeline_manager);
+    free(frame_stats.frame_times_ms);
+    destroy_pipeline_cache(logical_device.device, &pipeline_cache);
+    free(render_targets);
+    destroy_swapchain_resources(logical_device.device, &swapchain_etc, swapchain_image_views, swapchain_framebuffers);
+    if (render_pass != VK_NULL_HANDLE) vkDestroyRenderPass(logical_device.device, render_pass, NULL);
+    vkDestroySurfaceKHR(instance, surface, NULL);
+    vkDestroyDevice(logical_device.device, NULL);
+    vkDestroyInstance(instance, NULL);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
+
+void exit_with_error(const char *msg, ...) {
     fprintf(stderr, "FATAL: ");
     va_list ap;
     va_start(ap, msg);
@@ -226,6 +2429,21 @@ void keyboard_callback(GLFWwindow *window, int key, int scancode, int action, in
         trace_log("Received ESC. Terminating...");
         glfwSetWindowShouldClose(window, true);
     }
+
+    // NOTE: C cycles the clear color: a scene change that invalidates pre-recorded command buffers
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        Window_State *window_state = glfwGetWindowUserPointer(window);
+        window_state->clear_color_index++;
+        window_state->clear_color_changed = true;
+    }
+}
+
+void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
+    (void)width; (void)height;
+
+    // NOTE: Only flag it here. The swapchain is rebuilt from the main loop between frames.
+    Window_State *window_state = glfwGetWindowUserPointer(window);
+    window_state->framebuffer_resized = true;
 }
 
 VkInstance create_instance() {
@@ -276,8 +2494,17 @@ VkInstance create_instance() {
         trace_log("  glfw_extensions[%u] = %s", i, glfw_extensions[i]);
     }
 
-    create_info.enabledExtensionCount = glfw_extension_count;
-    create_info.ppEnabledExtensionNames = glfw_extensions;
+    // NOTE: Plus VK_KHR_get_physical_device_properties2 when it's there, it's core in 1.1 and the device
+    //       extensions behind VK_KHR_dynamic_rendering depend on it on this 1.0 instance
+    const char **instance_extensions = xmalloc(sizeof(const char *) * (glfw_extension_count + 1));
+    memcpy(instance_extensions, glfw_extensions, sizeof(const char *) * glfw_extension_count);
+    uint32_t instance_extension_count = glfw_extension_count;
+    if (check_instance_extension_support("VK_KHR_get_physical_device_properties2")) {
+        instance_extensions[instance_extension_count++] = "VK_KHR_get_physical_device_properties2";
+    }
+
+    create_info.enabledExtensionCount = instance_extension_count;
+    create_info.ppEnabledExtensionNames = instance_extensions;
 
     // NOTE: Validation layers
     const char *requested_layers[] = { "VK_LAYER_KHRONOS_validation" };
@@ -299,6 +2526,7 @@ VkInstance create_instance() {
     if (vkCreateInstance(&create_info, NULL, &instance) != VK_SUCCESS) {
         exit_with_error("Failed to create Vulkan instance");
     }
+    free(instance_extensions);
 
     return instance;
 }
@@ -355,6 +2583,59 @@ bool check_layer_support(const char **requested_layers, int requested_layer_coun
     return layers_valid;
 }
 
+bool check_instance_extension_support(const char *extension_name) {
+    /*
+      VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceExtensionProperties(
+      const char*                                 pLayerName,
+      uint32_t*                                   pPropertyCount,
+      VkExtensionProperties*                      pProperties);
+    */
+    uint32_t extension_count = 0;
+    vkEnumerateInstanceExtensionProperties(NULL, &extension_count, NULL);
+    VkExtensionProperties *extensions = xmalloc(sizeof(VkExtensionProperties) * extension_count);
+    vkEnumerateInstanceExtensionProperties(NULL, &extension_count, extensions);
+
+    bool found = false;
+    for (uint32_t i = 0; i < extension_count; i++) {
+        if (strcmp(extensions[i].extensionName, extension_name) == 0) {
+            found = true;
+            break;
+        }
+    }
+    free(extensions);
+    return found;
+}
+
+bool check_device_extension_support(VkPhysicalDevice physical_device, const char *extension_name) {
+    /*
+      VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateDeviceExtensionProperties(
+      VkPhysicalDevice                            physicalDevice,
+      const char*                                 pLayerName,
+      uint32_t*                                   pPropertyCount,
+      VkExtensionProperties*                      pProperties);
+
+      typedef struct VkExtensionProperties {
+      char        extensionName[VK_MAX_EXTENSION_NAME_SIZE];
+      uint32_t    specVersion;
+      } VkExtensionProperties;
+    */
+    uint32_t extension_count = 0;
+    vkEnumerateDeviceExtensionProperties(physical_device, NULL, &extension_count, NULL);
+    VkExtensionProperties *extensions = xmalloc(sizeof(VkExtensionProperties) * extension_count);
+    vkEnumerateDeviceExtensionProperties(physical_device, NULL, &extension_count, extensions);
+
+    bool found = false;
+    for (uint32_t i = 0; i < extension_count; i++) {
+        if (strcmp(extensions[i].extensionName, extension_name) == 0) {
+            found = true;
+            break;
+        }
+    }
+
+    free(extensions);
+    return found;
+}
+
 VkPhysicalDevice find_suitable_physical_device(VkInstance instance) {
     uint32_t device_count = 0;
 
@@ -453,26 +2734,68 @@ Logical_Device_Etc create_logical_device(VkPhysicalDevice physical_device, VkSur
           typedef VkFlags VkQueueFlags;
           typedef VkFlags VkDeviceCreateFlags;
          */
-        if (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+        // NOTE: Compute too if there's such a family (the spec says there is), so culling dispatches can be
+        //       recorded in the same command buffer as the draws they feed
+        VkQueueFlags graphics_compute = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+        if ((queue_families[i].queueFlags & graphics_compute) == graphics_compute) {
+            if (graphics_queue_family_index == -1 ||
+                (queue_families[graphics_queue_family_index].queueFlags & graphics_compute) != graphics_compute) {
+                graphics_queue_family_index = (int)i;
+            }
+        } else if ((queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) && graphics_queue_family_index == -1) {
             graphics_queue_family_index = (int)i;
         }
 
         VkBool32 present_support = VK_FALSE;
         vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, i, surface, &present_support);
 
-        if (present_support) {
+        if (present_support && present_queue_family_index == -1) {
             present_queue_family_index = (int)i;
         }
-
-        if (graphics_queue_family_index != -1 && present_queue_family_index != -1) {
-            break;
-        }
     }
     if (graphics_queue_family_index == -1 || present_queue_family_index == -1) {
         exit_with_error("Failed to find graphics and present queue family when creating logical device");
     }
+    VkQueueFamilyProperties graphics_family = queue_families[graphics_queue_family_index];
+
+    // NOTE: A transfer-only family usually maps to the copy engines, which run uploads alongside rendering.
+    //       Take a family without graphics and compute first, then one without graphics, else share the graphics queue.
+    int transfer_queue_family_index = -1;
+    for (uint32_t i = 0; i < queue_family_count && transfer_queue_family_index == -1; i++) {
+        VkQueueFlags flags = queue_families[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            transfer_queue_family_index = (int)i;
+        }
+    }
+    for (uint32_t i = 0; i < queue_family_count && transfer_queue_family_index == -1; i++) {
+        VkQueueFlags flags = queue_families[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            transfer_queue_family_index = (int)i;
+        }
+    }
+    if (transfer_queue_family_index == -1) {
+        transfer_queue_family_index = graphics_queue_family_index;
+    }
     free(queue_families);
 
+    trace_log("Using queue families: graphics %d, present %d, transfer %d%s",
+              graphics_queue_family_index,
+              present_queue_family_index,
+              transfer_queue_family_index,
+              transfer_queue_family_index == graphics_queue_family_index ? " (no dedicated transfer family)" : "");
+
+    // One queue per distinct family
+    uint32_t unique_queue_families[3];
+    uint32_t unique_queue_family_count = 0;
+    int requested_queue_families[] = {graphics_queue_family_index, present_queue_family_index, transfer_queue_family_index};
+    for (uint32_t i = 0; i < array_count(requested_queue_families); i++) {
+        bool seen = false;
+        for (uint32_t j = 0; j < unique_queue_family_count; j++) {
+            if (unique_queue_families[j] == (uint32_t)requested_queue_families[i]) seen = true;
+        }
+        if (!seen) unique_queue_families[unique_queue_family_count++] = (uint32_t)requested_queue_families[i];
+    }
+
     float queue_priority = 1.0f;
     /*
       typedef struct VkDeviceQueueCreateInfo {
@@ -484,11 +2807,13 @@ Logical_Device_Etc create_logical_device(VkPhysicalDevice physical_device, VkSur
           const float*                pQueuePriorities;
       } VkDeviceQueueCreateInfo;
     */
-    VkDeviceQueueCreateInfo queue_create_info = {};
-    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_info.queueFamilyIndex = graphics_queue_family_index;
-    queue_create_info.queueCount = 1;
-    queue_create_info.pQueuePriorities = &queue_priority;
+    VkDeviceQueueCreateInfo queue_create_infos[3] = {0};
+    for (uint32_t i = 0; i < unique_queue_family_count; i++) {
+        queue_create_infos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_create_infos[i].queueFamilyIndex = unique_queue_families[i];
+        queue_create_infos[i].queueCount = 1;
+        queue_create_infos[i].pQueuePriorities = &queue_priority;
+    }
 
     /*
       typedef struct VkDeviceCreateInfo {
@@ -506,12 +2831,59 @@ Logical_Device_Etc create_logical_device(VkPhysicalDevice physical_device, VkSur
     */
     VkDeviceCreateInfo device_create_info = {};
     device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    device_create_info.queueCreateInfoCount = 1;
-    device_create_info.pQueueCreateInfos = &queue_create_info;
-    const char *device_extensions[] = { "VK_KHR_swapchain" };
-    device_create_info.enabledExtensionCount = 1;
+    device_create_info.queueCreateInfoCount = unique_queue_family_count;
+    device_create_info.pQueueCreateInfos = queue_create_infos;
+    // NOTE: VK_KHR_draw_indirect_count is core in 1.2, this is a 1.0 instance so it goes through the extension
+    const char *device_extensions[8] = { "VK_KHR_swapchain" };
+    uint32_t device_extension_count = 1;
+    bool draw_indirect_count = check_device_extension_support(physical_device, "VK_KHR_draw_indirect_count");
+    if (draw_indirect_count) {
+        device_extensions[device_extension_count++] = "VK_KHR_draw_indirect_count";
+    }
+    // NOTE: Same for VK_KHR_dynamic_rendering (core in 1.3), together with the extensions it depends on.
+    //       Devices keep listing promoted extensions, so this finds it on 1.3 drivers too.
+    static const char *dynamic_rendering_extensions[] = {
+        "VK_KHR_dynamic_rendering",
+        "VK_KHR_depth_stencil_resolve",
+        "VK_KHR_create_renderpass2",
+        "VK_KHR_multiview",
+        "VK_KHR_maintenance2",
+    };
+    bool dynamic_rendering = check_instance_extension_support("VK_KHR_get_physical_device_properties2");
+    for (uint32_t i = 0; i < array_count(dynamic_rendering_extensions) && dynamic_rendering; i++) {
+        dynamic_rendering = check_device_extension_support(physical_device, dynamic_rendering_extensions[i]);
+    }
+    if (dynamic_rendering) {
+        for (uint32_t i = 0; i < array_count(dynamic_rendering_extensions); i++) {
+            device_extensions[device_extension_count++] = dynamic_rendering_extensions[i];
+        }
+    }
+    device_create_info.enabledExtensionCount = device_extension_count;
     device_create_info.ppEnabledExtensionNames = device_extensions;
 
+    /*
+      typedef struct VkPhysicalDeviceDynamicRenderingFeatures {
+          VkStructureType    sType;
+          void*              pNext;
+          VkBool32           dynamicRendering;
+      } VkPhysicalDeviceDynamicRenderingFeatures;
+    */
+    // Supporting the extension means supporting the feature, it only has to be turned on
+    VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features = {0};
+    dynamic_rendering_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+    dynamic_rendering_features.dynamicRendering = VK_TRUE;
+    if (dynamic_rendering) device_create_info.pNext = &dynamic_rendering_features;
+
+    // Only what the indirect draw path and the fragment counter use, and only if it's there
+    VkPhysicalDeviceFeatures supported_features;
+    vkGetPhysicalDeviceFeatures(physical_device, &supported_features);
+    VkPhysicalDeviceFeatures enabled_features = {0};
+    enabled_features.multiDrawIndirect = supported_features.multiDrawIndirect;
+    enabled_features.drawIndirectFirstInstance = supported_features.drawIndirectFirstInstance;
+    enabled_features.pipelineStatisticsQuery = supported_features.pipelineStatisticsQuery;
+    enabled_features.inheritedQueries = supported_features.inheritedQueries;
+    device_create_info.pEnabledFeatures = &enabled_features;
+
     /*
       Opaque pointer: VK_DEFINE_HANDLE(VkDevice)
     */
@@ -528,6 +2900,22 @@ Logical_Device_Etc create_logical_device(VkPhysicalDevice physical_device, VkSur
     logical_device.present_queue_family_index = (uint32_t)present_queue_family_index;
     vkGetDeviceQueue(device, graphics_queue_family_index, 0, &logical_device.graphics_queue);
     vkGetDeviceQueue(device, present_queue_family_index, 0, &logical_device.present_queue);
+    logical_device.transfer_queue_family_index = (uint32_t)transfer_queue_family_index;
+    vkGetDeviceQueue(device, transfer_queue_family_index, 0, &logical_device.transfer_queue);
+    logical_device.graphics_queue_has_compute = (graphics_family.queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+    logical_device.timestamp_valid_bits = graphics_family.timestampValidBits;
+    logical_device.multi_draw_indirect = enabled_features.multiDrawIndirect == VK_TRUE;
+    logical_device.draw_indirect_first_instance = enabled_features.drawIndirectFirstInstance == VK_TRUE;
+    logical_device.pipeline_statistics_query = enabled_features.pipelineStatisticsQuery == VK_TRUE;
+    logical_device.inherited_queries = enabled_features.inheritedQueries == VK_TRUE;
+    if (dynamic_rendering) {
+        logical_device.begin_rendering = (PFN_vkCmdBeginRenderingKHR)vkGetDeviceProcAddr(device, "vkCmdBeginRenderingKHR");
+        logical_device.end_rendering = (PFN_vkCmdEndRenderingKHR)vkGetDeviceProcAddr(device, "vkCmdEndRenderingKHR");
+    }
+    if (draw_indirect_count) {
+        logical_device.draw_indexed_indirect_count =
+            (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+    }
     return logical_device;
 }
 
@@ -539,7 +2927,64 @@ VkSurfaceKHR create_surface(VkInstance instance, GLFWwindow *window) {
     return surface;
 }
 
-Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_device, Logical_Device_Etc logical_device) {
+VkExtent2D get_framebuffer_extent(GLFWwindow *window) {
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+
+    VkExtent2D extent;
+    extent.width = width > 0 ? (uint32_t)width : 0;
+    extent.height = height > 0 ? (uint32_t)height : 0;
+    return extent;
+}
+
+const char *get_present_mode_name(VkPresentModeKHR present_mode) {
+    switch (present_mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+        case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+        default: return "UNKNOWN";
+    }
+}
+
+Present_Mode_Policy choose_present_mode(Latency_Mode latency_mode,
+                                       VkPresentModeKHR *present_modes,
+                                       uint32_t present_mode_count,
+                                       VkSurfaceCapabilitiesKHR surface_capabilities) {
+    Latency_Mode_Info *info = &latency_modes[latency_mode];
+
+    // NOTE: First mode in the chain the surface supports wins
+    Present_Mode_Policy result = {VK_PRESENT_MODE_FIFO_KHR, 0};
+    bool found = false;
+    for (uint32_t policy_i = 0; policy_i < info->policy_count && !found; policy_i++) {
+        for (uint32_t mode_i = 0; mode_i < present_mode_count; mode_i++) {
+            if (present_modes[mode_i] == info->policies[policy_i].present_mode) {
+                result = info->policies[policy_i];
+                found = true;
+                break;
+            }
+        }
+    }
+
+    // NOTE: Clamp the image count to what the surface allows. maxImageCount of 0 means no upper limit.
+    uint32_t image_count = result.image_count;
+    if (image_count < surface_capabilities.minImageCount) {
+        image_count = surface_capabilities.minImageCount;
+    }
+    if (surface_capabilities.maxImageCount > 0 && image_count > surface_capabilities.maxImageCount) {
+        image_count = surface_capabilities.maxImageCount;
+    }
+    result.image_count = image_count;
+
+    return result;
+}
+
+Swapchain_Etc create_swapchain(VkSurfaceKHR surface,
+                               VkPhysicalDevice physical_device,
+                               Logical_Device_Etc logical_device,
+                               VkExtent2D framebuffer_extent,
+                               Latency_Mode latency_mode,
+                               VkSwapchainKHR old_swapchain) {
     /*
       typedef struct VkSurfaceCapabilitiesKHR {
           uint32_t                         minImageCount;
@@ -591,7 +3036,10 @@ Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_d
           VK_PRESENT_MODE_MAX_ENUM_KHR = 0x7FFFFFFF
       } VkPresentModeKHR;
      */
-    VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR; // Always available... so why did we do the previous?
+    Present_Mode_Policy present_mode_policy = choose_present_mode(latency_mode,
+                                                                  present_modes,
+                                                                  present_mode_count,
+                                                                  surface_capabilities);
     free(present_modes);
 
     /*
@@ -602,8 +3050,12 @@ Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_d
     */
     VkExtent2D extent = surface_capabilities.currentExtent;
     if (extent.width == UINT32_MAX) {
-        extent.width = SCREEN_WIDTH;
-        extent.height = SCREEN_HEIGHT;
+        // NOTE: The surface lets us pick (e.g. Wayland), so follow the window's framebuffer size
+        extent = framebuffer_extent;
+        if (extent.width < surface_capabilities.minImageExtent.width) extent.width = surface_capabilities.minImageExtent.width;
+        if (extent.width > surface_capabilities.maxImageExtent.width) extent.width = surface_capabilities.maxImageExtent.width;
+        if (extent.height < surface_capabilities.minImageExtent.height) extent.height = surface_capabilities.minImageExtent.height;
+        if (extent.height > surface_capabilities.maxImageExtent.height) extent.height = surface_capabilities.maxImageExtent.height;
     }
 
     /*
@@ -631,7 +3083,7 @@ Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_d
     VkSwapchainCreateInfoKHR swapchain_create_info = {};
     swapchain_create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
     swapchain_create_info.surface = surface;
-    swapchain_create_info.minImageCount = surface_capabilities.minImageCount;
+    swapchain_create_info.minImageCount = present_mode_policy.image_count;
     swapchain_create_info.imageFormat = surface_format.format;
     swapchain_create_info.imageColorSpace = surface_format.colorSpace;
     swapchain_create_info.imageExtent = extent;
@@ -687,9 +3139,11 @@ Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_d
       } VkCompositeAlphaFlagBitsKHR;
     */
     swapchain_create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    swapchain_create_info.presentMode = present_mode;
+    swapchain_create_info.presentMode = present_mode_policy.present_mode;
     swapchain_create_info.clipped = VK_TRUE;
-    swapchain_create_info.oldSwapchain = VK_NULL_HANDLE;
+    // NOTE: Lets the driver hand over resources from the swapchain being replaced. The old one is retired,
+    //       not destroyed, here: frames still in flight may be rendering into its images.
+    swapchain_create_info.oldSwapchain = old_swapchain;
 
     VkSwapchainKHR swapchain;
     if (vkCreateSwapchainKHR(logical_device.device, &swapchain_create_info, NULL, &swapchain)) {
@@ -704,16 +3158,137 @@ Swapchain_Etc create_swapchain(VkSurfaceKHR surface, VkPhysicalDevice physical_d
     VkImage *swapchain_images = xmalloc(sizeof(VkImage) * swapchain_image_count);
     vkGetSwapchainImagesKHR(logical_device.device, swapchain, &swapchain_image_count, swapchain_images);
 
+    // NOTE: The driver may hand out more images than asked for, so report what we actually got
+    if (old_swapchain == VK_NULL_HANDLE) {
+        trace_log("Latency mode %s: preferred %s, granted %s with %u images (asked for %u)",
+                  latency_modes[latency_mode].name,
+                  get_present_mode_name(latency_modes[latency_mode].policies[0].present_mode),
+                  get_present_mode_name(present_mode_policy.present_mode),
+                  swapchain_image_count,
+                  present_mode_policy.image_count);
+    }
+
     Swapchain_Etc result;
     result.swapchain = swapchain;
     result.swapchain_image_count = swapchain_image_count;
     result.swapchain_images = swapchain_images;
     result.swapchain_extent = extent;
     result.swapchain_image_format = surface_format.format;
+    result.latency_mode = latency_mode;
+    result.present_mode = present_mode_policy.present_mode;
     return result;
 }
 
-VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format) {
+void destroy_swapchain_resources(VkDevice device,
+                                 Swapchain_Etc *swapchain_etc,
+                                 VkImageView *swapchain_image_views,
+                                 VkFramebuffer *swapchain_framebuffers) {
+    // No framebuffers on the dynamic rendering path
+    for (uint32_t i = 0; i < swapchain_etc->swapchain_image_count; i++) {
+        if (swapchain_framebuffers) vkDestroyFramebuffer(device, swapchain_framebuffers[i], NULL);
+        vkDestroyImageView(device, swapchain_image_views[i], NULL);
+    }
+    free(swapchain_framebuffers);
+    free(swapchain_image_views);
+    // Swapchain images are owned by the swapchain, only our array of handles needs freeing
+    free(swapchain_etc->swapchain_images);
+    vkDestroySwapchainKHR(device, swapchain_etc->swapchain, NULL);
+}
+
+double recreate_swapchain(VkSurfaceKHR surface,
+                          VkPhysicalDevice physical_device,
+                          Logical_Device_Etc logical_device,
+                          Device_Allocator *allocator,
+                          VkExtent2D framebuffer_extent,
+                          VkRenderPass render_pass,
+                          Swapchain_Etc *swapchain_etc,
+                          VkImageView **swapchain_image_views,
+                          VkFramebuffer **swapchain_framebuffers,
+                          Transient_Attachments *transient_attachments,
+                          Frame_Ring *ring,
+                          Retired_Swapchains *retired) {
+    double start_time = glfwGetTime();
+
+    Swapchain_Etc new_swapchain_etc = create_swapchain(surface,
+                                                       physical_device,
+                                                       logical_device,
+                                                       framebuffer_extent,
+                                                       swapchain_etc->latency_mode,
+                                                       swapchain_etc->swapchain);
+
+    // NOTE: The render pass and pipeline are reused, so the image format must not change under them
+    if (new_swapchain_etc.swapchain_image_format != swapchain_etc->swapchain_image_format) {
+        exit_with_error("Swapchain image format changed on recreation (%d -> %d)",
+                        swapchain_etc->swapchain_image_format,
+                        new_swapchain_etc.swapchain_image_format);
+    }
+
+    // NOTE: Hand the old swapchain to the retire list instead of waiting for the device to go idle
+    if (retired->count == MAX_RETIRED_SWAPCHAINS) {
+        trace_log("Too many retired swapchains, waiting for frames in flight");
+        for (uint32_t i = 0; i < ring->frame_count; i++) {
+            vkWaitForFences(logical_device.device, 1, &ring->frames[i].sync.in_flight_fence, VK_TRUE, UINT64_MAX);
+        }
+        destroy_retired_swapchains(allocator, retired, ring->frame_number, true);
+    }
+    Retired_Swapchain *entry = &retired->entries[retired->count++];
+    entry->swapchain_etc = *swapchain_etc;
+    entry->image_views = *swapchain_image_views;
+    entry->framebuffers = *swapchain_framebuffers;
+    entry->transient_attachments = *transient_attachments;
+    entry->retire_frame_number = ring->frame_number;
+
+    *swapchain_etc = new_swapchain_etc;
+    *swapchain_image_views = create_image_views(logical_device.device,
+                                                swapchain_etc->swapchain_image_format,
+                                                swapchain_etc->swapchain_images,
+                                                swapchain_etc->swapchain_image_count);
+    *transient_attachments = create_transient_attachments(allocator,
+                                                          swapchain_etc->swapchain_image_format,
+                                                          transient_attachments->depth.format,
+                                                          transient_attachments->depth_sampled,
+                                                          transient_attachments->samples,
+                                                          swapchain_etc->swapchain_extent);
+    *swapchain_framebuffers = NULL;
+    if (render_pass != VK_NULL_HANDLE) {
+        *swapchain_framebuffers = create_framebuffers(logical_device.device,
+                                                      render_pass,
+                                                      swapchain_etc->swapchain_extent,
+                                                      *swapchain_image_views,
+                                                      transient_attachments,
+                                                      swapchain_etc->swapchain_image_count);
+    }
+
+    reset_images_in_flight(ring, swapchain_etc->swapchain_image_count);
+
+    double ms = 1000.0 * (glfwGetTime() - start_time);
+    trace_log("Recreated swapchain: %ux%u, %u images in %.3f ms",
+              swapchain_etc->swapchain_extent.width,
+              swapchain_etc->swapchain_extent.height,
+              swapchain_etc->swapchain_image_count,
+              ms);
+    return ms;
+}
+
+void destroy_retired_swapchains(Device_Allocator *allocator, Retired_Swapchains *retired, uint64_t completed_frame_number, bool force) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < retired->count; i++) {
+        Retired_Swapchain *entry = &retired->entries[i];
+        if (force || entry->retire_frame_number <= completed_frame_number) {
+            destroy_swapchain_resources(allocator->device, &entry->swapchain_etc, entry->image_views, entry->framebuffers);
+            destroy_transient_attachments(allocator, &entry->transient_attachments);
+        } else {
+            retired->entries[kept++] = *entry;
+        }
+    }
+    retired->count = kept;
+}
+
+VkRenderPass create_render_pass(VkDevice device,
+                                VkFormat swapchain_image_format,
+                                VkFormat depth_format,
+                                VkSampleCountFlagBits samples,
+                                bool store_depth) {
     /*
       typedef struct VkAttachmentDescription {
            VkAttachmentDescriptionFlags    flags;
@@ -742,7 +3317,7 @@ VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format
       } VkSampleCountFlagBits;
       typedef VkFlags VkSampleCountFlags;
     */
-    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT; // No multisampling
+    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT; // The swapchain image, multisampled rendering resolves into it
     /*
       typedef enum VkAttachmentLoadOp {
           VK_ATTACHMENT_LOAD_OP_LOAD = 0,
@@ -786,6 +3361,15 @@ VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format
     color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // Layout before rendering
     color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; // Layout for presentation
 
+    // NOTE: --msaa: the subpass renders into a multisampled image and resolves it into the swapchain image as
+    //       it ends. Only the resolved image is stored; on a tiler the samples never leave tile memory.
+    bool has_msaa = samples != VK_SAMPLE_COUNT_1_BIT;
+    VkAttachmentDescription msaa_attachment = color_attachment;
+    msaa_attachment.samples = samples;
+    msaa_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    msaa_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    if (has_msaa) color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; // The resolve overwrites every pixel
+
     /*
       typedef struct VkAttachmentReference {
           uint32_t         attachment;
@@ -796,6 +3380,33 @@ VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format
     color_attachment_ref.attachment = 0; // Index in the attachment array (in subpass)
     color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
+    // NOTE: --depth: cleared on load and thrown away at the end, unless --hiz builds its pyramid from it
+    VkAttachmentDescription depth_attachment = {0};
+    depth_attachment.format = depth_format;
+    depth_attachment.samples = samples;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = store_depth ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    bool has_depth = depth_format != VK_FORMAT_UNDEFINED;
+
+    VkAttachmentReference depth_attachment_ref = {0};
+    depth_attachment_ref.attachment = 1;
+    depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    // Attachments in the order create_framebuffers lists the views: swapchain image, depth, multisampled color
+    VkAttachmentDescription attachments[3];
+    uint32_t attachment_count = 0;
+    attachments[attachment_count++] = color_attachment;
+    if (has_depth) attachments[attachment_count++] = depth_attachment;
+    VkAttachmentReference resolve_attachment_ref = color_attachment_ref;
+    if (has_msaa) {
+        color_attachment_ref.attachment = attachment_count;
+        attachments[attachment_count++] = msaa_attachment;
+    }
+
     /*
       typedef struct VkSubpassDescription {
           VkSubpassDescriptionFlags       flags;
@@ -827,6 +3438,8 @@ VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format
     subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
     subpass.colorAttachmentCount = 1;
     subpass.pColorAttachments = &color_attachment_ref;
+    if (has_msaa) subpass.pResolveAttachments = &resolve_attachment_ref;
+    if (has_depth) subpass.pDepthStencilAttachment = &depth_attachment_ref;
 
     /*
       typedef struct VkSubpassDependency {
@@ -925,6 +3538,17 @@ VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format
       typedef VkFlags VkAccessFlags;
     */
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    if (has_depth) {
+        // The depth image is shared between frames: this frame's clear waits for the last frame's depth tests.
+        // Early and late on both sides, depth can be written and the clear can happen in either.
+        VkPipelineStageFlags depth_stages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependency.srcStageMask |= depth_stages;
+        dependency.srcAccessMask |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependency.dstStageMask |= depth_stages;
+        dependency.dstAccessMask |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    }
+    // The multisampled image is shared too, so the same for the last frame's color writes to it
+    if (has_msaa) dependency.srcAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
     /*
       typedef struct VkRenderPassCreateInfo {
@@ -941,8 +3565,8 @@ VkRenderPass create_render_pass(VkDevice device, VkFormat swapchain_image_format
     */
     VkRenderPassCreateInfo render_pass_info = {0};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = 1;
-    render_pass_info.pAttachments = &color_attachment;
+    render_pass_info.attachmentCount = attachment_count;
+    render_pass_info.pAttachments = attachments;
     render_pass_info.subpassCount = 1;
     render_pass_info.pSubpasses = &subpass;
     render_pass_info.dependencyCount = 1;
@@ -1055,6 +3679,7 @@ VkFramebuffer *create_framebuffers(VkDevice device,
                                    VkRenderPass render_pass,
                                    VkExtent2D swapchain_extent,
                                    VkImageView *swapchain_image_views,
+                                   const Transient_Attachments *transient_attachments,
                                    uint32_t image_count) {
     /*
       VkFramebuffer is an opaque pointer: VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkFramebuffer)
@@ -1078,8 +3703,14 @@ VkFramebuffer *create_framebuffers(VkDevice device,
         VkFramebufferCreateInfo framebuffer_info = {};
         framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
         framebuffer_info.renderPass = render_pass;
-        framebuffer_info.attachmentCount = 1;
-        framebuffer_info.pAttachments = &swapchain_image_views[i];
+        // The same transient views in every framebuffer, in create_render_pass's order
+        VkImageView attachments[3];
+        uint32_t attachment_count = 0;
+        attachments[attachment_count++] = swapchain_image_views[i];
+        if (transient_attachments->depth.view != VK_NULL_HANDLE) attachments[attachment_count++] = transient_attachments->depth.view;
+        if (transient_attachments->color.view != VK_NULL_HANDLE) attachments[attachment_count++] = transient_attachments->color.view;
+        framebuffer_info.attachmentCount = attachment_count;
+        framebuffer_info.pAttachments = attachments;
         framebuffer_info.width = swapchain_extent.width;
         framebuffer_info.height = swapchain_extent.height;
         framebuffer_info.layers = 1;
@@ -1092,18 +3723,338 @@ VkFramebuffer *create_framebuffers(VkDevice device,
     return swapchain_framebuffers;
 }
 
-VkShaderModule create_shader_module(VkDevice device, const char *file_name) {
-    FILE *file = fopen(file_name, "rb");
-    if (!file) exit_with_error("Failed to open SPIR-V file: %s", file_name);
+VkFormat choose_depth_format(VkPhysicalDevice physical_device, bool sampled) {
+    // NOTE: Depth only, best precision first. Depth steps between draws get small with many of them (see
+    //       Scene.depth_step), which 16 bits can't tell apart. D16_UNORM is the one the spec guarantees.
+    //       sampled: --hiz reads it in a shader too.
+    VkFormatFeatureFlags required = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    if (sampled) required |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+    static const VkFormat candidates[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_X8_D24_UNORM_PACK32,
+        VK_FORMAT_D16_UNORM,
+    };
+    for (uint32_t i = 0; i < array_count(candidates); i++) {
+        /*
+          typedef struct VkFormatProperties {
+              VkFormatFeatureFlags    linearTilingFeatures;
+              VkFormatFeatureFlags    optimalTilingFeatures;
+              VkFormatFeatureFlags    bufferFeatures;
+          } VkFormatProperties;
+        */
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(physical_device, candidates[i], &properties);
+        if ((properties.optimalTilingFeatures & required) == required) {
+            return candidates[i];
+        }
+    }
+    exit_with_error("Failed to find a depth format");
+    return VK_FORMAT_UNDEFINED;
+}
+
+VkSampleCountFlagBits choose_sample_count(VkPhysicalDevice physical_device, uint32_t requested_samples, bool depth) {
+    // NOTE: The most samples up to the requested count that color attachments, and depth ones with --depth,
+    //       support. Every device has 1 and 4.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts;
+    if (depth) supported &= properties.limits.framebufferDepthSampleCounts;
+
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+    for (uint32_t count = requested_samples; count > 1; count /= 2) {
+        if (supported & count) {
+            samples = (VkSampleCountFlagBits)count;
+            break;
+        }
+    }
+    if ((uint32_t)samples != requested_samples) {
+        trace_log("WARNING: %ux MSAA not supported, using %ux", requested_samples, (uint32_t)samples);
+    }
+    return samples;
+}
+
+Transient_Attachment create_transient_attachment(Device_Allocator *allocator,
+                                                 VkFormat format,
+                                                 VkExtent2D extent,
+                                                 VkSampleCountFlagBits samples,
+                                                 VkImageUsageFlags usage,
+                                                 VkImageAspectFlags aspect) {
+    Transient_Attachment attachment = {0};
+    attachment.format = format;
+
+    /*
+      typedef struct VkImageCreateInfo {
+          VkStructureType          sType;
+          const void*              pNext;
+          VkImageCreateFlags       flags;
+          VkImageType              imageType;
+          VkFormat                 format;
+          VkExtent3D               extent;
+          uint32_t                 mipLevels;
+          uint32_t                 arrayLayers;
+          VkSampleCountFlagBits    samples;
+          VkImageTiling            tiling;
+          VkImageUsageFlags        usage;
+          VkSharingMode            sharingMode;
+          uint32_t                 queueFamilyIndexCount;
+          const uint32_t*          pQueueFamilyIndices;
+          VkImageLayout            initialLayout;
+      } VkImageCreateInfo;
+    */
+    VkImageCreateInfo image_info = {0};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = format;
+    image_info.extent = (VkExtent3D){extent.width, extent.height, 1};
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = samples;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    // Sampled after the render pass (--hiz) it has to be stored, so it can't be transient
+    bool transient = !(usage & VK_IMAGE_USAGE_SAMPLED_BIT);
+    image_info.usage = transient ? usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : usage;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attachment.image = create_image(allocator,
+                                    &image_info,
+                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                    transient ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0);
+
+    VkImageViewCreateInfo view_info = {0};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = attachment.image.image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = format;
+    view_info.subresourceRange.aspectMask = aspect;
+    view_info.subresourceRange.levelCount = 1;
+    view_info.subresourceRange.layerCount = 1;
+    if (vkCreateImageView(allocator->device, &view_info, NULL, &attachment.view) != VK_SUCCESS) {
+        exit_with_error("Failed to create transient attachment view");
+    }
+    return attachment;
+}
+
+void destroy_transient_attachment(Device_Allocator *allocator, Transient_Attachment *attachment) {
+    if (attachment->view == VK_NULL_HANDLE) return;
+    vkDestroyImageView(allocator->device, attachment->view, NULL);
+    destroy_image(allocator, &attachment->image);
+    attachment->view = VK_NULL_HANDLE;
+}
+
+Transient_Attachments create_transient_attachments(Device_Allocator *allocator,
+                                                   VkFormat color_format,
+                                                   VkFormat depth_format,
+                                                   bool depth_sampled,
+                                                   VkSampleCountFlagBits samples,
+                                                   VkExtent2D extent) {
+    Transient_Attachments attachments = {0};
+    attachments.samples = samples;
+    attachments.depth_sampled = depth_sampled;
+    if (samples != VK_SAMPLE_COUNT_1_BIT) {
+        attachments.color = create_transient_attachment(allocator,
+                                                        color_format,
+                                                        extent,
+                                                        samples,
+                                                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                                                        VK_IMAGE_ASPECT_COLOR_BIT);
+    }
+    if (depth_format != VK_FORMAT_UNDEFINED) {
+        attachments.depth = create_transient_attachment(allocator,
+                                                        depth_format,
+                                                        extent,
+                                                        samples,
+                                                        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                                        (depth_sampled ? VK_IMAGE_USAGE_SAMPLED_BIT : 0),
+                                                        VK_IMAGE_ASPECT_DEPTH_BIT);
+    }
+
+    // NOTE: What the images reserve. Lazily allocated memory is only committed for what a tiler spills out
+    //       of tile memory, which with these never being stored should be nothing.
+    if (attachments.color.view != VK_NULL_HANDLE || attachments.depth.view != VK_NULL_HANDLE) {
+        const Transient_Attachment *any = attachments.color.view != VK_NULL_HANDLE ? &attachments.color : &attachments.depth;
+        double mib = 1024.0 * 1024.0;
+        trace_log("Transient attachments: %ux%u at %ux, %.2f MiB color, %.2f MiB depth (format %d), %s memory",
+                  extent.width,
+                  extent.height,
+                  (uint32_t)samples,
+                  (double)attachments.color.image.allocation.requested_size / mib,
+                  (double)attachments.depth.image.allocation.requested_size / mib,
+                  depth_format,
+                  (any->image.memory_properties & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) ? "lazily allocated" : "device local");
+    }
+    return attachments;
+}
+
+void destroy_transient_attachments(Device_Allocator *allocator, Transient_Attachments *transient_attachments) {
+    destroy_transient_attachment(allocator, &transient_attachments->color);
+    destroy_transient_attachment(allocator, &transient_attachments->depth);
+}
+
+Render_Target *create_render_targets(const Swapchain_Etc *swapchain_etc,
+                                     VkImageView *swapchain_image_views,
+                                     VkFramebuffer *swapchain_framebuffers,
+                                     const Transient_Attachments *transient_attachments,
+                                     VkRenderPass render_pass,
+                                     const Logical_Device_Etc *logical_device) {
+    // NOTE: Plain handles, nothing is created here, so rebuilding these on a resize costs nothing
+    Render_Target *targets = xmalloc(sizeof(Render_Target) * swapchain_etc->swapchain_image_count);
+    for (uint32_t i = 0; i < swapchain_etc->swapchain_image_count; i++) {
+        Render_Target *target = &targets[i];
+        memset(target, 0, sizeof(Render_Target));
+        target->render_pass = render_pass;
+        target->framebuffer = render_pass != VK_NULL_HANDLE ? swapchain_framebuffers[i] : VK_NULL_HANDLE;
+        target->image = swapchain_etc->swapchain_images[i];
+        target->image_view = swapchain_image_views[i];
+        target->format = swapchain_etc->swapchain_image_format;
+        target->extent = swapchain_etc->swapchain_extent;
+        target->depth_image = transient_attachments->depth.image.image;
+        target->depth_view = transient_attachments->depth.view;
+        target->depth_format = transient_attachments->depth.format;
+        target->store_depth = transient_attachments->depth_sampled;
+        target->msaa_image = transient_attachments->color.image.image;
+        target->msaa_view = transient_attachments->color.view;
+        target->samples = transient_attachments->samples;
+        target->begin_rendering = logical_device->begin_rendering;
+        target->end_rendering = logical_device->end_rendering;
+    }
+    return targets;
+}
+
+void transition_attachment_image(VkCommandBuffer command_buffer,
+                                 VkImage image,
+                                 VkImageAspectFlags aspect,
+                                 VkImageLayout old_layout,
+                                 VkImageLayout new_layout,
+                                 VkPipelineStageFlags src_stage,
+                                 VkAccessFlags src_access,
+                                 VkPipelineStageFlags dst_stage,
+                                 VkAccessFlags dst_access) {
+    /*
+      typedef struct VkImageMemoryBarrier {
+          VkStructureType            sType;
+          const void*                pNext;
+          VkAccessFlags              srcAccessMask;
+          VkAccessFlags              dstAccessMask;
+          VkImageLayout              oldLayout;
+          VkImageLayout              newLayout;
+          uint32_t                   srcQueueFamilyIndex;
+          uint32_t                   dstQueueFamilyIndex;
+          VkImage                    image;
+          VkImageSubresourceRange    subresourceRange;
+      } VkImageMemoryBarrier;
+    */
+    VkImageMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(command_buffer, src_stage, dst_stage, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+void init_shader_binary_directory(void) {
+    char executable[256];
+    ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    if (length > 0) executable[length] = '\0';
+    char *slash = length > 0 ? strrchr(executable, '/') : NULL;
+    if (!slash) {
+        trace_log("WARNING: Can't tell where the executable is, mapping shaders from %s", shader_binary_directory);
+        return;
+    }
+    *slash = '\0';
+    snprintf(shader_binary_directory, sizeof(shader_binary_directory), "%s/%s", executable, SHADER_BINARY_DIRECTORY);
+}
+
+void log_shader_loading(bool from_disk) {
+    // NOTE: Every shader loaded once: the part of startup that differs between embedded and mapped SPIR-V,
+    //       see bench-shader-loading
+    #define SHADER_BINARY_NAME(symbol, file_name) file_name,
+    static const char *names[] = {SHADER_BINARIES(SHADER_BINARY_NAME)};
+    #undef SHADER_BINARY_NAME
+    double start = glfwGetTime();
+    size_t total_size = 0;
+    for (uint32_t i = 0; i < array_count(names); i++) {
+        Shader_Code shader_code = load_shader_code(names[i], from_disk);
+        total_size += shader_code.size;
+        release_shader_code(&shader_code);
+    }
+    trace_log("Shader loading: %u shaders, %.1f KiB in %.3f ms, %s%s",
+              (uint32_t)array_count(names),
+              (double)total_size / 1024.0,
+              1000.0 * (glfwGetTime() - start),
+              from_disk ? "mapped from " : "embedded",
+              from_disk ? shader_binary_directory : "");
+}
+
+const uint32_t *find_embedded_shader(const char *name, size_t *size) {
+#ifdef EMBED_SHADERS
+    for (uint32_t i = 0; i < array_count(embedded_shaders); i++) {
+        if (strcmp(embedded_shaders[i].name, name) == 0) {
+            *size = (size_t)(embedded_shaders[i].end - (const uint8_t *)embedded_shaders[i].start);
+            return embedded_shaders[i].start;
+        }
+    }
+#else
+    (void)name;
+#endif
+    *size = 0;
+    return NULL;
+}
+
+Shader_Code load_shader_code(const char *name, bool from_disk) {
+    // NOTE: Embedded SPIR-V is used in place. Files are mapped rather than read, so there's no heap copy either way.
+    //       A file that can't be read gives code == NULL after a warning instead of exiting: the shader watcher
+    //       thread can catch one halfway through being written, and only has to refuse that reload.
+    Shader_Code shader_code = {0};
+    shader_code.code = from_disk ? NULL : find_embedded_shader(name, &shader_code.size);
+    if (shader_code.code) return shader_code;
+    shader_code.size = 0;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", shader_binary_directory, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        trace_log("WARNING: Failed to open SPIR-V file: %s", path);
+        return shader_code;
+    }
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0) {
+        trace_log("WARNING: Failed to stat SPIR-V file: %s", path);
+        close(fd);
+        return shader_code;
+    }
+    size_t size = (size_t)file_info.st_size;
+    if (size == 0 || size % sizeof(uint32_t) != 0) {
+        trace_log("WARNING: Not a SPIR-V file (%zu bytes): %s", size, path);
+        close(fd);
+        return shader_code;
+    }
 
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        trace_log("WARNING: Failed to map SPIR-V file: %s", path);
+        return shader_code;
+    }
+    shader_code.mapping = mapping;
+    shader_code.size = size;
+    shader_code.code = mapping;
+    return shader_code;
+}
 
-    uint32_t *code = malloc(file_size);
-    fread(code, file_size, 1, file);
-    fclose(file);
+void release_shader_code(Shader_Code *shader_code) {
+    if (shader_code->mapping) munmap(shader_code->mapping, shader_code->size);
+    memset(shader_code, 0, sizeof(Shader_Code));
+}
 
+VkShaderModule create_shader_module(VkDevice device, const Shader_Code *shader_code, const char *name) {
     /*
       typedef struct VkShaderModuleCreateInfo {
           VkStructureType              sType;
@@ -1113,77 +4064,759 @@ VkShaderModule create_shader_module(VkDevice device, const char *file_name) {
           const uint32_t*              pCode;
       } VkShaderModuleCreateInfo;
     */
+    // Only reached with SPIR-V that reflected fine, except at startup where a missing file is fatal
+    if (!shader_code->code) exit_with_error("No SPIR-V for %s, see above", name);
+
     VkShaderModuleCreateInfo shader_module_info = {0};
     shader_module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    shader_module_info.codeSize = file_size;
-    shader_module_info.pCode = code;
+    shader_module_info.codeSize = shader_code->size;
+    shader_module_info.pCode = shader_code->code;
 
     /*
       VkShaderModule is an opaque pointer: VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkShaderModule)
     */
     VkShaderModule shader_module;
     if (vkCreateShaderModule(device, &shader_module_info, NULL, &shader_module) != VK_SUCCESS) {
-        exit_with_error("Failed to create shader module for file: %s", file_name);
+        exit_with_error("Failed to create shader module for %s", name);
     }
 
-    free(code);
     return shader_module;
 }
 
-VkPipelineLayout create_pipeline_layout(VkDevice device) {
-    // For now: empty layout as our shaders don't use external resources (no descriptor sets, no push consants)
+void spirv_error(Spirv_Module *module, const char *msg, ...) {
+    // NOTE: Logged rather than fatal, a hot reload can hand us anything. Only the first error is reported,
+    //       the ones after it tend to be follow-ups.
+    if (module->failed) return;
+    module->failed = true;
+    char message[512];
+    va_list ap;
+    va_start(ap, msg);
+    vsnprintf(message, sizeof(message), msg, ap);
+    va_end(ap);
+    trace_log("WARNING: %s: %s", module->name, message);
+}
 
-    /*
-      typedef struct VkPipelineLayoutCreateInfo {
-          VkStructureType                 sType;
-          const void*                     pNext;
-          VkPipelineLayoutCreateFlags     flags;
-          uint32_t                        setLayoutCount;
-          const VkDescriptorSetLayout*    pSetLayouts;
-          uint32_t                        pushConstantRangeCount;
-          const VkPushConstantRange*      pPushConstantRanges;
-      } VkPipelineLayoutCreateInfo;
-    */
-    VkPipelineLayoutCreateInfo layout_info = {0};
-    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    layout_info.setLayoutCount = 0;
-    layout_info.pSetLayouts = NULL;
-    layout_info.pushConstantRangeCount = 0;
-    layout_info.pPushConstantRanges = NULL;
+Spirv_Id *get_spirv_id(Spirv_Module *module, uint32_t id) {
+    if (id == 0 || id >= module->id_bound) {
+        spirv_error(module, "SPIR-V id %u out of bounds", id);
+        return &module->ids[0]; // Never defined, so it reads as nothing in particular
+    }
+    return &module->ids[id];
+}
 
-    VkPipelineLayout pipeline_layout;
-    if (vkCreatePipelineLayout(device, &layout_info, NULL, &pipeline_layout) != VK_SUCCESS) {
-        exit_with_error("Failed to create pipeline layout");
+uint32_t get_spirv_type_size(Spirv_Module *module, uint32_t type_id, uint32_t matrix_stride) {
+    // NOTE: Size of a type in a block, from the offsets and strides the compiler decorated it with. Runtime
+    //       arrays count as 0, they take whatever the buffer has left.
+    if (module->failed) return 0;
+    Spirv_Id *type = get_spirv_id(module, type_id);
+    switch (type->opcode) {
+    case SPIRV_OP_TYPE_BOOL: return 4;
+    case SPIRV_OP_TYPE_INT:
+    case SPIRV_OP_TYPE_FLOAT: return type->count / 8;
+    case SPIRV_OP_TYPE_VECTOR: return type->count * get_spirv_type_size(module, type->type_id, 0);
+    case SPIRV_OP_TYPE_MATRIX: {
+        uint32_t column_size = matrix_stride ? matrix_stride : get_spirv_type_size(module, type->type_id, 0);
+        return type->count * column_size;
+    }
+    case SPIRV_OP_TYPE_ARRAY: {
+        uint32_t length = get_spirv_id(module, type->count)->value;
+        uint32_t stride = type->array_stride != SPIRV_NOT_DECORATED ? type->array_stride
+                                                                    : get_spirv_type_size(module, type->type_id, matrix_stride);
+        return length * stride;
+    }
+    case SPIRV_OP_TYPE_RUNTIME_ARRAY: return 0;
+    case SPIRV_OP_TYPE_STRUCT: {
+        uint32_t size = 0;
+        for (uint32_t m = 0; m < type->member_count; m++) {
+            Spirv_Member *member = &module->members[type->first_member + m];
+            uint32_t end = member->offset + get_spirv_type_size(module, member->type_id, member->matrix_stride);
+            if (end > size) size = end;
+        }
+        return size;
+    }
+    default: spirv_error(module, "SPIR-V type %u has no size", type_id);
     }
+    return 0;
+}
 
-    return pipeline_layout;
+uint32_t add_shader_interface_variables(Spirv_Module *module,
+                                        uint32_t type_id,
+                                        uint32_t location,
+                                        Shader_Interface_Variable *variables,
+                                        uint32_t *variable_count) {
+    // NOTE: Splits an input or output into the locations it takes: a vector or scalar takes one, matrices one
+    //       per column, arrays and structs one per element. Returns the number of locations.
+    if (module->failed) return 0;
+    Spirv_Id *type = get_spirv_id(module, type_id);
+    switch (type->opcode) {
+    case SPIRV_OP_TYPE_ARRAY: {
+        uint32_t length = get_spirv_id(module, type->count)->value;
+        uint32_t taken = 0;
+        for (uint32_t i = 0; i < length; i++) {
+            taken += add_shader_interface_variables(module, type->type_id, location + taken, variables, variable_count);
+        }
+        return taken;
+    }
+    case SPIRV_OP_TYPE_MATRIX: {
+        for (uint32_t column = 0; column < type->count; column++) {
+            add_shader_interface_variables(module, type->type_id, location + column, variables, variable_count);
+        }
+        return type->count;
+    }
+    case SPIRV_OP_TYPE_STRUCT: {
+        uint32_t taken = 0;
+        for (uint32_t m = 0; m < type->member_count; m++) {
+            uint32_t member_type_id = module->members[type->first_member + m].type_id;
+            taken += add_shader_interface_variables(module, member_type_id, location + taken, variables, variable_count);
+        }
+        return taken;
+    }
+    case SPIRV_OP_TYPE_VECTOR:
+    case SPIRV_OP_TYPE_INT:
+    case SPIRV_OP_TYPE_FLOAT: {
+        Spirv_Id *scalar = type->opcode == SPIRV_OP_TYPE_VECTOR ? get_spirv_id(module, type->type_id) : type;
+        if (*variable_count == MAX_SHADER_INTERFACE_VARIABLES) {
+            spirv_error(module, "More than %d interface locations", MAX_SHADER_INTERFACE_VARIABLES);
+            return 1;
+        }
+        Shader_Interface_Variable *variable = &variables[(*variable_count)++];
+        variable->location = location;
+        variable->component_count = type->opcode == SPIRV_OP_TYPE_VECTOR ? type->count : 1;
+        if (scalar->opcode == SPIRV_OP_TYPE_FLOAT) {
+            variable->numeric_type = SHADER_NUMERIC_FLOAT;
+        } else {
+            variable->numeric_type = scalar->value ? SHADER_NUMERIC_SINT : SHADER_NUMERIC_UINT;
+        }
+        return 1;
+    }
+    default: spirv_error(module, "Unsupported type %u on location %u", type_id, location);
+    }
+    return 0;
 }
 
+uint32_t get_spirv_min_length(uint32_t opcode, const uint32_t *operands, uint32_t length) {
+    // NOTE: Words, the opcode word included, up to the last operand reflect_spirv reads of the instruction;
+    //       0 for instructions it skips. Decorations only have a literal after them for some kinds.
+    switch (opcode) {
+    case SPIRV_OP_TYPE_BOOL:
+    case SPIRV_OP_TYPE_SAMPLER:
+    case SPIRV_OP_TYPE_STRUCT: return 2;
+    case SPIRV_OP_TYPE_FLOAT:
+    case SPIRV_OP_TYPE_SAMPLED_IMAGE:
+    case SPIRV_OP_TYPE_RUNTIME_ARRAY: return 3;
+    case SPIRV_OP_ENTRY_POINT: // Execution model, entry point id and at least one word of name
+    case SPIRV_OP_TYPE_INT:
+    case SPIRV_OP_TYPE_VECTOR:
+    case SPIRV_OP_TYPE_MATRIX:
+    case SPIRV_OP_TYPE_ARRAY:
+    case SPIRV_OP_TYPE_POINTER:
+    case SPIRV_OP_CONSTANT:
+    case SPIRV_OP_VARIABLE: return 4;
+    case SPIRV_OP_TYPE_IMAGE: return 9;
+    case SPIRV_OP_DECORATE: {
+        if (length < 3) return 3;
+        switch (operands[1]) {
+        case SPIRV_DECORATION_ARRAY_STRIDE:
+        case SPIRV_DECORATION_LOCATION:
+        case SPIRV_DECORATION_BINDING:
+        case SPIRV_DECORATION_DESCRIPTOR_SET: return 4;
+        }
+        return 3;
+    }
+    case SPIRV_OP_MEMBER_DECORATE: {
+        if (length < 4) return 4;
+        switch (operands[2]) {
+        case SPIRV_DECORATION_OFFSET:
+        case SPIRV_DECORATION_MATRIX_STRIDE: return 5;
+        }
+        return 4;
+    }
+    }
+    return 0;
+}
 
-VkVertexInputBindingDescription get_binding_description() {
-    /*
-      typedef struct VkVertexInputBindingDescription {
+bool reflect_spirv(const uint32_t *code, size_t size, const char *name, Shader_Reflection *reflection) {
+    // NOTE: Returns false on SPIR-V it can't make sense of, after logging why. At startup that's fatal to the
+    //       caller; on the shader watcher thread it only means the reload is refused.
+    memset(reflection, 0, sizeof(Shader_Reflection));
+    size_t word_count = size / sizeof(uint32_t);
+    if (word_count < SPIRV_HEADER_WORD_COUNT || code[0] != SPIRV_MAGIC || code[3] == 0) {
+        trace_log("%s: Not a SPIR-V module", name);
+        return false;
+    }
+
+    Spirv_Module module = {0};
+    module.name = name;
+    module.id_bound = code[3];
+    module.ids = xmalloc(sizeof(Spirv_Id) * module.id_bound);
+    memset(module.ids, 0, sizeof(Spirv_Id) * module.id_bound);
+    for (uint32_t id = 0; id < module.id_bound; id++) {
+        module.ids[id].location = SPIRV_NOT_DECORATED;
+        module.ids[id].binding = SPIRV_NOT_DECORATED;
+        module.ids[id].set = SPIRV_NOT_DECORATED;
+        module.ids[id].array_stride = SPIRV_NOT_DECORATED;
+    }
+    // Every struct member takes at least one word, so this is always enough
+    module.members = xmalloc(sizeof(Spirv_Member) * word_count);
+    memset(module.members, 0, sizeof(Spirv_Member) * word_count);
+
+    // Decorations come before the types they decorate, so the definitions go first and the decorations second
+    for (uint32_t pass = 0; pass < 2 && !module.failed; pass++) {
+        for (size_t i = SPIRV_HEADER_WORD_COUNT; i < word_count && !module.failed;) {
+            uint32_t opcode = code[i] & 0xFFFF;
+            uint32_t length = code[i] >> 16;
+            if (length == 0 || i + length > word_count) {
+                spirv_error(&module, "Truncated SPIR-V instruction");
+                break;
+            }
+            const uint32_t *operands = &code[i + 1];
+            i += length;
+            // Operands are read at fixed positions below, a shorter instruction would read past it
+            if (length < get_spirv_min_length(opcode, operands, length)) {
+                spirv_error(&module, "Opcode %u takes at least %u words, the instruction has %u",
+                            opcode,
+                            get_spirv_min_length(opcode, operands, length),
+                            length);
+                break;
+            }
+
+            if (pass == 0) {
+                switch (opcode) {
+                case SPIRV_OP_ENTRY_POINT:
+                    if (reflection->stage) break; // The first entry point is the one the pipeline uses ("main")
+                    switch (operands[0]) {
+                    case SPIRV_EXECUTION_MODEL_VERTEX: reflection->stage = VK_SHADER_STAGE_VERTEX_BIT; break;
+                    case SPIRV_EXECUTION_MODEL_FRAGMENT: reflection->stage = VK_SHADER_STAGE_FRAGMENT_BIT; break;
+                    case SPIRV_EXECUTION_MODEL_GL_COMPUTE: reflection->stage = VK_SHADER_STAGE_COMPUTE_BIT; break;
+                    default: spirv_error(&module, "Unsupported execution model %u", operands[0]);
+                    }
+                    break;
+                case SPIRV_OP_TYPE_BOOL:
+                case SPIRV_OP_TYPE_SAMPLER: get_spirv_id(&module, operands[0])->opcode = opcode; break;
+                case SPIRV_OP_TYPE_INT: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->count = operands[1];
+                    type->value = operands[2];
+                } break;
+                case SPIRV_OP_TYPE_FLOAT: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->count = operands[1];
+                } break;
+                case SPIRV_OP_TYPE_VECTOR:
+                case SPIRV_OP_TYPE_MATRIX:
+                case SPIRV_OP_TYPE_ARRAY: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->type_id = operands[1];
+                    type->count = operands[2];
+                } break;
+                case SPIRV_OP_TYPE_SAMPLED_IMAGE:
+                case SPIRV_OP_TYPE_RUNTIME_ARRAY: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->type_id = operands[1];
+                } break;
+                case SPIRV_OP_TYPE_IMAGE: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->type_id = operands[1];
+                    type->image_dim = operands[2];
+                    type->image_sampled = operands[6];
+                } break;
+                case SPIRV_OP_TYPE_STRUCT: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->first_member = module.member_count;
+                    type->member_count = length - 2;
+                    for (uint32_t m = 0; m < type->member_count; m++) {
+                        module.members[module.member_count++].type_id = operands[1 + m];
+                    }
+                } break;
+                case SPIRV_OP_TYPE_POINTER: {
+                    Spirv_Id *type = get_spirv_id(&module, operands[0]);
+                    type->opcode = opcode;
+                    type->storage_class = operands[1];
+                    type->type_id = operands[2];
+                } break;
+                case SPIRV_OP_CONSTANT: {
+                    Spirv_Id *constant = get_spirv_id(&module, operands[1]);
+                    constant->opcode = opcode;
+                    constant->type_id = operands[0];
+                    constant->value = operands[2];
+                } break;
+                case SPIRV_OP_VARIABLE: {
+                    Spirv_Id *variable = get_spirv_id(&module, operands[1]);
+                    variable->opcode = opcode;
+                    variable->type_id = operands[0];
+                    variable->storage_class = operands[2];
+                } break;
+                }
+            } else if (opcode == SPIRV_OP_DECORATE) {
+                Spirv_Id *target = get_spirv_id(&module, operands[0]);
+                switch (operands[1]) {
+                case SPIRV_DECORATION_BUFFER_BLOCK: target->buffer_block = true; break;
+                case SPIRV_DECORATION_ARRAY_STRIDE: target->array_stride = operands[2]; break;
+                case SPIRV_DECORATION_BUILT_IN: target->builtin = true; break;
+                case SPIRV_DECORATION_LOCATION: target->location = operands[2]; break;
+                case SPIRV_DECORATION_BINDING: target->binding = operands[2]; break;
+                case SPIRV_DECORATION_DESCRIPTOR_SET: target->set = operands[2]; break;
+                }
+            } else if (opcode == SPIRV_OP_MEMBER_DECORATE) {
+                Spirv_Id *target = get_spirv_id(&module, operands[0]);
+                if (target->opcode != SPIRV_OP_TYPE_STRUCT || operands[1] >= target->member_count) {
+                    spirv_error(&module, "Member decoration on something that isn't a struct member");
+                    continue;
+                }
+                Spirv_Member *member = &module.members[target->first_member + operands[1]];
+                switch (operands[2]) {
+                case SPIRV_DECORATION_BUILT_IN: target->builtin = true; break; // gl_PerVertex
+                case SPIRV_DECORATION_OFFSET: member->offset = operands[3]; break;
+                case SPIRV_DECORATION_MATRIX_STRIDE: member->matrix_stride = operands[3]; break;
+                }
+            }
+        }
+    }
+    if (!module.failed && !reflection->stage) spirv_error(&module, "No entry point");
+
+    for (uint32_t id = 1; id < module.id_bound && !module.failed; id++) {
+        Spirv_Id *variable = &module.ids[id];
+        if (variable->opcode != SPIRV_OP_VARIABLE) continue;
+        uint32_t type_id = get_spirv_id(&module, variable->type_id)->type_id;
+        Spirv_Id *type = get_spirv_id(&module, type_id);
+
+        switch (variable->storage_class) {
+        case SPIRV_STORAGE_CLASS_INPUT:
+        case SPIRV_STORAGE_CLASS_OUTPUT: {
+            if (variable->builtin || type->builtin) break; // gl_VertexIndex, gl_Position and the like
+            if (variable->location == SPIRV_NOT_DECORATED) {
+                spirv_error(&module, "Interface variable %u has no location", id);
+                continue;
+            }
+            if (variable->storage_class == SPIRV_STORAGE_CLASS_INPUT) {
+                add_shader_interface_variables(&module, type_id, variable->location, reflection->inputs, &reflection->input_count);
+            } else {
+                add_shader_interface_variables(&module, type_id, variable->location, reflection->outputs, &reflection->output_count);
+            }
+        } break;
+        case SPIRV_STORAGE_CLASS_PUSH_CONSTANT: {
+            // NOTE: The range always starts at 0, which also covers blocks that use layout(offset = ...)
+            reflection->push_constant_range.stageFlags = reflection->stage;
+            reflection->push_constant_range.offset = 0;
+            reflection->push_constant_range.size = get_spirv_type_size(&module, type_id, 0);
+        } break;
+        case SPIRV_STORAGE_CLASS_UNIFORM_CONSTANT:
+        case SPIRV_STORAGE_CLASS_UNIFORM:
+        case SPIRV_STORAGE_CLASS_STORAGE_BUFFER: {
+            if (variable->set == SPIRV_NOT_DECORATED || variable->binding == SPIRV_NOT_DECORATED) {
+                spirv_error(&module, "Resource variable %u has no set or binding", id);
+                continue;
+            }
+            if (variable->set >= MAX_DESCRIPTOR_SETS) {
+                spirv_error(&module, "Descriptor set %u, only %d are supported", variable->set, MAX_DESCRIPTOR_SETS);
+                continue;
+            }
+
+            // Arrays of resources are one binding with several descriptors
+            uint32_t descriptor_count = 1;
+            while (type->opcode == SPIRV_OP_TYPE_ARRAY && !module.failed) {
+                descriptor_count *= get_spirv_id(&module, type->count)->value;
+                type = get_spirv_id(&module, type->type_id);
+            }
+            if (type->opcode == SPIRV_OP_TYPE_RUNTIME_ARRAY) {
+                spirv_error(&module, "Unsized descriptor array %u is not supported", id);
+                continue;
+            }
+
+            VkDescriptorType descriptor_type;
+            switch (type->opcode) {
+            case SPIRV_OP_TYPE_STRUCT:
+                // NOTE: Older SPIR-V puts storage buffers in the Uniform storage class with a BufferBlock decoration
+                if (variable->storage_class == SPIRV_STORAGE_CLASS_STORAGE_BUFFER || type->buffer_block) {
+                    descriptor_type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                } else {
+                    descriptor_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                }
+                break;
+            case SPIRV_OP_TYPE_SAMPLER: descriptor_type = VK_DESCRIPTOR_TYPE_SAMPLER; break;
+            case SPIRV_OP_TYPE_SAMPLED_IMAGE: descriptor_type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER; break;
+            case SPIRV_OP_TYPE_IMAGE:
+                if (type->image_dim == SPIRV_DIM_SUBPASS_DATA) {
+                    descriptor_type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+                } else if (type->image_dim == SPIRV_DIM_BUFFER) {
+                    descriptor_type = type->image_sampled == SPIRV_IMAGE_SAMPLED_STORAGE ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                                                                                         : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+                } else {
+                    descriptor_type = type->image_sampled == SPIRV_IMAGE_SAMPLED_STORAGE ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                                                                                         : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+                }
+                break;
+            default:
+                spirv_error(&module, "Unsupported resource type on variable %u", id);
+                continue;
+            }
+
+            if (reflection->binding_count == MAX_SHADER_BINDINGS) {
+                spirv_error(&module, "More than %d bindings", MAX_SHADER_BINDINGS);
+                continue;
+            }
+            Shader_Binding *binding = &reflection->bindings[reflection->binding_count++];
+            binding->set = variable->set;
+            binding->binding = variable->binding;
+            binding->descriptor_type = descriptor_type;
+            binding->descriptor_count = descriptor_count;
+            binding->stages = reflection->stage;
+        } break;
+        }
+    }
+
+    free(module.members);
+    free(module.ids);
+    return !module.failed;
+}
+
+Shader_Numeric_Type get_format_numeric_type(VkFormat format) {
+    switch (format) {
+    case VK_FORMAT_R8_UINT:
+    case VK_FORMAT_R8G8_UINT:
+    case VK_FORMAT_R8G8B8A8_UINT:
+    case VK_FORMAT_R16_UINT:
+    case VK_FORMAT_R16G16_UINT:
+    case VK_FORMAT_R16G16B16A16_UINT:
+    case VK_FORMAT_R32_UINT:
+    case VK_FORMAT_R32G32_UINT:
+    case VK_FORMAT_R32G32B32_UINT:
+    case VK_FORMAT_R32G32B32A32_UINT: return SHADER_NUMERIC_UINT;
+    case VK_FORMAT_R8_SINT:
+    case VK_FORMAT_R8G8_SINT:
+    case VK_FORMAT_R8G8B8A8_SINT:
+    case VK_FORMAT_R16_SINT:
+    case VK_FORMAT_R16G16_SINT:
+    case VK_FORMAT_R16G16B16A16_SINT:
+    case VK_FORMAT_R32_SINT:
+    case VK_FORMAT_R32G32_SINT:
+    case VK_FORMAT_R32G32B32_SINT:
+    case VK_FORMAT_R32G32B32A32_SINT: return SHADER_NUMERIC_SINT;
+    default: return SHADER_NUMERIC_FLOAT; // Float, half, normalized and scaled formats all arrive as floats
+    }
+}
+
+bool reflect_shader_program(Shader_Program program, bool from_disk, const bool *pending, Shader_Program_Interface *interface) {
+    // NOTE: Builds the program's interface from the SPIR-V of its stages and checks them against each other and
+    //       against the vertex layout. Problems are logged and reported with false, so a hot reload can refuse them.
+    //       pending (NULL for none) marks the stages to read from the watcher's freshly compiled, not yet
+    //       installed, PENDING_SPIRV_SUFFIX file instead.
+    Shader_Program_Info *info = &shader_programs[program];
+    char pending_names[2][256];
+    const char *names[2] = {info->vertex_spirv, info->fragment_spirv};
+    VkShaderStageFlagBits expected_stages[2] = {VK_SHADER_STAGE_VERTEX_BIT, VK_SHADER_STAGE_FRAGMENT_BIT};
+    for (uint32_t s = 0; s < 2; s++) {
+        if (!pending || !pending[s]) continue;
+        snprintf(pending_names[s], sizeof(pending_names[s]), "%s%s", names[s], PENDING_SPIRV_SUFFIX);
+        names[s] = pending_names[s];
+    }
+
+    memset(interface, 0, sizeof(Shader_Program_Interface));
+
+    // Heap allocated because it's a few KB, and this also runs on the shader watcher thread
+    Shader_Reflection *stages = xmalloc(sizeof(Shader_Reflection) * 2);
+    bool ok = true;
+    for (uint32_t s = 0; s < 2; s++) {
+        Shader_Code shader_code = load_shader_code(names[s], from_disk || (pending && pending[s]));
+        if (!shader_code.code) {
+            memset(&stages[s], 0, sizeof(Shader_Reflection));
+            ok = false;
+            continue;
+        }
+        ok = reflect_spirv(shader_code.code, shader_code.size, names[s], &stages[s]) && ok;
+        release_shader_code(&shader_code);
+    }
+    if (!ok) {
+        free(stages);
+        return false;
+    }
+    Shader_Reflection *vertex = &stages[0];
+    Shader_Reflection *fragment = &stages[1];
+
+    for (uint32_t s = 0; s < 2; s++) {
+        if (stages[s].stage != expected_stages[s]) {
+            trace_log("%s: Wrong shader stage 0x%x, expected 0x%x", names[s], stages[s].stage, expected_stages[s]);
+            ok = false;
+        }
+    }
+
+    // Every vertex input needs an attribute of the same numeric type in GPU_VERTEX_ATTRIBUTES or
+    // GPU_INSTANCE_ATTRIBUTES. Attributes the shader doesn't read are left out of the vertex input state.
+    uint32_t attribute_count = 0;
+    VkVertexInputAttributeDescription *attributes = get_attribute_descriptions(&attribute_count);
+    for (uint32_t i = 0; i < vertex->input_count; i++) {
+        Shader_Interface_Variable *input = &vertex->inputs[i];
+        VkVertexInputAttributeDescription *attribute = NULL;
+        for (uint32_t a = 0; a < attribute_count; a++) {
+            if (attributes[a].location == input->location) attribute = &attributes[a];
+        }
+        if (!attribute) {
+            trace_log("%s: Input location %u is not in the vertex layout", names[0], input->location);
+            ok = false;
+            continue;
+        }
+        if (get_format_numeric_type(attribute->format) != input->numeric_type) {
+            trace_log("%s: Input location %u doesn't match the numeric type of vertex format %d", names[0], input->location, attribute->format);
+            ok = false;
+            continue;
+        }
+        interface->attributes[interface->attribute_count++] = *attribute;
+    }
+
+    // Same for the bindings: one the shader reads nothing from needs no buffer bound
+    uint32_t vertex_binding_count = 0;
+    VkVertexInputBindingDescription *vertex_bindings = get_binding_descriptions(&vertex_binding_count);
+    for (uint32_t b = 0; b < vertex_binding_count; b++) {
+        for (uint32_t a = 0; a < interface->attribute_count; a++) {
+            if (interface->attributes[a].binding == vertex_bindings[b].binding) {
+                interface->vertex_bindings[interface->vertex_binding_count++] = vertex_bindings[b];
+                break;
+            }
+        }
+    }
+
+    // Every fragment input needs a vertex output at the same location with at least as many components
+    for (uint32_t i = 0; i < fragment->input_count; i++) {
+        Shader_Interface_Variable *input = &fragment->inputs[i];
+        Shader_Interface_Variable *output = NULL;
+        for (uint32_t o = 0; o < vertex->output_count; o++) {
+            if (vertex->outputs[o].location == input->location) output = &vertex->outputs[o];
+        }
+        if (!output) {
+            trace_log("%s: Input location %u is not written by %s", names[1], input->location, names[0]);
+            ok = false;
+        } else if (output->numeric_type != input->numeric_type || output->component_count < input->component_count) {
+            trace_log("%s: Input location %u doesn't match the output of %s", names[1], input->location, names[0]);
+            ok = false;
+        }
+    }
+
+    // Bindings used by both stages are merged, they have to agree on what's bound there
+    for (uint32_t s = 0; s < 2; s++) {
+        for (uint32_t b = 0; b < stages[s].binding_count; b++) {
+            Shader_Binding *binding = &stages[s].bindings[b];
+            Shader_Binding *merged = NULL;
+            for (uint32_t m = 0; m < interface->binding_count; m++) {
+                if (interface->bindings[m].set == binding->set && interface->bindings[m].binding == binding->binding) {
+                    merged = &interface->bindings[m];
+                }
+            }
+            if (!merged && interface->binding_count == MAX_SHADER_BINDINGS) {
+                trace_log("%s: More than %d bindings between the two stages", names[s], MAX_SHADER_BINDINGS);
+                ok = false;
+            } else if (!merged) {
+                interface->bindings[interface->binding_count++] = *binding;
+            } else if (merged->descriptor_type != binding->descriptor_type || merged->descriptor_count != binding->descriptor_count) {
+                trace_log("%s: Set %u binding %u disagrees with the other stage", names[s], binding->set, binding->binding);
+                ok = false;
+            } else {
+                merged->stages |= binding->stages;
+            }
+        }
+
+        VkPushConstantRange *range = &stages[s].push_constant_range;
+        if (range->size == 0) continue;
+        interface->push_constant_range.stageFlags |= range->stageFlags;
+        if (range->size > interface->push_constant_range.size) interface->push_constant_range.size = range->size;
+    }
+
+    finish_shader_program_interface(interface);
+    free(stages);
+    return ok;
+}
+
+bool reflect_compute_shader(const char *spirv_name, bool from_disk, Shader_Program_Interface *interface) {
+    // NOTE: A single stage, so there's nothing to check between stages and no vertex input
+    Shader_Reflection *reflection = xmalloc(sizeof(Shader_Reflection));
+    memset(reflection, 0, sizeof(Shader_Reflection));
+    Shader_Code shader_code = load_shader_code(spirv_name, from_disk);
+    bool ok = shader_code.code && reflect_spirv(shader_code.code, shader_code.size, spirv_name, reflection);
+    release_shader_code(&shader_code);
+
+    if (ok && reflection->stage != VK_SHADER_STAGE_COMPUTE_BIT) {
+        trace_log("%s: Wrong shader stage 0x%x, expected 0x%x", spirv_name, reflection->stage, VK_SHADER_STAGE_COMPUTE_BIT);
+        ok = false;
+    }
+
+    memset(interface, 0, sizeof(Shader_Program_Interface));
+    interface->binding_count = reflection->binding_count;
+    memcpy(interface->bindings, reflection->bindings, sizeof(Shader_Binding) * reflection->binding_count);
+    interface->push_constant_range = reflection->push_constant_range;
+
+    finish_shader_program_interface(interface);
+    free(reflection);
+    return ok;
+}
+
+void finish_shader_program_interface(Shader_Program_Interface *interface) {
+    // Sorted so equal interfaces are equal byte for byte, whatever order the compiler declared things in
+    for (uint32_t i = 1; i < interface->binding_count; i++) {
+        Shader_Binding binding = interface->bindings[i];
+        uint32_t j = i;
+        for (; j > 0; j--) {
+            Shader_Binding *previous = &interface->bindings[j - 1];
+            if (previous->set < binding.set || (previous->set == binding.set && previous->binding < binding.binding)) break;
+            interface->bindings[j] = *previous;
+        }
+        interface->bindings[j] = binding;
+    }
+
+    // Buffers in the per-frame set point into the stream buffer at a different offset every frame
+    for (uint32_t b = 0; b < interface->binding_count; b++) {
+        Shader_Binding *binding = &interface->bindings[b];
+        if (binding->set != DESCRIPTOR_SET_FRAME) continue;
+        if (binding->descriptor_type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+            binding->descriptor_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        } else if (binding->descriptor_type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) {
+            binding->descriptor_type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        }
+    }
+}
+
+VkDescriptorSetLayout get_descriptor_set_layout(Layout_Cache *cache,
+                                                const VkDescriptorSetLayoutBinding *bindings,
+                                                uint32_t binding_count) {
+    Cached_Set_Layout key;
+    memset(&key, 0, sizeof(key));
+    key.binding_count = binding_count;
+    memcpy(key.bindings, bindings, sizeof(VkDescriptorSetLayoutBinding) * binding_count);
+
+    for (uint32_t i = 0; i < cache->set_layout_count; i++) {
+        if (memcmp(&cache->set_layouts[i], &key, offsetof(Cached_Set_Layout, layout)) == 0) return cache->set_layouts[i].layout;
+    }
+    if (cache->set_layout_count == MAX_CACHED_SET_LAYOUTS) exit_with_error("Too many descriptor set layouts");
+
+    /*
+      typedef struct VkDescriptorSetLayoutCreateInfo {
+          VkStructureType                        sType;
+          const void*                            pNext;
+          VkDescriptorSetLayoutCreateFlags       flags;
+          uint32_t                               bindingCount;
+          const VkDescriptorSetLayoutBinding*    pBindings;
+      } VkDescriptorSetLayoutCreateInfo;
+    */
+    VkDescriptorSetLayoutCreateInfo layout_info = {0};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = binding_count;
+    layout_info.pBindings = key.bindings;
+
+    if (vkCreateDescriptorSetLayout(cache->device, &layout_info, NULL, &key.layout) != VK_SUCCESS) {
+        exit_with_error("Failed to create descriptor set layout");
+    }
+    cache->set_layouts[cache->set_layout_count++] = key;
+    return key.layout;
+}
+
+Cached_Pipeline_Layout get_pipeline_layout(Layout_Cache *cache, const Shader_Program_Interface *interface) {
+    cache->request_count++;
+
+    Cached_Pipeline_Layout key;
+    memset(&key, 0, sizeof(key));
+    key.push_constant_range = interface->push_constant_range;
+
+    // One set layout for each set up to the highest one used, with empty layouts for the sets in between
+    for (uint32_t b = 0; b < interface->binding_count; b++) {
+        if (interface->bindings[b].set + 1 > key.set_layout_count) key.set_layout_count = interface->bindings[b].set + 1;
+    }
+    for (uint32_t set = 0; set < key.set_layout_count; set++) {
+        /*
+          typedef struct VkDescriptorSetLayoutBinding {
+              uint32_t              binding;
+              VkDescriptorType      descriptorType;
+              uint32_t              descriptorCount;
+              VkShaderStageFlags    stageFlags;
+              const VkSampler*      pImmutableSamplers;
+          } VkDescriptorSetLayoutBinding;
+        */
+        VkDescriptorSetLayoutBinding set_bindings[MAX_SHADER_BINDINGS];
+        memset(set_bindings, 0, sizeof(set_bindings));
+        uint32_t set_binding_count = 0;
+        for (uint32_t b = 0; b < interface->binding_count; b++) {
+            const Shader_Binding *binding = &interface->bindings[b];
+            if (binding->set != set) continue;
+            VkDescriptorSetLayoutBinding *set_binding = &set_bindings[set_binding_count++];
+            set_binding->binding = binding->binding;
+            set_binding->descriptorType = binding->descriptor_type;
+            set_binding->descriptorCount = binding->descriptor_count;
+            set_binding->stageFlags = binding->stages;
+        }
+        key.set_layouts[set] = get_descriptor_set_layout(cache, set_bindings, set_binding_count);
+    }
+
+    for (uint32_t i = 0; i < cache->pipeline_layout_count; i++) {
+        if (memcmp(&cache->pipeline_layouts[i], &key, offsetof(Cached_Pipeline_Layout, layout)) == 0) {
+            return cache->pipeline_layouts[i];
+        }
+    }
+    if (cache->pipeline_layout_count == MAX_CACHED_PIPELINE_LAYOUTS) exit_with_error("Too many pipeline layouts");
+
+    /*
+      typedef struct VkPipelineLayoutCreateInfo {
+          VkStructureType                 sType;
+          const void*                     pNext;
+          VkPipelineLayoutCreateFlags     flags;
+          uint32_t                        setLayoutCount;
+          const VkDescriptorSetLayout*    pSetLayouts;
+          uint32_t                        pushConstantRangeCount;
+          const VkPushConstantRange*      pPushConstantRanges;
+      } VkPipelineLayoutCreateInfo;
+    */
+    VkPipelineLayoutCreateInfo layout_info = {0};
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = key.set_layout_count;
+    layout_info.pSetLayouts = key.set_layouts;
+    layout_info.pushConstantRangeCount = key.push_constant_range.size ? 1 : 0;
+    layout_info.pPushConstantRanges = &key.push_constant_range;
+
+    if (vkCreatePipelineLayout(cache->device, &layout_info, NULL, &key.layout) != VK_SUCCESS) {
+        exit_with_error("Failed to create pipeline layout");
+    }
+    cache->pipeline_layouts[cache->pipeline_layout_count++] = key;
+    return key;
+}
+
+void destroy_layout_cache(Layout_Cache *cache) {
+    for (uint32_t i = 0; i < cache->pipeline_layout_count; i++) {
+        vkDestroyPipelineLayout(cache->device, cache->pipeline_layouts[i].layout, NULL);
+    }
+    for (uint32_t i = 0; i < cache->set_layout_count; i++) {
+        vkDestroyDescriptorSetLayout(cache->device, cache->set_layouts[i].layout, NULL);
+    }
+    cache->pipeline_layout_count = 0;
+    cache->set_layout_count = 0;
+}
+
+VkVertexInputBindingDescription *get_binding_descriptions(uint32_t *binding_count) {
+    /*
+      typedef struct VkVertexInputBindingDescription {
           uint32_t             binding;
           uint32_t             stride;
           VkVertexInputRate    inputRate;
       } VkVertexInputBindingDescription;
-    */
-    VkVertexInputBindingDescription binding_description = {0};
-    binding_description.binding = 0; // Binding index in the vertex buffer
-    binding_description.stride = sizeof(Vertex);
-    /*
+
       typedef enum VkVertexInputRate {
           VK_VERTEX_INPUT_RATE_VERTEX = 0,
           VK_VERTEX_INPUT_RATE_INSTANCE = 1,
           VK_VERTEX_INPUT_RATE_MAX_ENUM = 0x7FFFFFFF
       } VkVertexInputRate;
     */
-    binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX; // Per vertex data
-
-    return binding_description;
+    // Mesh vertices, and per-instance data that advances once per instance instead of once per vertex
+    static VkVertexInputBindingDescription binding_descriptions[] = {
+        {VERTEX_BINDING, sizeof(Gpu_Vertex), VK_VERTEX_INPUT_RATE_VERTEX},
+        {INSTANCE_BINDING, sizeof(Gpu_Instance), VK_VERTEX_INPUT_RATE_INSTANCE},
+    };
+
+    *binding_count = array_count(binding_descriptions);
+    return binding_descriptions;
 }
 
-VkVertexInputAttributeDescription *get_attribute_descriptions() {
+VkVertexInputAttributeDescription *get_attribute_descriptions(uint32_t *attribute_count) {
     /*
       typedef struct VkVertexInputAttributeDescription {
           uint32_t    location;
@@ -1192,26 +4825,172 @@ VkVertexInputAttributeDescription *get_attribute_descriptions() {
           uint32_t    offset;
       } VkVertexInputAttributeDescription;
     */
-    static VkVertexInputAttributeDescription attribute_descriptions[2] = {0};
+    // One per entry of GPU_VERTEX_ATTRIBUTES from binding 0, then GPU_INSTANCE_ATTRIBUTES from binding 1. The
+    // shader inputs stay vec2/vec3, normalized and half formats are expanded to float by the vertex fetch.
+    // Programs only get the ones they read, see reflect_shader_program.
+#define DESCRIBE_GPU_VERTEX_ATTRIBUTE(location, field, type, count, format, source_field, source_count, pack) \
+    {location, VERTEX_BINDING, format, offsetof(Gpu_Vertex, field)},
+#define DESCRIBE_GPU_INSTANCE_ATTRIBUTE(location, field, type, count, format) \
+    {location, INSTANCE_BINDING, format, offsetof(Gpu_Instance, field)},
+    static VkVertexInputAttributeDescription attribute_descriptions[] = {
+        GPU_VERTEX_ATTRIBUTES(DESCRIBE_GPU_VERTEX_ATTRIBUTE)
+        GPU_INSTANCE_ATTRIBUTES(DESCRIBE_GPU_INSTANCE_ATTRIBUTE)
+    };
+#undef DESCRIBE_GPU_INSTANCE_ATTRIBUTE
+#undef DESCRIBE_GPU_VERTEX_ATTRIBUTE
+
+    *attribute_count = array_count(attribute_descriptions);
+    return attribute_descriptions;
+}
+
+uint16_t float_to_half(float value) {
+    // NOTE: Round to nearest even. Handles denormals, overflow to infinity and NaN.
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    }
+    if (exponent >= 31) {
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) return (uint16_t)sign;
+        mantissa |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - exponent);
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1))) half_mantissa++;
+        return (uint16_t)(sign | half_mantissa);
+    }
+
+    uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1fff;
+    // A carry out of the mantissa bumps the exponent, which is still the right answer
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) half++;
+    return (uint16_t)half;
+}
 
-    // Position
-    attribute_descriptions[0].binding = 0; // Binding index
-    attribute_descriptions[0].location = 0; // Location in shader
-    attribute_descriptions[0].format = VK_FORMAT_R32G32_SFLOAT; // vec2 -- 2 floats
-    attribute_descriptions[0].offset = offsetof(Vertex, position);
+void pack_float(float *out, const float *in, uint32_t out_count, uint32_t in_count) {
+    for (uint32_t i = 0; i < out_count; i++) out[i] = i < in_count ? in[i] : 1.0f;
+}
 
-    // Color
-    attribute_descriptions[1].binding = 0; // Binding index
-    attribute_descriptions[1].location = 1; // Location in shader
-    attribute_descriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT; // vec3 -- 3 floats
-    attribute_descriptions[1].offset = offsetof(Vertex, color);
+void pack_half(uint16_t *out, const float *in, uint32_t out_count, uint32_t in_count) {
+    for (uint32_t i = 0; i < out_count; i++) out[i] = float_to_half(i < in_count ? in[i] : 1.0f);
+}
 
-    return attribute_descriptions;
+void pack_snorm16(int16_t *out, const float *in, uint32_t out_count, uint32_t in_count) {
+    for (uint32_t i = 0; i < out_count; i++) {
+        float value = i < in_count ? in[i] : 1.0f;
+        if (value < -1.0f) value = -1.0f;
+        if (value > 1.0f) value = 1.0f;
+        out[i] = (int16_t)lrintf(value * 32767.0f);
+    }
+}
+
+void pack_unorm8(uint8_t *out, const float *in, uint32_t out_count, uint32_t in_count) {
+    // Components the source doesn't have (alpha) become 1.0
+    for (uint32_t i = 0; i < out_count; i++) {
+        float value = i < in_count ? in[i] : 1.0f;
+        if (value < 0.0f) value = 0.0f;
+        if (value > 1.0f) value = 1.0f;
+        out[i] = (uint8_t)lrintf(value * 255.0f);
+    }
+}
+
+void pack_vertices(Gpu_Vertex *out, const Vertex *in, uint32_t vertex_count) {
+#define PACK_GPU_VERTEX_ATTRIBUTE(location, field, type, count, format, source_field, source_count, pack) \
+    pack(out[i].field, in[i].source_field, count, source_count);
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        GPU_VERTEX_ATTRIBUTES(PACK_GPU_VERTEX_ATTRIBUTE)
+    }
+#undef PACK_GPU_VERTEX_ATTRIBUTE
+}
+
+Pipeline_Key get_default_pipeline_key(VkFormat color_format, Transform_Source transform_source) {
+    Pipeline_Key key = {0};
+    key.shader_program = SHADER_PROGRAM_BASIC;
+    key.color_format = color_format;
+    key.vertex_layout = VERTEX_LAYOUT;
+    key.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    key.polygon_mode = VK_POLYGON_MODE_FILL;
+    key.cull_mode = VK_CULL_MODE_BACK_BIT;
+    key.front_face = VK_FRONT_FACE_CLOCKWISE;
+    key.blend_enable = VK_FALSE;
+    key.color_write_mask = (VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                            VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT);
+    key.depth_write_enable = VK_TRUE; // Ignored without a depth buffer
+    key.constants.color_mode = COLOR_MODE_VERTEX;
+    key.constants.brightness = 1.0f;
+    key.constants.transform_source = transform_source;
+    return key;
 }
 
-VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent, VkRenderPass render_pass, VkPipelineLayout pipeline_layout) {
-    VkShaderModule vert_shader_module = create_shader_module(device, "../res/shaders/bin/basic.vert.spv");
-    VkShaderModule frag_shader_module = create_shader_module(device, "../res/shaders/bin/basic.frag.spv");
+Pipeline_Key get_material_pipeline_key(uint32_t material, VkFormat color_format, Transform_Source transform_source) {
+    // NOTE: Material 0 is the default pipeline. The others differ in fixed-function state and in the fragment
+    //       shader's specialization constants. They all share one SPIR-V file, but each combination is a full
+    //       pipeline compile, which is what a material costs.
+    Pipeline_Key key = get_default_pipeline_key(color_format, transform_source);
+    if (material & 1) key.cull_mode = VK_CULL_MODE_NONE;
+    if (material & 2) {
+        // Blended draws test against depth but don't write it, what's behind them must still show through
+        key.blend_enable = VK_TRUE;
+        key.depth_write_enable = VK_FALSE;
+    }
+    uint32_t shading = (material >> 2) & 7;
+    key.constants.color_mode = shading % COLOR_MODE_COUNT;
+    key.constants.brightness = 1.0f - 0.25f * (float)(shading / COLOR_MODE_COUNT);
+    return key;
+}
+
+Pipeline_Key get_depth_prepass_pipeline_key(const Pipeline_Key *color_key) {
+    // NOTE: Same vertex stage and rasterization state as the color pipeline, so it produces the same depth
+    //       for the same pixels. No fragment shader and no color writes; the fragment constants are reset so
+    //       materials that only differ in shading share one depth-only pipeline.
+    Pipeline_Key key = *color_key;
+    key.blend_enable = VK_FALSE;
+    key.color_write_mask = 0;
+    key.depth_write_enable = VK_TRUE;
+    key.constants.color_mode = COLOR_MODE_VERTEX;
+    key.constants.brightness = 1.0f;
+    return key;
+}
+
+Pipeline_Key get_instanced_pipeline_key(VkFormat color_format) {
+    // NOTE: Markers are flat, drawing both sides costs nothing. They sit at z = 0, in front of everything, and
+    //       don't write depth: the dynamic geometry drawn after them has to end up on top, as it does without
+    //       a depth buffer.
+    Pipeline_Key key = get_default_pipeline_key(color_format, TRANSFORM_SOURCE_NONE);
+    key.shader_program = SHADER_PROGRAM_INSTANCED;
+    key.cull_mode = VK_CULL_MODE_NONE;
+    key.depth_write_enable = VK_FALSE;
+    return key;
+}
+
+uint32_t hash_pipeline_key(const Pipeline_Key *key) {
+    return compute_checksum(key, sizeof(*key));
+}
+
+// NOTE: Called from the pipeline compile threads, keep it free of shared state
+VkPipeline create_graphics_pipeline(VkDevice device,
+                                    Pipeline_Cache_Etc *pipeline_cache,
+                                    VkRenderPass render_pass,
+                                    VkFormat depth_format,
+                                    VkSampleCountFlagBits samples,
+                                    const Shader_Program_Layout *program_layout,
+                                    const Pipeline_Key *key,
+                                    bool shaders_from_disk) {
+    Shader_Program_Info *program = &shader_programs[key->shader_program];
+    Shader_Code vert_code = load_shader_code(program->vertex_spirv, shaders_from_disk);
+    Shader_Code frag_code = load_shader_code(program->fragment_spirv, shaders_from_disk);
+    VkShaderModule vert_shader_module = create_shader_module(device, &vert_code, program->vertex_spirv);
+    VkShaderModule frag_shader_module = create_shader_module(device, &frag_code, program->fragment_spirv);
+    release_shader_code(&vert_code);
+    release_shader_code(&frag_code);
 
     /*
       typedef struct VkPipelineShaderStageCreateInfo {
@@ -1267,7 +5046,39 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
     frag_stage_info.module = frag_shader_module;
     frag_stage_info.pName = "main"; // Entry point in the shader
 
+    /*
+      typedef struct VkSpecializationMapEntry {
+          uint32_t    constantID;
+          uint32_t    offset;
+          size_t      size;
+      } VkSpecializationMapEntry;
+
+      typedef struct VkSpecializationInfo {
+          uint32_t                           mapEntryCount;
+          const VkSpecializationMapEntry*    pMapEntries;
+          size_t                             dataSize;
+          const void*                        pData;
+      } VkSpecializationInfo;
+    */
+#define MAP_SPECIALIZATION_CONSTANT(constant_id, field, type) \
+    {constant_id, offsetof(Specialization_Constants, field), sizeof(type)},
+    static const VkSpecializationMapEntry specialization_entries[] = {
+        SPECIALIZATION_CONSTANTS(MAP_SPECIALIZATION_CONSTANT)
+    };
+#undef MAP_SPECIALIZATION_CONSTANT
+
+    // Both stages get every constant, the ones a stage doesn't declare are ignored
+    VkSpecializationInfo specialization_info = {0};
+    specialization_info.mapEntryCount = array_count(specialization_entries);
+    specialization_info.pMapEntries = specialization_entries;
+    specialization_info.dataSize = sizeof(key->constants);
+    specialization_info.pData = &key->constants;
+    vert_stage_info.pSpecializationInfo = &specialization_info;
+    frag_stage_info.pSpecializationInfo = &specialization_info;
+
     VkPipelineShaderStageCreateInfo shader_stages[] = {vert_stage_info, frag_stage_info};
+    // A depth-only pipeline runs no fragment shader at all
+    uint32_t stage_count = key->color_write_mask == 0 ? 1 : 2;
 
     // Vertex Input
     /*
@@ -1284,13 +5095,11 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
     VkPipelineVertexInputStateCreateInfo vertex_input_info = {0};
     vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-    VkVertexInputBindingDescription binding_description = get_binding_description();
-    vertex_input_info.vertexBindingDescriptionCount = 1;
-    vertex_input_info.pVertexBindingDescriptions = &binding_description;
-
-    VkVertexInputAttributeDescription *attribute_descriptions = get_attribute_descriptions();
-    vertex_input_info.vertexAttributeDescriptionCount = 2;
-    vertex_input_info.pVertexAttributeDescriptions = attribute_descriptions;
+    // The bindings and attributes the shader reads, checked against the layouts when the program was reflected
+    vertex_input_info.vertexBindingDescriptionCount = program_layout->interface.vertex_binding_count;
+    vertex_input_info.pVertexBindingDescriptions = program_layout->interface.vertex_bindings;
+    vertex_input_info.vertexAttributeDescriptionCount = program_layout->interface.attribute_count;
+    vertex_input_info.pVertexAttributeDescriptions = program_layout->interface.attributes;
 
     /*
       typedef struct VkPipelineInputAssemblyStateCreateInfo {
@@ -1319,47 +5128,9 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
           VK_PRIMITIVE_TOPOLOGY_MAX_ENUM = 0x7FFFFFFF
       } VkPrimitiveTopology;
     */
-    input_assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    input_assembly_info.topology = key->topology;
     input_assembly_info.primitiveRestartEnable = VK_FALSE;
 
-    /*
-      typedef struct VkViewport {
-          float    x;
-          float    y;
-          float    width;
-          float    height;
-          float    minDepth;
-          float    maxDepth;
-      } VkViewport;
-    */
-    VkViewport viewport = {0};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float)swapchain_extent.width;
-    viewport.height = (float)swapchain_extent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    /*
-      typedef struct VkOffset2D {
-          int32_t    x;
-          int32_t    y;
-      } VkOffset2D;
-
-      typedef struct VkExtent2D {
-          uint32_t    width;
-          uint32_t    height;
-      } VkExtent2D;
-
-      typedef struct VkRect2D {
-          VkOffset2D    offset;
-          VkExtent2D    extent;
-      } VkRect2D;
-    */
-    VkRect2D scissor = {0};
-    scissor.offset = (VkOffset2D){0, 0};
-    scissor.extent = swapchain_extent;
-
     /*
       typedef struct VkPipelineViewportStateCreateInfo {
           VkStructureType                       sType;
@@ -1373,10 +5144,9 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
     */
     VkPipelineViewportStateCreateInfo viewport_state_info = {0};
     viewport_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    // NOTE: Only the counts are baked in, the rectangles come from set_viewport_and_scissor
     viewport_state_info.viewportCount = 1;
-    viewport_state_info.pViewports = &viewport;
     viewport_state_info.scissorCount = 1;
-    viewport_state_info.pScissors = &scissor;
 
     /*
       typedef struct VkPipelineRasterizationStateCreateInfo {
@@ -1409,7 +5179,7 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
           VK_POLYGON_MODE_MAX_ENUM = 0x7FFFFFFF
       } VkPolygonMode;
     */
-    rasterization_state_info.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization_state_info.polygonMode = key->polygon_mode;
     rasterization_state_info.lineWidth = 1.0f;
     /*
       typedef enum VkCullModeFlagBits {
@@ -1420,7 +5190,7 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
           VK_CULL_MODE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
       } VkCullModeFlagBits;
     */
-    rasterization_state_info.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterization_state_info.cullMode = key->cull_mode;
     /*
       typedef enum VkFrontFace {
           VK_FRONT_FACE_COUNTER_CLOCKWISE = 0,
@@ -1428,7 +5198,7 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
           VK_FRONT_FACE_MAX_ENUM = 0x7FFFFFFF
       } VkFrontFace;
     */
-    rasterization_state_info.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rasterization_state_info.frontFace = key->front_face;
     rasterization_state_info.depthBiasEnable = VK_FALSE;
 
     // Multisampling (disabled for now)
@@ -1460,7 +5230,8 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
           VK_SAMPLE_COUNT_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
       } VkSampleCountFlagBits;
     */
-    multisample_state_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    // Has to match the attachments, so it comes with the render pass rather than the key
+    multisample_state_info.rasterizationSamples = samples;
 
     // Color blending (disabled for now)
     /*
@@ -1485,9 +5256,15 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
           VK_COLOR_COMPONENT_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
       } VkColorComponentFlagBits;
     */
-    color_blend_attachment.colorWriteMask = (VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-                                             VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT);
-    color_blend_attachment.blendEnable = VK_FALSE;
+    color_blend_attachment.colorWriteMask = key->color_write_mask;
+    color_blend_attachment.blendEnable = key->blend_enable;
+    // Plain alpha blending, ignored unless blendEnable is set
+    color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
+    color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
 
     /*
       typedef struct VkPipelineColorBlendStateCreateInfo {
@@ -1507,6 +5284,45 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
     color_blend_state_info.attachmentCount = 1;
     color_blend_state_info.pAttachments = &color_blend_attachment;
 
+    /*
+      typedef struct VkPipelineDepthStencilStateCreateInfo {
+          VkStructureType                           sType;
+          const void*                               pNext;
+          VkPipelineDepthStencilStateCreateFlags    flags;
+          VkBool32                                  depthTestEnable;
+          VkBool32                                  depthWriteEnable;
+          VkCompareOp                               depthCompareOp;
+          VkBool32                                  depthBoundsTestEnable;
+          VkBool32                                  stencilTestEnable;
+          VkStencilOpState                          front;
+          VkStencilOpState                          back;
+          float                                     minDepthBounds;
+          float                                     maxDepthBounds;
+      } VkPipelineDepthStencilStateCreateInfo;
+    */
+    // NOTE: LESS_OR_EQUAL rather than LESS: after a depth pre-pass the color pass meets its own depth again
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_state_info = {0};
+    depth_stencil_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_state_info.depthTestEnable = VK_TRUE;
+    depth_stencil_state_info.depthWriteEnable = key->depth_write_enable;
+    depth_stencil_state_info.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    depth_stencil_state_info.maxDepthBounds = 1.0f;
+
+    /*
+      typedef struct VkPipelineDynamicStateCreateInfo {
+          VkStructureType                      sType;
+          const void*                          pNext;
+          VkPipelineDynamicStateCreateFlags    flags;
+          uint32_t                             dynamicStateCount;
+          const VkDynamicState*                pDynamicStates;
+      } VkPipelineDynamicStateCreateInfo;
+    */
+    VkDynamicState dynamic_states[] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamic_state_info = {0};
+    dynamic_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state_info.dynamicStateCount = array_count(dynamic_states);
+    dynamic_state_info.pDynamicStates = dynamic_states;
+
     /*
       typedef struct VkGraphicsPipelineCreateInfo {
           VkStructureType                                  sType;
@@ -1532,22 +5348,45 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
     */
     VkGraphicsPipelineCreateInfo pipeline_info = {0};
     pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_info.stageCount = 2;
+    pipeline_info.stageCount = stage_count;
     pipeline_info.pStages = shader_stages;
     pipeline_info.pVertexInputState = &vertex_input_info;
     pipeline_info.pInputAssemblyState = &input_assembly_info;
     pipeline_info.pViewportState = &viewport_state_info;
     pipeline_info.pRasterizationState = &rasterization_state_info;
     pipeline_info.pMultisampleState = &multisample_state_info;
+    if (depth_format != VK_FORMAT_UNDEFINED) pipeline_info.pDepthStencilState = &depth_stencil_state_info;
     pipeline_info.pColorBlendState = &color_blend_state_info;
-    pipeline_info.layout = pipeline_layout;
+    pipeline_info.pDynamicState = &dynamic_state_info;
+    pipeline_info.layout = program_layout->pipeline_layout;
     pipeline_info.renderPass = render_pass;
     pipeline_info.subpass = 0; // TODO: Didn't we define this before?
 
+    /*
+      typedef struct VkPipelineRenderingCreateInfo {
+          VkStructureType    sType;
+          const void*        pNext;
+          uint32_t           viewMask;
+          uint32_t           colorAttachmentCount;
+          const VkFormat*    pColorAttachmentFormats;
+          VkFormat           depthAttachmentFormat;
+          VkFormat           stencilAttachmentFormat;
+      } VkPipelineRenderingCreateInfo;
+    */
+    // NOTE: Dynamic rendering: no render pass to be compatible with, the attachment formats stand in for it
+    VkPipelineRenderingCreateInfoKHR rendering_info = {0};
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachmentFormats = &key->color_format;
+    rendering_info.depthAttachmentFormat = depth_format;
+    if (render_pass == VK_NULL_HANDLE) pipeline_info.pNext = &rendering_info;
+
     VkPipeline pipeline;
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &pipeline) != VK_SUCCESS) {
+    double start = glfwGetTime();
+    if (vkCreateGraphicsPipelines(device, pipeline_cache->cache, 1, &pipeline_info, NULL, &pipeline) != VK_SUCCESS) {
         exit_with_error("Failed to create graphics pipeline");
     }
+    trace_log("Created graphics pipeline %08x in %.2f ms", hash_pipeline_key(key), 1000.0 * (glfwGetTime() - start));
 
     vkDestroyShaderModule(device, vert_shader_module, NULL);
     vkDestroyShaderModule(device, frag_shader_module, NULL);
@@ -1555,364 +5394,4274 @@ VkPipeline create_graphics_pipeline(VkDevice device, VkExtent2D swapchain_extent
     return pipeline;
 }
 
-uint32_t find_memory_type(VkPhysicalDevice physical_device, uint32_t type_filter, VkMemoryPropertyFlags properties) {
+VkPipeline create_compute_pipeline(VkDevice device,
+                                   Pipeline_Cache_Etc *pipeline_cache,
+                                   VkPipelineLayout pipeline_layout,
+                                   const char *spirv_name,
+                                   bool shaders_from_disk) {
+    Shader_Code code = load_shader_code(spirv_name, shaders_from_disk);
+    VkShaderModule shader_module = create_shader_module(device, &code, spirv_name);
+    release_shader_code(&code);
+
     /*
-      typedef struct VkMemoryType {
-          VkMemoryPropertyFlags    propertyFlags;
-          uint32_t                 heapIndex;
-      } VkMemoryType;
+      typedef struct VkComputePipelineCreateInfo {
+          VkStructureType                    sType;
+          const void*                        pNext;
+          VkPipelineCreateFlags              flags;
+          VkPipelineShaderStageCreateInfo    stage;
+          VkPipelineLayout                   layout;
+          VkPipeline                         basePipelineHandle;
+          int32_t                            basePipelineIndex;
+      } VkComputePipelineCreateInfo;
+    */
+    VkComputePipelineCreateInfo pipeline_info = {0};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = shader_module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = pipeline_layout;
 
-      typedef enum VkMemoryHeapFlagBits {
-          VK_MEMORY_HEAP_DEVICE_LOCAL_BIT = 0x00000001,
-          VK_MEMORY_HEAP_MULTI_INSTANCE_BIT = 0x00000002,
-          VK_MEMORY_HEAP_MULTI_INSTANCE_BIT_KHR = VK_MEMORY_HEAP_MULTI_INSTANCE_BIT,
-          VK_MEMORY_HEAP_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
-      } VkMemoryHeapFlagBits;
+    VkPipeline pipeline;
+    double start = glfwGetTime();
+    if (vkCreateComputePipelines(device, pipeline_cache->cache, 1, &pipeline_info, NULL, &pipeline) != VK_SUCCESS) {
+        exit_with_error("Failed to create compute pipeline %s", spirv_name);
+    }
+    trace_log("Created compute pipeline %s in %.2f ms", spirv_name, 1000.0 * (glfwGetTime() - start));
 
-      typedef struct VkMemoryHeap {
-          VkDeviceSize         size;
-          VkMemoryHeapFlags    flags;
-      } VkMemoryHeap;
+    vkDestroyShaderModule(device, shader_module, NULL);
+    return pipeline;
+}
 
-      typedef struct VkPhysicalDeviceMemoryProperties {
-          uint32_t        memoryTypeCount;
-          VkMemoryType    memoryTypes[VK_MAX_MEMORY_TYPES];
-          uint32_t        memoryHeapCount;
-          VkMemoryHeap    memoryHeaps[VK_MAX_MEMORY_HEAPS];
-      } VkPhysicalDeviceMemoryProperties;
-    */
-    VkPhysicalDeviceMemoryProperties mem_properties;
-    vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_properties);
+uint32_t compute_checksum(const void *data, size_t size) {
+    // FNV-1a, only here to catch truncated or corrupted files
+    const uint8_t *bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
 
-    bool memory_type_index_found = false;
-    uint32_t memory_type_index = 0;
-    for (uint32_t i = 0; i < mem_properties.memoryTypeCount; i++) {
-        if ((type_filter & (1 << i)) && ((mem_properties.memoryTypes[i].propertyFlags & properties) == properties)) {
-            memory_type_index_found = true;
-            memory_type_index = i;
+Pipeline_Cache_Etc create_pipeline_cache(VkPhysicalDevice physical_device, VkDevice device, const char *path, bool cold) {
+    Pipeline_Cache_Etc result = {0};
+    result.path = path;
+    vkGetPhysicalDeviceProperties(physical_device, &result.device_properties);
+    VkPhysicalDeviceProperties *properties = &result.device_properties;
+
+    void *initial_data = NULL;
+    size_t initial_data_size = 0;
+    const char *reject_reason = NULL;
+
+    FILE *file = cold ? NULL : fopen(path, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        long file_size = ftell(file);
+        rewind(file);
+
+        Pipeline_Cache_File_Header header = {0};
+        if (file_size < (long)sizeof(header) || fread(&header, sizeof(header), 1, file) != 1) {
+            reject_reason = "file too small";
+        } else if (header.magic != PIPELINE_CACHE_FILE_MAGIC || header.file_version != PIPELINE_CACHE_FILE_VERSION) {
+            reject_reason = "not a pipeline cache file";
+        } else if (header.vendor_id != properties->vendorID || header.device_id != properties->deviceID) {
+            reject_reason = "different device";
+        } else if (header.driver_version != properties->driverVersion) {
+            reject_reason = "different driver version";
+        } else if (memcmp(header.pipeline_cache_uuid, properties->pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            reject_reason = "different pipeline cache UUID";
+        } else if (header.data_size != (uint64_t)(file_size - (long)sizeof(header))) {
+            reject_reason = "truncated";
+        } else {
+            initial_data_size = (size_t)header.data_size;
+            initial_data = xmalloc(initial_data_size);
+            if (fread(initial_data, initial_data_size, 1, file) != 1 ||
+                compute_checksum(initial_data, initial_data_size) != header.data_checksum) {
+                reject_reason = "checksum mismatch";
+            }
+        }
+        fclose(file);
+
+        if (reject_reason) {
+            trace_log("Ignoring pipeline cache %s: %s", path, reject_reason);
+            free(initial_data);
+            initial_data = NULL;
+            initial_data_size = 0;
         }
     }
 
-    if (!memory_type_index_found) {
-        exit_with_error("Failed to find suitable memory type");
+    /*
+      typedef struct VkPipelineCacheCreateInfo {
+          VkStructureType               sType;
+          const void*                   pNext;
+          VkPipelineCacheCreateFlags    flags;
+          size_t                        initialDataSize;
+          const void*                   pInitialData;
+      } VkPipelineCacheCreateInfo;
+    */
+    VkPipelineCacheCreateInfo cache_info = {0};
+    cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cache_info.initialDataSize = initial_data_size;
+    cache_info.pInitialData = initial_data;
+
+    // The driver validates its own header too and silently starts empty on a mismatch
+    if (vkCreatePipelineCache(device, &cache_info, NULL, &result.cache) != VK_SUCCESS) {
+        exit_with_error("Failed to create pipeline cache");
     }
 
-    return memory_type_index;
+    result.warm = initial_data != NULL;
+    result.saved_size = initial_data_size;
+    result.last_save_time = glfwGetTime();
+    free(initial_data);
+
+    trace_log("Pipeline cache: %s (%zu bytes from %s)", result.warm ? "warm" : "cold", initial_data_size, path);
+    return result;
 }
 
-Vertex_Buffer_Etc create_vertex_buffer(VkDevice device, VkPhysicalDevice physical_device) {
-    // typedef uint64_t VkDeviceSize;
-    VkDeviceSize buffer_size = sizeof(vertices);
+void save_pipeline_cache(VkDevice device, Pipeline_Cache_Etc *pipeline_cache, bool force) {
+    // NOTE: Called at checkpoints and at shutdown. Unless forced, only writes when the cache has grown.
+    pipeline_cache->last_save_time = glfwGetTime();
 
-    /*
-      typedef struct VkBufferCreateInfo {
-          VkStructureType        sType;
-          const void*            pNext;
-          VkBufferCreateFlags    flags;
-          VkDeviceSize           size;
-          VkBufferUsageFlags     usage;
-          VkSharingMode          sharingMode;
-          uint32_t               queueFamilyIndexCount;
-          const uint32_t*        pQueueFamilyIndices;
-      } VkBufferCreateInfo;
+    size_t data_size = 0;
+    if (vkGetPipelineCacheData(device, pipeline_cache->cache, &data_size, NULL) != VK_SUCCESS) return;
+    if (!force && data_size == pipeline_cache->saved_size) return;
+
+    void *data = xmalloc(data_size);
+    if (vkGetPipelineCacheData(device, pipeline_cache->cache, &data_size, data) != VK_SUCCESS) {
+        free(data);
+        return;
+    }
+
+    Pipeline_Cache_File_Header header = {0};
+    header.magic = PIPELINE_CACHE_FILE_MAGIC;
+    header.file_version = PIPELINE_CACHE_FILE_VERSION;
+    header.vendor_id = pipeline_cache->device_properties.vendorID;
+    header.device_id = pipeline_cache->device_properties.deviceID;
+    header.driver_version = pipeline_cache->device_properties.driverVersion;
+    memcpy(header.pipeline_cache_uuid, pipeline_cache->device_properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.data_checksum = compute_checksum(data, data_size);
+    header.data_size = data_size;
+
+    // NOTE: Written to a temporary file and renamed over the old one, so a crash mid-write
+    //       leaves the previous cache intact instead of a torn one
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", pipeline_cache->path);
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        trace_log("WARNING: Failed to open %s for writing", temp_path);
+        free(data);
+        return;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(data, data_size, 1, file) == 1 &&
+                   fflush(file) == 0 &&
+                   fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+    free(data);
+
+    if (!written || rename(temp_path, pipeline_cache->path) != 0) {
+        trace_log("WARNING: Failed to save pipeline cache to %s", pipeline_cache->path);
+        remove(temp_path);
+        return;
+    }
+
+    pipeline_cache->saved_size = data_size;
+    trace_log("Saved pipeline cache (%zu bytes) to %s", data_size, pipeline_cache->path);
+}
+
+void destroy_pipeline_cache(VkDevice device, Pipeline_Cache_Etc *pipeline_cache) {
+    save_pipeline_cache(device, pipeline_cache, false);
+    vkDestroyPipelineCache(device, pipeline_cache->cache, NULL);
+}
+
+Pipeline_Manager *create_pipeline_manager(VkDevice device,
+                                          Pipeline_Cache_Etc *pipeline_cache,
+                                          VkRenderPass render_pass,
+                                          VkFormat depth_format,
+                                          VkSampleCountFlagBits samples,
+                                          bool shaders_from_disk,
+                                          uint32_t thread_count) {
+    // NOTE: Heap allocated because the threads hold on to its address
+    Pipeline_Manager *manager = xmalloc(sizeof(Pipeline_Manager));
+    memset(manager, 0, sizeof(Pipeline_Manager));
+    manager->device = device;
+    manager->pipeline_cache = pipeline_cache;
+    manager->render_pass = render_pass;
+    manager->depth_format = depth_format;
+    manager->samples = samples;
+    manager->shaders_from_disk = shaders_from_disk;
+    manager->thread_count = thread_count;
+
+    // Vertex input and pipeline layouts come from the shaders themselves, so a mismatch stops us here rather
+    // than showing up as a validation error or garbage on screen
+    manager->layout_cache.device = device;
+    for (uint32_t p = 0; p < SHADER_PROGRAM_COUNT; p++) {
+        Shader_Program_Layout *program_layout = &manager->program_layouts[p];
+        if (!reflect_shader_program((Shader_Program)p, shaders_from_disk, NULL, &program_layout->interface)) {
+            exit_with_error("Shader interface errors in %s, see above", shader_programs[p].vertex_source);
+        }
+        Cached_Pipeline_Layout layout = get_pipeline_layout(&manager->layout_cache, &program_layout->interface);
+        program_layout->pipeline_layout = layout.layout;
+        program_layout->set_layout_count = layout.set_layout_count;
+        memcpy(program_layout->set_layouts, layout.set_layouts, sizeof(layout.set_layouts));
+    }
+    trace_log("Reflected %d shader programs: %u pipeline layouts, %u descriptor set layouts",
+              SHADER_PROGRAM_COUNT,
+              manager->layout_cache.pipeline_layout_count,
+              manager->layout_cache.set_layout_count);
+
+    pthread_mutex_init(&manager->mutex, NULL);
+    pthread_cond_init(&manager->work_ready, NULL);
+    pthread_cond_init(&manager->variant_ready, NULL);
+
+    for (uint32_t t = 0; t < thread_count; t++) {
+        if (pthread_create(&manager->threads[t], NULL, pipeline_compile_thread_main, manager) != 0) {
+            exit_with_error("Failed to start pipeline compile thread");
+        }
+    }
+
+    if (thread_count > 0) {
+        trace_log("Started %u pipeline compile threads", thread_count);
+    } else {
+        trace_log("Compiling pipelines on the main thread");
+    }
+    return manager;
+}
+
+void destroy_pipeline_manager(Pipeline_Manager *manager) {
+    pthread_mutex_lock(&manager->mutex);
+    manager->quit = true;
+    pthread_cond_broadcast(&manager->work_ready);
+    pthread_mutex_unlock(&manager->mutex);
+
+    // A compile in progress finishes first, anything still queued is dropped
+    for (uint32_t t = 0; t < manager->thread_count; t++) {
+        pthread_join(manager->threads[t], NULL);
+    }
+
+    for (uint32_t i = 0; i < PIPELINE_VARIANT_CAPACITY; i++) {
+        if (manager->variants[i].state == PIPELINE_VARIANT_READY) {
+            vkDestroyPipeline(manager->device, manager->variants[i].pipeline, NULL);
+        }
+    }
+    destroy_retired_pipelines(manager, 0, 0, true);
+    free(manager->retired);
+    destroy_layout_cache(&manager->layout_cache);
+
+    pthread_cond_destroy(&manager->variant_ready);
+    pthread_cond_destroy(&manager->work_ready);
+    pthread_mutex_destroy(&manager->mutex);
+    free(manager);
+}
+
+void *pipeline_compile_thread_main(void *arg) {
+    Pipeline_Manager *manager = arg;
+
+    pthread_mutex_lock(&manager->mutex);
+    for (;;) {
+        while (!manager->quit && manager->queue_head == manager->queue_tail) {
+            pthread_cond_wait(&manager->work_ready, &manager->mutex);
+        }
+        if (manager->quit) break;
+
+        uint32_t slot = manager->queue[manager->queue_head % PIPELINE_VARIANT_CAPACITY];
+        manager->queue_head++;
+        manager->variants[slot].queued = false;
+        compile_pipeline_variant(manager, slot);
+    }
+    pthread_mutex_unlock(&manager->mutex);
+
+    return NULL;
+}
+
+void compile_pipeline_variant(Pipeline_Manager *manager, uint32_t slot) {
+    // NOTE: Called with the mutex held, it's dropped for the compile itself. The key never changes once the
+    //       slot is taken, and the pipeline handle is only swapped below, so the slot can be read meanwhile.
+    //       compiling keeps a second thread off the slot; a reload that lands meanwhile sets dirty instead, and
+    //       the compile goes again so the last pipeline installed is always built from the newest SPIR-V.
+    Pipeline_Variant *variant = &manager->variants[slot];
+    variant->compiling = true;
+    for (;;) {
+        variant->dirty = false;
+        Pipeline_Key key = variant->key;
+        pthread_mutex_unlock(&manager->mutex);
+
+        double start = glfwGetTime();
+        VkPipeline pipeline = create_graphics_pipeline(manager->device,
+                                                       manager->pipeline_cache,
+                                                       manager->render_pass,
+                                                       manager->depth_format,
+                                                       manager->samples,
+                                                       &manager->program_layouts[key.shader_program],
+                                                       &key,
+                                                       manager->shaders_from_disk);
+        double end = glfwGetTime();
+
+        pthread_mutex_lock(&manager->mutex);
+        double compile_ms = 1000.0 * (end - start);
+        manager->creation_count++;
+        manager->total_compile_ms += compile_ms;
+        if (compile_ms > manager->max_compile_ms) manager->max_compile_ms = compile_ms;
+
+        if (variant->dirty && variant->state == PIPELINE_VARIANT_READY) {
+            // Built from SPIR-V that has been replaced already and never handed out, the old pipeline carries on
+            vkDestroyPipeline(manager->device, pipeline, NULL);
+            continue;
+        }
+        if (variant->state == PIPELINE_VARIANT_READY) {
+            // A rebuild: frames in flight may still use the old pipeline
+            if (manager->retired_count == manager->retired_capacity) {
+                manager->retired_capacity = manager->retired_capacity ? manager->retired_capacity * 2 : 16;
+                manager->retired = realloc(manager->retired, sizeof(Retired_Pipeline) * manager->retired_capacity);
+                if (!manager->retired) exit_with_error("Out of memory for retired pipelines");
+            }
+            manager->retired[manager->retired_count++] = (Retired_Pipeline){variant->pipeline, PIPELINE_RETIRE_FRAME_UNKNOWN};
+            manager->rebuild_count++;
+        }
+        // A first compile is installed even when dirty, get_pipeline may be waiting for it
+        variant->pipeline = pipeline;
+        variant->state = PIPELINE_VARIANT_READY;
+
+        double wait_ms = 1000.0 * (end - variant->request_time);
+        if (wait_ms > manager->max_wait_ms) manager->max_wait_ms = wait_ms;
+        pthread_cond_broadcast(&manager->variant_ready);
+        if (!variant->dirty) break;
+    }
+    variant->compiling = false;
+}
+
+VkPipeline get_pipeline(Pipeline_Manager *manager, const Pipeline_Key *key, bool wait) {
+    // NOTE: Returns VK_NULL_HANDLE while the variant is still compiling, unless wait is set
+    uint32_t hash = hash_pipeline_key(key);
+
+    pthread_mutex_lock(&manager->mutex);
+
+    // Open addressing with linear probing. Variants are never removed, so the first empty slot ends the search.
+    uint32_t slot = hash & (PIPELINE_VARIANT_CAPACITY - 1);
+    while (manager->variants[slot].state != PIPELINE_VARIANT_EMPTY &&
+           (manager->variants[slot].hash != hash || memcmp(&manager->variants[slot].key, key, sizeof(*key)) != 0)) {
+        slot = (slot + 1) & (PIPELINE_VARIANT_CAPACITY - 1);
+    }
+
+    Pipeline_Variant *variant = &manager->variants[slot];
+    if (variant->state == PIPELINE_VARIANT_EMPTY) {
+        // Keep the table at most 3/4 full so probe sequences stay short
+        if (manager->variant_count >= PIPELINE_VARIANT_CAPACITY / 4 * 3) {
+            exit_with_error("Too many pipeline variants (%u)", manager->variant_count);
+        }
+        manager->variant_count++;
+        manager->request_count++;
+        variant->state = PIPELINE_VARIANT_PENDING;
+        variant->key = *key;
+        variant->hash = hash;
+        variant->request_time = glfwGetTime();
+
+        if (manager->thread_count == 0) {
+            compile_pipeline_variant(manager, slot);
+        } else {
+            variant->queued = true;
+            manager->queue[manager->queue_tail % PIPELINE_VARIANT_CAPACITY] = slot;
+            manager->queue_tail++;
+            pthread_cond_signal(&manager->work_ready);
+        }
+    }
+
+    if (wait) {
+        while (variant->state != PIPELINE_VARIANT_READY) {
+            pthread_cond_wait(&manager->variant_ready, &manager->mutex);
+        }
+    }
+
+    VkPipeline pipeline = variant->state == PIPELINE_VARIANT_READY ? variant->pipeline : VK_NULL_HANDLE;
+    pthread_mutex_unlock(&manager->mutex);
+
+    if (pipeline == VK_NULL_HANDLE) manager->not_ready_count++;
+    return pipeline;
+}
+
+bool resolve_material_pipelines(Pipeline_Manager *manager,
+                                Scene *scene,
+                                VkFormat color_format,
+                                uint32_t active_material_count,
+                                Pipeline_Fallback fallback) {
+    // NOTE: Picks this frame's pipeline for every material. Materials that aren't in use yet, or whose variant
+    //       is still compiling, get the fallback. Returns true when anything changed since last frame.
+    Pipeline_Key default_key = get_default_pipeline_key(color_format, scene->transform_source);
+    VkPipeline default_pipeline = get_pipeline(manager, &default_key, true);
+    VkPipeline fallback_pipeline = fallback == PIPELINE_FALLBACK_SKIP ? VK_NULL_HANDLE : default_pipeline;
+
+    bool changed = false;
+    for (uint32_t m = 0; m < scene->material_count; m++) {
+        VkPipeline pipeline = fallback_pipeline;
+        Pipeline_Key key = default_key; // What the pipeline was built from
+        if (m == 0) {
+            pipeline = default_pipeline;
+        } else if (m < active_material_count) {
+            Pipeline_Key variant_key = get_material_pipeline_key(m, color_format, scene->transform_source);
+            VkPipeline variant_pipeline = get_pipeline(manager, &variant_key, false);
+            if (variant_pipeline != VK_NULL_HANDLE) {
+                pipeline = variant_pipeline;
+                key = variant_key;
+            }
+        }
+
+        if (scene->material_pipelines[m] != pipeline) {
+            scene->material_pipelines[m] = pipeline;
+            changed = true;
+        }
+        scene->material_blended[m] = key.blend_enable == VK_TRUE;
+
+        // Blended materials are left out of the pre-pass, they don't write depth in the color pass either. A
+        // material whose depth-only variant is still compiling just rejects nothing until it's there.
+        if (scene->prepass_pipelines) {
+            VkPipeline prepass_pipeline = VK_NULL_HANDLE;
+            if (pipeline != VK_NULL_HANDLE && !scene->material_blended[m]) {
+                Pipeline_Key prepass_key = get_depth_prepass_pipeline_key(&key);
+                prepass_pipeline = get_pipeline(manager, &prepass_key, m == 0);
+            }
+            if (scene->prepass_pipelines[m] != prepass_pipeline) {
+                scene->prepass_pipelines[m] = prepass_pipeline;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+void log_pipeline_manager_stats(Pipeline_Manager *manager) {
+    pthread_mutex_lock(&manager->mutex);
+    trace_log("Pipelines: %llu compiled %s, %.2f ms average, %.2f ms worst, %.2f ms worst wait from request to ready",
+              (unsigned long long)manager->creation_count,
+              manager->thread_count > 0 ? "in the background" : "on the main thread",
+              manager->creation_count > 0 ? manager->total_compile_ms / (double)manager->creation_count : 0.0,
+              manager->max_compile_ms,
+              manager->max_wait_ms);
+    trace_log("Pipelines: %llu lookups fell back or skipped while a variant was compiling, %llu rebuilt after shader reloads",
+              (unsigned long long)manager->not_ready_count,
+              (unsigned long long)manager->rebuild_count);
+    pthread_mutex_unlock(&manager->mutex);
+}
+
+uint64_t get_pipeline_creation_count(Pipeline_Manager *manager) {
+    pthread_mutex_lock(&manager->mutex);
+    uint64_t creation_count = manager->creation_count;
+    pthread_mutex_unlock(&manager->mutex);
+    return creation_count;
+}
+
+void rebuild_shader_program_pipelines(Pipeline_Manager *manager, Shader_Program program) {
+    // NOTE: Queues every variant built from the program. The old pipelines stay in use until the new ones are
+    //       ready. Without compile threads the rebuild runs on the calling thread, which is never the render thread.
+    pthread_mutex_lock(&manager->mutex);
+    uint32_t rebuild_count = 0;
+    for (uint32_t slot = 0; slot < PIPELINE_VARIANT_CAPACITY; slot++) {
+        Pipeline_Variant *variant = &manager->variants[slot];
+        if (variant->state == PIPELINE_VARIANT_EMPTY || variant->key.shader_program != program) continue;
+        rebuild_count++;
+        variant->request_time = glfwGetTime();
+
+        if (variant->compiling) {
+            // The compile in flight may have read the old SPIR-V. Whoever runs it compiles again when it's
+            // done, which also keeps two threads from compiling the slot at once when there are no compile threads.
+            variant->dirty = true;
+        } else if (manager->thread_count == 0) {
+            compile_pipeline_variant(manager, slot);
+        } else if (!variant->queued) {
+            // A variant that is queued already will read the new SPIR-V when it gets compiled
+            variant->queued = true;
+            manager->queue[manager->queue_tail % PIPELINE_VARIANT_CAPACITY] = slot;
+            manager->queue_tail++;
+        }
+    }
+    pthread_cond_broadcast(&manager->work_ready);
+    pthread_mutex_unlock(&manager->mutex);
+
+    trace_log("Rebuilding %u pipelines for %s", rebuild_count, shader_programs[program].vertex_source);
+}
+
+void destroy_retired_pipelines(Pipeline_Manager *manager, uint64_t frame_number, uint64_t completed_frame_number, bool force) {
+    // NOTE: Same scheme as the retired swapchains: a pipeline replaced before frame_number was submitted is
+    //       only used by frames up to frame_number, so it can go once those have completed.
+    pthread_mutex_lock(&manager->mutex);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < manager->retired_count; i++) {
+        Retired_Pipeline *entry = &manager->retired[i];
+        if (entry->retire_frame_number == PIPELINE_RETIRE_FRAME_UNKNOWN) {
+            entry->retire_frame_number = frame_number;
+        }
+        if (force || entry->retire_frame_number <= completed_frame_number) {
+            vkDestroyPipeline(manager->device, entry->pipeline, NULL);
+        } else {
+            manager->retired[kept++] = *entry;
+        }
+    }
+    manager->retired_count = kept;
+    pthread_mutex_unlock(&manager->mutex);
+}
+
+Shader_Watcher *create_shader_watcher(Pipeline_Manager *manager) {
+    // NOTE: Heap allocated because the thread holds on to its address
+    Shader_Watcher *watcher = xmalloc(sizeof(Shader_Watcher));
+    memset(watcher, 0, sizeof(Shader_Watcher));
+    watcher->manager = manager;
+
+    watcher->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (watcher->inotify_fd < 0) exit_with_error("Failed to initialize inotify");
+    // Watch the directory rather than the files: editors often save by writing a new file and renaming it over
+    if (inotify_add_watch(watcher->inotify_fd, SHADER_SOURCE_DIRECTORY, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        exit_with_error("Failed to watch %s", SHADER_SOURCE_DIRECTORY);
+    }
+    if (pipe(watcher->quit_pipe) != 0) exit_with_error("Failed to create shader watcher pipe");
+
+    if (pthread_create(&watcher->thread, NULL, shader_watcher_main, watcher) != 0) {
+        exit_with_error("Failed to start shader watcher thread");
+    }
+
+    trace_log("Watching %s for shader changes", SHADER_SOURCE_DIRECTORY);
+    return watcher;
+}
+
+void destroy_shader_watcher(Shader_Watcher *watcher) {
+    char quit = 1;
+    if (write(watcher->quit_pipe[1], &quit, 1) != 1) exit_with_error("Failed to stop shader watcher");
+    pthread_join(watcher->thread, NULL);
+
+    close(watcher->quit_pipe[0]);
+    close(watcher->quit_pipe[1]);
+    close(watcher->inotify_fd);
+    free(watcher);
+}
+
+void *shader_watcher_main(void *arg) {
+    Shader_Watcher *watcher = arg;
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            {watcher->inotify_fd, POLLIN, 0},
+            {watcher->quit_pipe[0], POLLIN, 0},
+        };
+        if (poll(fds, 2, -1) < 0) continue;
+        if (fds[1].revents & POLLIN) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        // One save tends to produce several events, so collect everything that's pending before compiling.
+        // A source can be shared between programs (basic.frag.glsl is), so each one is listed, compiled and
+        // installed once, and source_index maps a program's changed stages onto the list.
+        bool changed[SHADER_PROGRAM_COUNT][2] = {{false}};
+        uint32_t source_index[SHADER_PROGRAM_COUNT][2];
+        const char *sources[SHADER_PROGRAM_COUNT * 2];
+        const char *spirv_names[SHADER_PROGRAM_COUNT * 2];
+        bool accepted[SHADER_PROGRAM_COUNT * 2];
+        uint32_t source_count = 0;
+        // The union keeps the buffer aligned for the event structs
+        union {
+            struct inotify_event event;
+            char bytes[4096];
+        } buffer;
+        ssize_t length = read(watcher->inotify_fd, buffer.bytes, sizeof(buffer.bytes));
+        for (ssize_t offset = 0; offset < length;) {
+            struct inotify_event *event = (struct inotify_event *)(buffer.bytes + offset);
+            offset += (ssize_t)(sizeof(struct inotify_event) + event->len);
+            if (event->len == 0) continue;
+
+            for (uint32_t p = 0; p < SHADER_PROGRAM_COUNT; p++) {
+                const char *program_sources[2] = {shader_programs[p].vertex_source, shader_programs[p].fragment_source};
+                const char *program_spirv[2] = {shader_programs[p].vertex_spirv, shader_programs[p].fragment_spirv};
+                for (uint32_t stage = 0; stage < 2; stage++) {
+                    const char *file_name = strrchr(program_sources[stage], '/') + 1;
+                    if (changed[p][stage] || strcmp(event->name, file_name) != 0) continue;
+
+                    uint32_t index = 0;
+                    while (index < source_count && strcmp(sources[index], program_sources[stage]) != 0) index++;
+                    if (index == source_count) {
+                        sources[source_count] = program_sources[stage];
+                        spirv_names[source_count] = program_spirv[stage];
+                        source_count++;
+                    }
+                    changed[p][stage] = true;
+                    source_index[p][stage] = index;
+                }
+            }
+        }
+
+        // NOTE: New SPIR-V stays pending until every program built from it has reflected it, so the installed
+        //       files always match the running pipelines. On a compile error the old SPIR-V and pipelines stay,
+        //       fix the shader and save again.
+        char spirv_paths[SHADER_PROGRAM_COUNT * 2][1024];
+        char pending_paths[SHADER_PROGRAM_COUNT * 2][1024 + sizeof(PENDING_SPIRV_SUFFIX)];
+        for (uint32_t i = 0; i < source_count; i++) {
+            snprintf(spirv_paths[i], sizeof(spirv_paths[i]), "%s/%s", shader_binary_directory, spirv_names[i]);
+            snprintf(pending_paths[i], sizeof(pending_paths[i]), "%s%s", spirv_paths[i], PENDING_SPIRV_SUFFIX);
+            accepted[i] = compile_shader_source(sources[i], pending_paths[i]);
+        }
+
+        // Pipeline layouts and vertex input are fixed at startup, a reload can only change the code
+        for (uint32_t p = 0; p < SHADER_PROGRAM_COUNT; p++) {
+            Shader_Program_Info *program = &shader_programs[p];
+            if (!(changed[p][0] || changed[p][1])) continue;
+
+            bool ok = true;
+            for (uint32_t stage = 0; stage < 2; stage++) {
+                if (changed[p][stage]) ok = ok && accepted[source_index[p][stage]];
+            }
+
+            Shader_Program_Interface interface;
+            if (!ok) {
+                // Already reported by the compile
+            } else if (!reflect_shader_program((Shader_Program)p, true, changed[p], &interface)) {
+                trace_log("Shader interface errors in %s, keeping the old pipelines", program->vertex_source);
+                ok = false;
+            } else if (memcmp(&interface, &watcher->manager->program_layouts[p].interface, sizeof(interface)) != 0) {
+                trace_log("%s changed its inputs, bindings or push constants, restart to pick that up", program->vertex_source);
+                ok = false;
+            }
+
+            for (uint32_t stage = 0; stage < 2; stage++) {
+                if (changed[p][stage] && !ok) accepted[source_index[p][stage]] = false;
+            }
+        }
+
+        // A source one program rejects is rejected for every program, along with the other changed stage of
+        // those programs, so nothing gets installed that a program's running pipelines weren't rebuilt from
+        bool reload[SHADER_PROGRAM_COUNT];
+        for (bool again = true; again;) {
+            again = false;
+            for (uint32_t p = 0; p < SHADER_PROGRAM_COUNT; p++) {
+                reload[p] = changed[p][0] || changed[p][1];
+                for (uint32_t stage = 0; stage < 2; stage++) {
+                    if (changed[p][stage] && !accepted[source_index[p][stage]]) reload[p] = false;
+                }
+                for (uint32_t stage = 0; stage < 2; stage++) {
+                    if (!reload[p] && changed[p][stage] && accepted[source_index[p][stage]]) {
+                        accepted[source_index[p][stage]] = false;
+                        again = true;
+                    }
+                }
+            }
+        }
+
+        for (uint32_t i = 0; i < source_count; i++) {
+            if (!accepted[i]) {
+                remove(pending_paths[i]);
+            } else if (rename(pending_paths[i], spirv_paths[i]) != 0) {
+                trace_log("WARNING: Failed to replace %s, keeping the old version", spirv_paths[i]);
+                remove(pending_paths[i]);
+                accepted[i] = false;
+            }
+        }
+        // A program with a stage that didn't get installed has nothing new to rebuild from. Its other stage may
+        // have been installed already, the next reload of the program picks that up.
+        for (uint32_t p = 0; p < SHADER_PROGRAM_COUNT; p++) {
+            for (uint32_t stage = 0; stage < 2; stage++) {
+                if (changed[p][stage] && !accepted[source_index[p][stage]]) reload[p] = false;
+            }
+        }
+
+        // Only once everything is installed, so each rebuild reads the new SPIR-V of every stage it shares
+        for (uint32_t p = 0; p < SHADER_PROGRAM_COUNT; p++) {
+            if (reload[p]) rebuild_shader_program_pipelines(watcher->manager, (Shader_Program)p);
+        }
+    }
+
+    return NULL;
+}
+
+bool compile_shader_source(const char *source_path, const char *spirv_path) {
+    // NOTE: The watcher compiles to a pending file next to the real one and renames it over once the SPIR-V
+    //       has been reflected, so a pipeline compile never reads a half-written or rejected file
+    char command[1536];
+    snprintf(command, sizeof(command), "glslangValidator -V '%s' -o '%s' > /dev/null", source_path, spirv_path);
+
+    double start = glfwGetTime();
+    if (system(command) != 0) {
+        trace_log("Shader compile failed, keeping the old version: %s (run '%s' for the errors)", source_path, command);
+        remove(spirv_path);
+        return false;
+    }
+
+    trace_log("Recompiled %s in %.1f ms", source_path, 1000.0 * (glfwGetTime() - start));
+    return true;
+}
+
+uint32_t find_memory_type(VkPhysicalDevice physical_device, uint32_t type_filter, VkMemoryPropertyFlags properties) {
+    /*
+      typedef struct VkMemoryType {
+          VkMemoryPropertyFlags    propertyFlags;
+          uint32_t                 heapIndex;
+      } VkMemoryType;
+
+      typedef enum VkMemoryHeapFlagBits {
+          VK_MEMORY_HEAP_DEVICE_LOCAL_BIT = 0x00000001,
+          VK_MEMORY_HEAP_MULTI_INSTANCE_BIT = 0x00000002,
+          VK_MEMORY_HEAP_MULTI_INSTANCE_BIT_KHR = VK_MEMORY_HEAP_MULTI_INSTANCE_BIT,
+          VK_MEMORY_HEAP_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+      } VkMemoryHeapFlagBits;
+
+      typedef struct VkMemoryHeap {
+          VkDeviceSize         size;
+          VkMemoryHeapFlags    flags;
+      } VkMemoryHeap;
+
+      typedef struct VkPhysicalDeviceMemoryProperties {
+          uint32_t        memoryTypeCount;
+          VkMemoryType    memoryTypes[VK_MAX_MEMORY_TYPES];
+          uint32_t        memoryHeapCount;
+          VkMemoryHeap    memoryHeaps[VK_MAX_MEMORY_HEAPS];
+      } VkPhysicalDeviceMemoryProperties;
+    */
+    VkPhysicalDeviceMemoryProperties mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_properties);
+
+    // NOTE: The spec orders memory types so that the first match is the best one (fewest extra properties,
+    //       fastest heap), so stop there. Taking the last match could land device local requests in
+    //       host-visible BAR memory.
+    bool memory_type_index_found = false;
+    uint32_t memory_type_index = 0;
+    for (uint32_t i = 0; i < mem_properties.memoryTypeCount; i++) {
+        if ((type_filter & (1 << i)) && ((mem_properties.memoryTypes[i].propertyFlags & properties) == properties)) {
+            memory_type_index_found = true;
+            memory_type_index = i;
+            break;
+        }
+    }
+
+    if (!memory_type_index_found) {
+        exit_with_error("Failed to find suitable memory type");
+    }
+
+    return memory_type_index;
+}
+
+Scene create_scene(uint32_t draw_count, uint32_t mesh_grid_size, uint32_t material_count, float overlap) {
+    Scene scene = {0};
+    scene.clear_color = (VkClearValue){{{0.0f, 0.0f, 0.0f, 1.0f}}};
+    scene.version = 1;
+
+    if (mesh_grid_size > 0) {
+        generate_grid_mesh(&scene, mesh_grid_size);
+    } else {
+        // NOTE: draw_count copies of the triangle laid out on a square grid.
+        //       With a single draw this is the original full-size triangle. --overlap scales every triangle
+        //       up in place, so each pixel is covered about that many times over.
+        uint32_t triangle_vertex_count = sizeof(vertices) / sizeof(vertices[0]);
+        scene.vertex_count = draw_count * triangle_vertex_count;
+        scene.vertices = xmalloc(sizeof(Vertex) * scene.vertex_count);
+        scene.index_count = scene.vertex_count;
+        scene.indices = xmalloc(sizeof(uint32_t) * scene.index_count);
+
+        uint32_t columns = 1;
+        while (columns * columns < draw_count) columns++;
+        float cell_size = 2.0f / (float)columns;
+
+        for (uint32_t i = 0; i < draw_count; i++) {
+            float center_x = -1.0f + cell_size * ((float)(i % columns) + 0.5f);
+            float center_y = -1.0f + cell_size * ((float)(i / columns) + 0.5f);
+
+            for (uint32_t v = 0; v < triangle_vertex_count; v++) {
+                Vertex *vertex = &scene.vertices[i * triangle_vertex_count + v];
+                *vertex = vertices[v];
+                vertex->position[0] = center_x + vertices[v].position[0] * cell_size * 0.5f * overlap;
+                vertex->position[1] = center_y + vertices[v].position[1] * cell_size * 0.5f * overlap;
+                scene.indices[i * triangle_vertex_count + v] = i * triangle_vertex_count + v;
+            }
+        }
+    }
+
+    optimize_scene_mesh(&scene);
+
+    // One draw per contiguous, triangle-aligned slice of the optimized index list, so every draw
+    // gets a spatially coherent piece of the mesh
+    uint32_t triangle_count = scene.index_count / 3;
+    if (draw_count > triangle_count) draw_count = triangle_count;
+    scene.draw_count = draw_count;
+    scene.draws = xmalloc(sizeof(Draw_Command) * draw_count);
+    for (uint32_t i = 0; i < draw_count; i++) {
+        uint32_t first_triangle = (uint32_t)((uint64_t)triangle_count * i / draw_count);
+        uint32_t end_triangle = (uint32_t)((uint64_t)triangle_count * (i + 1) / draw_count);
+        scene.draws[i].first_index = first_triangle * 3;
+        scene.draws[i].index_count = (end_triangle - first_triangle) * 3;
+        // Contiguous runs of draws share a material, so pipeline binds stay at one per material
+        scene.draws[i].material = (uint32_t)((uint64_t)material_count * i / draw_count);
+    }
+
+    // Every draw is an object that can move on its own. Transforms start out as the identity, plus one more
+    // for the dynamic geometry.
+    scene.object_centers = xmalloc(sizeof(float) * 2 * draw_count);
+    scene.object_radii = xmalloc(sizeof(float) * draw_count);
+    scene.object_transforms = xmalloc(sizeof(Object_Transform) * (draw_count + 1));
+    scene.vertex_objects = xmalloc(sizeof(uint32_t) * scene.vertex_count);
+    memset(scene.vertex_objects, 0, sizeof(uint32_t) * scene.vertex_count);
+    for (uint32_t i = 0; i < draw_count; i++) {
+        Draw_Command *draw = &scene.draws[i];
+        float sum[2] = {0.0f, 0.0f};
+        for (uint32_t k = draw->first_index; k < draw->first_index + draw->index_count; k++) {
+            uint32_t v = scene.indices[k];
+            sum[0] += scene.vertices[v].position[0];
+            sum[1] += scene.vertices[v].position[1];
+            scene.vertex_objects[v] = i;
+        }
+        scene.object_centers[i * 2 + 0] = sum[0] / (float)draw->index_count;
+        scene.object_centers[i * 2 + 1] = sum[1] / (float)draw->index_count;
+
+        float radius_squared = 0.0f;
+        for (uint32_t k = draw->first_index; k < draw->first_index + draw->index_count; k++) {
+            const Vertex *vertex = &scene.vertices[scene.indices[k]];
+            float dx = vertex->position[0] - scene.object_centers[i * 2 + 0];
+            float dy = vertex->position[1] - scene.object_centers[i * 2 + 1];
+            if (dx * dx + dy * dy > radius_squared) radius_squared = dx * dx + dy * dy;
+        }
+        scene.object_radii[i] = sqrtf(radius_squared);
+    }
+    for (uint32_t i = 0; i <= draw_count; i++) {
+        Object_Transform identity = {{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}}};
+        scene.object_transforms[i] = identity;
+    }
+
+    scene.camera = (Camera){{0.0f, 0.0f}, 1.0f};
+
+    scene.material_count = material_count;
+    scene.material_pipelines = xmalloc(sizeof(VkPipeline) * material_count);
+    scene.material_blended = xmalloc(sizeof(bool) * material_count);
+    for (uint32_t m = 0; m < material_count; m++) {
+        scene.material_pipelines[m] = VK_NULL_HANDLE;
+        scene.material_blended[m] = false;
+    }
+
+    // 16-bit indices halve index fetch bandwidth whenever every vertex can be addressed with them
+    scene.index_type = scene.vertex_count <= UINT16_MAX + 1 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+
+    return scene;
+}
+
+void destroy_scene(Scene *scene) {
+    free(scene->vertices);
+    free(scene->indices);
+    free(scene->draws);
+    free(scene->material_pipelines);
+    free(scene->material_blended);
+    free(scene->prepass_pipelines);
+    free(scene->object_centers);
+    free(scene->object_radii);
+    free(scene->object_transforms);
+    free(scene->vertex_objects);
+    scene->vertices = NULL;
+    scene->indices = NULL;
+    scene->draws = NULL;
+    scene->material_pipelines = NULL;
+    scene->material_blended = NULL;
+    scene->prepass_pipelines = NULL;
+    scene->object_centers = NULL;
+    scene->object_radii = NULL;
+    scene->object_transforms = NULL;
+    scene->vertex_objects = NULL;
+}
+
+void generate_grid_mesh(Scene *scene, uint32_t grid_size) {
+    // NOTE: A grid_size x grid_size quad grid, written out the way a careless exporter would: as a triangle
+    //       soup with every corner duplicated and the triangles in random order. That's the optimizer's worst case.
+    uint32_t triangle_count = grid_size * grid_size * 2;
+    scene->vertex_count = triangle_count * 3;
+    scene->vertices = xmalloc(sizeof(Vertex) * scene->vertex_count);
+    scene->index_count = triangle_count * 3;
+    scene->indices = xmalloc(sizeof(uint32_t) * scene->index_count);
+
+    float cell_size = 1.8f / (float)grid_size;
+    uint32_t corner_offsets[6][2] = {{0, 0}, {1, 0}, {0, 1}, {1, 0}, {1, 1}, {0, 1}};
+    uint32_t v = 0;
+    for (uint32_t y = 0; y < grid_size; y++) {
+        for (uint32_t x = 0; x < grid_size; x++) {
+            for (uint32_t c = 0; c < 6; c++) {
+                uint32_t corner_x = x + corner_offsets[c][0];
+                uint32_t corner_y = y + corner_offsets[c][1];
+                Vertex *vertex = &scene->vertices[v];
+                vertex->position[0] = -0.9f + cell_size * (float)corner_x;
+                vertex->position[1] = -0.9f + cell_size * (float)corner_y;
+                vertex->color[0] = (float)corner_x / (float)grid_size;
+                vertex->color[1] = (float)corner_y / (float)grid_size;
+                vertex->color[2] = 0.5f;
+                scene->indices[v] = v;
+                v++;
+            }
+        }
+    }
+
+    // Shuffle the triangles (Fisher-Yates with xorshift32)
+    uint32_t rng = 0x2545f491u;
+    for (uint32_t i = triangle_count - 1; i > 0; i--) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        uint32_t j = rng % (i + 1);
+        for (uint32_t k = 0; k < 3; k++) {
+            uint32_t temp = scene->indices[i * 3 + k];
+            scene->indices[i * 3 + k] = scene->indices[j * 3 + k];
+            scene->indices[j * 3 + k] = temp;
+        }
+    }
+}
+
+uint32_t deduplicate_vertices(Vertex *vertices, uint32_t vertex_count, uint32_t *indices, uint32_t index_count) {
+    // NOTE: Bitwise equality, found with an open addressing hash table. Vertices are compacted in place
+    //       (a unique vertex never moves up) and the indices are rewritten to match.
+    uint32_t table_size = 1;
+    while (table_size < vertex_count * 2) table_size *= 2;
+    uint32_t *table = xmalloc(sizeof(uint32_t) * table_size);
+    memset(table, 0xff, sizeof(uint32_t) * table_size);
+    uint32_t *remap = xmalloc(sizeof(uint32_t) * vertex_count);
+
+    uint32_t unique_count = 0;
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        // FNV-1a
+        const uint8_t *bytes = (const uint8_t *)&vertices[i];
+        uint32_t hash = 2166136261u;
+        for (size_t b = 0; b < sizeof(Vertex); b++) {
+            hash = (hash ^ bytes[b]) * 16777619u;
+        }
+
+        uint32_t slot = hash & (table_size - 1);
+        while (table[slot] != UINT32_MAX && memcmp(&vertices[table[slot]], &vertices[i], sizeof(Vertex)) != 0) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] == UINT32_MAX) {
+            vertices[unique_count] = vertices[i];
+            table[slot] = unique_count++;
+        }
+        remap[i] = table[slot];
+    }
+
+    for (uint32_t i = 0; i < index_count; i++) {
+        indices[i] = remap[indices[i]];
+    }
+
+    free(remap);
+    free(table);
+    return unique_count;
+}
+
+float forsyth_vertex_score(int32_t cache_position, uint32_t remaining_triangles) {
+    // NOTE: Tom Forsyth's "Linear-Speed Vertex Cache Optimisation" scoring, with his suggested constants
+    if (remaining_triangles == 0) return -1.0f;
+
+    float score = 0.0f;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            // Used by the last triangle. Deliberately lower so the next triangle doesn't just reuse its edge.
+            score = 0.75f;
+        } else {
+            float scaler = 1.0f / (float)(FORSYTH_CACHE_SIZE - 3);
+            score = powf(1.0f - (float)(cache_position - 3) * scaler, 1.5f);
+        }
+    }
+    // Boost vertices with few triangles left, so they get finished off instead of lingering
+    score += 2.0f * powf((float)remaining_triangles, -0.5f);
+    return score;
+}
+
+void optimize_vertex_cache(uint32_t *indices, uint32_t index_count, uint32_t vertex_count) {
+    uint32_t triangle_count = index_count / 3;
+    if (triangle_count == 0) return;
+
+    // Per-vertex list of the triangles still to be emitted
+    uint32_t *remaining = xmalloc(sizeof(uint32_t) * vertex_count);
+    uint32_t *adjacency_offsets = xmalloc(sizeof(uint32_t) * (vertex_count + 1));
+    uint32_t *adjacency = xmalloc(sizeof(uint32_t) * index_count);
+    memset(remaining, 0, sizeof(uint32_t) * vertex_count);
+    for (uint32_t i = 0; i < index_count; i++) remaining[indices[i]]++;
+    adjacency_offsets[0] = 0;
+    for (uint32_t v = 0; v < vertex_count; v++) adjacency_offsets[v + 1] = adjacency_offsets[v] + remaining[v];
+    memset(remaining, 0, sizeof(uint32_t) * vertex_count);
+    for (uint32_t i = 0; i < index_count; i++) {
+        uint32_t v = indices[i];
+        adjacency[adjacency_offsets[v] + remaining[v]++] = i / 3;
+    }
+
+    int32_t *cache_positions = xmalloc(sizeof(int32_t) * vertex_count);
+    float *vertex_scores = xmalloc(sizeof(float) * vertex_count);
+    for (uint32_t v = 0; v < vertex_count; v++) {
+        cache_positions[v] = -1;
+        vertex_scores[v] = forsyth_vertex_score(-1, remaining[v]);
+    }
+
+    float *triangle_scores = xmalloc(sizeof(float) * triangle_count);
+    bool *emitted = xmalloc(sizeof(bool) * triangle_count);
+    uint32_t best_triangle = 0;
+    for (uint32_t t = 0; t < triangle_count; t++) {
+        emitted[t] = false;
+        triangle_scores[t] = vertex_scores[indices[t * 3 + 0]] +
+                             vertex_scores[indices[t * 3 + 1]] +
+                             vertex_scores[indices[t * 3 + 2]];
+        if (triangle_scores[t] > triangle_scores[best_triangle]) best_triangle = t;
+    }
+
+    uint32_t *output = xmalloc(sizeof(uint32_t) * index_count);
+    uint32_t cache[FORSYTH_CACHE_SIZE + 3];
+    uint32_t cache_count = 0;
+    uint32_t scan_cursor = 0;
+
+    for (uint32_t emitted_count = 0; emitted_count < triangle_count; emitted_count++) {
+        if (best_triangle == UINT32_MAX) {
+            // Nothing in the cache touches a remaining triangle, so start over at the next unemitted one
+            while (emitted[scan_cursor]) scan_cursor++;
+            best_triangle = scan_cursor;
+        }
+
+        uint32_t t = best_triangle;
+        emitted[t] = true;
+        uint32_t new_cache[FORSYTH_CACHE_SIZE + 3];
+        uint32_t new_cache_count = 0;
+        for (uint32_t k = 0; k < 3; k++) {
+            uint32_t v = indices[t * 3 + k];
+            output[emitted_count * 3 + k] = v;
+            new_cache[new_cache_count++] = v;
+
+            // Take the triangle off the vertex's list
+            uint32_t *list = &adjacency[adjacency_offsets[v]];
+            for (uint32_t a = 0; a < remaining[v]; a++) {
+                if (list[a] == t) {
+                    list[a] = list[remaining[v] - 1];
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+
+        // The triangle's vertices go to the front, the rest of the old cache shifts back
+        for (uint32_t c = 0; c < cache_count; c++) {
+            uint32_t v = cache[c];
+            if (v != indices[t * 3 + 0] && v != indices[t * 3 + 1] && v != indices[t * 3 + 2]) {
+                new_cache[new_cache_count++] = v;
+            }
+        }
+        for (uint32_t c = FORSYTH_CACHE_SIZE; c < new_cache_count; c++) {
+            // Fell out of the cache
+            cache_positions[new_cache[c]] = -1;
+            vertex_scores[new_cache[c]] = forsyth_vertex_score(-1, remaining[new_cache[c]]);
+        }
+        cache_count = new_cache_count < FORSYTH_CACHE_SIZE ? new_cache_count : FORSYTH_CACHE_SIZE;
+        memcpy(cache, new_cache, sizeof(uint32_t) * cache_count);
+
+        for (uint32_t c = 0; c < cache_count; c++) {
+            cache_positions[cache[c]] = (int32_t)c;
+            vertex_scores[cache[c]] = forsyth_vertex_score((int32_t)c, remaining[cache[c]]);
+        }
+
+        // Only triangles touching the cache changed score, and the next one is picked among them
+        best_triangle = UINT32_MAX;
+        float best_score = -1.0f;
+        for (uint32_t c = 0; c < new_cache_count; c++) {
+            uint32_t v = new_cache[c];
+            uint32_t *list = &adjacency[adjacency_offsets[v]];
+            for (uint32_t a = 0; a < remaining[v]; a++) {
+                uint32_t adjacent = list[a];
+                float score = vertex_scores[indices[adjacent * 3 + 0]] +
+                              vertex_scores[indices[adjacent * 3 + 1]] +
+                              vertex_scores[indices[adjacent * 3 + 2]];
+                triangle_scores[adjacent] = score;
+                if (score > best_score) {
+                    best_score = score;
+                    best_triangle = adjacent;
+                }
+            }
+        }
+    }
+
+    memcpy(indices, output, sizeof(uint32_t) * index_count);
+
+    free(output);
+    free(emitted);
+    free(triangle_scores);
+    free(vertex_scores);
+    free(cache_positions);
+    free(adjacency);
+    free(adjacency_offsets);
+    free(remaining);
+}
+
+void optimize_vertex_fetch(Vertex *vertices, uint32_t vertex_count, uint32_t *indices, uint32_t index_count) {
+    // NOTE: Renumber vertices in order of first use, so vertex fetch walks the buffer front to back
+    uint32_t *remap = xmalloc(sizeof(uint32_t) * vertex_count);
+    memset(remap, 0xff, sizeof(uint32_t) * vertex_count);
+    Vertex *reordered = xmalloc(sizeof(Vertex) * vertex_count);
+
+    uint32_t next_vertex = 0;
+    for (uint32_t i = 0; i < index_count; i++) {
+        uint32_t v = indices[i];
+        if (remap[v] == UINT32_MAX) {
+            remap[v] = next_vertex;
+            reordered[next_vertex++] = vertices[v];
+        }
+        indices[i] = remap[v];
+    }
+    // Unreferenced vertices keep their relative order at the end
+    for (uint32_t v = 0; v < vertex_count; v++) {
+        if (remap[v] == UINT32_MAX) reordered[next_vertex++] = vertices[v];
+    }
+
+    memcpy(vertices, reordered, sizeof(Vertex) * vertex_count);
+    free(reordered);
+    free(remap);
+}
+
+float compute_acmr(const uint32_t *indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size) {
+    // NOTE: Average cache miss ratio (post-transform misses per triangle) against a FIFO cache,
+    //       the usual model for hardware vertex reuse. 3.0 is no reuse, ~0.5 is the ideal for a regular grid.
+    if (index_count < 3) return 0.0f;
+
+    uint64_t *inserted_at = xmalloc(sizeof(uint64_t) * vertex_count);
+    memset(inserted_at, 0, sizeof(uint64_t) * vertex_count);
+    uint64_t misses = 0;
+    for (uint32_t i = 0; i < index_count; i++) {
+        uint32_t v = indices[i];
+        // inserted_at is the miss count when the vertex entered the cache (+1, so 0 means never)
+        if (inserted_at[v] == 0 || misses - (inserted_at[v] - 1) >= cache_size) {
+            inserted_at[v] = misses + 1;
+            misses++;
+        }
+    }
+    free(inserted_at);
+
+    return (float)misses / (float)(index_count / 3);
+}
+
+void optimize_scene_mesh(Scene *scene) {
+    double start = glfwGetTime();
+    uint32_t original_vertex_count = scene->vertex_count;
+
+    scene->vertex_count = deduplicate_vertices(scene->vertices, scene->vertex_count, scene->indices, scene->index_count);
+    float acmr_before = compute_acmr(scene->indices, scene->index_count, scene->vertex_count, 16);
+
+    // Runs before the index list is split into draws, which then inherit the optimized order
+    optimize_vertex_cache(scene->indices, scene->index_count, scene->vertex_count);
+    optimize_vertex_fetch(scene->vertices, scene->vertex_count, scene->indices, scene->index_count);
+
+    float acmr_after = compute_acmr(scene->indices, scene->index_count, scene->vertex_count, 16);
+    double elapsed_ms = 1000.0 * (glfwGetTime() - start);
+
+    trace_log("Mesh: %u triangles, %u -> %u vertices after dedup, ACMR %.3f -> %.3f (FIFO 16), optimized in %.1f ms",
+              scene->index_count / 3,
+              original_vertex_count,
+              scene->vertex_count,
+              acmr_before,
+              acmr_after,
+              elapsed_ms);
+}
+
+Device_Allocator create_device_allocator(VkPhysicalDevice physical_device, VkDevice device) {
+    Device_Allocator allocator = {0};
+    allocator.physical_device = physical_device;
+    allocator.device = device;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &allocator.memory_properties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    allocator.buffer_image_granularity = properties.limits.bufferImageGranularity;
+
+    return allocator;
+}
+
+void destroy_device_allocator(Device_Allocator *allocator) {
+    for (uint32_t i = 0; i < allocator->block_count; i++) {
+        Memory_Block *block = &allocator->blocks[i];
+        if (block->memory == VK_NULL_HANDLE) continue;
+        if (block->live_count > 0) {
+            trace_log("WARNING: Device memory block %u destroyed with %u live allocations", i, block->live_count);
+        }
+        destroy_memory_block(allocator, i);
+    }
+    free(allocator->blocks);
+    allocator->blocks = NULL;
+    allocator->block_count = 0;
+    allocator->block_capacity = 0;
+}
+
+uint32_t create_memory_block(Device_Allocator *allocator,
+                             uint32_t memory_type_index,
+                             VkDeviceSize size,
+                             Allocation_Strategy strategy) {
+    uint32_t block_index = allocator->block_count;
+    for (uint32_t i = 0; i < allocator->block_count; i++) {
+        if (allocator->blocks[i].memory == VK_NULL_HANDLE) {
+            block_index = i;
+            break;
+        }
+    }
+    if (block_index == allocator->block_count) {
+        if (allocator->block_count == allocator->block_capacity) {
+            allocator->block_capacity = allocator->block_capacity ? allocator->block_capacity * 2 : 16;
+            allocator->blocks = realloc(allocator->blocks, sizeof(Memory_Block) * allocator->block_capacity);
+            if (!allocator->blocks) exit_with_error("Failed to grow device memory block list");
+        }
+        allocator->block_count++;
+    }
+
+    Memory_Block *block = &allocator->blocks[block_index];
+    memset(block, 0, sizeof(Memory_Block));
+    block->size = size;
+    block->memory_type_index = memory_type_index;
+    block->strategy = strategy;
+
+    /*
+      typedef struct VkMemoryAllocateInfo {
+          VkStructureType    sType;
+          const void*        pNext;
+          VkDeviceSize       allocationSize;
+          uint32_t           memoryTypeIndex;
+      } VkMemoryAllocateInfo;
+    */
+    VkMemoryAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = memory_type_index;
+
+    // VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkDeviceMemory)
+    if (vkAllocateMemory(allocator->device, &alloc_info, NULL, &block->memory) != VK_SUCCESS) {
+        exit_with_error("Failed to allocate %llu bytes of device memory", (unsigned long long)size);
+    }
+    allocator->block_allocation_count++;
+
+    /*
+      typedef enum VkMemoryPropertyFlagBits {
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT = 0x00000001,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT = 0x00000002,
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT = 0x00000004,
+          VK_MEMORY_PROPERTY_HOST_CACHED_BIT = 0x00000008,
+          VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT = 0x00000010,
+          VK_MEMORY_PROPERTY_PROTECTED_BIT = 0x00000020,
+          VK_MEMORY_PROPERTY_DEVICE_COHERENT_BIT_AMD = 0x00000040,
+          VK_MEMORY_PROPERTY_DEVICE_UNCACHED_BIT_AMD = 0x00000080,
+          VK_MEMORY_PROPERTY_RDMA_CAPABLE_BIT_NV = 0x00000100,
+          VK_MEMORY_PROPERTY_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+      } VkMemoryPropertyFlagBits;
+      typedef VkFlags VkMemoryPropertyFlags;
+    */
+    VkMemoryPropertyFlags memory_flags = allocator->memory_properties.memoryTypes[memory_type_index].propertyFlags;
+    if (memory_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        // NOTE: Mapped once for the block's whole lifetime. Allocations hand out pointers into it.
+        /*
+          VKAPI_ATTR VkResult VKAPI_CALL vkMapMemory(
+              VkDevice                                    device,
+              VkDeviceMemory                              memory,
+              VkDeviceSize                                offset,
+              VkDeviceSize                                size,
+              VkMemoryMapFlags                            flags,
+              void**                                      ppData);
+        */
+        if (vkMapMemory(allocator->device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped) != VK_SUCCESS) {
+            exit_with_error("Failed to map device memory block");
+        }
+    }
+
+    if (strategy == ALLOCATION_STRATEGY_BUDDY) {
+        uint32_t unit_count = (uint32_t)(size / BUDDY_MIN_BLOCK_SIZE);
+        block->free_next = xmalloc(sizeof(uint32_t) * unit_count);
+        block->free_prev = xmalloc(sizeof(uint32_t) * unit_count);
+        block->free_orders = xmalloc(sizeof(uint8_t) * unit_count);
+        memset(block->free_orders, 0, sizeof(uint8_t) * unit_count);
+        for (uint32_t order = 0; order < BUDDY_ORDER_COUNT; order++) {
+            block->free_heads[order] = UINT32_MAX;
+        }
+        buddy_push(block, 0, BUDDY_ORDER_COUNT - 1);
+    }
+
+    return block_index;
+}
+
+void destroy_memory_block(Device_Allocator *allocator, uint32_t block_index) {
+    Memory_Block *block = &allocator->blocks[block_index];
+    // Freeing the memory also unmaps it
+    vkFreeMemory(allocator->device, block->memory, NULL);
+    free(block->free_next);
+    free(block->free_prev);
+    free(block->free_orders);
+    memset(block, 0, sizeof(Memory_Block));
+}
+
+void buddy_push(Memory_Block *block, uint32_t unit, uint32_t order) {
+    block->free_orders[unit] = (uint8_t)(order + 1);
+    block->free_prev[unit] = UINT32_MAX;
+    block->free_next[unit] = block->free_heads[order];
+    if (block->free_heads[order] != UINT32_MAX) {
+        block->free_prev[block->free_heads[order]] = unit;
+    }
+    block->free_heads[order] = unit;
+}
+
+void buddy_remove(Memory_Block *block, uint32_t unit, uint32_t order) {
+    uint32_t prev = block->free_prev[unit];
+    uint32_t next = block->free_next[unit];
+    if (prev != UINT32_MAX) block->free_next[prev] = next;
+    else block->free_heads[order] = next;
+    if (next != UINT32_MAX) block->free_prev[next] = prev;
+    block->free_orders[unit] = 0;
+}
+
+uint32_t buddy_order_for_size(VkDeviceSize size) {
+    uint32_t order = 0;
+    while (((VkDeviceSize)BUDDY_MIN_BLOCK_SIZE << order) < size) order++;
+    return order;
+}
+
+bool allocate_from_block(Memory_Block *block,
+                         VkDeviceSize size,
+                         VkDeviceSize alignment,
+                         VkDeviceSize *offset,
+                         VkDeviceSize *reserved_size) {
+    if (block->strategy == ALLOCATION_STRATEGY_BUDDY) {
+        // NOTE: A block of order k starts on a multiple of its own size, so rounding the size up to
+        //       the alignment is all it takes to satisfy the alignment.
+        uint32_t order = buddy_order_for_size(size > alignment ? size : alignment);
+        if (order >= BUDDY_ORDER_COUNT) return false;
+
+        uint32_t free_order = order;
+        while (free_order < BUDDY_ORDER_COUNT && block->free_heads[free_order] == UINT32_MAX) free_order++;
+        if (free_order == BUDDY_ORDER_COUNT) return false;
+
+        uint32_t unit = block->free_heads[free_order];
+        buddy_remove(block, unit, free_order);
+        // Split down, handing the upper halves back to the free lists
+        while (free_order > order) {
+            free_order--;
+            buddy_push(block, unit + (1u << free_order), free_order);
+        }
+
+        *offset = (VkDeviceSize)unit * BUDDY_MIN_BLOCK_SIZE;
+        *reserved_size = (VkDeviceSize)BUDDY_MIN_BLOCK_SIZE << order;
+        return true;
+    } else if (block->strategy == ALLOCATION_STRATEGY_LINEAR) {
+        VkDeviceSize aligned_offset = align_up(block->linear_offset, alignment);
+        if (aligned_offset + size > block->size) return false;
+
+        // The alignment padding is charged to this allocation, it only comes back when the block rewinds
+        *offset = aligned_offset;
+        *reserved_size = aligned_offset + size - block->linear_offset;
+        block->linear_offset = aligned_offset + size;
+        return true;
+    }
+
+    return false;
+}
+
+Device_Allocation allocate_device_memory(Device_Allocator *allocator,
+                                         VkMemoryRequirements requirements,
+                                         VkMemoryPropertyFlags properties,
+                                         Allocation_Strategy strategy) {
+    uint32_t memory_type_index = find_memory_type(allocator->physical_device, requirements.memoryTypeBits, properties);
+    if (requirements.size > DEVICE_MEMORY_BLOCK_SIZE / 2) {
+        strategy = ALLOCATION_STRATEGY_DEDICATED;
+    }
+
+    Device_Allocation allocation = {0};
+    allocation.requested_size = requirements.size;
+
+    uint32_t block_index = UINT32_MAX;
+    if (strategy == ALLOCATION_STRATEGY_DEDICATED) {
+        block_index = create_memory_block(allocator, memory_type_index, requirements.size, strategy);
+        allocation.offset = 0;
+        allocation.size = requirements.size;
+    } else {
+        for (uint32_t i = 0; i < allocator->block_count; i++) {
+            Memory_Block *block = &allocator->blocks[i];
+            if (block->memory == VK_NULL_HANDLE ||
+                block->memory_type_index != memory_type_index ||
+                block->strategy != strategy) {
+                continue;
+            }
+            if (allocate_from_block(block, requirements.size, requirements.alignment, &allocation.offset, &allocation.size)) {
+                block_index = i;
+                break;
+            }
+        }
+
+        if (block_index == UINT32_MAX) {
+            block_index = create_memory_block(allocator, memory_type_index, DEVICE_MEMORY_BLOCK_SIZE, strategy);
+            if (!allocate_from_block(&allocator->blocks[block_index],
+                                     requirements.size,
+                                     requirements.alignment,
+                                     &allocation.offset,
+                                     &allocation.size)) {
+                exit_with_error("Failed to sub-allocate %llu bytes from a fresh block",
+                                (unsigned long long)requirements.size);
+            }
+        }
+    }
+
+    Memory_Block *block = &allocator->blocks[block_index];
+    block->live_count++;
+    block->bytes_used += allocation.size;
+
+    allocation.memory = block->memory;
+    allocation.block_index = block_index;
+    allocation.mapped = block->mapped ? (uint8_t *)block->mapped + allocation.offset : NULL;
+
+    allocator->total_allocation_count++;
+    allocator->bytes_requested += allocation.requested_size;
+    return allocation;
+}
+
+void free_device_memory(Device_Allocator *allocator, Device_Allocation *allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) return;
+
+    uint32_t block_index = allocation->block_index;
+    Memory_Block *block = &allocator->blocks[block_index];
+
+    if (block->strategy == ALLOCATION_STRATEGY_BUDDY) {
+        uint32_t unit = (uint32_t)(allocation->offset / BUDDY_MIN_BLOCK_SIZE);
+        uint32_t order = buddy_order_for_size(allocation->size);
+        // Merge with the buddy for as long as it's free at the same order
+        while (order + 1 < BUDDY_ORDER_COUNT) {
+            uint32_t buddy = unit ^ (1u << order);
+            if (block->free_orders[buddy] != order + 1) break;
+            buddy_remove(block, buddy, order);
+            if (buddy < unit) unit = buddy;
+            order++;
+        }
+        buddy_push(block, unit, order);
+    }
+
+    block->live_count--;
+    block->bytes_used -= allocation->size;
+    allocator->bytes_requested -= allocation->requested_size;
+
+    if (block->live_count == 0) {
+        if (block->strategy == ALLOCATION_STRATEGY_LINEAR) {
+            block->linear_offset = 0;
+        }
+
+        // NOTE: Keep one empty block per memory type and strategy so alloc/free churn around an
+        //       empty pool doesn't turn into a vkAllocateMemory/vkFreeMemory pair every time.
+        bool release = block->strategy == ALLOCATION_STRATEGY_DEDICATED;
+        for (uint32_t i = 0; i < allocator->block_count && !release; i++) {
+            Memory_Block *other = &allocator->blocks[i];
+            if (i != block_index &&
+                other->memory != VK_NULL_HANDLE &&
+                other->live_count == 0 &&
+                other->memory_type_index == block->memory_type_index &&
+                other->strategy == block->strategy) {
+                release = true;
+            }
+        }
+        if (release) destroy_memory_block(allocator, block_index);
+    }
+
+    memset(allocation, 0, sizeof(Device_Allocation));
+}
+
+Device_Allocator_Stats get_device_allocator_stats(Device_Allocator *allocator) {
+    Device_Allocator_Stats stats = {0};
+    stats.total_allocation_count = allocator->total_allocation_count;
+    stats.block_allocation_count = allocator->block_allocation_count;
+    stats.bytes_requested = allocator->bytes_requested;
+
+    VkDeviceSize free_bytes = 0;
+    VkDeviceSize largest_free_bytes = 0;
+    for (uint32_t i = 0; i < allocator->block_count; i++) {
+        Memory_Block *block = &allocator->blocks[i];
+        if (block->memory == VK_NULL_HANDLE) continue;
+
+        stats.live_block_count++;
+        stats.live_allocation_count += block->live_count;
+        stats.bytes_used += block->bytes_used;
+        stats.bytes_reserved += block->size;
+
+        if (block->strategy == ALLOCATION_STRATEGY_BUDDY) {
+            free_bytes += block->size - block->bytes_used;
+            for (int order = BUDDY_ORDER_COUNT - 1; order >= 0; order--) {
+                if (block->free_heads[order] != UINT32_MAX) {
+                    largest_free_bytes += (VkDeviceSize)BUDDY_MIN_BLOCK_SIZE << order;
+                    break;
+                }
+            }
+        } else if (block->strategy == ALLOCATION_STRATEGY_LINEAR) {
+            // Holes left by freed allocations aren't reusable until the block rewinds, so only the tail is free
+            free_bytes += block->size - block->linear_offset;
+            largest_free_bytes += block->size - block->linear_offset;
+        }
+    }
+
+    stats.fragmentation = free_bytes > 0 ? 1.0f - (float)largest_free_bytes / (float)free_bytes : 0.0f;
+    return stats;
+}
+
+void log_device_allocator_stats(Device_Allocator *allocator) {
+    Device_Allocator_Stats stats = get_device_allocator_stats(allocator);
+    double mib = 1024.0 * 1024.0;
+    trace_log("Device memory: %llu live allocations in %u blocks (%llu vkAllocateMemory calls for %llu allocations)",
+              (unsigned long long)stats.live_allocation_count,
+              stats.live_block_count,
+              (unsigned long long)stats.block_allocation_count,
+              (unsigned long long)stats.total_allocation_count);
+    trace_log("Device memory: %.2f MiB requested, %.2f MiB used, %.2f MiB reserved, %.1f%% lost to rounding, %.1f%% fragmentation",
+              (double)stats.bytes_requested / mib,
+              (double)stats.bytes_used / mib,
+              (double)stats.bytes_reserved / mib,
+              stats.bytes_used > 0 ? 100.0 * (double)(stats.bytes_used - stats.bytes_requested) / (double)stats.bytes_used : 0.0,
+              100.0 * stats.fragmentation);
+}
+
+void run_allocator_stress_test(Device_Allocator *allocator) {
+    enum { BUDDY_OPERATIONS = 50000, MAX_LIVE_BUFFERS = 4096 };
+    enum { LINEAR_ROUNDS = 64, LINEAR_BATCH = 1024 };
+
+    Buffer_Etc *buffers = xmalloc(sizeof(Buffer_Etc) * MAX_LIVE_BUFFERS);
+    uint32_t live_count = 0;
+    uint32_t peak_live_count = 0;
+    uint32_t rng = 0x9e3779b9u;
+
+    // Random sizes and lifetimes, the case buddy allocation is for
+    double start = glfwGetTime();
+    for (uint32_t i = 0; i < BUDDY_OPERATIONS; i++) {
+        // xorshift32
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+
+        // Grow towards MAX_LIVE_BUFFERS for the first half, then churn at a steady size
+        bool grow = i < BUDDY_OPERATIONS / 2 ? (rng & 3) != 0 : (rng & 1) != 0;
+        bool allocate = live_count == 0 || (live_count < MAX_LIVE_BUFFERS && grow);
+        if (allocate) {
+            // Log-uniform between 64 B and 512 KiB
+            VkDeviceSize size = (VkDeviceSize)64 << ((rng >> 8) % 13);
+            size += (rng >> 16) % size;
+            buffers[live_count++] = create_buffer(allocator,
+                                                  size,
+                                                  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                                  ALLOCATION_STRATEGY_BUDDY);
+            if (live_count > peak_live_count) peak_live_count = live_count;
+        } else {
+            uint32_t index = (rng >> 8) % live_count;
+            destroy_buffer(allocator, &buffers[index]);
+            buffers[index] = buffers[--live_count];
+        }
+    }
+    double buddy_ms = 1000.0 * (glfwGetTime() - start);
+    trace_log("Allocator stress: %u buddy create/destroy operations in %.1f ms (%.2f us each), peak %u live buffers",
+              BUDDY_OPERATIONS,
+              buddy_ms,
+              1000.0 * buddy_ms / BUDDY_OPERATIONS,
+              peak_live_count);
+    log_device_allocator_stats(allocator);
+
+    while (live_count > 0) {
+        destroy_buffer(allocator, &buffers[--live_count]);
+    }
+
+    // Batches that live and die together, the case linear allocation is for
+    start = glfwGetTime();
+    for (uint32_t round = 0; round < LINEAR_ROUNDS; round++) {
+        for (uint32_t i = 0; i < LINEAR_BATCH; i++) {
+            buffers[i] = create_buffer(allocator,
+                                       1024 + (i % 16) * 256,
+                                       VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                       ALLOCATION_STRATEGY_LINEAR);
+        }
+        if (round == 0) log_device_allocator_stats(allocator);
+        for (uint32_t i = 0; i < LINEAR_BATCH; i++) {
+            destroy_buffer(allocator, &buffers[i]);
+        }
+    }
+    double linear_ms = 1000.0 * (glfwGetTime() - start);
+    trace_log("Allocator stress: %u linear create/destroy pairs in %.1f ms (%.2f us each)",
+              LINEAR_ROUNDS * LINEAR_BATCH,
+              linear_ms,
+              1000.0 * linear_ms / (LINEAR_ROUNDS * LINEAR_BATCH));
+    log_device_allocator_stats(allocator);
+
+    free(buffers);
+}
+
+Buffer_Etc create_buffer(Device_Allocator *allocator,
+                         VkDeviceSize size,
+                         VkBufferUsageFlags usage,
+                         VkMemoryPropertyFlags properties,
+                         Allocation_Strategy strategy) {
+    /*
+      typedef struct VkBufferCreateInfo {
+          VkStructureType        sType;
+          const void*            pNext;
+          VkBufferCreateFlags    flags;
+          VkDeviceSize           size;
+          VkBufferUsageFlags     usage;
+          VkSharingMode          sharingMode;
+          uint32_t               queueFamilyIndexCount;
+          const uint32_t*        pQueueFamilyIndices;
+      } VkBufferCreateInfo;
+    */
+    VkBufferCreateInfo buffer_info = {0};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    /*
+      typedef enum VkBufferUsageFlagBits {
+          VK_BUFFER_USAGE_TRANSFER_SRC_BIT = 0x00000001,
+          VK_BUFFER_USAGE_TRANSFER_DST_BIT = 0x00000002,
+          VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT = 0x00000004,
+          VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT = 0x00000008,
+          VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT = 0x00000010,
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT = 0x00000020,
+          VK_BUFFER_USAGE_INDEX_BUFFER_BIT = 0x00000040,
+          VK_BUFFER_USAGE_VERTEX_BUFFER_BIT = 0x00000080,
+          VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT = 0x00000100,
+          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT = 0x00020000,
+          VK_BUFFER_USAGE_VIDEO_DECODE_SRC_BIT_KHR = 0x00002000,
+          VK_BUFFER_USAGE_VIDEO_DECODE_DST_BIT_KHR = 0x00004000,
+          VK_BUFFER_USAGE_TRANSFORM_FEEDBACK_BUFFER_BIT_EXT = 0x00000800,
+          VK_BUFFER_USAGE_TRANSFORM_FEEDBACK_COUNTER_BUFFER_BIT_EXT = 0x00001000,
+          VK_BUFFER_USAGE_CONDITIONAL_RENDERING_BIT_EXT = 0x00000200,
+      #ifdef VK_ENABLE_BETA_EXTENSIONS
+          VK_BUFFER_USAGE_EXECUTION_GRAPH_SCRATCH_BIT_AMDX = 0x02000000,
+      #endif
+          VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR = 0x00080000,
+          VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR = 0x00100000,
+          VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR = 0x00000400,
+          VK_BUFFER_USAGE_VIDEO_ENCODE_DST_BIT_KHR = 0x00008000,
+          VK_BUFFER_USAGE_VIDEO_ENCODE_SRC_BIT_KHR = 0x00010000,
+          VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT = 0x00200000,
+          VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT = 0x00400000,
+          VK_BUFFER_USAGE_PUSH_DESCRIPTORS_DESCRIPTOR_BUFFER_BIT_EXT = 0x04000000,
+          VK_BUFFER_USAGE_MICROMAP_BUILD_INPUT_READ_ONLY_BIT_EXT = 0x00800000,
+          VK_BUFFER_USAGE_MICROMAP_STORAGE_BIT_EXT = 0x01000000,
+          VK_BUFFER_USAGE_RAY_TRACING_BIT_NV = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR,
+          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_EXT = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+          VK_BUFFER_USAGE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+      } VkBufferUsageFlagBits;
+    */
+    buffer_info.usage = usage;
+    /*
+      typedef enum VkSharingMode {
+          VK_SHARING_MODE_EXCLUSIVE = 0,
+          VK_SHARING_MODE_CONCURRENT = 1,
+          VK_SHARING_MODE_MAX_ENUM = 0x7FFFFFFF
+      } VkSharingMode;
+    */
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    Buffer_Etc result = {0};
+    if (vkCreateBuffer(allocator->device, &buffer_info, NULL, &result.buffer) != VK_SUCCESS) {
+        exit_with_error("Failed to create buffer");
+    }
+
+    /*
+      typedef struct VkMemoryRequirements {
+          VkDeviceSize    size;
+          VkDeviceSize    alignment;
+          uint32_t        memoryTypeBits;
+      } VkMemoryRequirements;
+    */
+    VkMemoryRequirements mem_requirements;
+    vkGetBufferMemoryRequirements(allocator->device, result.buffer, &mem_requirements);
+    result.allocation = allocate_device_memory(allocator, mem_requirements, properties, strategy);
+
+    /*
+      VKAPI_ATTR VkResult VKAPI_CALL vkBindBufferMemory(
+          VkDevice                                    device,
+          VkBuffer                                    buffer,
+          VkDeviceMemory                              memory,
+          VkDeviceSize                                memoryOffset);
+    */
+    vkBindBufferMemory(allocator->device, result.buffer, result.allocation.memory, result.allocation.offset);
+
+    return result;
+}
+
+void destroy_buffer(Device_Allocator *allocator, Buffer_Etc *buffer) {
+    vkDestroyBuffer(allocator->device, buffer->buffer, NULL);
+    free_device_memory(allocator, &buffer->allocation);
+    buffer->buffer = VK_NULL_HANDLE;
+}
+
+Image_Etc create_image(Device_Allocator *allocator,
+                       const VkImageCreateInfo *image_info,
+                       VkMemoryPropertyFlags properties,
+                       VkMemoryPropertyFlags preferred_properties) {
+    Image_Etc result = {0};
+    if (vkCreateImage(allocator->device, image_info, NULL, &result.image) != VK_SUCCESS) {
+        exit_with_error("Failed to create image");
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetImageMemoryRequirements(allocator->device, result.image, &mem_requirements);
+
+    // NOTE: Images share blocks with buffers. Starting and ending them on bufferImageGranularity
+    //       boundaries keeps them off any page that also holds a linear resource.
+    VkDeviceSize granularity = allocator->buffer_image_granularity;
+    if (mem_requirements.alignment < granularity) mem_requirements.alignment = granularity;
+    mem_requirements.size = align_up(mem_requirements.size, granularity);
+
+    // preferred_properties are only asked for when some memory type the image can live in has them, e.g.
+    // LAZILY_ALLOCATED, which only tilers offer
+    result.memory_properties = properties;
+    for (uint32_t i = 0; i < allocator->memory_properties.memoryTypeCount; i++) {
+        VkMemoryPropertyFlags flags = allocator->memory_properties.memoryTypes[i].propertyFlags;
+        if ((mem_requirements.memoryTypeBits & (1u << i)) &&
+            (flags & (properties | preferred_properties)) == (properties | preferred_properties)) {
+            result.memory_properties = properties | preferred_properties;
+            break;
+        }
+    }
+
+    result.allocation = allocate_device_memory(allocator, mem_requirements, result.memory_properties, ALLOCATION_STRATEGY_BUDDY);
+    vkBindImageMemory(allocator->device, result.image, result.allocation.memory, result.allocation.offset);
+
+    return result;
+}
+
+void destroy_image(Device_Allocator *allocator, Image_Etc *image) {
+    vkDestroyImage(allocator->device, image->image, NULL);
+    free_device_memory(allocator, &image->allocation);
+    image->image = VK_NULL_HANDLE;
+}
+
+Buffer_Etc create_vertex_buffer(Device_Allocator *allocator, Uploader *uploader, Vertex *vertices, uint32_t vertex_count) {
+    // typedef uint64_t VkDeviceSize;
+    VkDeviceSize buffer_size = sizeof(Gpu_Vertex) * vertex_count;
+
+    Gpu_Vertex *gpu_vertices = xmalloc((size_t)buffer_size);
+    pack_vertices(gpu_vertices, vertices, vertex_count);
+
+    trace_log("Vertex layout %s: %u bytes per vertex, %.2f MiB for %u vertices",
+              VERTEX_LAYOUT_NAME,
+              (uint32_t)sizeof(Gpu_Vertex),
+              (double)buffer_size / (1024.0 * 1024.0),
+              vertex_count);
+
+    // NOTE: Device local, so vertex fetch doesn't cross the bus on discrete GPUs.
+    //       The data arrives through the staging ring; the caller flushes and waits before drawing.
+    Buffer_Etc result = create_device_local_buffer(allocator,
+                                                   uploader,
+                                                   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                                   gpu_vertices,
+                                                   buffer_size);
+    free(gpu_vertices);
+    return result;
+}
+
+Buffer_Etc create_index_buffer(Device_Allocator *allocator,
+                               Uploader *uploader,
+                               const uint32_t *indices,
+                               uint32_t index_count,
+                               VkIndexType index_type) {
+    if (index_type == VK_INDEX_TYPE_UINT32) {
+        return create_device_local_buffer(allocator,
+                                          uploader,
+                                          VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                                          indices,
+                                          sizeof(uint32_t) * index_count);
+    }
+
+    uint16_t *indices_16 = xmalloc(sizeof(uint16_t) * index_count);
+    for (uint32_t i = 0; i < index_count; i++) {
+        indices_16[i] = (uint16_t)indices[i];
+    }
+    // The data is copied into the staging ring right away, so the temporary can go
+    Buffer_Etc result = create_device_local_buffer(allocator,
+                                                   uploader,
+                                                   VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                                                   indices_16,
+                                                   sizeof(uint16_t) * index_count);
+    free(indices_16);
+    return result;
+}
+
+Uploader create_uploader(Device_Allocator *allocator, Logical_Device_Etc logical_device) {
+    Uploader uploader = {0};
+    uploader.device = logical_device.device;
+    uploader.queue = logical_device.transfer_queue;
+    uploader.queue_family_indices[0] = logical_device.transfer_queue_family_index;
+    uploader.queue_family_count = 1;
+    if (logical_device.transfer_queue_family_index != logical_device.graphics_queue_family_index) {
+        uploader.queue_family_indices[1] = logical_device.graphics_queue_family_index;
+        uploader.queue_family_count = 2;
+    }
+
+    VkCommandPoolCreateInfo command_pool_info = {0};
+    command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    command_pool_info.queueFamilyIndex = logical_device.transfer_queue_family_index;
+    command_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    if (vkCreateCommandPool(uploader.device, &command_pool_info, NULL, &uploader.command_pool) != VK_SUCCESS) {
+        exit_with_error("Failed to create upload command pool");
+    }
+
+    for (uint32_t i = 0; i < UPLOAD_BATCH_COUNT; i++) {
+        uploader.batches[i].command_buffer = allocate_command_buffer(uploader.device, uploader.command_pool);
+
+        VkFenceCreateInfo fence_info = {0};
+        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        if (vkCreateFence(uploader.device, &fence_info, NULL, &uploader.batches[i].fence) != VK_SUCCESS) {
+            exit_with_error("Failed to create upload fence");
+        }
+    }
+
+    uploader.staging = create_buffer(allocator,
+                                     STAGING_RING_SIZE,
+                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                     ALLOCATION_STRATEGY_BUDDY);
+
+    return uploader;
+}
+
+void destroy_uploader(Device_Allocator *allocator, Uploader *uploader) {
+    wait_for_uploads(uploader, flush_uploads(uploader));
+
+    trace_log("Uploads: %llu copies, %.2f MiB in %llu submits",
+              (unsigned long long)uploader->copy_count,
+              (double)uploader->bytes_uploaded / (1024.0 * 1024.0),
+              (unsigned long long)uploader->submit_count);
+
+    for (uint32_t i = 0; i < UPLOAD_BATCH_COUNT; i++) {
+        vkDestroyFence(uploader->device, uploader->batches[i].fence, NULL);
+    }
+    // Command buffers are freed together with their pool
+    vkDestroyCommandPool(uploader->device, uploader->command_pool, NULL);
+    destroy_buffer(allocator, &uploader->staging);
+}
+
+void upload_to_buffer(Uploader *uploader, VkBuffer buffer, VkDeviceSize offset, const void *data, VkDeviceSize size) {
+    // NOTE: Anything bigger than half the ring goes in pieces, so a single upload can always make progress
+    VkDeviceSize max_chunk_size = STAGING_RING_SIZE / 2;
+    while (size > 0) {
+        VkDeviceSize chunk_size = size < max_chunk_size ? size : max_chunk_size;
+
+        // Copies don't need more than this, but it keeps the source offsets friendly
+        VkDeviceSize start = align_up(uploader->head, 16);
+        VkDeviceSize ring_offset = start % STAGING_RING_SIZE;
+        if (ring_offset + chunk_size > STAGING_RING_SIZE) {
+            // Doesn't fit before the end of the ring, skip to the start
+            start += STAGING_RING_SIZE - ring_offset;
+            ring_offset = 0;
+        }
+
+        // Wait for older batches to free up space. The batch being recorded may be what's holding it.
+        while (start + chunk_size - uploader->tail > STAGING_RING_SIZE) {
+            if (uploader->pending_batch_count == 0) flush_uploads(uploader);
+            retire_oldest_upload_batch(uploader);
+        }
+
+        if (!uploader->recording) {
+            if (uploader->pending_batch_count == UPLOAD_BATCH_COUNT) retire_oldest_upload_batch(uploader);
+
+            uint32_t batch_index = (uploader->oldest_batch + uploader->pending_batch_count) % UPLOAD_BATCH_COUNT;
+            VkCommandBuffer command_buffer = uploader->batches[batch_index].command_buffer;
+            vkResetCommandBuffer(command_buffer, 0);
+
+            VkCommandBufferBeginInfo begin_info = {0};
+            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+                exit_with_error("Failed to begin recording upload command buffer");
+            }
+            uploader->recording = true;
+        }
+
+        memcpy((uint8_t *)uploader->staging.allocation.mapped + ring_offset, data, (size_t)chunk_size);
+        uploader->head = start + chunk_size;
+
+        /*
+          typedef struct VkBufferCopy {
+              VkDeviceSize    srcOffset;
+              VkDeviceSize    dstOffset;
+              VkDeviceSize    size;
+          } VkBufferCopy;
+        */
+        VkBufferCopy copy_region = {0};
+        copy_region.srcOffset = ring_offset;
+        copy_region.dstOffset = offset;
+        copy_region.size = chunk_size;
+
+        uint32_t batch_index = (uploader->oldest_batch + uploader->pending_batch_count) % UPLOAD_BATCH_COUNT;
+        /*
+          VKAPI_ATTR void VKAPI_CALL vkCmdCopyBuffer(
+              VkCommandBuffer                             commandBuffer,
+              VkBuffer                                    srcBuffer,
+              VkBuffer                                    dstBuffer,
+              uint32_t                                    regionCount,
+              const VkBufferCopy*                         pRegions);
+        */
+        vkCmdCopyBuffer(uploader->batches[batch_index].command_buffer, uploader->staging.buffer, buffer, 1, &copy_region);
+
+        uploader->copy_count++;
+        uploader->bytes_uploaded += chunk_size;
+        data = (const uint8_t *)data + chunk_size;
+        offset += chunk_size;
+        size -= chunk_size;
+    }
+}
+
+uint64_t flush_uploads(Uploader *uploader) {
+    // NOTE: Returns a ticket for everything uploaded so far, to pass to wait_for_uploads
+    if (!uploader->recording) return uploader->submitted_ticket;
+
+    uint32_t batch_index = (uploader->oldest_batch + uploader->pending_batch_count) % UPLOAD_BATCH_COUNT;
+    Upload_Batch *batch = &uploader->batches[batch_index];
+    if (vkEndCommandBuffer(batch->command_buffer) != VK_SUCCESS) {
+        exit_with_error("Failed to record upload command buffer");
+    }
+
+    VkSubmitInfo submit_info = {0};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &batch->command_buffer;
+
+    vkResetFences(uploader->device, 1, &batch->fence);
+    if (vkQueueSubmit(uploader->queue, 1, &submit_info, batch->fence) != VK_SUCCESS) {
+        exit_with_error("Failed to submit uploads");
+    }
+
+    batch->ticket = ++uploader->submitted_ticket;
+    batch->ring_end = uploader->head;
+    uploader->pending_batch_count++;
+    uploader->recording = false;
+    uploader->submit_count++;
+    return batch->ticket;
+}
+
+void wait_for_uploads(Uploader *uploader, uint64_t ticket) {
+    while (uploader->completed_ticket < ticket) {
+        retire_oldest_upload_batch(uploader);
+    }
+}
+
+void retire_oldest_upload_batch(Uploader *uploader) {
+    if (uploader->pending_batch_count == 0) return;
+
+    Upload_Batch *batch = &uploader->batches[uploader->oldest_batch];
+    vkWaitForFences(uploader->device, 1, &batch->fence, VK_TRUE, UINT64_MAX);
+
+    uploader->tail = batch->ring_end;
+    uploader->completed_ticket = batch->ticket;
+    uploader->oldest_batch = (uploader->oldest_batch + 1) % UPLOAD_BATCH_COUNT;
+    uploader->pending_batch_count--;
+}
+
+Buffer_Etc create_device_local_buffer(Device_Allocator *allocator,
+                                      Uploader *uploader,
+                                      VkBufferUsageFlags usage,
+                                      const void *data,
+                                      VkDeviceSize size) {
+    VkBufferCreateInfo buffer_info = {0};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    // NOTE: Written on the transfer queue and read on the graphics queue. Concurrent sharing avoids
+    //       a queue family ownership transfer when those are different families.
+    if (uploader->queue_family_count > 1) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = uploader->queue_family_count;
+        buffer_info.pQueueFamilyIndices = uploader->queue_family_indices;
+    } else {
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
+
+    Buffer_Etc result = {0};
+    if (vkCreateBuffer(allocator->device, &buffer_info, NULL, &result.buffer) != VK_SUCCESS) {
+        exit_with_error("Failed to create device local buffer");
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetBufferMemoryRequirements(allocator->device, result.buffer, &mem_requirements);
+    result.allocation = allocate_device_memory(allocator,
+                                               mem_requirements,
+                                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                               ALLOCATION_STRATEGY_BUDDY);
+    vkBindBufferMemory(allocator->device, result.buffer, result.allocation.memory, result.allocation.offset);
+
+    upload_to_buffer(uploader, result.buffer, 0, data, size);
+    return result;
+}
+
+VkCommandPool create_command_pool(VkDevice device, uint32_t queue_family_index) {
+    /*
+      typedef struct VkCommandPoolCreateInfo {
+         VkStructureType             sType;
+         const void*                 pNext;
+         VkCommandPoolCreateFlags    flags;
+         uint32_t                    queueFamilyIndex;
+     } VkCommandPoolCreateInfo;
+    */
+    VkCommandPoolCreateInfo command_pool_info = {0};
+    command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    command_pool_info.queueFamilyIndex = queue_family_index; // Graphics queue family
+    /*
+      typedef enum VkCommandPoolCreateFlagBits {
+          VK_COMMAND_POOL_CREATE_TRANSIENT_BIT = 0x00000001,
+          VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT = 0x00000002,
+          VK_COMMAND_POOL_CREATE_PROTECTED_BIT = 0x00000004,
+          VK_COMMAND_POOL_CREATE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
+      } VkCommandPoolCreateFlagBits;
+    */
+    command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+    VkCommandPool command_pool;
+    if (vkCreateCommandPool(device, &command_pool_info, NULL, &command_pool) != VK_SUCCESS) {
+        exit_with_error("Failed to create command pool");
+    }
+
+    return command_pool;
+}
+
+VkCommandBuffer allocate_command_buffer(VkDevice device, VkCommandPool command_pool) {
+    /*
+      typedef struct VkCommandBufferAllocateInfo {
+          VkStructureType         sType;
+          const void*             pNext;
+          VkCommandPool           commandPool;
+          VkCommandBufferLevel    level;
+          uint32_t                commandBufferCount;
+      } VkCommandBufferAllocateInfo;
+    */
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = command_pool;
+    /*
+      typedef enum VkCommandBufferLevel {
+          VK_COMMAND_BUFFER_LEVEL_PRIMARY = 0,
+          VK_COMMAND_BUFFER_LEVEL_SECONDARY = 1,
+          VK_COMMAND_BUFFER_LEVEL_MAX_ENUM = 0x7FFFFFFF
+      } VkCommandBufferLevel;
+    */
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+
+    VkCommandBuffer command_buffer;
+    if (vkAllocateCommandBuffers(device, &alloc_info, &command_buffer) != VK_SUCCESS) {
+        exit_with_error("Failed to allocate command buffer");
+    }
+
+    return command_buffer;
+}
+
+void begin_render_pass(VkCommandBuffer command_buffer,
+                       const Render_Target *target,
+                       const Scene *scene,
+                       VkSubpassContents contents) {
+    if (target->render_pass == VK_NULL_HANDLE) {
+        begin_dynamic_rendering(command_buffer, target, scene, contents);
+        return;
+    }
+
+    /*
+      typedef struct VkRenderPassBeginInfo {
+          VkStructureType        sType;
+          const void*            pNext;
+          VkRenderPass           renderPass;
+          VkFramebuffer          framebuffer;
+          VkRect2D               renderArea;
+          uint32_t               clearValueCount;
+          const VkClearValue*    pClearValues;
+      } VkRenderPassBeginInfo;
+    */
+    VkRenderPassBeginInfo render_pass_begin_info = {0};
+    render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_begin_info.renderPass = target->render_pass;
+    render_pass_begin_info.framebuffer = target->framebuffer;
+    render_pass_begin_info.renderArea.offset = (VkOffset2D){0, 0};
+    render_pass_begin_info.renderArea.extent = target->extent;
+
+    /*
+      typedef union VkClearColorValue {
+          float       float32[4];
+          int32_t     int32[4];
+          uint32_t    uint32[4];
+      } VkClearColorValue;
+
+      typedef union VkClearValue {
+          VkClearColorValue           color;
+          VkClearDepthStencilValue    depthStencil;
+      } VkClearValue;
+    */
+    // One per attachment, in create_render_pass's order. The swapchain image's is unused with --msaa.
+    VkClearValue clear_values[3];
+    uint32_t clear_value_count = 0;
+    clear_values[clear_value_count++] = scene->clear_color;
+    if (target->depth_format != VK_FORMAT_UNDEFINED) {
+        clear_values[clear_value_count].depthStencil = (VkClearDepthStencilValue){1.0f, 0};
+        clear_value_count++;
+    }
+    if (target->msaa_view != VK_NULL_HANDLE) clear_values[clear_value_count++] = scene->clear_color;
+    render_pass_begin_info.clearValueCount = clear_value_count;
+    render_pass_begin_info.pClearValues = clear_values;
+
+    /*
+      VKAPI_ATTR void VKAPI_CALL vkCmdBeginRenderPass(
+          VkCommandBuffer                             commandBuffer,
+          const VkRenderPassBeginInfo*                pRenderPassBegin,
+          VkSubpassContents                           contents);
+
+      typedef enum VkSubpassContents {
+          VK_SUBPASS_CONTENTS_INLINE = 0,
+          VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS = 1,
+          VK_SUBPASS_CONTENTS_INLINE_AND_SECONDARY_COMMAND_BUFFERS_KHR = 1000451000,
+          VK_SUBPASS_CONTENTS_INLINE_AND_SECONDARY_COMMAND_BUFFERS_EXT = VK_SUBPASS_CONTENTS_INLINE_AND_SECONDARY_COMMAND_BUFFERS_KHR,
+          VK_SUBPASS_CONTENTS_MAX_ENUM = 0x7FFFFFFF
+      } VkSubpassContents;
+    */
+    vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, contents);
+}
+
+void begin_dynamic_rendering(VkCommandBuffer command_buffer,
+                             const Render_Target *target,
+                             const Scene *scene,
+                             VkSubpassContents contents) {
+    // NOTE: What the render pass's initial layout and external dependency did: wait for the acquire semaphore's
+    //       stage, then discard the old contents on the way to COLOR_ATTACHMENT_OPTIMAL
+    transition_attachment_image(command_buffer,
+                                target->image,
+                                VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_UNDEFINED,
+                                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                0,
+                                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+    // Same for depth, which also has to wait for the last frame's depth tests since the image is shared. Early
+    // and late on both sides, like the render pass dependency.
+    bool has_depth = target->depth_format != VK_FORMAT_UNDEFINED;
+    if (has_depth) {
+        VkPipelineStageFlags depth_stages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        transition_attachment_image(command_buffer,
+                                    target->depth_image,
+                                    VK_IMAGE_ASPECT_DEPTH_BIT,
+                                    VK_IMAGE_LAYOUT_UNDEFINED,
+                                    VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                                    depth_stages,
+                                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                    depth_stages,
+                                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+    }
+    // And the multisampled color image, shared too, after the last frame's writes to it
+    bool has_msaa = target->msaa_view != VK_NULL_HANDLE;
+    if (has_msaa) {
+        transition_attachment_image(command_buffer,
+                                    target->msaa_image,
+                                    VK_IMAGE_ASPECT_COLOR_BIT,
+                                    VK_IMAGE_LAYOUT_UNDEFINED,
+                                    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+    }
+
+    /*
+      typedef struct VkRenderingAttachmentInfo {
+          VkStructureType          sType;
+          const void*              pNext;
+          VkImageView              imageView;
+          VkImageLayout            imageLayout;
+          VkResolveModeFlagBits    resolveMode;
+          VkImageView              resolveImageView;
+          VkImageLayout            resolveImageLayout;
+          VkAttachmentLoadOp       loadOp;
+          VkAttachmentStoreOp      storeOp;
+          VkClearValue             clearValue;
+      } VkRenderingAttachmentInfo;
+    */
+    VkRenderingAttachmentInfoKHR color_attachment = {0};
+    color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    color_attachment.imageView = target->image_view;
+    color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.clearValue = scene->clear_color;
+    if (has_msaa) {
+        // Rendered at full sample count and averaged into the swapchain image when rendering ends, like the
+        // render pass's resolve attachment
+        color_attachment.imageView = target->msaa_view;
+        color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        color_attachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT_KHR;
+        color_attachment.resolveImageView = target->image_view;
+        color_attachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    }
+
+    VkRenderingAttachmentInfoKHR depth_attachment = {0};
+    depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    depth_attachment.imageView = target->depth_view;
+    depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = target->store_depth ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.clearValue.depthStencil.depth = 1.0f;
+
+    /*
+      typedef struct VkRenderingInfo {
+          VkStructureType                     sType;
+          const void*                         pNext;
+          VkRenderingFlags                    flags;
+          VkRect2D                            renderArea;
+          uint32_t                            layerCount;
+          uint32_t                            viewMask;
+          uint32_t                            colorAttachmentCount;
+          const VkRenderingAttachmentInfo*    pColorAttachments;
+          const VkRenderingAttachmentInfo*    pDepthAttachment;
+          const VkRenderingAttachmentInfo*    pStencilAttachment;
+      } VkRenderingInfo;
+    */
+    VkRenderingInfoKHR rendering_info = {0};
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+    if (contents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS) {
+        rendering_info.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT_KHR;
+    }
+    rendering_info.renderArea.offset = (VkOffset2D){0, 0};
+    rendering_info.renderArea.extent = target->extent;
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &color_attachment;
+    if (has_depth) rendering_info.pDepthAttachment = &depth_attachment;
+    target->begin_rendering(command_buffer, &rendering_info);
+}
+
+void end_render_pass(VkCommandBuffer command_buffer, const Render_Target *target) {
+    if (target->render_pass != VK_NULL_HANDLE) {
+        vkCmdEndRenderPass(command_buffer);
+        return;
+    }
+
+    target->end_rendering(command_buffer);
+    // And the render pass's final layout
+    transition_attachment_image(command_buffer,
+                                target->image,
+                                VK_IMAGE_ASPECT_COLOR_BIT,
+                                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                0);
+}
+
+void record_draws(VkCommandBuffer command_buffer,
+                  VkBuffer vertex_buffer,
+                  const Scene *scene,
+                  uint32_t first_draw,
+                  uint32_t draw_count) {
+    if (scene->frame_descriptor_set != VK_NULL_HANDLE) {
+        /*
+          VKAPI_ATTR void VKAPI_CALL vkCmdBindDescriptorSets(
+              VkCommandBuffer                             commandBuffer,
+              VkPipelineBindPoint                         pipelineBindPoint,
+              VkPipelineLayout                            layout,
+              uint32_t                                    firstSet,
+              uint32_t                                    descriptorSetCount,
+              const VkDescriptorSet*                      pDescriptorSets,
+              uint32_t                                    dynamicOffsetCount,
+              const uint32_t*                             pDynamicOffsets);
+        */
+        // Stays bound across the pipeline binds below, they all share the layout
+        vkCmdBindDescriptorSets(command_buffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                scene->pipeline_layout,
+                                DESCRIPTOR_SET_FRAME,
+                                1,
+                                &scene->frame_descriptor_set,
+                                1,
+                                &scene->object_transform_offset);
+    }
+
+    // NOTE: With a render queue, first_draw and draw_count are a slice of its sorted entries, and the items
+    //       bind their own vertex buffers
+    if (scene->render_queue) {
+        vkCmdBindIndexBuffer(command_buffer, scene->index_buffer, 0, scene->index_type);
+        push_draw_constants(command_buffer, scene);
+        record_render_queue(command_buffer, scene, scene->render_queue, first_draw, draw_count);
+        return;
+    }
+
+    VkDeviceSize offsets[] = {0};
+    if (scene->animated_vertex_buffer != VK_NULL_HANDLE) {
+        vertex_buffer = scene->animated_vertex_buffer;
+        offsets[0] = scene->animated_vertex_offset;
+    }
+    /*
+      VKAPI_ATTR void VKAPI_CALL vkCmdBindVertexBuffers(
+          VkCommandBuffer                             commandBuffer,
+          uint32_t                                    firstBinding,
+          uint32_t                                    bindingCount,
+          const VkBuffer*                             pBuffers,
+          const VkDeviceSize*                         pOffsets);
+    */
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, offsets);
+
+    /*
+      VKAPI_ATTR void VKAPI_CALL vkCmdBindIndexBuffer(
+          VkCommandBuffer                             commandBuffer,
+          VkBuffer                                    buffer,
+          VkDeviceSize                                offset,
+          VkIndexType                                 indexType);
+
+      typedef enum VkIndexType {
+          VK_INDEX_TYPE_UINT16 = 0,
+          VK_INDEX_TYPE_UINT32 = 1,
+          VK_INDEX_TYPE_NONE_KHR = 1000165000,
+          VK_INDEX_TYPE_UINT8_EXT = 1000265000,
+          VK_INDEX_TYPE_NONE_NV = VK_INDEX_TYPE_NONE_KHR,
+          VK_INDEX_TYPE_MAX_ENUM = 0x7FFFFFFF
+      } VkIndexType;
+    */
+    vkCmdBindIndexBuffer(command_buffer, scene->index_buffer, 0, scene->index_type);
+    push_draw_constants(command_buffer, scene);
+
+    // NOTE: The indirect path isn't split into slices, the first one records all of it
+    if (scene->indirect_draws) {
+        if (first_draw == 0) record_indirect_draws(command_buffer, scene, scene->indirect_draws);
+        return;
+    }
+
+    // Draw the triangles
+    /*
+      VKAPI_ATTR void VKAPI_CALL vkCmdDrawIndexed(
+          VkCommandBuffer                             commandBuffer,
+          uint32_t                                    indexCount,
+          uint32_t                                    instanceCount,
+          uint32_t                                    firstIndex,
+          int32_t                                     vertexOffset,
+          uint32_t                                    firstInstance);
+    */
+    VkPipeline bound_pipeline = VK_NULL_HANDLE;
+    for (uint32_t n = 0; n < draw_count; n++) {
+        uint32_t i = scene->front_to_back ? first_draw + draw_count - 1 - n : first_draw + n;
+        const Draw_Command *draw = &scene->draws[i];
+        VkPipeline pipeline = scene->material_pipelines[draw->material];
+        if (pipeline == VK_NULL_HANDLE) continue; // Variant still compiling, see Pipeline_Fallback
+
+        if (pipeline != bound_pipeline) {
+            /*
+              VKAPI_ATTR void VKAPI_CALL vkCmdBindPipeline(
+                  VkCommandBuffer                             commandBuffer,
+                  VkPipelineBindPoint                         pipelineBindPoint,
+                  VkPipeline                                  pipeline);
+            */
+            vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            bound_pipeline = pipeline;
+        }
+        if (scene->transform_source == TRANSFORM_SOURCE_PUSH_CONSTANTS) {
+            /*
+              VKAPI_ATTR void VKAPI_CALL vkCmdPushConstants(
+                  VkCommandBuffer                             commandBuffer,
+                  VkPipelineLayout                            layout,
+                  VkShaderStageFlags                          stageFlags,
+                  uint32_t                                    offset,
+                  uint32_t                                    size,
+                  const void*                                 pValues);
+            */
+            vkCmdPushConstants(command_buffer,
+                               scene->pipeline_layout,
+                               scene->push_constant_stages,
+                               0,
+                               sizeof(Object_Transform),
+                               &scene->object_transforms[i]);
+        }
+        // The draw index goes in as firstInstance, it's the draw ID the shader indexes the transforms with
+        vkCmdDrawIndexed(command_buffer, draw->index_count, 1, draw->first_index, 0, i);
+    }
+}
+
+void record_depth_prepass(VkCommandBuffer command_buffer, VkBuffer vertex_buffer, const Scene *scene) {
+    // NOTE: --depth-prepass: the whole draw list again with the depth-only pipelines, before any color draw.
+    //       Later draws are nearer, so it's walked backwards: front to back, and each draw's early depth test
+    //       rejects what the nearer ones already covered. The indirect path keeps its buffer order.
+    if (!scene->prepass_pipelines) return;
+    Scene prepass = *scene;
+    prepass.material_pipelines = scene->prepass_pipelines;
+    prepass.render_queue = NULL;
+    prepass.front_to_back = true;
+    record_draws(command_buffer, vertex_buffer, &prepass, 0, scene->draw_count);
+}
+
+uint32_t get_draw_list_count(const Scene *scene) {
+    // What record_draws slices: the sorted render queue when there is one
+    return scene->render_queue ? scene->render_queue->item_count : scene->draw_count;
+}
+
+void set_viewport_and_scissor(VkCommandBuffer command_buffer, VkRect2D area) {
+    /*
+      typedef struct VkViewport {
+          float    x;
+          float    y;
+          float    width;
+          float    height;
+          float    minDepth;
+          float    maxDepth;
+      } VkViewport;
+    */
+    VkViewport viewport = {0};
+    viewport.x = (float)area.offset.x;
+    viewport.y = (float)area.offset.y;
+    viewport.width = (float)area.extent.width;
+    viewport.height = (float)area.extent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+
+    /*
+      VKAPI_ATTR void VKAPI_CALL vkCmdSetViewport(
+          VkCommandBuffer                             commandBuffer,
+          uint32_t                                    firstViewport,
+          uint32_t                                    viewportCount,
+          const VkViewport*                           pViewports);
+
+      VKAPI_ATTR void VKAPI_CALL vkCmdSetScissor(
+          VkCommandBuffer                             commandBuffer,
+          uint32_t                                    firstScissor,
+          uint32_t                                    scissorCount,
+          const VkRect2D*                             pScissors);
+    */
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    vkCmdSetScissor(command_buffer, 0, 1, &area);
+}
+
+void record_dynamic_draws(VkCommandBuffer command_buffer, VkPipeline pipeline, const Scene *scene) {
+    if (scene->dynamic_vertex_count == 0) return;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &scene->dynamic_vertex_buffer, &scene->dynamic_vertex_offset);
+    // Again, the instanced batches in between bind a layout without push constants
+    // Not an object: the identity transform after the last one, which the push leaves in place
+    push_draw_constants(command_buffer, scene);
+    vkCmdDraw(command_buffer, scene->dynamic_vertex_count, 1, 0, scene->draw_count);
+}
+
+void record_command_buffer(VkCommandBuffer command_buffer,
+                           const Render_Target *target,
+                           VkPipeline pipeline,
+                           VkBuffer vertex_buffer,
+                           const Scene *scene) {
+    VkCommandBufferBeginInfo command_buffer_begin_info = {0};
+    command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    if (vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info) != VK_SUCCESS) {
+        exit_with_error("Failed to begin recording command buffer");
+    }
+
+    record_frame_prologue(command_buffer, scene);
+    begin_render_pass(command_buffer, target, scene, VK_SUBPASS_CONTENTS_INLINE);
+    set_viewport_and_scissor(command_buffer, (VkRect2D){{0, 0}, target->extent});
+    record_depth_prepass(command_buffer, vertex_buffer, scene);
+    record_draws(command_buffer, vertex_buffer, scene, 0, get_draw_list_count(scene));
+    record_instance_batches(command_buffer, scene->instance_batcher);
+    record_dynamic_draws(command_buffer, pipeline, scene);
+    end_render_pass(command_buffer, target);
+    record_frame_epilogue(command_buffer, target, scene);
+
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+        exit_with_error("Failed to record command buffer");
+    }
+}
+
+Record_Workers *create_record_workers(VkDevice device, uint32_t queue_family_index, uint32_t thread_count, uint32_t frame_count) {
+    // NOTE: Heap allocated because the threads hold on to its address
+    Record_Workers *workers = xmalloc(sizeof(Record_Workers));
+    memset(workers, 0, sizeof(Record_Workers));
+    workers->device = device;
+    workers->thread_count = thread_count;
+    workers->frame_count = frame_count;
+
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->job_ready, NULL);
+    pthread_cond_init(&workers->job_done, NULL);
+
+    for (uint32_t t = 0; t < thread_count; t++) {
+        Record_Worker *worker = &workers->workers[t];
+        worker->workers = workers;
+        worker->thread_index = t;
+
+        for (uint32_t f = 0; f < frame_count; f++) {
+            VkCommandPoolCreateInfo command_pool_info = {0};
+            command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            command_pool_info.queueFamilyIndex = queue_family_index;
+            // Recorded every frame and reset as a whole with vkResetCommandPool
+            command_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            if (vkCreateCommandPool(device, &command_pool_info, NULL, &worker->command_pools[f]) != VK_SUCCESS) {
+                exit_with_error("Failed to create recording thread command pool");
+            }
+
+            VkCommandBufferAllocateInfo alloc_info = {0};
+            alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            alloc_info.commandPool = worker->command_pools[f];
+            alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            alloc_info.commandBufferCount = 1;
+            if (vkAllocateCommandBuffers(device, &alloc_info, &worker->command_buffers[f]) != VK_SUCCESS) {
+                exit_with_error("Failed to allocate secondary command buffer");
+            }
+        }
+
+        if (pthread_create(&worker->thread, NULL, record_worker_main, worker) != 0) {
+            exit_with_error("Failed to start recording thread");
+        }
+    }
+
+    trace_log("Started %u recording threads", thread_count);
+    return workers;
+}
+
+void destroy_record_workers(Record_Workers *workers) {
+    pthread_mutex_lock(&workers->mutex);
+    workers->quit = true;
+    pthread_cond_broadcast(&workers->job_ready);
+    pthread_mutex_unlock(&workers->mutex);
+
+    for (uint32_t t = 0; t < workers->thread_count; t++) {
+        pthread_join(workers->workers[t].thread, NULL);
+    }
+
+    // Secondary command buffers are freed together with their pools
+    for (uint32_t t = 0; t < workers->thread_count; t++) {
+        for (uint32_t f = 0; f < workers->frame_count; f++) {
+            vkDestroyCommandPool(workers->device, workers->workers[t].command_pools[f], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&workers->job_done);
+    pthread_cond_destroy(&workers->job_ready);
+    pthread_mutex_destroy(&workers->mutex);
+    free(workers);
+}
+
+void *record_worker_main(void *arg) {
+    Record_Worker *worker = arg;
+    Record_Workers *workers = worker->workers;
+    uint64_t seen_generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&workers->mutex);
+        while (!workers->quit && workers->job_generation == seen_generation) {
+            pthread_cond_wait(&workers->job_ready, &workers->mutex);
+        }
+        if (workers->quit) {
+            pthread_mutex_unlock(&workers->mutex);
+            break;
+        }
+        seen_generation = workers->job_generation;
+        Record_Job job = workers->job;
+        pthread_mutex_unlock(&workers->mutex);
+
+        if (job.kind == RECORD_JOB_SUBMIT && worker->thread_index < job.active_thread_count) {
+            uint32_t draw_count = job.scene->draw_count;
+            uint32_t first_draw = (uint32_t)((uint64_t)draw_count * worker->thread_index / job.active_thread_count);
+            uint32_t end_draw = (uint32_t)((uint64_t)draw_count * (worker->thread_index + 1) / job.active_thread_count);
+            submit_scene_draws(job.render_queue, worker->thread_index, job.scene, job.vertex_buffer, first_draw, end_draw - first_draw);
+        } else if (worker->thread_index < job.active_thread_count) {
+            VkCommandBuffer command_buffer = worker->command_buffers[job.frame_index];
+            vkResetCommandPool(workers->device, worker->command_pools[job.frame_index], 0);
+
+            /*
+              typedef struct VkCommandBufferInheritanceInfo {
+                  VkStructureType                  sType;
+                  const void*                      pNext;
+                  VkRenderPass                     renderPass;
+                  uint32_t                         subpass;
+                  VkFramebuffer                    framebuffer;
+                  VkBool32                         occlusionQueryEnable;
+                  VkQueryControlFlags              queryFlags;
+                  VkQueryPipelineStatisticFlags    pipelineStatistics;
+              } VkCommandBufferInheritanceInfo;
+            */
+            VkCommandBufferInheritanceInfo inheritance_info = {0};
+            inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+            inheritance_info.renderPass = job.target.render_pass;
+            inheritance_info.subpass = 0;
+            inheritance_info.framebuffer = job.target.framebuffer;
+            // The primary has the fragment counter running around the render pass
+            if (job.scene->gpu_timer && job.scene->gpu_timer->statistics_pool != VK_NULL_HANDLE) {
+                inheritance_info.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+            }
+
+            /*
+              typedef struct VkCommandBufferInheritanceRenderingInfo {
+                  VkStructureType          sType;
+                  const void*              pNext;
+                  VkRenderingFlags         flags;
+                  uint32_t                 viewMask;
+                  uint32_t                 colorAttachmentCount;
+                  const VkFormat*          pColorAttachmentFormats;
+                  VkFormat                 depthAttachmentFormat;
+                  VkFormat                 stencilAttachmentFormat;
+                  VkSampleCountFlagBits    rasterizationSamples;
+              } VkCommandBufferInheritanceRenderingInfo;
+            */
+            // Without a render pass to inherit, the secondary is told the attachment formats instead
+            VkCommandBufferInheritanceRenderingInfoKHR inheritance_rendering_info = {0};
+            inheritance_rendering_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO_KHR;
+            inheritance_rendering_info.colorAttachmentCount = 1;
+            inheritance_rendering_info.pColorAttachmentFormats = &job.target.format;
+            inheritance_rendering_info.depthAttachmentFormat = job.target.depth_format;
+            inheritance_rendering_info.rasterizationSamples = job.target.samples;
+            if (job.target.render_pass == VK_NULL_HANDLE) inheritance_info.pNext = &inheritance_rendering_info;
+
+            VkCommandBufferBeginInfo begin_info = {0};
+            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+                               VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            begin_info.pInheritanceInfo = &inheritance_info;
+
+            if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+                exit_with_error("Failed to begin recording secondary command buffer");
+            }
+
+            // Contiguous slice of the draw list, so the split is even and the draw order is kept
+            uint32_t draw_count = get_draw_list_count(job.scene);
+            uint32_t first_draw = (uint32_t)((uint64_t)draw_count * worker->thread_index / job.active_thread_count);
+            uint32_t end_draw = (uint32_t)((uint64_t)draw_count * (worker->thread_index + 1) / job.active_thread_count);
+            set_viewport_and_scissor(command_buffer, (VkRect2D){{0, 0}, job.target.extent});
+            // NOTE: The whole pre-pass goes in the first slice. Secondaries run in order, so it's done before
+            //       any color draw and every one of them is tested against the full depth buffer.
+            if (worker->thread_index == 0) record_depth_prepass(command_buffer, job.vertex_buffer, job.scene);
+            record_draws(command_buffer, job.vertex_buffer, job.scene, first_draw, end_draw - first_draw);
+            // Instanced batches and dynamic geometry go on top, so they belong to the last slice
+            if (worker->thread_index == job.active_thread_count - 1) {
+                record_instance_batches(command_buffer, job.scene->instance_batcher);
+                record_dynamic_draws(command_buffer, job.pipeline, job.scene);
+            }
+
+            if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+                exit_with_error("Failed to record secondary command buffer");
+            }
+        }
+
+        pthread_mutex_lock(&workers->mutex);
+        workers->jobs_remaining--;
+        if (workers->jobs_remaining == 0) {
+            pthread_cond_signal(&workers->job_done);
+        }
+        pthread_mutex_unlock(&workers->mutex);
+    }
+
+    return NULL;
+}
+
+void run_record_job(Record_Workers *workers, const Record_Job *job) {
+    // NOTE: Hand the job to the workers and wait for all of them. Threads past active_thread_count only
+    //       acknowledge the job, which lets the benchmark try every thread count with the same pool.
+    pthread_mutex_lock(&workers->mutex);
+    workers->job = *job;
+    workers->jobs_remaining = workers->thread_count;
+    workers->job_generation++;
+    pthread_cond_broadcast(&workers->job_ready);
+    while (workers->jobs_remaining > 0) {
+        pthread_cond_wait(&workers->job_done, &workers->mutex);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+void record_command_buffer_parallel(VkCommandBuffer command_buffer,
+                                    Record_Workers *workers,
+                                    uint32_t active_thread_count,
+                                    uint32_t frame_index,
+                                    const Render_Target *target,
+                                    VkPipeline pipeline,
+                                    VkBuffer vertex_buffer,
+                                    const Scene *scene) {
+    Record_Job job = {0};
+    job.kind = RECORD_JOB_RECORD;
+    job.frame_index = frame_index;
+    job.active_thread_count = active_thread_count;
+    job.target = *target;
+    job.pipeline = pipeline;
+    job.vertex_buffer = vertex_buffer;
+    job.scene = scene;
+    run_record_job(workers, &job);
+
+    VkCommandBuffer secondary_command_buffers[MAX_RECORD_THREADS];
+    for (uint32_t t = 0; t < active_thread_count; t++) {
+        secondary_command_buffers[t] = workers->workers[t].command_buffers[frame_index];
+    }
+
+    VkCommandBufferBeginInfo command_buffer_begin_info = {0};
+    command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    if (vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info) != VK_SUCCESS) {
+        exit_with_error("Failed to begin recording command buffer");
+    }
+
+    record_frame_prologue(command_buffer, scene);
+    begin_render_pass(command_buffer, target, scene, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    /*
+      VKAPI_ATTR void VKAPI_CALL vkCmdExecuteCommands(
+          VkCommandBuffer                             commandBuffer,
+          uint32_t                                    commandBufferCount,
+          const VkCommandBuffer*                      pCommandBuffers);
     */
-    VkBufferCreateInfo buffer_info = {0};
-    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    buffer_info.size = buffer_size;
+    vkCmdExecuteCommands(command_buffer, active_thread_count, secondary_command_buffers);
+    end_render_pass(command_buffer, target);
+    record_frame_epilogue(command_buffer, target, scene);
+
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+        exit_with_error("Failed to record command buffer");
+    }
+}
+
+void run_recording_benchmark(VkDevice device,
+                             VkCommandPool command_pool,
+                             Record_Workers *workers,
+                             const Render_Target *target,
+                             VkPipeline pipeline,
+                             VkBuffer vertex_buffer,
+                             const Scene *scene) {
+    // NOTE: CPU side only. Nothing is submitted, so the worker pools of frame 0 can be reused every iteration.
+    enum { ITERATIONS = 20 };
+    VkCommandBuffer command_buffer = allocate_command_buffer(device, command_pool);
+
+    double start = glfwGetTime();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        vkResetCommandBuffer(command_buffer, 0);
+        record_command_buffer(command_buffer, target, pipeline, vertex_buffer, scene);
+    }
+    double inline_ms = 1000.0 * (glfwGetTime() - start) / ITERATIONS;
+    trace_log("Recording %u draws inline: %.3f ms%s",
+              scene->draw_count,
+              inline_ms,
+              scene->indirect_draws ? " (indirect)" : "");
+
+    for (uint32_t thread_count = 1; thread_count <= workers->thread_count; thread_count++) {
+        start = glfwGetTime();
+        for (uint32_t i = 0; i < ITERATIONS; i++) {
+            vkResetCommandBuffer(command_buffer, 0);
+            record_command_buffer_parallel(command_buffer,
+                                           workers,
+                                           thread_count,
+                                           0,
+                                           target,
+                                           pipeline,
+                                           vertex_buffer,
+                                           scene);
+        }
+        double ms = 1000.0 * (glfwGetTime() - start) / ITERATIONS;
+        trace_log("Recording %u draws on %2u threads: %.3f ms (%.2fx inline)",
+                  scene->draw_count,
+                  thread_count,
+                  ms,
+                  ms > 0.0 ? inline_ms / ms : 0.0);
+    }
+
+    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+}
+
+Stream_Buffer create_stream_buffer(Device_Allocator *allocator,
+                                   VkPhysicalDevice physical_device,
+                                   uint32_t frame_count,
+                                   VkDeviceSize frame_size) {
+    Stream_Buffer stream = {0};
+    stream.frame_size = frame_size;
+    stream.frame_count = frame_count;
+    stream.buffer = create_buffer(allocator,
+                                  frame_size * frame_count,
+                                  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                  VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                                  VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                  ALLOCATION_STRATEGY_BUDDY);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    stream.storage_alignment = properties.limits.minStorageBufferOffsetAlignment;
+
+    return stream;
+}
+
+void destroy_stream_buffer(Device_Allocator *allocator, Stream_Buffer *stream) {
+    if (stream->overflow_count > 0) {
+        trace_log("WARNING: Stream buffer ran out of space %llu times", (unsigned long long)stream->overflow_count);
+    }
+    trace_log("Stream buffer: peak %.1f KiB of %.1f KiB per frame",
+              (double)stream->peak_used / 1024.0,
+              (double)stream->frame_size / 1024.0);
+    destroy_buffer(allocator, &stream->buffer);
+}
+
+void begin_stream_frame(Stream_Buffer *stream, uint32_t frame_index) {
+    // NOTE: Only called once the frame context's fence has signaled, so the GPU is done with this partition
+    stream->current_frame = frame_index;
+    stream->used = 0;
+}
+
+Stream_Allocation stream_allocate(Stream_Buffer *stream, VkDeviceSize size, VkDeviceSize alignment) {
+    Stream_Allocation result = {0};
+
+    VkDeviceSize offset = align_up(stream->used, alignment > 4 ? alignment : 4);
+    if (offset + size > stream->frame_size) {
+        stream->overflow_count++;
+        return result;
+    }
+    stream->used = offset + size;
+    if (stream->used > stream->peak_used) stream->peak_used = stream->used;
+
+    VkDeviceSize buffer_offset = stream->frame_size * stream->current_frame + offset;
+    result.data = (uint8_t *)stream->buffer.allocation.mapped + buffer_offset;
+    result.buffer = stream->buffer.buffer;
+    result.offset = buffer_offset;
+    return result;
+}
+
+void write_dynamic_geometry(Stream_Buffer *stream, Scene *scene, double time) {
+    // NOTE: Stand-in for UI and debug geometry: a small triangle spinning in the corner, rebuilt every frame
+    enum { DYNAMIC_VERTEX_COUNT = 3 };
+    scene->dynamic_vertex_count = 0;
+
+    Stream_Allocation allocation = stream_allocate(stream, sizeof(Gpu_Vertex) * DYNAMIC_VERTEX_COUNT, sizeof(float));
+    if (!allocation.data) return;
+
+    Gpu_Vertex *out = allocation.data;
+    for (uint32_t i = 0; i < DYNAMIC_VERTEX_COUNT; i++) {
+        float angle = (float)time + (float)i * (2.0f * 3.14159265f / DYNAMIC_VERTEX_COUNT);
+        Vertex vertex = {0};
+        vertex.position[0] = 0.8f + 0.15f * cosf(angle);
+        vertex.position[1] = -0.8f + 0.15f * sinf(angle);
+        vertex.color[0] = 1.0f;
+        vertex.color[1] = 1.0f;
+        vertex.color[2] = 1.0f;
+        // Pack on the stack and write whole vertices in order, the memory may be write-combined
+        Gpu_Vertex packed;
+        pack_vertices(&packed, &vertex, 1);
+        out[i] = packed;
+    }
+
+    scene->dynamic_vertex_buffer = allocation.buffer;
+    scene->dynamic_vertex_offset = allocation.offset;
+    scene->dynamic_vertex_count = DYNAMIC_VERTEX_COUNT;
+}
+
+VkDeviceSize get_object_transform_range(const Stream_Buffer *stream, Transform_Source transform_source, uint32_t object_count) {
+    // NOTE: What every set 0 descriptor covers, bound at the frame's dynamic offset. The shaders statically use
+    //       the binding whatever the transform source, specialization doesn't change that, so the set is always
+    //       bound. Only the storage buffer source reads the transforms, the others get a single one's worth.
+    VkDeviceSize transform_count = transform_source == TRANSFORM_SOURCE_STORAGE_BUFFER ? (VkDeviceSize)object_count + 1 : 1;
+    VkDeviceSize range = sizeof(Object_Transform) * transform_count;
+    if (range > stream->frame_size) {
+        exit_with_error("The transforms of %u objects don't fit in the stream buffer", object_count);
+    }
+    return range;
+}
+
+Frame_Descriptors create_frame_descriptors(VkDevice device,
+                                           const Shader_Program_Layout *program_layout,
+                                           Stream_Buffer *stream,
+                                           Transform_Source transform_source,
+                                           uint32_t object_count) {
+    // NOTE: The layout was reflected from the shaders, this is where it has to match what we feed them
+    const Shader_Program_Interface *interface = &program_layout->interface;
+    bool has_object_transforms = false;
+    for (uint32_t b = 0; b < interface->binding_count; b++) {
+        const Shader_Binding *binding = &interface->bindings[b];
+        if (binding->set == DESCRIPTOR_SET_FRAME && binding->binding == OBJECT_TRANSFORM_BINDING &&
+            binding->descriptor_type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC) {
+            has_object_transforms = true;
+        } else {
+            exit_with_error("Nothing to bind to set %u binding %u", binding->set, binding->binding);
+        }
+    }
+    if (!has_object_transforms) {
+        exit_with_error("The shaders don't read object transforms from set %d binding %d", DESCRIPTOR_SET_FRAME, OBJECT_TRANSFORM_BINDING);
+    }
+
+    Frame_Descriptors descriptors = {0};
+    descriptors.object_transform_range = get_object_transform_range(stream, transform_source, object_count);
+
     /*
-      typedef enum VkBufferUsageFlagBits {
-          VK_BUFFER_USAGE_TRANSFER_SRC_BIT = 0x00000001,
-          VK_BUFFER_USAGE_TRANSFER_DST_BIT = 0x00000002,
-          VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT = 0x00000004,
-          VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT = 0x00000008,
-          VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT = 0x00000010,
-          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT = 0x00000020,
-          VK_BUFFER_USAGE_INDEX_BUFFER_BIT = 0x00000040,
-          VK_BUFFER_USAGE_VERTEX_BUFFER_BIT = 0x00000080,
-          VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT = 0x00000100,
-          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT = 0x00020000,
-          VK_BUFFER_USAGE_VIDEO_DECODE_SRC_BIT_KHR = 0x00002000,
-          VK_BUFFER_USAGE_VIDEO_DECODE_DST_BIT_KHR = 0x00004000,
-          VK_BUFFER_USAGE_TRANSFORM_FEEDBACK_BUFFER_BIT_EXT = 0x00000800,
-          VK_BUFFER_USAGE_TRANSFORM_FEEDBACK_COUNTER_BUFFER_BIT_EXT = 0x00001000,
-          VK_BUFFER_USAGE_CONDITIONAL_RENDERING_BIT_EXT = 0x00000200,
-      #ifdef VK_ENABLE_BETA_EXTENSIONS
-          VK_BUFFER_USAGE_EXECUTION_GRAPH_SCRATCH_BIT_AMDX = 0x02000000,
-      #endif
-          VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR = 0x00080000,
-          VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR = 0x00100000,
-          VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR = 0x00000400,
-          VK_BUFFER_USAGE_VIDEO_ENCODE_DST_BIT_KHR = 0x00008000,
-          VK_BUFFER_USAGE_VIDEO_ENCODE_SRC_BIT_KHR = 0x00010000,
-          VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT = 0x00200000,
-          VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT = 0x00400000,
-          VK_BUFFER_USAGE_PUSH_DESCRIPTORS_DESCRIPTOR_BUFFER_BIT_EXT = 0x04000000,
-          VK_BUFFER_USAGE_MICROMAP_BUILD_INPUT_READ_ONLY_BIT_EXT = 0x00800000,
-          VK_BUFFER_USAGE_MICROMAP_STORAGE_BIT_EXT = 0x01000000,
-          VK_BUFFER_USAGE_RAY_TRACING_BIT_NV = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR,
-          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_EXT = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-          VK_BUFFER_USAGE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
-      } VkBufferUsageFlagBits;
+      typedef struct VkDescriptorPoolSize {
+          VkDescriptorType    type;
+          uint32_t            descriptorCount;
+      } VkDescriptorPoolSize;
+
+      typedef struct VkDescriptorPoolCreateInfo {
+          VkStructureType                sType;
+          const void*                    pNext;
+          VkDescriptorPoolCreateFlags    flags;
+          uint32_t                       maxSets;
+          uint32_t                       poolSizeCount;
+          const VkDescriptorPoolSize*    pPoolSizes;
+      } VkDescriptorPoolCreateInfo;
     */
-    buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    VkDescriptorPoolSize pool_size = {0};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    pool_size.descriptorCount = 1;
+
+    VkDescriptorPoolCreateInfo pool_info = {0};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+
+    if (vkCreateDescriptorPool(device, &pool_info, NULL, &descriptors.pool) != VK_SUCCESS) {
+        exit_with_error("Failed to create descriptor pool");
+    }
+
     /*
-      typedef enum VkSharingMode {
-          VK_SHARING_MODE_EXCLUSIVE = 0,
-          VK_SHARING_MODE_CONCURRENT = 1,
-          VK_SHARING_MODE_MAX_ENUM = 0x7FFFFFFF
-      } VkSharingMode;
+      typedef struct VkDescriptorSetAllocateInfo {
+          VkStructureType                 sType;
+          const void*                     pNext;
+          VkDescriptorPool                descriptorPool;
+          uint32_t                        descriptorSetCount;
+          const VkDescriptorSetLayout*    pSetLayouts;
+      } VkDescriptorSetAllocateInfo;
     */
-    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VkDescriptorSetAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = descriptors.pool;
+    alloc_info.descriptorSetCount = 1;
+    alloc_info.pSetLayouts = &program_layout->set_layouts[DESCRIPTOR_SET_FRAME];
+
+    if (vkAllocateDescriptorSets(device, &alloc_info, &descriptors.set) != VK_SUCCESS) {
+        exit_with_error("Failed to allocate the per-frame descriptor set");
+    }
 
-    VkBuffer vertex_buffer;
-    if (vkCreateBuffer(device, &buffer_info, NULL, &vertex_buffer) != VK_SUCCESS) {
-        exit_with_error("Failed to create vertex buffer");
+    /*
+      typedef struct VkDescriptorBufferInfo {
+          VkBuffer        buffer;
+          VkDeviceSize    offset;
+          VkDeviceSize    range;
+      } VkDescriptorBufferInfo;
+
+      typedef struct VkWriteDescriptorSet {
+          VkStructureType                  sType;
+          const void*                      pNext;
+          VkDescriptorSet                  dstSet;
+          uint32_t                         dstBinding;
+          uint32_t                         dstArrayElement;
+          uint32_t                         descriptorCount;
+          VkDescriptorType                 descriptorType;
+          const VkDescriptorImageInfo*     pImageInfo;
+          const VkDescriptorBufferInfo*    pBufferInfo;
+          const VkBufferView*              pTexelBufferView;
+      } VkWriteDescriptorSet;
+    */
+    // Offset 0, the frame's dynamic offset is added when the set is bound
+    VkDescriptorBufferInfo buffer_info = {0};
+    buffer_info.buffer = stream->buffer.buffer;
+    buffer_info.offset = 0;
+    buffer_info.range = descriptors.object_transform_range;
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = descriptors.set;
+    write.dstBinding = OBJECT_TRANSFORM_BINDING;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    write.pBufferInfo = &buffer_info;
+
+    vkUpdateDescriptorSets(device, 1, &write, 0, NULL);
+
+    return descriptors;
+}
+
+void destroy_frame_descriptors(VkDevice device, Frame_Descriptors *descriptors) {
+    // The set goes with its pool
+    vkDestroyDescriptorPool(device, descriptors->pool, NULL);
+    descriptors->pool = VK_NULL_HANDLE;
+    descriptors->set = VK_NULL_HANDLE;
+}
+
+void animate_objects(Scene *scene, double time) {
+    // NOTE: Every object spins around its own center at one of a few speeds and bobs up and down a little.
+    //       p' = R (p - center) + center + bob, folded into one affine transform.
+    for (uint32_t i = 0; i < scene->draw_count; i++) {
+        float angle = (float)time * (0.5f + 0.25f * (float)(i % 5));
+        float c = cosf(angle);
+        float s = sinf(angle);
+        float center_x = scene->object_centers[i * 2 + 0];
+        float center_y = scene->object_centers[i * 2 + 1];
+        float bob = 0.01f * sinf(2.0f * (float)time + 0.37f * (float)i);
+
+        Object_Transform *transform = &scene->object_transforms[i];
+        transform->rows[0][0] = c;
+        transform->rows[0][1] = -s;
+        transform->rows[0][2] = center_x - (c * center_x - s * center_y);
+        transform->rows[0][3] = 0.0f;
+        transform->rows[1][0] = s;
+        transform->rows[1][1] = c;
+        transform->rows[1][2] = center_y - (s * center_x + c * center_y) + bob;
+        transform->rows[1][3] = 0.0f;
+    }
+}
+
+VkDeviceSize write_object_transforms(Stream_Buffer *stream, Scene *scene) {
+    // NOTE: Every object's transform plus the identity for the dynamic geometry, read by draw ID in the shader.
+    //       Returns the bytes written.
+    VkDeviceSize size = sizeof(Object_Transform) * ((VkDeviceSize)scene->draw_count + 1);
+    Stream_Allocation allocation = stream_allocate(stream, size, stream->storage_alignment);
+    // NOTE: There's nothing safe to fall back to. Any other offset is another frame's memory, which the CPU may
+    //       be rewriting while this frame reads it. The frame size is checked against the transforms at startup,
+    //       so this is the other stream users taking more than was planned for.
+    if (!allocation.data) exit_with_error("No stream buffer space left for %u object transforms", scene->draw_count + 1);
+
+    memcpy(allocation.data, scene->object_transforms, (size_t)size);
+    scene->object_transform_offset = (uint32_t)allocation.offset;
+    return size;
+}
+
+VkDeviceSize write_animated_vertices(Stream_Buffer *stream, Scene *scene) {
+    // NOTE: The baseline: what moving objects costs when the transform is applied on the CPU. Every vertex
+    //       is transformed, packed and written again, every frame. Returns the bytes written.
+    scene->animated_vertex_buffer = VK_NULL_HANDLE;
+    VkDeviceSize size = sizeof(Gpu_Vertex) * (VkDeviceSize)scene->vertex_count;
+    Stream_Allocation allocation = stream_allocate(stream, size, sizeof(float));
+    if (!allocation.data) return 0;
+
+    Gpu_Vertex *out = allocation.data;
+    for (uint32_t v = 0; v < scene->vertex_count; v++) {
+        const Object_Transform *transform = &scene->object_transforms[scene->vertex_objects[v]];
+        Vertex vertex = scene->vertices[v];
+        float x = vertex.position[0];
+        float y = vertex.position[1];
+        vertex.position[0] = transform->rows[0][0] * x + transform->rows[0][1] * y + transform->rows[0][2];
+        vertex.position[1] = transform->rows[1][0] * x + transform->rows[1][1] * y + transform->rows[1][2];
+        // Pack on the stack and write whole vertices in order, the memory may be write-combined
+        Gpu_Vertex packed;
+        pack_vertices(&packed, &vertex, 1);
+        out[v] = packed;
+    }
+
+    scene->animated_vertex_buffer = allocation.buffer;
+    scene->animated_vertex_offset = allocation.offset;
+    return size;
+}
+
+Instance_Batcher create_instance_batcher(Device_Allocator *allocator, Uploader *uploader, uint32_t instance_capacity) {
+    // NOTE: The meshes are markers: regular polygons of 3 to 8 sides as triangle fans around a white center,
+    //       unit radius. The instance color tints them, so the rims come out darker.
+    static const uint32_t side_counts[] = {3, 4, 5, 6, 8};
+    Instance_Batcher batcher = {0};
+
+    uint32_t vertex_capacity = 0;
+    uint32_t index_capacity = 0;
+    for (uint32_t m = 0; m < array_count(side_counts); m++) {
+        vertex_capacity += side_counts[m] + 1;
+        index_capacity += side_counts[m] * 3;
+    }
+    Vertex *mesh_vertices = xmalloc(sizeof(Vertex) * vertex_capacity);
+    uint32_t *mesh_indices = xmalloc(sizeof(uint32_t) * index_capacity);
+
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+    for (uint32_t m = 0; m < array_count(side_counts); m++) {
+        uint32_t sides = side_counts[m];
+        Instance_Mesh *mesh = &batcher.meshes[batcher.mesh_count++];
+        mesh->first_index = index_count;
+        mesh->index_count = sides * 3;
+        mesh->vertex_offset = (int32_t)vertex_count;
+
+        // Indices are relative to the mesh's first vertex, vertex_offset moves them into place
+        Vertex center = {{0.0f, 0.0f}, {1.0f, 1.0f, 1.0f}};
+        mesh_vertices[vertex_count++] = center;
+        for (uint32_t s = 0; s < sides; s++) {
+            float angle = (float)s * (2.0f * 3.14159265f / (float)sides);
+            Vertex rim = {{sinf(angle), -cosf(angle)}, {0.5f, 0.5f, 0.5f}};
+            mesh_vertices[vertex_count++] = rim;
+            mesh_indices[index_count++] = 0;
+            mesh_indices[index_count++] = 1 + s;
+            mesh_indices[index_count++] = 1 + (s + 1) % sides;
+        }
+    }
+
+    batcher.vertex_buffer = create_vertex_buffer(allocator, uploader, mesh_vertices, vertex_count);
+    batcher.index_buffer = create_index_buffer(allocator, uploader, mesh_indices, index_count, VK_INDEX_TYPE_UINT16);
+    free(mesh_vertices);
+    free(mesh_indices);
+
+    batcher.instance_capacity = instance_capacity;
+    batcher.instances = xmalloc(sizeof(Gpu_Instance) * instance_capacity);
+    batcher.instance_meshes = xmalloc(sizeof(uint32_t) * instance_capacity);
+    batcher.sorted_instances = xmalloc(sizeof(Gpu_Instance) * instance_capacity);
+
+    trace_log("Instancing: %u marker meshes, up to %u instances of %u bytes",
+              batcher.mesh_count,
+              instance_capacity,
+              (uint32_t)sizeof(Gpu_Instance));
+    return batcher;
+}
+
+void destroy_instance_batcher(Device_Allocator *allocator, Instance_Batcher *batcher) {
+    destroy_buffer(allocator, &batcher->vertex_buffer);
+    destroy_buffer(allocator, &batcher->index_buffer);
+    free(batcher->instances);
+    free(batcher->instance_meshes);
+    free(batcher->sorted_instances);
+    memset(batcher, 0, sizeof(Instance_Batcher));
+}
+
+void add_instance(Instance_Batcher *batcher, uint32_t mesh, float x, float y, float scale, const float color[3]) {
+    if (batcher->instance_count == batcher->instance_capacity) {
+        batcher->dropped_instance_count++;
+        return;
+    }
+
+    uint32_t i = batcher->instance_count++;
+    Gpu_Instance *instance = &batcher->instances[i];
+    instance->offset[0] = x;
+    instance->offset[1] = y;
+    instance->scale[0] = scale;
+    pack_unorm8(instance->color, color, 4, 3);
+    batcher->instance_meshes[i] = mesh;
+}
+
+void build_instance_batches(Instance_Batcher *batcher, Stream_Buffer *stream) {
+    // NOTE: Consumes the instances added since the last build. A counting sort groups them by mesh (stable, so
+    //       instances of a mesh keep the order they were added in), then the grouped array goes into the stream
+    //       buffer in one sequential copy. One batch per mesh that has any instances.
+    uint32_t instance_count = batcher->instance_count;
+    batcher->instance_count = 0;
+    batcher->batch_count = 0;
+    if (instance_count == 0) return;
+
+    uint32_t mesh_starts[MAX_INSTANCE_MESHES] = {0};
+    for (uint32_t i = 0; i < instance_count; i++) {
+        mesh_starts[batcher->instance_meshes[i]]++;
+    }
+    uint32_t first_instance = 0;
+    for (uint32_t m = 0; m < batcher->mesh_count; m++) {
+        uint32_t count = mesh_starts[m];
+        if (count > 0) {
+            batcher->batches[batcher->batch_count++] = (Instance_Batch){m, first_instance, count};
+        }
+        mesh_starts[m] = first_instance;
+        first_instance += count;
+    }
+    for (uint32_t i = 0; i < instance_count; i++) {
+        batcher->sorted_instances[mesh_starts[batcher->instance_meshes[i]]++] = batcher->instances[i];
+    }
+
+    Stream_Allocation allocation = stream_allocate(stream, sizeof(Gpu_Instance) * instance_count, sizeof(Gpu_Instance));
+    if (!allocation.data) {
+        batcher->batch_count = 0;
+        return;
+    }
+    memcpy(allocation.data, batcher->sorted_instances, sizeof(Gpu_Instance) * instance_count);
+    batcher->instance_buffer = allocation.buffer;
+    batcher->instance_offset = allocation.offset;
+}
+
+void record_instance_batches(VkCommandBuffer command_buffer, const Instance_Batcher *batcher) {
+    if (!batcher || batcher->batch_count == 0 || batcher->pipeline == VK_NULL_HANDLE) return;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, batcher->pipeline);
+    VkBuffer vertex_buffers[] = {batcher->vertex_buffer.buffer, batcher->instance_buffer};
+    VkDeviceSize offsets[] = {0, batcher->instance_offset};
+    vkCmdBindVertexBuffers(command_buffer, VERTEX_BINDING, 2, vertex_buffers, offsets);
+    vkCmdBindIndexBuffer(command_buffer, batcher->index_buffer.buffer, 0, VK_INDEX_TYPE_UINT16);
+
+    for (uint32_t b = 0; b < batcher->batch_count; b++) {
+        const Instance_Batch *batch = &batcher->batches[b];
+        const Instance_Mesh *mesh = &batcher->meshes[batch->mesh];
+        vkCmdDrawIndexed(command_buffer,
+                         mesh->index_count,
+                         batch->instance_count,
+                         mesh->first_index,
+                         mesh->vertex_offset,
+                         batch->first_instance);
+    }
+}
+
+void write_markers(Instance_Batcher *batcher, uint32_t marker_count, double time) {
+    // NOTE: Stand-in for glyphs and map markers: marker_count of them on a square grid over the whole window,
+    //       cycling through the meshes, each with its own color and a little wobble
+    uint32_t columns = 1;
+    while (columns * columns < marker_count) columns++;
+    float cell_size = 2.0f / (float)columns;
+
+    for (uint32_t i = 0; i < marker_count; i++) {
+        float wobble = 0.1f * cell_size * sinf(3.0f * (float)time + 0.61f * (float)i);
+        float x = -1.0f + cell_size * ((float)(i % columns) + 0.5f) + wobble;
+        float y = -1.0f + cell_size * ((float)(i / columns) + 0.5f);
+        float color[3] = {
+            0.5f + 0.5f * sinf(0.37f * (float)i),
+            0.5f + 0.5f * sinf(0.37f * (float)i + 2.1f),
+            0.5f + 0.5f * sinf(0.37f * (float)i + 4.2f),
+        };
+        add_instance(batcher, i % batcher->mesh_count, x, y, 0.4f * cell_size, color);
+    }
+}
+
+Indirect_Draws create_indirect_draws(Device_Allocator *allocator,
+                                     Uploader *uploader,
+                                     Logical_Device_Etc logical_device,
+                                     const Scene *scene) {
+    Indirect_Draws indirect = {0};
+    indirect.material_count = scene->material_count;
+    indirect.multi_draw = logical_device.multi_draw_indirect;
+    indirect.draw_indexed_indirect_count = logical_device.draw_indexed_indirect_count;
+
+    // NOTE: One run of commands per material, in draw order within a run. The draw index still goes in as
+    //       firstInstance, so the shader finds its transform the same way as on the direct path.
+    indirect.material_first_commands = xmalloc(sizeof(uint32_t) * (indirect.material_count + 1));
+    memset(indirect.material_first_commands, 0, sizeof(uint32_t) * (indirect.material_count + 1));
+    for (uint32_t i = 0; i < scene->draw_count; i++) {
+        indirect.material_first_commands[scene->draws[i].material + 1]++;
+    }
+    for (uint32_t m = 0; m < indirect.material_count; m++) {
+        indirect.material_first_commands[m + 1] += indirect.material_first_commands[m];
     }
 
-    // Allocate memory for the buffer
     /*
-      typedef struct VkMemoryRequirements {
-          VkDeviceSize    size;
-          VkDeviceSize    alignment;
-          uint32_t        memoryTypeBits;
-      } VkMemoryRequirements;
+      typedef struct VkDrawIndexedIndirectCommand {
+          uint32_t    indexCount;
+          uint32_t    instanceCount;
+          uint32_t    firstIndex;
+          int32_t     vertexOffset;
+          uint32_t    firstInstance;
+      } VkDrawIndexedIndirectCommand;
     */
-    VkMemoryRequirements mem_requirements;
-    vkGetBufferMemoryRequirements(device, vertex_buffer, &mem_requirements);
+    VkDrawIndexedIndirectCommand *commands = xmalloc(sizeof(VkDrawIndexedIndirectCommand) * scene->draw_count);
+    indirect.command_draws = xmalloc(sizeof(uint32_t) * scene->draw_count);
+    uint32_t *next_commands = xmalloc(sizeof(uint32_t) * indirect.material_count);
+    memcpy(next_commands, indirect.material_first_commands, sizeof(uint32_t) * indirect.material_count);
+    for (uint32_t i = 0; i < scene->draw_count; i++) {
+        const Draw_Command *draw = &scene->draws[i];
+        uint32_t c = next_commands[draw->material]++;
+        indirect.command_draws[c] = i;
+        VkDrawIndexedIndirectCommand *command = &commands[c];
+        command->indexCount = draw->index_count;
+        command->instanceCount = 1;
+        command->firstIndex = draw->first_index;
+        command->vertexOffset = 0;
+        // Nonzero needs drawIndirectFirstInstance, main falls back to the direct path without it when anything
+        // reads the draw ID
+        command->firstInstance = logical_device.draw_indirect_first_instance ? i : 0;
+    }
+
+    // Every run starts out full. A compute pass that drops draws compacts the survivors to the front of the
+    // run and writes how many are left.
+    uint32_t *counts = xmalloc(sizeof(uint32_t) * indirect.material_count);
+    for (uint32_t m = 0; m < indirect.material_count; m++) {
+        counts[m] = indirect.material_first_commands[m + 1] - indirect.material_first_commands[m];
+    }
+
+    // NOTE: Storage usage so a compute pass can write both instead of the upload
+    indirect.commands = create_device_local_buffer(allocator,
+                                                   uploader,
+                                                   VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                   commands,
+                                                   sizeof(VkDrawIndexedIndirectCommand) * scene->draw_count);
+    indirect.counts = create_device_local_buffer(allocator,
+                                                 uploader,
+                                                 VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                 counts,
+                                                 sizeof(uint32_t) * indirect.material_count);
+    free(commands);
+    free(next_commands);
+    free(counts);
+
+    trace_log("Indirect draws: %u commands in %u runs, %s",
+              scene->draw_count,
+              indirect.material_count,
+              indirect.draw_indexed_indirect_count ? "count from the GPU (drawIndirectCount)" :
+              indirect.multi_draw ? "one multi-draw per run (multiDrawIndirect)" :
+              "one indirect call per command (no multiDrawIndirect)");
+    return indirect;
+}
+
+void destroy_indirect_draws(Device_Allocator *allocator, Indirect_Draws *indirect) {
+    destroy_buffer(allocator, &indirect->commands);
+    destroy_buffer(allocator, &indirect->counts);
+    free(indirect->material_first_commands);
+    free(indirect->command_draws);
+    memset(indirect, 0, sizeof(Indirect_Draws));
+}
+
+void record_indirect_draws(VkCommandBuffer command_buffer, const Scene *scene, const Indirect_Draws *indirect) {
+    // NOTE: The number of calls depends on the materials, not on the draw count
+    VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+    // What the cull pass left, when there is one
+    VkBuffer commands = scene->cull_pass ? scene->cull_pass->visible_commands.buffer : indirect->commands.buffer;
+    VkBuffer counts = scene->cull_pass ? scene->cull_pass->visible_counts.buffer : indirect->counts.buffer;
+    VkPipeline bound_pipeline = VK_NULL_HANDLE;
+    for (uint32_t m = 0; m < indirect->material_count; m++) {
+        uint32_t first_command = indirect->material_first_commands[m];
+        uint32_t command_count = indirect->material_first_commands[m + 1] - first_command;
+        VkPipeline pipeline = scene->material_pipelines[m];
+        if (command_count == 0 || pipeline == VK_NULL_HANDLE) continue;
+
+        if (pipeline != bound_pipeline) {
+            vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            bound_pipeline = pipeline;
+        }
+
+        VkDeviceSize offset = stride * first_command;
+        if (indirect->draw_indexed_indirect_count) {
+            /*
+              VKAPI_ATTR void VKAPI_CALL vkCmdDrawIndexedIndirectCountKHR(
+                  VkCommandBuffer                             commandBuffer,
+                  VkBuffer                                    buffer,
+                  VkDeviceSize                                offset,
+                  VkBuffer                                    countBuffer,
+                  VkDeviceSize                                countBufferOffset,
+                  uint32_t                                    maxDrawCount,
+                  uint32_t                                    stride);
+            */
+            indirect->draw_indexed_indirect_count(command_buffer,
+                                                  commands,
+                                                  offset,
+                                                  counts,
+                                                  sizeof(uint32_t) * m,
+                                                  command_count,
+                                                  (uint32_t)stride);
+        } else if (indirect->multi_draw) {
+            /*
+              VKAPI_ATTR void VKAPI_CALL vkCmdDrawIndexedIndirect(
+                  VkCommandBuffer                             commandBuffer,
+                  VkBuffer                                    buffer,
+                  VkDeviceSize                                offset,
+                  uint32_t                                    drawCount,
+                  uint32_t                                    stride);
+            */
+            vkCmdDrawIndexedIndirect(command_buffer, commands, offset, command_count, (uint32_t)stride);
+        } else {
+            for (uint32_t c = 0; c < command_count; c++) {
+                vkCmdDrawIndexedIndirect(command_buffer, commands, offset + stride * c, 1, (uint32_t)stride);
+            }
+        }
+    }
+}
+
+void update_camera(Camera *camera, float zoom, double time) {
+    // NOTE: Zoomed in, the camera drifts around the scene without leaving it, so the visible set keeps changing
+    float max_offset = 1.0f - 1.0f / zoom;
+    camera->center[0] = max_offset * cosf(0.3f * (float)time);
+    camera->center[1] = max_offset * sinf(0.2f * (float)time);
+    camera->zoom = zoom;
+}
+
+void push_draw_constants(VkCommandBuffer command_buffer, const Scene *scene) {
+    // NOTE: Everything the shader declares gets a value, even the transform it only reads with
+    //       TRANSFORM_SOURCE_PUSH_CONSTANTS. The identity is also what the dynamic geometry is drawn with.
+    Draw_Constants constants = {0};
+    constants.transform = (Object_Transform){{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f}}};
+    constants.camera = scene->camera;
+    constants.depth_step = scene->depth_step;
+    vkCmdPushConstants(command_buffer, scene->pipeline_layout, scene->push_constant_stages, 0, sizeof(Draw_Constants), &constants);
+}
+
+Cull_Pass create_cull_pass(Device_Allocator *allocator,
+                           Uploader *uploader,
+                           Pipeline_Manager *pipeline_manager,
+                           Stream_Buffer *stream,
+                           const Scene *scene,
+                           const Indirect_Draws *indirect,
+                           uint32_t frame_count,
+                           bool occlusion) {
+    VkDevice device = allocator->device;
+    Cull_Pass cull = {0};
+    cull.command_count = scene->draw_count;
+    cull.frame_count = frame_count;
+    cull.read_transforms = scene->transform_source == TRANSFORM_SOURCE_STORAGE_BUFFER;
+    // Packing the survivors to the front of their run only pays off when the GPU also supplies the count
+    cull.compact = indirect->draw_indexed_indirect_count != NULL;
+    cull.occlusion = occlusion;
+
+    const char *shader = occlusion ? CULL_HIZ_SHADER : CULL_SHADER;
+    uint32_t cull_binding_count = occlusion ? CULL_BINDING_COUNT : CULL_HIZ_BINDING;
+    Shader_Program_Interface interface;
+    if (!reflect_compute_shader(shader, pipeline_manager->shaders_from_disk, &interface)) {
+        exit_with_error("Shader interface errors in %s, see above", shader);
+    }
+    // NOTE: Set 0 is the object transforms, like the graphics programs, set 1 the buffers created below and
+    //       with --hiz the pyramid
+    for (uint32_t b = 0; b < interface.binding_count; b++) {
+        const Shader_Binding *binding = &interface.bindings[b];
+        VkDescriptorType cull_type = binding->binding == CULL_HIZ_BINDING ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bool expected = binding->set == DESCRIPTOR_SET_FRAME ?
+            binding->binding == OBJECT_TRANSFORM_BINDING && binding->descriptor_type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC :
+            binding->set == DESCRIPTOR_SET_CULL && binding->binding < cull_binding_count && binding->descriptor_type == cull_type;
+        if (!expected) exit_with_error("%s: Nothing to bind to set %u binding %u", shader, binding->set, binding->binding);
+    }
+    if (interface.binding_count != 1 + cull_binding_count) {
+        exit_with_error("%s: Expected %u bindings, the shader declares %u", shader, 1 + cull_binding_count, interface.binding_count);
+    }
+    if (interface.push_constant_range.size != sizeof(Cull_Constants)) {
+        exit_with_error("%s: Declares %u bytes of push constants, expected a Cull_Constants (%zu bytes)",
+                        shader,
+                        interface.push_constant_range.size,
+                        sizeof(Cull_Constants));
+    }
+    Cached_Pipeline_Layout layout = get_pipeline_layout(&pipeline_manager->layout_cache, &interface);
+    cull.pipeline_layout = layout.layout;
+    cull.pipeline = create_compute_pipeline(device,
+                                            pipeline_manager->pipeline_cache,
+                                            cull.pipeline_layout,
+                                            shader,
+                                            pipeline_manager->shaders_from_disk);
+    if (occlusion) cull.hiz = create_hiz_pyramid(allocator, pipeline_manager, frame_count);
+
+    // Bounding circles in object space, in the order of the indirect commands
+    Cull_Object *objects = xmalloc(sizeof(Cull_Object) * cull.command_count);
+    for (uint32_t m = 0; m < indirect->material_count; m++) {
+        for (uint32_t c = indirect->material_first_commands[m]; c < indirect->material_first_commands[m + 1]; c++) {
+            uint32_t draw = indirect->command_draws[c];
+            Cull_Object *object = &objects[c];
+            object->center[0] = scene->object_centers[draw * 2 + 0];
+            object->center[1] = scene->object_centers[draw * 2 + 1];
+            object->radius = scene->object_radii[draw];
+            object->draw = draw;
+            object->run = m;
+            object->first_run_command = indirect->material_first_commands[m];
+        }
+    }
+    cull.objects = create_device_local_buffer(allocator,
+                                              uploader,
+                                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                              objects,
+                                              sizeof(Cull_Object) * cull.command_count);
+    free(objects);
+
+    cull.visible_commands = create_buffer(allocator,
+                                          sizeof(VkDrawIndexedIndirectCommand) * cull.command_count,
+                                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                          ALLOCATION_STRATEGY_BUDDY);
+    cull.visible_counts = create_buffer(allocator,
+                                        sizeof(uint32_t) * indirect->material_count,
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                        ALLOCATION_STRATEGY_BUDDY);
+    // Read back on the CPU once the frame's fence has signaled, one slot per frame in flight
+    cull.statistics = create_buffer(allocator,
+                                    sizeof(Cull_Statistics) * frame_count,
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                    ALLOCATION_STRATEGY_BUDDY);
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 1},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, CULL_HIZ_BINDING},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1}, // --hiz only
+    };
+    VkDescriptorPoolCreateInfo pool_info = {0};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 2;
+    pool_info.poolSizeCount = occlusion ? array_count(pool_sizes) : array_count(pool_sizes) - 1;
+    pool_info.pPoolSizes = pool_sizes;
+    if (vkCreateDescriptorPool(device, &pool_info, NULL, &cull.descriptor_pool) != VK_SUCCESS) {
+        exit_with_error("Failed to create the culling descriptor pool");
+    }
+
+    VkDescriptorSet sets[2];
+    VkDescriptorSetAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = cull.descriptor_pool;
+    alloc_info.descriptorSetCount = 2;
+    alloc_info.pSetLayouts = layout.set_layouts;
+    if (vkAllocateDescriptorSets(device, &alloc_info, sets) != VK_SUCCESS) {
+        exit_with_error("Failed to allocate the culling descriptor sets");
+    }
+    cull.frame_set = sets[DESCRIPTOR_SET_FRAME];
+    cull.set = sets[DESCRIPTOR_SET_CULL];
+
+    // The transforms are the same range of the stream buffer the graphics set points at, checked the same way
+    VkDeviceSize object_transform_range = get_object_transform_range(stream, scene->transform_source, scene->draw_count);
+    VkDescriptorBufferInfo buffer_infos[1 + CULL_HIZ_BINDING] = {
+        {stream->buffer.buffer, 0, object_transform_range},
+        [1 + CULL_OBJECTS_BINDING] = {cull.objects.buffer, 0, VK_WHOLE_SIZE},
+        [1 + CULL_COMMANDS_BINDING] = {indirect->commands.buffer, 0, VK_WHOLE_SIZE},
+        [1 + CULL_VISIBLE_COMMANDS_BINDING] = {cull.visible_commands.buffer, 0, VK_WHOLE_SIZE},
+        [1 + CULL_VISIBLE_COUNTS_BINDING] = {cull.visible_counts.buffer, 0, VK_WHOLE_SIZE},
+        [1 + CULL_STATISTICS_BINDING] = {cull.statistics.buffer, 0, VK_WHOLE_SIZE},
+    };
+    VkWriteDescriptorSet writes[1 + CULL_BINDING_COUNT] = {0};
+    for (uint32_t w = 0; w < array_count(buffer_infos); w++) {
+        writes[w].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[w].dstSet = w == 0 ? cull.frame_set : cull.set;
+        writes[w].dstBinding = w == 0 ? OBJECT_TRANSFORM_BINDING : w - 1;
+        writes[w].descriptorCount = 1;
+        writes[w].descriptorType = w == 0 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[w].pBufferInfo = &buffer_infos[w];
+    }
+    // The whole pyramid, in the layout it's built in
+    VkDescriptorImageInfo hiz_info = {cull.hiz.sampler, cull.hiz.view, VK_IMAGE_LAYOUT_GENERAL};
+    VkWriteDescriptorSet *hiz_write = &writes[1 + CULL_HIZ_BINDING];
+    hiz_write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    hiz_write->dstSet = cull.set;
+    hiz_write->dstBinding = CULL_HIZ_BINDING;
+    hiz_write->descriptorCount = 1;
+    hiz_write->descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    hiz_write->pImageInfo = &hiz_info;
+    vkUpdateDescriptorSets(device, 1 + cull_binding_count, writes, 0, NULL);
+
+    cull.statistics_pending = xmalloc(sizeof(bool) * frame_count);
+    memset(cull.statistics_pending, 0, sizeof(bool) * frame_count);
+
+    trace_log("Culling %u draws on the GPU%s, survivors %s",
+              cull.command_count,
+              occlusion ? " against the view and the previous frame's depth" : "",
+              cull.compact ? "packed to the front of their run (drawIndirectCount)" : "kept in place, culled ones get no instances");
+    return cull;
+}
+
+void destroy_cull_pass(Device_Allocator *allocator, Cull_Pass *cull) {
+    // The pipeline layout belongs to the layout cache, the sets to the pool
+    vkDestroyPipeline(allocator->device, cull->pipeline, NULL);
+    vkDestroyDescriptorPool(allocator->device, cull->descriptor_pool, NULL);
+    destroy_buffer(allocator, &cull->objects);
+    destroy_buffer(allocator, &cull->visible_commands);
+    destroy_buffer(allocator, &cull->visible_counts);
+    destroy_buffer(allocator, &cull->statistics);
+    if (cull->occlusion) destroy_hiz_pyramid(allocator, &cull->hiz);
+    free(cull->statistics_pending);
+    memset(cull, 0, sizeof(Cull_Pass));
+}
 
+void record_cull_pass(VkCommandBuffer command_buffer, const Scene *scene, const Cull_Pass *cull) {
     /*
-      typedef struct VkMemoryAllocateInfo {
-          VkStructureType    sType;
-          const void*        pNext;
-          VkDeviceSize       allocationSize;
-          uint32_t           memoryTypeIndex;
-      } VkMemoryAllocateInfo;
+      VKAPI_ATTR void VKAPI_CALL vkCmdPipelineBarrier(
+          VkCommandBuffer                             commandBuffer,
+          VkPipelineStageFlags                        srcStageMask,
+          VkPipelineStageFlags                        dstStageMask,
+          VkDependencyFlags                           dependencyFlags,
+          uint32_t                                    memoryBarrierCount,
+          const VkMemoryBarrier*                      pMemoryBarriers,
+          uint32_t                                    bufferMemoryBarrierCount,
+          const VkBufferMemoryBarrier*                pBufferMemoryBarriers,
+          uint32_t                                    imageMemoryBarrierCount,
+          const VkImageMemoryBarrier*                 pImageMemoryBarriers);
     */
-    VkMemoryAllocateInfo alloc_info = {0};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = mem_requirements.size;
+    // NOTE: The previous frame may still be drawing from these buffers, so nothing gets written before it's done
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, NULL, 0, NULL, 0, NULL);
+    vkCmdFillBuffer(command_buffer, cull->visible_counts.buffer, 0, VK_WHOLE_SIZE, 0);
+    vkCmdFillBuffer(command_buffer, cull->statistics.buffer, sizeof(Cull_Statistics) * scene->frame_index, sizeof(Cull_Statistics), 0);
+    // Until the first frame has built it the pyramid is never read, but the descriptor wants it in GENERAL
+    if (cull->occlusion && !cull->hiz.built) {
+        VkImageMemoryBarrier undefined = {0};
+        undefined.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        undefined.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        undefined.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        undefined.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        undefined.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        undefined.image = cull->hiz.image.image;
+        undefined.subresourceRange = (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, HIZ_LEVEL_COUNT, 0, 1};
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 0, NULL, 0, NULL, 1, &undefined);
+    }
+
+    VkMemoryBarrier cleared = {0};
+    cleared.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    cleared.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    cleared.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &cleared, 0, NULL, 0, NULL);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull->pipeline);
+    VkDescriptorSet sets[] = {cull->frame_set, cull->set};
+    vkCmdBindDescriptorSets(command_buffer,
+                            VK_PIPELINE_BIND_POINT_COMPUTE,
+                            cull->pipeline_layout,
+                            DESCRIPTOR_SET_FRAME,
+                            2,
+                            sets,
+                            1,
+                            &scene->object_transform_offset);
+
+    Cull_Constants constants = {0};
+    constants.camera = scene->camera;
+    constants.command_count = cull->command_count;
+    constants.read_transforms = cull->read_transforms;
+    constants.compact = cull->compact;
+    constants.statistics_slot = scene->frame_index;
+    constants.occlusion = cull->occlusion && cull->hiz.built;
+    constants.hiz_camera = cull->hiz.camera;
+    constants.depth_step = scene->depth_step;
+    vkCmdPushConstants(command_buffer, cull->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(Cull_Constants), &constants);
+
     /*
-      typedef enum VkMemoryPropertyFlagBits {
-          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT = 0x00000001,
-          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT = 0x00000002,
-          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT = 0x00000004,
-          VK_MEMORY_PROPERTY_HOST_CACHED_BIT = 0x00000008,
-          VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT = 0x00000010,
-          VK_MEMORY_PROPERTY_PROTECTED_BIT = 0x00000020,
-          VK_MEMORY_PROPERTY_DEVICE_COHERENT_BIT_AMD = 0x00000040,
-          VK_MEMORY_PROPERTY_DEVICE_UNCACHED_BIT_AMD = 0x00000080,
-          VK_MEMORY_PROPERTY_RDMA_CAPABLE_BIT_NV = 0x00000100,
-          VK_MEMORY_PROPERTY_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
-      } VkMemoryPropertyFlagBits;
-      typedef VkFlags VkMemoryPropertyFlags;
+      VKAPI_ATTR void VKAPI_CALL vkCmdDispatch(
+          VkCommandBuffer                             commandBuffer,
+          uint32_t                                    groupCountX,
+          uint32_t                                    groupCountY,
+          uint32_t                                    groupCountZ);
+    */
+    vkCmdDispatch(command_buffer, (cull->command_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // The draws read the commands and counts, the CPU reads the statistics after the fence
+    VkMemoryBarrier culled = {0};
+    culled.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    culled.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    culled.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &culled, 0, NULL, 0, NULL);
+}
+
+void collect_cull_statistics(Cull_Pass *cull, uint32_t frame_index) {
+    // NOTE: Only called once the frame context's fence has signaled
+    if (!cull->statistics_pending[frame_index]) return;
+    cull->statistics_pending[frame_index] = false;
+
+    const Cull_Statistics *statistics = cull->statistics.allocation.mapped;
+    cull->visible_total += statistics[frame_index].visible;
+    cull->occluded_total += statistics[frame_index].occluded;
+    cull->sampled_frame_count++;
+}
+
+Hiz_Pyramid create_hiz_pyramid(Device_Allocator *allocator, Pipeline_Manager *pipeline_manager, uint32_t frame_count) {
+    VkDevice device = allocator->device;
+    Hiz_Pyramid hiz = {0};
+    hiz.device = device;
+
+    Shader_Program_Interface interface;
+    if (!reflect_compute_shader(HIZ_SHADER, pipeline_manager->shaders_from_disk, &interface)) {
+        exit_with_error("Shader interface errors in %s, see above", HIZ_SHADER);
+    }
+    // NOTE: Set 0 only: binding 0 is read from, binding 1 is the level written
+    const Shader_Binding *bindings = interface.bindings;
+    bool expected = interface.binding_count == 2 &&
+        bindings[0].set == 0 && bindings[0].binding == 0 && bindings[0].descriptor_type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER &&
+        bindings[1].set == 0 && bindings[1].binding == 1 && bindings[1].descriptor_type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    if (!expected) exit_with_error("%s: Expected a sampler at set 0 binding 0 and a storage image at binding 1", HIZ_SHADER);
+    if (interface.push_constant_range.size != sizeof(Hiz_Constants)) {
+        exit_with_error("%s: Declares %u bytes of push constants, expected a Hiz_Constants (%zu bytes)",
+                        HIZ_SHADER,
+                        interface.push_constant_range.size,
+                        sizeof(Hiz_Constants));
+    }
+    Cached_Pipeline_Layout layout = get_pipeline_layout(&pipeline_manager->layout_cache, &interface);
+    hiz.pipeline_layout = layout.layout;
+    hiz.pipeline = create_compute_pipeline(device,
+                                           pipeline_manager->pipeline_cache,
+                                           hiz.pipeline_layout,
+                                           HIZ_SHADER,
+                                           pipeline_manager->shaders_from_disk);
+
+    // Written a level at a time as a storage image, read back through the sampler
+    VkImageCreateInfo image_info = {0};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = VK_FORMAT_R32_SFLOAT;
+    image_info.extent = (VkExtent3D){HIZ_SIZE, HIZ_SIZE, 1};
+    image_info.mipLevels = HIZ_LEVEL_COUNT;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    hiz.image = create_image(allocator, &image_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+
+    VkImageViewCreateInfo view_info = {0};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = hiz.image.image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = VK_FORMAT_R32_SFLOAT;
+    view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    view_info.subresourceRange.levelCount = HIZ_LEVEL_COUNT;
+    view_info.subresourceRange.layerCount = 1;
+    if (vkCreateImageView(device, &view_info, NULL, &hiz.view) != VK_SUCCESS) {
+        exit_with_error("Failed to create depth pyramid view");
+    }
+    for (uint32_t level = 0; level < HIZ_LEVEL_COUNT; level++) {
+        view_info.subresourceRange.baseMipLevel = level;
+        view_info.subresourceRange.levelCount = 1;
+        if (vkCreateImageView(device, &view_info, NULL, &hiz.level_views[level]) != VK_SUCCESS) {
+            exit_with_error("Failed to create depth pyramid level view");
+        }
+    }
+
+    /*
+      typedef struct VkSamplerCreateInfo {
+          VkStructureType         sType;
+          const void*             pNext;
+          VkSamplerCreateFlags    flags;
+          VkFilter                magFilter;
+          VkFilter                minFilter;
+          VkSamplerMipmapMode     mipmapMode;
+          VkSamplerAddressMode    addressModeU;
+          VkSamplerAddressMode    addressModeV;
+          VkSamplerAddressMode    addressModeW;
+          float                   mipLodBias;
+          VkBool32                anisotropyEnable;
+          float                   maxAnisotropy;
+          VkBool32                compareEnable;
+          VkCompareOp             compareOp;
+          float                   minLod;
+          float                   maxLod;
+          VkBorderColor           borderColor;
+          VkBool32                unnormalizedCoordinates;
+      } VkSamplerCreateInfo;
     */
-    alloc_info.memoryTypeIndex = find_memory_type(physical_device,
-                                                  mem_requirements.memoryTypeBits,
-                                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    VkSamplerCreateInfo sampler_info = {0};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_NEAREST;
+    sampler_info.minFilter = VK_FILTER_NEAREST;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.maxLod = (float)HIZ_LEVEL_COUNT;
+    if (vkCreateSampler(device, &sampler_info, NULL, &hiz.sampler) != VK_SUCCESS) {
+        exit_with_error("Failed to create depth pyramid sampler");
+    }
 
-    // VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkDeviceMemory)
-    VkDeviceMemory vertex_buffer_memory;
-    if (vkAllocateMemory(device, &alloc_info, NULL, &vertex_buffer_memory) != VK_SUCCESS) {
-        exit_with_error("Failed to allocate vertex buffer memory");
+    // One set per level: level 0 from the depth buffer, one of those per frame in flight since the depth view
+    // is only known when recording, the others from the level before
+    uint32_t set_count = frame_count + HIZ_LEVEL_COUNT - 1;
+    VkDescriptorPoolSize pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, set_count},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, set_count},
+    };
+    VkDescriptorPoolCreateInfo pool_info = {0};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = set_count;
+    pool_info.poolSizeCount = array_count(pool_sizes);
+    pool_info.pPoolSizes = pool_sizes;
+    if (vkCreateDescriptorPool(device, &pool_info, NULL, &hiz.descriptor_pool) != VK_SUCCESS) {
+        exit_with_error("Failed to create the depth pyramid descriptor pool");
     }
 
-    /*
-      VKAPI_ATTR VkResult VKAPI_CALL vkBindBufferMemory(
-          VkDevice                                    device,
-          VkBuffer                                    buffer,
-          VkDeviceMemory                              memory,
-          VkDeviceSize                                memoryOffset);
-    */
-    vkBindBufferMemory(device, vertex_buffer, vertex_buffer_memory, 0);
+    VkDescriptorSetLayout *set_layouts = xmalloc(sizeof(VkDescriptorSetLayout) * set_count);
+    VkDescriptorSet *sets = xmalloc(sizeof(VkDescriptorSet) * set_count);
+    for (uint32_t i = 0; i < set_count; i++) set_layouts[i] = layout.set_layouts[0];
+    VkDescriptorSetAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = hiz.descriptor_pool;
+    alloc_info.descriptorSetCount = set_count;
+    alloc_info.pSetLayouts = set_layouts;
+    if (vkAllocateDescriptorSets(device, &alloc_info, sets) != VK_SUCCESS) {
+        exit_with_error("Failed to allocate the depth pyramid descriptor sets");
+    }
+    hiz.depth_sets = xmalloc(sizeof(VkDescriptorSet) * frame_count);
+    memcpy(hiz.depth_sets, sets, sizeof(VkDescriptorSet) * frame_count);
+    memcpy(hiz.level_sets, sets + frame_count, sizeof(hiz.level_sets));
+    free(set_layouts);
+    free(sets);
+
+    // Everything but the depth buffer, which record_hiz_pyramid points at
+    for (uint32_t i = 0; i < set_count; i++) {
+        uint32_t level = i < frame_count ? 0 : i - frame_count + 1;
+        VkDescriptorSet set = level == 0 ? hiz.depth_sets[i] : hiz.level_sets[level - 1];
+        VkDescriptorImageInfo destination = {VK_NULL_HANDLE, hiz.level_views[level], VK_IMAGE_LAYOUT_GENERAL};
+        VkDescriptorImageInfo source = {hiz.sampler, level > 0 ? hiz.level_views[level - 1] : VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL};
+        VkWriteDescriptorSet writes[2] = {0};
+        writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[0].dstSet = set;
+        writes[0].dstBinding = 1;
+        writes[0].descriptorCount = 1;
+        writes[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        writes[0].pImageInfo = &destination;
+        writes[1] = writes[0];
+        writes[1].dstBinding = 0;
+        writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        writes[1].pImageInfo = &source;
+        vkUpdateDescriptorSets(device, level > 0 ? 2 : 1, writes, 0, NULL);
+    }
 
-    void *data;
-    /*
-      VKAPI_ATTR VkResult VKAPI_CALL vkMapMemory(
-          VkDevice                                    device,
-          VkDeviceMemory                              memory,
-          VkDeviceSize                                offset,
-          VkDeviceSize                                size,
-          VkMemoryMapFlags                            flags,
-          void**                                      ppData);
-    */
-    vkMapMemory(device, vertex_buffer_memory, 0, buffer_size, 0, &data);
-    memcpy(data, vertices, (size_t)buffer_size);
-    vkUnmapMemory(device, vertex_buffer_memory);
+    trace_log("Depth pyramid: %ux%u, %u levels, %.2f MiB",
+              HIZ_SIZE,
+              HIZ_SIZE,
+              HIZ_LEVEL_COUNT,
+              (double)hiz.image.allocation.requested_size / (1024.0 * 1024.0));
+    return hiz;
+}
 
-    Vertex_Buffer_Etc result = {0};
-    result.buffer = vertex_buffer;
-    result.buffer_memory = vertex_buffer_memory;
-    return result;
+void destroy_hiz_pyramid(Device_Allocator *allocator, Hiz_Pyramid *hiz) {
+    // The pipeline layout belongs to the layout cache, the sets to the pool
+    vkDestroyPipeline(allocator->device, hiz->pipeline, NULL);
+    vkDestroyDescriptorPool(allocator->device, hiz->descriptor_pool, NULL);
+    vkDestroySampler(allocator->device, hiz->sampler, NULL);
+    for (uint32_t level = 0; level < HIZ_LEVEL_COUNT; level++) {
+        vkDestroyImageView(allocator->device, hiz->level_views[level], NULL);
+    }
+    vkDestroyImageView(allocator->device, hiz->view, NULL);
+    destroy_image(allocator, &hiz->image);
+    free(hiz->depth_sets);
+    memset(hiz, 0, sizeof(Hiz_Pyramid));
 }
 
-void destroy_vertex_buffer(VkDevice device, Vertex_Buffer_Etc vertex_buffer) {
-    vkDestroyBuffer(device, vertex_buffer.buffer, NULL);
-    vkFreeMemory(device, vertex_buffer.buffer_memory, NULL);
+void record_hiz_pyramid(VkCommandBuffer command_buffer, const Render_Target *target, const Scene *scene, Hiz_Pyramid *hiz) {
+    // NOTE: The depth image is recreated with the swapchain, so level 0's set is pointed at it every time. The
+    //       frame's fence has signaled, so its set isn't in use.
+    VkDescriptorSet depth_set = hiz->depth_sets[scene->frame_index];
+    VkDescriptorImageInfo depth_info = {hiz->sampler, target->depth_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = depth_set;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &depth_info;
+    vkUpdateDescriptorSets(hiz->device, 1, &write, 0, NULL);
+
+    // The depth tests are done with the depth, and this frame's cull pass with the pyramid, whose contents can
+    // go since every texel is written again
+    VkPipelineStageFlags depth_stages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    VkImageMemoryBarrier barriers[2] = {0};
+    barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barriers[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[0].image = target->depth_image;
+    barriers[0].subresourceRange = (VkImageSubresourceRange){VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+    barriers[1] = barriers[0];
+    barriers[1].srcAccessMask = 0;
+    barriers[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barriers[1].image = hiz->image.image;
+    barriers[1].subresourceRange = (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, HIZ_LEVEL_COUNT, 0, 1};
+    vkCmdPipelineBarrier(command_buffer,
+                         depth_stages | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, NULL, 0, NULL, 2, barriers);
+
+    // A dispatch per level, each reading what the one before wrote
+    VkMemoryBarrier level_written = {0};
+    level_written.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    level_written.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    level_written.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, hiz->pipeline);
+    Hiz_Constants constants = {{target->extent.width, target->extent.height}, {HIZ_SIZE, HIZ_SIZE}};
+    for (uint32_t level = 0; level < HIZ_LEVEL_COUNT; level++) {
+        if (level > 0) {
+            vkCmdPipelineBarrier(command_buffer,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 0, 1, &level_written, 0, NULL, 0, NULL);
+            constants.source_size[0] = constants.destination_size[0];
+            constants.source_size[1] = constants.destination_size[1];
+            constants.destination_size[0] = HIZ_SIZE >> level;
+            constants.destination_size[1] = HIZ_SIZE >> level;
+        }
+        VkDescriptorSet set = level == 0 ? depth_set : hiz->level_sets[level - 1];
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, hiz->pipeline_layout, 0, 1, &set, 0, NULL);
+        vkCmdPushConstants(command_buffer, hiz->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(Hiz_Constants), &constants);
+        uint32_t group_count = (constants.destination_size[0] + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE;
+        vkCmdDispatch(command_buffer, group_count, group_count, 1);
+    }
+
+    // The next frame's cull pass reads the pyramid, its render pass clears the depth again
+    barriers[0].srcAccessMask = 0;
+    barriers[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | depth_stages,
+                         0, 1, &level_written, 0, NULL, 1, &barriers[0]);
+
+    hiz->built = true;
+    hiz->camera = scene->camera;
 }
 
-VkCommandPool create_command_pool(VkDevice device, uint32_t queue_family_index) {
-    /*
-      typedef struct VkCommandPoolCreateInfo {
-         VkStructureType             sType;
-         const void*                 pNext;
-         VkCommandPoolCreateFlags    flags;
-         uint32_t                    queueFamilyIndex;
-     } VkCommandPoolCreateInfo;
-    */
-    VkCommandPoolCreateInfo command_pool_info = {0};
-    command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    command_pool_info.queueFamilyIndex = queue_family_index; // Graphics queue family
+Gpu_Timer create_gpu_timer(VkDevice device, uint32_t frame_count, float timestamp_period, bool count_fragments) {
+    Gpu_Timer timer = {0};
+    timer.frame_count = frame_count;
+    timer.timestamp_period = timestamp_period;
+
     /*
-      typedef enum VkCommandPoolCreateFlagBits {
-          VK_COMMAND_POOL_CREATE_TRANSIENT_BIT = 0x00000001,
-          VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT = 0x00000002,
-          VK_COMMAND_POOL_CREATE_PROTECTED_BIT = 0x00000004,
-          VK_COMMAND_POOL_CREATE_FLAG_BITS_MAX_ENUM = 0x7FFFFFFF
-      } VkCommandPoolCreateFlagBits;
+      typedef struct VkQueryPoolCreateInfo {
+          VkStructureType                  sType;
+          const void*                      pNext;
+          VkQueryPoolCreateFlags           flags;
+          VkQueryType                      queryType;
+          uint32_t                         queryCount;
+          VkQueryPipelineStatisticFlags    pipelineStatistics;
+      } VkQueryPoolCreateInfo;
     */
-    command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkQueryPoolCreateInfo pool_info = {0};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = GPU_TIMESTAMP_COUNT * frame_count;
+    if (vkCreateQueryPool(device, &pool_info, NULL, &timer.query_pool) != VK_SUCCESS) {
+        exit_with_error("Failed to create timestamp query pool");
+    }
 
-    VkCommandPool command_pool;
-    if (vkCreateCommandPool(device, &command_pool_info, NULL, &command_pool) != VK_SUCCESS) {
-        exit_with_error("Failed to create command pool");
+    // Fragment shader invocations over the render pass: what the depth test saves shows up here
+    if (count_fragments) {
+        VkQueryPoolCreateInfo statistics_pool_info = {0};
+        statistics_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        statistics_pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        statistics_pool_info.queryCount = frame_count;
+        statistics_pool_info.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+        if (vkCreateQueryPool(device, &statistics_pool_info, NULL, &timer.statistics_pool) != VK_SUCCESS) {
+            exit_with_error("Failed to create pipeline statistics query pool");
+        }
     }
 
-    return command_pool;
+    timer.pending = xmalloc(sizeof(bool) * frame_count);
+    memset(timer.pending, 0, sizeof(bool) * frame_count);
+    return timer;
 }
 
-VkCommandBuffer allocate_command_buffer(VkDevice device, VkCommandPool command_pool) {
-    /*
-      typedef struct VkCommandBufferAllocateInfo {
-          VkStructureType         sType;
-          const void*             pNext;
-          VkCommandPool           commandPool;
-          VkCommandBufferLevel    level;
-          uint32_t                commandBufferCount;
-      } VkCommandBufferAllocateInfo;
-    */
-    VkCommandBufferAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    alloc_info.commandPool = command_pool;
-    /*
-      typedef enum VkCommandBufferLevel {
-          VK_COMMAND_BUFFER_LEVEL_PRIMARY = 0,
-          VK_COMMAND_BUFFER_LEVEL_SECONDARY = 1,
-          VK_COMMAND_BUFFER_LEVEL_MAX_ENUM = 0x7FFFFFFF
-      } VkCommandBufferLevel;
-    */
-    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    alloc_info.commandBufferCount = 1;
+void destroy_gpu_timer(VkDevice device, Gpu_Timer *timer) {
+    vkDestroyQueryPool(device, timer->query_pool, NULL);
+    if (timer->statistics_pool != VK_NULL_HANDLE) vkDestroyQueryPool(device, timer->statistics_pool, NULL);
+    free(timer->pending);
+    memset(timer, 0, sizeof(Gpu_Timer));
+}
 
-    VkCommandBuffer command_buffer;
-    if (vkAllocateCommandBuffers(device, &alloc_info, &command_buffer) != VK_SUCCESS) {
-        exit_with_error("Failed to allocate command buffer");
+void collect_gpu_timestamps(VkDevice device, Gpu_Timer *timer, uint32_t frame_index) {
+    // NOTE: Only called once the frame context's fence has signaled, so the results are there without waiting
+    if (!timer->pending[frame_index]) return;
+    timer->pending[frame_index] = false;
+
+    uint64_t timestamps[GPU_TIMESTAMP_COUNT];
+    VkResult result = vkGetQueryPoolResults(device,
+                                            timer->query_pool,
+                                            GPU_TIMESTAMP_COUNT * frame_index,
+                                            GPU_TIMESTAMP_COUNT,
+                                            sizeof(timestamps),
+                                            timestamps,
+                                            sizeof(uint64_t),
+                                            VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS) return;
+
+    // timestamp_period is in nanoseconds per tick
+    double ms_per_tick = (double)timer->timestamp_period / 1e6;
+    timer->cull_ms += ms_per_tick * (double)(timestamps[GPU_TIMESTAMP_CULLED] - timestamps[GPU_TIMESTAMP_FRAME_BEGIN]);
+    timer->cull_ms += ms_per_tick * (double)(timestamps[GPU_TIMESTAMP_HIZ_BUILT] - timestamps[GPU_TIMESTAMP_RENDERED]);
+    timer->render_ms += ms_per_tick * (double)(timestamps[GPU_TIMESTAMP_RENDERED] - timestamps[GPU_TIMESTAMP_CULLED]);
+    timer->sampled_frame_count++;
+
+    if (timer->statistics_pool != VK_NULL_HANDLE) {
+        uint64_t fragment_invocations = 0;
+        result = vkGetQueryPoolResults(device,
+                                       timer->statistics_pool,
+                                       frame_index,
+                                       1,
+                                       sizeof(fragment_invocations),
+                                       &fragment_invocations,
+                                       sizeof(uint64_t),
+                                       VK_QUERY_RESULT_64_BIT);
+        if (result == VK_SUCCESS) timer->fragment_invocations += fragment_invocations;
     }
+}
 
-    return command_buffer;
+void record_frame_prologue(VkCommandBuffer command_buffer, const Scene *scene) {
+    // NOTE: Work outside the render pass that comes before it: timer start and culling
+    const Gpu_Timer *timer = scene->gpu_timer;
+    uint32_t first_query = GPU_TIMESTAMP_COUNT * scene->frame_index;
+    if (timer) {
+        vkCmdResetQueryPool(command_buffer, timer->query_pool, first_query, GPU_TIMESTAMP_COUNT);
+        vkCmdWriteTimestamp(command_buffer,
+                            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            timer->query_pool,
+                            first_query + GPU_TIMESTAMP_FRAME_BEGIN);
+    }
+    if (scene->cull_pass) record_cull_pass(command_buffer, scene, scene->cull_pass);
+    if (timer) {
+        vkCmdWriteTimestamp(command_buffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            timer->query_pool,
+                            first_query + GPU_TIMESTAMP_CULLED);
+    }
+    if (timer && timer->statistics_pool != VK_NULL_HANDLE) {
+        /*
+          VKAPI_ATTR void VKAPI_CALL vkCmdBeginQuery(
+              VkCommandBuffer                             commandBuffer,
+              VkQueryPool                                 queryPool,
+              uint32_t                                    query,
+              VkQueryControlFlags                         flags);
+        */
+        vkCmdResetQueryPool(command_buffer, timer->statistics_pool, scene->frame_index, 1);
+        vkCmdBeginQuery(command_buffer, timer->statistics_pool, scene->frame_index, 0);
+    }
 }
 
-void record_command_buffer(VkCommandBuffer command_buffer,
-                           VkRenderPass render_pass,
-                           VkFramebuffer framebuffer,
-                           VkPipeline pipeline,
-                           VkBuffer vertex_buffer,
-                           VkExtent2D swapchain_extent) {
-    VkCommandBufferBeginInfo command_buffer_begin_info = {0};
-    command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+void record_frame_epilogue(VkCommandBuffer command_buffer, const Render_Target *target, const Scene *scene) {
+    // NOTE: Work outside the render pass that comes after it: timer end and the --hiz pyramid
+    if (scene->gpu_timer && scene->gpu_timer->statistics_pool != VK_NULL_HANDLE) {
+        vkCmdEndQuery(command_buffer, scene->gpu_timer->statistics_pool, scene->frame_index);
+    }
+    if (scene->gpu_timer) {
+        vkCmdWriteTimestamp(command_buffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            scene->gpu_timer->query_pool,
+                            GPU_TIMESTAMP_COUNT * scene->frame_index + GPU_TIMESTAMP_RENDERED);
+    }
+    if (scene->cull_pass && scene->cull_pass->occlusion) record_hiz_pyramid(command_buffer, target, scene, &scene->cull_pass->hiz);
+    if (scene->gpu_timer) {
+        vkCmdWriteTimestamp(command_buffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            scene->gpu_timer->query_pool,
+                            GPU_TIMESTAMP_COUNT * scene->frame_index + GPU_TIMESTAMP_HIZ_BUILT);
+    }
+}
 
-    if (vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info) != VK_SUCCESS) {
-        exit_with_error("Failed to begin recording command buffer");
+Render_Queue create_render_queue(uint32_t buffer_count) {
+    Render_Queue queue = {0};
+    queue.buffer_count = buffer_count;
+    return queue;
+}
+
+void destroy_render_queue(Render_Queue *queue) {
+    for (uint32_t b = 0; b < queue->buffer_count; b++) {
+        free(queue->buffers[b].keys);
+        free(queue->buffers[b].items);
     }
+    free(queue->items);
+    free(queue->entries);
+    free(queue->scratch);
+    memset(queue, 0, sizeof(Render_Queue));
+}
 
-    // Begin render pass
-    /*
-      typedef struct VkRenderPassBeginInfo {
-          VkStructureType        sType;
-          const void*            pNext;
-          VkRenderPass           renderPass;
-          VkFramebuffer          framebuffer;
-          VkRect2D               renderArea;
-          uint32_t               clearValueCount;
-          const VkClearValue*    pClearValues;
-      } VkRenderPassBeginInfo;
-    */
-    VkRenderPassBeginInfo render_pass_begin_info = {0};
-    render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_pass_begin_info.renderPass = render_pass;
-    render_pass_begin_info.framebuffer = framebuffer;
-    render_pass_begin_info.renderArea.offset = (VkOffset2D){0, 0};
-    render_pass_begin_info.renderArea.extent = swapchain_extent;
+uint64_t make_render_key(uint32_t layer, uint32_t pipeline, uint32_t material, uint32_t depth) {
+    uint64_t key = (uint64_t)(layer & ((1u << RENDER_KEY_LAYER_BITS) - 1));
+    if (layer == RENDER_LAYER_BLENDED) key = (key << RENDER_KEY_DEPTH_BITS) | depth;
+    key = (key << RENDER_KEY_PIPELINE_BITS) | (pipeline & ((1u << RENDER_KEY_PIPELINE_BITS) - 1));
+    key = (key << RENDER_KEY_MATERIAL_BITS) | (material & ((1u << RENDER_KEY_MATERIAL_BITS) - 1));
+    if (layer != RENDER_LAYER_BLENDED) key = (key << RENDER_KEY_DEPTH_BITS) | depth;
+    return key;
+}
 
-    /*
-      typedef union VkClearColorValue {
-          float       float32[4];
-          int32_t     int32[4];
-          uint32_t    uint32[4];
-      } VkClearColorValue;
+void push_render_item(Render_Queue_Buffer *buffer, uint64_t key, const Render_Item *item) {
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+        buffer->keys = realloc(buffer->keys, sizeof(uint64_t) * buffer->capacity);
+        buffer->items = realloc(buffer->items, sizeof(Render_Item) * buffer->capacity);
+        if (!buffer->keys || !buffer->items) exit_with_error("Out of memory growing a render queue buffer");
+    }
+    buffer->keys[buffer->count] = key;
+    buffer->items[buffer->count] = *item;
+    buffer->count++;
+}
 
-      typedef union VkClearValue {
-          VkClearColorValue           color;
-          VkClearDepthStencilValue    depthStencil;
-      } VkClearValue;
-    */
-    VkClearValue clear_color = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    render_pass_begin_info.clearValueCount = 1;
-    render_pass_begin_info.pClearValues = &clear_color;
+void submit_scene_draws(Render_Queue *queue,
+                        uint32_t buffer_index,
+                        const Scene *scene,
+                        VkBuffer vertex_buffer,
+                        uint32_t first_draw,
+                        uint32_t draw_count) {
+    Render_Queue_Buffer *buffer = &queue->buffers[buffer_index];
+    Render_Item item = {0};
+    item.vertex_buffer = vertex_buffer;
+    if (scene->animated_vertex_buffer != VK_NULL_HANDLE) {
+        item.vertex_buffer = scene->animated_vertex_buffer;
+        item.vertex_offset = scene->animated_vertex_offset;
+    }
+    for (uint32_t i = first_draw; i < first_draw + draw_count; i++) {
+        uint32_t material = scene->draws[i].material;
+        item.pipeline = scene->material_pipelines[material];
+        if (item.pipeline == VK_NULL_HANDLE) continue; // Variant still compiling, see Pipeline_Fallback
+        item.draw = i;
+        // NOTE: Without --depth, the draw ID keeps draw list order between draws of a material. With it, later
+        //       draws are nearer: opaque draws go front to back inside their pipeline and material, so the
+        //       depth test rejects as much as it can, and blended ones go last, strictly back to front whatever
+        //       their pipeline, on top of them.
+        uint32_t layer = RENDER_LAYER_SCENE;
+        uint32_t depth = i;
+        if (scene->depth_step > 0.0f) {
+            if (scene->material_blended[material]) {
+                layer = RENDER_LAYER_BLENDED;
+            } else {
+                depth = scene->draw_count - 1 - i;
+            }
+        }
+        uint64_t key = make_render_key(layer, queue->pipeline_ids[material], material, depth);
+        push_render_item(buffer, key, &item);
+    }
+}
 
-    /*
-      VKAPI_ATTR void VKAPI_CALL vkCmdBeginRenderPass(
-          VkCommandBuffer                             commandBuffer,
-          const VkRenderPassBeginInfo*                pRenderPassBegin,
-          VkSubpassContents                           contents);
+Render_Sort_Entry *radix_sort_render_entries(Render_Sort_Entry *entries, Render_Sort_Entry *scratch, uint32_t count) {
+    // NOTE: LSD radix sort, 8 bits a pass, stable. Every pass's histogram is counted in one read up front, and
+    //       a pass is skipped when all keys have the same byte there, which with a few layers and pipelines
+    //       is most of the upper half. Returns whichever of the two arrays ended up holding the result.
+    if (count == 0) return entries;
+
+    uint32_t histograms[8][256] = {{0}};
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t key = entries[i].key;
+        for (uint32_t pass = 0; pass < 8; pass++) {
+            histograms[pass][(key >> (8 * pass)) & 0xff]++;
+        }
+    }
 
-      typedef enum VkSubpassContents {
-          VK_SUBPASS_CONTENTS_INLINE = 0,
-          VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS = 1,
-          VK_SUBPASS_CONTENTS_INLINE_AND_SECONDARY_COMMAND_BUFFERS_KHR = 1000451000,
-          VK_SUBPASS_CONTENTS_INLINE_AND_SECONDARY_COMMAND_BUFFERS_EXT = VK_SUBPASS_CONTENTS_INLINE_AND_SECONDARY_COMMAND_BUFFERS_KHR,
-          VK_SUBPASS_CONTENTS_MAX_ENUM = 0x7FFFFFFF
-      } VkSubpassContents;
-    */
-    vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    Render_Sort_Entry *source = entries;
+    Render_Sort_Entry *destination = scratch;
+    for (uint32_t pass = 0; pass < 8; pass++) {
+        uint32_t shift = 8 * pass;
+        uint32_t *histogram = histograms[pass];
+        if (histogram[(source[0].key >> shift) & 0xff] == count) continue;
+
+        uint32_t offset = 0;
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t bucket_count = histogram[b];
+            histogram[b] = offset;
+            offset += bucket_count;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            destination[histogram[(source[i].key >> shift) & 0xff]++] = source[i];
+        }
 
-    /*
-      VKAPI_ATTR void VKAPI_CALL vkCmdBindPipeline(
-          VkCommandBuffer                             commandBuffer,
-          VkPipelineBindPoint                         pipelineBindPoint,
-          VkPipeline                                  pipeline);
-    */
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        Render_Sort_Entry *swap = source;
+        source = destination;
+        destination = swap;
+    }
+    return source;
+}
 
-    VkDeviceSize offsets[] = {0};
-    /*
-      VKAPI_ATTR void VKAPI_CALL vkCmdBindVertexBuffers(
-          VkCommandBuffer                             commandBuffer,
-          uint32_t                                    firstBinding,
-          uint32_t                                    bindingCount,
-          const VkBuffer*                             pBuffers,
-          const VkDeviceSize*                         pOffsets);
-    */
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, offsets);
+void build_render_queue(Render_Queue *queue, const Scene *scene, VkBuffer vertex_buffer, Record_Workers *workers) {
+    double submit_start = glfwGetTime();
 
-    // Draw the triangle
-    /*
-      VKAPI_ATTR void VKAPI_CALL vkCmdDraw(
-          VkCommandBuffer                             commandBuffer,
-          uint32_t                                    vertexCount,
-          uint32_t                                    instanceCount,
-          uint32_t                                    firstVertex,
-          uint32_t                                    firstInstance);
-    */
-    vkCmdDraw(command_buffer, 3, 1, 0, 0);
+    // Materials that resolved to the same pipeline (fallbacks, reloads) share its key field
+    for (uint32_t m = 0; m < scene->material_count; m++) {
+        queue->pipeline_ids[m] = m;
+        for (uint32_t other = 0; other < m; other++) {
+            if (scene->material_pipelines[other] == scene->material_pipelines[m]) {
+                queue->pipeline_ids[m] = other;
+                break;
+            }
+        }
+    }
 
-    vkCmdEndRenderPass(command_buffer);
+    for (uint32_t b = 0; b < queue->buffer_count; b++) {
+        queue->buffers[b].count = 0;
+    }
+    if (workers && queue->buffer_count > 1) {
+        Record_Job job = {0};
+        job.kind = RECORD_JOB_SUBMIT;
+        job.active_thread_count = workers->thread_count < queue->buffer_count ? workers->thread_count : queue->buffer_count;
+        job.vertex_buffer = vertex_buffer;
+        job.scene = scene;
+        job.render_queue = queue;
+        run_record_job(workers, &job);
+    } else {
+        submit_scene_draws(queue, 0, scene, vertex_buffer, 0, scene->draw_count);
+    }
 
-    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
-        exit_with_error("Failed to record command buffer");
+    double sort_start = glfwGetTime();
+
+    // Merge, in buffer order, so equal keys keep their submission order through the (stable) sort
+    uint32_t item_count = 0;
+    for (uint32_t b = 0; b < queue->buffer_count; b++) {
+        item_count += queue->buffers[b].count;
+    }
+    if (item_count > queue->item_capacity) {
+        queue->item_capacity = item_count;
+        queue->items = realloc(queue->items, sizeof(Render_Item) * item_count);
+        queue->entries = realloc(queue->entries, sizeof(Render_Sort_Entry) * item_count);
+        queue->scratch = realloc(queue->scratch, sizeof(Render_Sort_Entry) * item_count);
+        if (!queue->items || !queue->entries || !queue->scratch) exit_with_error("Out of memory growing the render queue");
+    }
+    uint32_t next_item = 0;
+    for (uint32_t b = 0; b < queue->buffer_count; b++) {
+        const Render_Queue_Buffer *buffer = &queue->buffers[b];
+        memcpy(&queue->items[next_item], buffer->items, sizeof(Render_Item) * buffer->count);
+        for (uint32_t i = 0; i < buffer->count; i++) {
+            queue->entries[next_item + i] = (Render_Sort_Entry){buffer->keys[i], next_item + i};
+        }
+        next_item += buffer->count;
+    }
+    queue->item_count = item_count;
+
+    Render_Sort_Entry *sorted = radix_sort_render_entries(queue->entries, queue->scratch, item_count);
+    if (sorted != queue->entries) {
+        queue->scratch = queue->entries;
+        queue->entries = sorted;
+    }
+
+    double sort_end = glfwGetTime();
+    queue->submit_ms += 1000.0 * (sort_start - submit_start);
+    queue->sort_ms += 1000.0 * (sort_end - sort_start);
+
+    // The binds record_render_queue will skip, counted the same way
+    VkPipeline bound_pipeline = VK_NULL_HANDLE;
+    VkBuffer bound_vertex_buffer = VK_NULL_HANDLE;
+    VkDeviceSize bound_vertex_offset = 0;
+    VkPipeline unsorted_pipeline = VK_NULL_HANDLE;
+    for (uint32_t e = 0; e < item_count; e++) {
+        const Render_Item *item = &queue->items[queue->entries[e].item];
+        if (item->pipeline != bound_pipeline) {
+            bound_pipeline = item->pipeline;
+            queue->pipeline_bind_count++;
+        }
+        if (item->vertex_buffer != bound_vertex_buffer || item->vertex_offset != bound_vertex_offset) {
+            bound_vertex_buffer = item->vertex_buffer;
+            bound_vertex_offset = item->vertex_offset;
+            queue->vertex_buffer_bind_count++;
+        }
+        if (queue->items[e].pipeline != unsorted_pipeline) {
+            unsorted_pipeline = queue->items[e].pipeline;
+            queue->unsorted_pipeline_bind_count++;
+        }
+    }
+    queue->command_count += item_count;
+    queue->build_count++;
+}
+
+void record_render_queue(VkCommandBuffer command_buffer,
+                         const Scene *scene,
+                         const Render_Queue *queue,
+                         uint32_t first_entry,
+                         uint32_t entry_count) {
+    VkPipeline bound_pipeline = VK_NULL_HANDLE;
+    VkBuffer bound_vertex_buffer = VK_NULL_HANDLE;
+    VkDeviceSize bound_vertex_offset = 0;
+    for (uint32_t e = first_entry; e < first_entry + entry_count; e++) {
+        const Render_Item *item = &queue->items[queue->entries[e].item];
+        if (item->pipeline != bound_pipeline) {
+            vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, item->pipeline);
+            bound_pipeline = item->pipeline;
+        }
+        if (item->vertex_buffer != bound_vertex_buffer || item->vertex_offset != bound_vertex_offset) {
+            vkCmdBindVertexBuffers(command_buffer, 0, 1, &item->vertex_buffer, &item->vertex_offset);
+            bound_vertex_buffer = item->vertex_buffer;
+            bound_vertex_offset = item->vertex_offset;
+        }
+        if (scene->transform_source == TRANSFORM_SOURCE_PUSH_CONSTANTS) {
+            vkCmdPushConstants(command_buffer,
+                               scene->pipeline_layout,
+                               scene->push_constant_stages,
+                               0,
+                               sizeof(Object_Transform),
+                               &scene->object_transforms[item->draw]);
+        }
+        const Draw_Command *draw = &scene->draws[item->draw];
+        vkCmdDrawIndexed(command_buffer, draw->index_count, 1, draw->first_index, 0, item->draw);
+    }
+}
+
+Static_Command_Buffers create_static_command_buffers(VkDevice device, VkCommandPool command_pool, uint32_t image_count) {
+    Static_Command_Buffers result = {0};
+    invalidate_static_command_buffers(device, command_pool, &result, image_count);
+    return result;
+}
+
+void invalidate_static_command_buffers(VkDevice device,
+                                       VkCommandPool command_pool,
+                                       Static_Command_Buffers *static_command_buffers,
+                                       uint32_t image_count) {
+    // NOTE: Buffers are kept (a recreated swapchain can have more images, never fewer buffers) and
+    //       re-recorded lazily on the next acquire of their image. Buffers past image_count just sit unused.
+    if (image_count > static_command_buffers->count) {
+        size_t count = image_count;
+        static_command_buffers->command_buffers = realloc(static_command_buffers->command_buffers,
+                                                          sizeof(VkCommandBuffer) * count);
+        static_command_buffers->recorded_versions = realloc(static_command_buffers->recorded_versions,
+                                                            sizeof(uint64_t) * count);
+        static_command_buffers->last_submit_fences = realloc(static_command_buffers->last_submit_fences,
+                                                             sizeof(VkFence) * count);
+        if (!static_command_buffers->command_buffers ||
+            !static_command_buffers->recorded_versions ||
+            !static_command_buffers->last_submit_fences) {
+            exit_with_error("Failed to grow static command buffers");
+        }
+        for (uint32_t i = static_command_buffers->count; i < image_count; i++) {
+            static_command_buffers->command_buffers[i] = allocate_command_buffer(device, command_pool);
+            static_command_buffers->last_submit_fences[i] = VK_NULL_HANDLE;
+        }
+        static_command_buffers->count = image_count;
+    }
+
+    for (uint32_t i = 0; i < static_command_buffers->count; i++) {
+        static_command_buffers->recorded_versions[i] = 0;
     }
 }
 
+void destroy_static_command_buffers(Static_Command_Buffers *static_command_buffers) {
+    // Command buffers are freed together with their pool
+    free(static_command_buffers->command_buffers);
+    free(static_command_buffers->recorded_versions);
+    free(static_command_buffers->last_submit_fences);
+    *static_command_buffers = (Static_Command_Buffers){0};
+}
+
 Synchronization_Objects create_synchronization_objects(VkDevice device) {
     Synchronization_Objects result;
 
@@ -1955,16 +9704,50 @@ Synchronization_Objects create_synchronization_objects(VkDevice device) {
     return result;
 }
 
-void draw_frame(VkDevice device,
-                Swapchain_Etc swapchain_etc,
-                VkFramebuffer *swapchain_framebuffers,
-                VkRenderPass render_pass,
-                VkPipeline pipeline,
-                VkBuffer vertex_buffer,
-                VkQueue graphics_queue,
-                VkQueue present_queue,
-                VkCommandBuffer command_buffer,
-                Synchronization_Objects *sync) {
+Frame_Ring create_frame_ring(VkDevice device, VkCommandPool command_pool, uint32_t frame_count, uint32_t image_count) {
+    Frame_Ring ring = {0};
+    ring.frame_count = frame_count;
+    ring.current_frame = 0;
+    for (uint32_t i = 0; i < frame_count; i++) {
+        ring.frames[i].command_buffer = allocate_command_buffer(device, command_pool);
+        ring.frames[i].sync = create_synchronization_objects(device);
+    }
+
+    reset_images_in_flight(&ring, image_count);
+
+    return ring;
+}
+
+void reset_images_in_flight(Frame_Ring *ring, uint32_t image_count) {
+    // NOTE: Fresh swapchain images aren't used by any frame yet
+    free(ring->images_in_flight);
+    ring->image_count = image_count;
+    ring->images_in_flight = xmalloc(sizeof(VkFence) * image_count);
+    for (uint32_t i = 0; i < image_count; i++) {
+        ring->images_in_flight[i] = VK_NULL_HANDLE;
+    }
+}
+
+uint64_t get_completed_frame_number(Frame_Ring *ring) {
+    // NOTE: draw_frame waits on a context's fence before reusing it, so once frame_number frames have been
+    //       submitted everything older than the last frame_count frames is known to be finished.
+    //       Returns how many frames are known to be complete.
+    if (ring->frame_number < ring->frame_count) return 0;
+    return ring->frame_number - ring->frame_count;
+}
+
+void destroy_frame_ring(VkDevice device, Frame_Ring *ring) {
+    // Command buffers are freed together with their pool
+    for (uint32_t i = 0; i < ring->frame_count; i++) {
+        destroy_synchronization_objects(device, &ring->frames[i].sync);
+    }
+    free(ring->images_in_flight);
+    ring->images_in_flight = NULL;
+}
+
+void begin_frame(VkDevice device, Frame_Ring *ring, Stream_Buffer *stream) {
+    Frame_Context *frame = &ring->frames[ring->current_frame];
+
     /*
       VKAPI_ATTR VkResult VKAPI_CALL vkWaitForFences(
           VkDevice                                    device,
@@ -1973,20 +9756,132 @@ void draw_frame(VkDevice device,
           VkBool32                                    waitAll,
           uint64_t                                    timeout);
     */
-    vkWaitForFences(device, 1, &sync->in_flight_fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(device, 1, &sync->in_flight_fence);
+    // Only waits for the frame that used this context N frames ago, so the GPU keeps working on the others
+    vkWaitForFences(device, 1, &frame->sync.in_flight_fence, VK_TRUE, UINT64_MAX);
+
+    // Everything this context wrote last time around is free again
+    begin_stream_frame(stream, ring->current_frame);
+}
+
+void record_frame_time(Frame_Stats *stats, double now) {
+    if (stats->last_frame_time > 0.0) {
+        if (stats->frame_time_count == stats->frame_time_capacity) {
+            stats->frame_time_capacity = stats->frame_time_capacity ? stats->frame_time_capacity * 2 : 4096;
+            stats->frame_times_ms = realloc(stats->frame_times_ms, sizeof(float) * stats->frame_time_capacity);
+            if (!stats->frame_times_ms) exit_with_error("Out of memory for frame times");
+        }
+        stats->frame_times_ms[stats->frame_time_count++] = (float)(1000.0 * (now - stats->last_frame_time));
+    }
+    stats->last_frame_time = now;
+}
+
+int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+void log_frame_time_percentiles(Frame_Stats *stats) {
+    // NOTE: Averages hide hitches, a single 100 ms compile stall only shows up in the top percentiles
+    if (stats->frame_time_count == 0) return;
+
+    qsort(stats->frame_times_ms, stats->frame_time_count, sizeof(float), compare_floats);
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    char line[256];
+    int length = 0;
+    for (uint32_t i = 0; i < array_count(percentiles); i++) {
+        // Nearest rank
+        uint64_t rank = (uint64_t)ceil(percentiles[i] / 100.0 * (double)stats->frame_time_count);
+        if (rank > 0) rank--;
+        length += snprintf(line + length,
+                           sizeof(line) - (size_t)length,
+                           "p%g %.2f ms, ",
+                           percentiles[i],
+                           stats->frame_times_ms[rank]);
+    }
+    trace_log("Frame times: %smax %.2f ms", line, stats->frame_times_ms[stats->frame_time_count - 1]);
+}
+
+// NOTE: Returns true when the swapchain no longer matches the surface and has to be recreated.
+//       Call begin_frame first.
+bool draw_frame(VkDevice device,
+                Swapchain_Etc swapchain_etc,
+                const Render_Target *render_targets,
+                VkPipeline pipeline,
+                VkBuffer vertex_buffer,
+                VkQueue graphics_queue,
+                VkQueue present_queue,
+                const Scene *scene,
+                Frame_Ring *ring,
+                Static_Command_Buffers *static_command_buffers,
+                Record_Workers *record_workers,
+                Frame_Stats *frame_stats) {
+    // NOTE: begin_frame has already waited on this context's fence
+    Frame_Context *frame = &ring->frames[ring->current_frame];
+    Synchronization_Objects *sync = &frame->sync;
+    VkCommandBuffer command_buffer = frame->command_buffer;
 
     uint32_t image_index;
-    vkAcquireNextImageKHR(device, swapchain_etc.swapchain, UINT64_MAX, sync->image_available_semaphore, VK_NULL_HANDLE, &image_index);
+    VkResult acquire_result = vkAcquireNextImageKHR(device,
+                                                    swapchain_etc.swapchain,
+                                                    UINT64_MAX,
+                                                    sync->image_available_semaphore,
+                                                    VK_NULL_HANDLE,
+                                                    &image_index);
+    if (acquire_result == VK_ERROR_OUT_OF_DATE_KHR) {
+        // Nothing was submitted, so the fence stays signaled and this context can be used again right away
+        return true;
+    } else if (acquire_result != VK_SUCCESS && acquire_result != VK_SUBOPTIMAL_KHR) {
+        exit_with_error("Failed to acquire swapchain image (%d)", acquire_result);
+    }
+
+    // The image may still be in use by an older frame from another context
+    VkFence image_fence = ring->images_in_flight[image_index];
+    if (image_fence != VK_NULL_HANDLE && image_fence != sync->in_flight_fence) {
+        vkWaitForFences(device, 1, &image_fence, VK_TRUE, UINT64_MAX);
+    }
+    ring->images_in_flight[image_index] = sync->in_flight_fence;
+
+    double record_start = glfwGetTime();
+    if (static_command_buffers) {
+        // NOTE: Static scene: submit the image's pre-recorded buffer, recording it only if it's stale
+        command_buffer = static_command_buffers->command_buffers[image_index];
+        if (static_command_buffers->recorded_versions[image_index] != scene->version) {
+            // After a swapchain rebuild the buffer can still be pending from a frame on the old swapchain
+            VkFence last_fence = static_command_buffers->last_submit_fences[image_index];
+            if (last_fence != VK_NULL_HANDLE && last_fence != sync->in_flight_fence) {
+                vkWaitForFences(device, 1, &last_fence, VK_TRUE, UINT64_MAX);
+            }
+
+            if (static_command_buffers->last_submit_fences[image_index] != VK_NULL_HANDLE) {
+                static_command_buffers->rerecord_count++;
+            }
+            static_command_buffers->record_count++;
+
+            vkResetCommandBuffer(command_buffer, 0);
+            record_command_buffer(command_buffer, &render_targets[image_index], pipeline, vertex_buffer, scene);
+            static_command_buffers->recorded_versions[image_index] = scene->version;
+        }
+        static_command_buffers->last_submit_fences[image_index] = sync->in_flight_fence;
+    } else if (record_workers) {
+        // NOTE: This context's fence was waited in begin_frame, so the workers' pools for it are free to reset
+        vkResetCommandBuffer(command_buffer, 0);
+        record_command_buffer_parallel(command_buffer,
+                                       record_workers,
+                                       record_workers->thread_count,
+                                       ring->current_frame,
+                                       &render_targets[image_index],
+                                       pipeline,
+                                       vertex_buffer,
+                                       scene);
+    } else {
+        // Reset and re-record this frame's command buffer
+        vkResetCommandBuffer(command_buffer, 0);
+        record_command_buffer(command_buffer, &render_targets[image_index], pipeline, vertex_buffer, scene);
+    }
+    frame_stats->record_ms += 1000.0 * (glfwGetTime() - record_start);
 
-    // Reset and re-record the command buffer for the current_image
-    vkResetCommandBuffer(command_buffer, 0);
-    record_command_buffer(command_buffer,
-                          render_pass,
-                          swapchain_framebuffers[image_index],
-                          pipeline,
-                          vertex_buffer,
-                          swapchain_etc.swapchain_extent);
+    vkResetFences(device, 1, &sync->in_flight_fence);
 
 
     /*
@@ -2021,6 +9916,9 @@ void draw_frame(VkDevice device,
     if (vkQueueSubmit(graphics_queue, 1, &submit_info, sync->in_flight_fence) != VK_SUCCESS) {
         exit_with_error("Failed to submit draw command buffer");
     }
+    // Collected when this frame context comes around again
+    if (scene->cull_pass) scene->cull_pass->statistics_pending[ring->current_frame] = true;
+    if (scene->gpu_timer) scene->gpu_timer->pending[ring->current_frame] = true;
 
     /*
       typedef struct VkPresentInfoKHR {
@@ -2046,7 +9944,19 @@ void draw_frame(VkDevice device,
     present_info.waitSemaphoreCount = 1;
     present_info.pWaitSemaphores = wait_for_semaphores;
 
-    vkQueuePresentKHR(present_queue, &present_info);
+    VkResult present_result = vkQueuePresentKHR(present_queue, &present_info);
+
+    ring->frame_number++;
+    ring->current_frame = (ring->current_frame + 1) % ring->frame_count;
+
+    // NOTE: Suboptimal still presented fine, but the swapchain should be rebuilt to match the surface
+    if (present_result == VK_ERROR_OUT_OF_DATE_KHR || present_result == VK_SUBOPTIMAL_KHR ||
+        acquire_result == VK_SUBOPTIMAL_KHR) {
+        return true;
+    } else if (present_result != VK_SUCCESS) {
+        exit_with_error("Failed to present swapchain image (%d)", present_result);
+    }
+    return false;
 }
 
 void destroy_synchronization_objects(VkDevice device, Synchronization_Objects *sync) {